@@ -4,6 +4,8 @@
 #include <nvcd/nvcd.cuh>
 #undef NVCD_HEADER_IMPL
 
+#include <nvcd/stats.h>
+
 #include <dlfcn.h>
 
 #include <time.h>
@@ -14,6 +16,14 @@
 
 #include <cstdint>
 
+#include <mutex>
+
+#include <fstream>
+
+#include <map>
+
+#include <cmath>
+
 #define NVCD_TIMEFLAGS_NONE 0
 #define NVCD_TIMEFLAGS_REGION (1 << 2)
 #define NVCD_TIMEFLAGS_KERNEL (1 << 1)
@@ -117,426 +127,913 @@ static time_output_map_type time_map
    }
   };
 
-static bool g_enabled = false;
+//
+// Region state is kept per host thread, so that each thread
+// can profile its own device independently. Nothing here is shared
+// between threads except for the merged time records, which
+// are only touched at libnvcd_end() and libnvcd_time_report().
+//
+static thread_local bool g_enabled = false;
+
+//
+// Timer (libnvcd_time())
+//
+// Each timed region, kernel and run is a fixed-width span in a per
+// thread buffer, in the order they began. Only the innermost level
+// that the flags select is measured; every outer level is the sum of
+// the spans it contains, which is derived when the spans are reported.
+// A region's spans are moved into its record when it ends, and the
+// buffer is reserved to the same capacity for the next region, so
+// timing a launch costs two clock reads and no allocation.
+//
+
+static inline uint64_t hook_now_nsec() {
+  struct timespec t;
+  // unlike CLOCK_REALTIME, it isn't stepped or slewed by NTP
+  clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+  return static_cast<uint64_t>(t.tv_sec) * 1000000000ull + static_cast<uint64_t>(t.tv_nsec);
+}
 
-struct timeslice {
-  struct timespec start;
-  struct timespec end;
-  double time;
-  bool set;
+struct time_span {
+  uint32_t level; // into time_map.at(flags)
+  // innermost level only: the start time until the span
+  // ends, and its duration after
+  uint64_t nsec;
+};
 
-  timeslice() { reset(); }
+// one per outermost region entry
+struct time_entry {
+  uint32_t flags;
+  std::vector<time_span> spans;
+};
 
-  timeslice& reset() {
-    start.tv_sec = start.tv_nsec = 0;
-    end.tv_sec = end.tv_nsec = 0;
-    time = 0.0;
-    set = false;
-    return *this;
-  }
+struct hook_time_record {
+  std::string region_name;
+  std::vector<time_entry> entries;
+};
 
-  timeslice& go() {
-    clock_gettime(CLOCK_REALTIME, &start);
-    return *this;
+static thread_local std::vector<hook_time_record> g_time_records;
+// by region name
+static thread_local std::unordered_map<std::string, size_t> g_time_record_index;
+
+// every thread's records, merged at libnvcd_end()
+static std::vector<hook_time_record> g_merged_time_records;
+static std::mutex g_merged_time_records_lock;
+
+static void merge_time_records() {
+  if (!g_time_records.empty()) {
+    std::lock_guard<std::mutex> guard(g_merged_time_records_lock);
+
+    for (auto& record: g_time_records) {
+      g_merged_time_records.push_back(std::move(record));
+    }
   }
 
-  double seconds(struct timespec* t) const { return (double)t->tv_sec + ((double)t->tv_nsec) * 1e-9; }
+  g_time_records.clear();
+  g_time_record_index.clear();
+}
 
-  timeslice& stop() {
-    if (!set) {
-      clock_gettime(CLOCK_REALTIME, &end);
-      time = seconds(&end) - seconds(&start);
+using call_interval_type = int32_t;
+
+static constexpr call_interval_type k_max_call_interval{10000};
+static constexpr call_interval_type k_min_call_interval{0};
+static constexpr call_interval_type k_unset_call_interval{-1};
+
+static call_interval_type read_call_interval() {
+  call_interval_type interval = k_min_call_interval;
+  
+  char* interval_str = getenv(ENV_SAMPLE);
+
+  if (interval_str != nullptr) {
+    bool ok = false;
+    // we restrict ourselves currently to a single value
+    char* end_ptr = nullptr;
+    call_interval_type ci = strtol(interval_str, &end_ptr, 10);
+	  
+    ok =
+      C_ASSERT(k_min_call_interval <= ci) &&
+      C_ASSERT(ci <= k_max_call_interval) &&
+      // ensures the entire string is a valid base 10 integer
+      C_ASSERT(end_ptr[0] == '\0' &&
+	       interval_str[0] != '\0');
+	  
+    if (ok) {
+      interval = ci;
     }
-    return *this;
   }
 
-  operator double () const {
-    return time;
+  msg_userf("[HOOK CALL INTERVAL = %" PRId32"]\n", interval);
+
+  return interval;
+}
+
+struct kernel_interval_params {
+  call_interval_type call_count;
+
+  // the pass collected by the next profiled call,
+  // when ENV_ROTATE is set
+  uint32_t rotate_pass;
+  
+  kernel_interval_params()
+    : call_count(0),
+      rotate_pass(0) {
+  }
+
+  // read once for the whole process
+  static call_interval_type interval() {
+    static const call_interval_type value = read_call_interval();
+    return value;
   }
 };
 
+// per thread, so the launch path doesn't need a lock
+static thread_local std::unordered_map<uintptr_t, kernel_interval_params>  g_call_counts;
 
-struct timetree {
-  enum ttype
-    {
-     node,
-     leaf
-    };
+namespace {
+  struct call_for {
+    uintptr_t symaddr;
 
-  const ttype type;
+    call_for(const void* func)
+      : symaddr{reinterpret_cast<uintptr_t>(func)}{    
+    }
   
-  timetree(ttype type) : type(type) {}
+    // an interval of 0 profiles every call, same as 1
+    bool is_ready() {
+      call_interval_type interval = kernel_interval_params::interval();
+      kernel_interval_params& params = g_call_counts[symaddr];
+      bool ready = interval <= 1 || (params.call_count % interval) == 0;
+      params.call_count++;
+      return ready;
+    }    
+  };
+}
+
+struct hook_time_info {
+  static constexpr uint32_t k_untimed = UINT32_MAX;
   
-  using ptr_type = std::unique_ptr<timetree>;
+  timeflags flags;
+
+  std::string region_name;
+
+  std::vector<time_span> spans;
+
+  // of the selected parts, or k_untimed
+  uint32_t region_level;
+  uint32_t kernel_level;
+  uint32_t run_level;
   
-  virtual double value() const = 0;
+  uint32_t innermost_level;
+
+  // of the innermost span that's being measured
+  size_t open_span;
+
+  hook_time_info(timeflags flags)
+    : flags(flags),
+      region_name(),
+      spans(),
+      region_level(k_untimed),
+      kernel_level(k_untimed),
+      run_level(k_untimed),
+      innermost_level(0),
+      open_span(0) {
+    const std::vector<std::string>& titles = time_map.at(flags);
+    
+    for (uint32_t level = 0; level < titles.size(); ++level) {
+      if (titles[level] == "region") {
+        region_level = level;
+      } else if (titles[level] == "kernel") {
+        kernel_level = level;
+      } else {
+        run_level = level;
+      }
+    }
 
-  virtual std::string to_string(const std::string& region, timeflags flags, uint32_t depth) const {
-    std::stringstream ret;
-    std::string title{time_map.at(flags).at(depth)};
-    std::string tabs = (depth != 0) ? std::string(depth, '\t') : "";
-    ret << tabs << "[HOOK TIME " << ((title == "region") ? ("region " + region) : title) <<  "] " << value() << " seconds\n";
-    return ret.str();
+    innermost_level = static_cast<uint32_t>(titles.size()) - 1;
   }
-};
 
-struct timenode : public timetree {
-  std::vector<timetree::ptr_type> children;
+  void begin(uint32_t level) {
+    if (level != k_untimed) {
+      time_span span{level, 0};
+      
+      if (level == innermost_level) {
+        open_span = spans.size();
+        span.nsec = hook_now_nsec();
+      }
+      
+      spans.push_back(span);
+    }
+  }
 
-  timenode() : timetree(node) {}
+  void end(uint32_t level) {
+    if (level != k_untimed && level == innermost_level) {
+      ASSERT(open_span < spans.size());
+      spans[open_span].nsec = hook_now_nsec() - spans[open_span].nsec;
+    }
+  }
   
-  double value() const override {
-    double ret = 0.0;
-    for (const auto& child: children) {
-      ret += child->value();
-    }    
-    return ret;
+  void begin_region(const char* region_name) {
+    this->region_name = std::string(region_name);
+    begin(region_level);
   }
 
-  std::string to_string(const std::string& region, timeflags flags, uint32_t depth) const override {
-    std::stringstream ret;
-    ret << timetree::to_string(region, flags, depth);
-    for (const auto& child: children) {
-      ret << child->to_string(region, flags, depth + 1);
+  void begin_kernel() { begin(kernel_level); }
+  
+  void begin_run() { begin(run_level); }
+
+  void end_run() { end(run_level); }
+
+  void end_kernel() { end(kernel_level); }
+
+  void end_region() { end(region_level); }
+
+  // moves the spans of the region that just
+  // ended into the thread's records
+  void record() {
+    ASSERT(!region_name.empty());
+
+    auto it = g_time_record_index.find(region_name);
+
+    if (it == g_time_record_index.end()) {
+      it = g_time_record_index.emplace(region_name, g_time_records.size()).first;
+      g_time_records.push_back(hook_time_record{region_name, {}});
     }
-    return ret.str();
+
+    // moved rather than copied; the next region's buffer starts
+    // with the same room, so its launches don't grow it either
+    size_t capacity = spans.capacity();
+
+    g_time_records[it->second].entries.push_back(time_entry{static_cast<uint32_t>(flags), std::move(spans)});
+
+    spans = std::vector<time_span>();
+    spans.reserve(capacity);
+  }
+
+  void reset() {
+    spans.clear();
+    region_name.clear();
   }
 };
 
-struct timeleaf : public timetree {
-  timeslice v;
+static thread_local std::unique_ptr<hook_time_info> g_timer{nullptr};
 
-  timeleaf() : timetree(leaf) {}
+static void reset_timer() {
+  ASSERT(!g_enabled);
+  if (!g_enabled) {
+    if (g_timer) {
+      g_timer->reset();
+    }
+  }
+}
 
-  double value() const override {
-    return static_cast<double>(v);
+//
+// Rotation mode (ENV_ROTATE)
+//
+// Instead of replaying a kernel until every pass of the collection
+// plan has been read, each profiled invocation collects a single pass,
+// and successive invocations of the same kernel rotate through the plan.
+// Kernels are never relaunched, so this is safe for kernels which
+// aren't idempotent. Since different events are observed on different
+// invocations, counters are reported as rates and per-call averages
+// over the invocations that covered them.
+//
+
+struct rotate_event_stats {
+  uint64_t sum; // over all instances and covering calls
+  uint64_t time_nsec; // of the calls which covered this event
+  uint64_t num_calls; // which covered this event
+  uint64_t last_call;
+
+  rotate_event_stats()
+    : sum(0),
+      time_nsec(0),
+      num_calls(0),
+      last_call(0) {
   }
 };
 
-struct hook_time_record {
-  std::string region_name;
-  std::vector<std::string> dumps;
-};
+struct rotate_kernel_stats {
+  uint64_t num_calls;
+  uint32_t num_passes;
+  std::unordered_map<CUpti_EventID, rotate_event_stats> events;
 
-static std::vector<hook_time_record> g_time_records;
+  rotate_kernel_stats()
+    : num_calls(0),
+      num_passes(0) {
+  }
+};
 
-using call_interval_type = int32_t;
+//
+// Launch statistics (ENV_STATS)
+//
+// The per-launch counter totals and kernel time of each kernel
+// symbol in each region are summarized as a stream (see stats.h),
+// so that the spread and tail over many launches are visible
+// in constant memory per event. Threads keep their own summaries,
+// which are merged at the end of their outermost region and
+// reported when the process exits.
+//
+
+struct region_kernel_stats {
+  nvcd_stats_t kernel_nsec;
+  std::unordered_map<CUpti_EventID, nvcd_stats_t> counters;
+
+  region_kernel_stats()
+    : kernel_nsec(),
+      counters() {
+  }
+};
 
-static constexpr call_interval_type k_max_call_interval{10000};
-static constexpr call_interval_type k_min_call_interval{0};
-static constexpr call_interval_type k_unset_call_interval{-1};
+//
+// Region tree
+//
+// libnvcd_begin() and libnvcd_end() may nest. Each thread keeps a stack
+// of the regions it's in, and every distinct path of region names
+// (e.g., "timestep/solve/smooth") is a node in a prefix tree. Kernel
+// times and counters are attributed to the node at the top of the
+// stack, which gives the exclusive totals; inclusive totals are
+// summed over a node's subtree when the tree is reported.
+//
+
+struct region_node {
+  using ptr_type = std::unique_ptr<region_node>;
+  
+  std::string name;
+  std::string path; // names from the root, separated by '/'
+  region_node* parent;
+  
+  std::unordered_map<std::string, ptr_type> children;
 
-struct kernel_interval_params {
-  static call_interval_type interval;
-  call_interval_type call_count;
+  uint64_t num_entries;
+  uint64_t entered_nsec; // of the current entry
+  uint64_t wall_nsec; // inclusive, since it's measured between begin and end
   
-  kernel_interval_params()
-    : call_count(0) {
+  // exclusive: only launches made while this node
+  // is at the top of the stack
+  uint64_t num_kernels;
+  uint64_t kernel_nsec;
+  std::unordered_map<CUpti_EventID, uint64_t> counters;
+
+  // since the last rotate_report() for this node
+  std::unordered_map<uintptr_t, rotate_kernel_stats> rotate_stats;
+
+  // by kernel symbol, since the last merge_kernel_stats()
+  std::unordered_map<uintptr_t, region_kernel_stats> kernel_stats;
+
+  region_node(const std::string& name, region_node* parent)
+    : name(name),
+      path(),
+      parent(parent),
+      children(),
+      num_entries(0),
+      entered_nsec(0),
+      wall_nsec(0),
+      num_kernels(0),
+      kernel_nsec(0),
+      counters(),
+      rotate_stats(),
+      kernel_stats() {
+    if (parent != nullptr && parent->parent != nullptr) {
+      path = parent->path + "/" + name;
+    } else {
+      path = name;
+    }
+  }
 
-    ASSERT((interval == k_unset_call_interval) ||
-	   (k_min_call_interval <= interval &&
-	    interval <= k_max_call_interval));
-    
-    if (interval == k_unset_call_interval) {
-      char* interval_str = getenv(ENV_SAMPLE);
-
-      if (interval_str != nullptr) {
-	bool ok = false;
-	// we restrict ourselves currently to a single value
-	char* end_ptr = nullptr;
-	call_interval_type ci = strtol(interval_str, &end_ptr, 10);
-	  
-	ok =
-	  C_ASSERT(k_min_call_interval <= ci) &&
-	  C_ASSERT(ci <= k_max_call_interval) &&
-	  // ensures the entire string is a valid base 10 integer
-	  C_ASSERT(end_ptr[0] == '\0' &&
-		   interval_str[0] != '\0');
-	  
-	if (ok) {
-	  interval = ci;
-	}
-	else {
-	  interval = k_min_call_interval;
-	}
-      }
-      else {
-	interval = k_min_call_interval;
-      }
+  region_node* child(const std::string& child_name) {
+    ptr_type& c = children[child_name];
+    if (!c) {
+      c.reset(new region_node(child_name, this));
+    }
+    return c.get();
+  }
 
-      printf("[HOOK CALL INTERVAL = %" PRId32"]\n", interval);
+  uint64_t children_wall_nsec() const {
+    uint64_t ret = 0;
+    for (const auto& kv: children) {
+      ret += kv.second->wall_nsec;
     }
+    return ret;
+  }
+
+  uint64_t exclusive_wall_nsec() const {
+    uint64_t c = children_wall_nsec();
+    return wall_nsec > c ? wall_nsec - c : 0;
   }
 };
 
-call_interval_type kernel_interval_params::interval{k_unset_call_interval};
+// the root is unnamed, and never on the stack
+static thread_local region_node::ptr_type g_region_root{nullptr};
+static thread_local std::vector<region_node*> g_region_stack;
 
-static std::unordered_map<uintptr_t, kernel_interval_params>  g_call_counts;
+static region_node* region_top() {
+  return g_region_stack.empty() ? nullptr : g_region_stack.back();
+}
 
-namespace {
-  struct push {
-    timetree::ptr_type& src;
+static region_node* region_push(const char* region_name) {
+  if (!g_region_root) {
+    g_region_root.reset(new region_node("", nullptr));
+  }
 
-    void to(timetree::ptr_type& dst) {
-      ASSERT(dst->type == timetree::node);
-      dynamic_cast<timenode*>(dst.get())->children.push_back(std::move(src));
-    }
-  };
-  
-  struct stop {
-    timetree::ptr_type& src;
+  region_node* parent = g_region_stack.empty() ? g_region_root.get() : g_region_stack.back();
+  region_node* node = parent->child(std::string(region_name));
 
-    stop(timetree::ptr_type& src)
-      : src(src)
-    {
-      ASSERT(src->type == timetree::leaf);
-      dynamic_cast<timeleaf*>(src.get())->v.stop();
-    }
-    
-    void then_push_to(timetree::ptr_type& dst) {
-      push { src }.to(dst);
-    }
-  };
+  node->num_entries++;
+  node->entered_nsec = hook_now_nsec();
 
-  template <class T>
-  struct set_traits {
-    timetree::ptr_type& v;
-    set_traits(timetree::ptr_type& v) : v(v) { v.reset(new T()); }   
-  };
+  g_region_stack.push_back(node);
 
-  template <class T>
-  struct set_to : public set_traits<T> {
-    set_to(timetree::ptr_type& v) : set_traits<T>(v) {}
-    
-    void then_start() {
-      exit_msg(stdout,
-	       EBAD_PATH,
-	       "%s\n",
-	       "[HOOK ERROR] then_start() reached with invalid type.\n");      
-    }
-  };
+  return node;
+}
 
-  template <>
-  struct set_to<timeleaf> : public set_traits<timeleaf> {
-    set_to(timetree::ptr_type& v) : set_traits<timeleaf>(v) {}
-    
-    void then_start() {
-      dynamic_cast<timeleaf*>(v.get())->v.go();
-    }
-  };
+static region_node* region_pop() {
+  ASSERT(!g_region_stack.empty());
+
+  region_node* node = g_region_stack.back();
+  node->wall_nsec += hook_now_nsec() - node->entered_nsec;
+
+  g_region_stack.pop_back();
+
+  return node;
+}
 
-  const std::vector<timetree::ptr_type>& get_children(const timetree::ptr_type& parent) {
-    return dynamic_cast<timenode*>(parent.get())->children;
+// attributes a profiled launch to the current region
+static void region_add_kernel(uint64_t kernel_nsec) {
+  region_node* node = region_top();
+  if (node != nullptr) {
+    node->num_kernels++;
+    node->kernel_nsec += kernel_nsec;
   }
+}
 
-  struct add {
-    const std::string& dump;
+static void region_add_counter(CUpti_EventID event, uint64_t value) {
+  region_node* node = region_top();
+  if (node != nullptr) {
+    node->counters[event] += value;
+  }
+}
 
-    void to(const std::string& region_name) {
-      bool found = false;
-      for (auto& entry: g_time_records) {
-        found = entry.region_name == region_name;
-        if (found) {
-          entry.dumps.push_back(dump);
-          break;
-        }
-      }
-      if (!found) {
-        g_time_records.push_back(hook_time_record {region_name, {dump}});
-      }
-    }
-  };
+static bool stats_enabled();
 
-  struct call_for {
-    uintptr_t symaddr;
+// the current region's summaries of the kernel,
+// or nullptr if ENV_STATS isn't set
+static region_kernel_stats* region_kernel_stats_for(const void* func) {
+  region_node* node = region_top();
+  
+  if (node == nullptr || !stats_enabled()) {
+    return nullptr;
+  }
+  
+  return &node->kernel_stats[reinterpret_cast<uintptr_t>(func)];
+}
 
-    call_for(const void* func)
-      : symaddr{reinterpret_cast<uintptr_t>(func)}{    
+struct region_totals {
+  uint64_t num_kernels;
+  uint64_t kernel_nsec;
+  std::unordered_map<CUpti_EventID, uint64_t> counters;
+
+  region_totals()
+    : num_kernels(0),
+      kernel_nsec(0),
+      counters() {
+  }
+
+  void add(const region_totals& x) {
+    num_kernels += x.num_kernels;
+    kernel_nsec += x.kernel_nsec;
+    for (const auto& kv: x.counters) {
+      counters[kv.first] += kv.second;
     }
-  
-    bool is_ready() {
-      bool ready = (g_call_counts[symaddr].call_count % kernel_interval_params::interval) == 0;
-      g_call_counts[symaddr].call_count++;
-      return ready;
-    }    
-  };
+  }
+};
+
+static std::string region_event_name(CUpti_EventID event) {
+  char* event_name = cupti_event_get_name(event);
+  ASSERT(event_name != nullptr);
+  std::string ret(event_name != nullptr ? event_name : "?");
+  free(event_name);
+  return ret;
 }
 
-struct hook_time_info {
-  timetree::ptr_type root;
-  
-  timetree::ptr_type region;
-  timetree::ptr_type kernel;
-  timetree::ptr_type run;
+// reports the subtree depth first, and returns its inclusive totals
+static region_totals region_report_node(const region_node* node, std::stringstream& ss) {
+  region_totals inclusive;
 
-  std::string region_name;
+  inclusive.num_kernels = node->num_kernels;
+  inclusive.kernel_nsec = node->kernel_nsec;
+  inclusive.counters = node->counters;
+
+  std::stringstream children_ss;
   
-  timeflags flags;
+  for (const auto& kv: node->children) {
+    inclusive.add(region_report_node(kv.second.get(), children_ss));
+  }
 
-  hook_time_info ()
-    : root(nullptr),
-      region(nullptr),
-      kernel(nullptr),
-      run(nullptr),
-      flags(0)
-  {
-    set_to<timenode>{root};
+  if (node->parent != nullptr) {
+    ss << "|REGION|" << node->path
+       << ": ENTRIES: " << node->num_entries
+       << " WALL_NSEC: " << node->wall_nsec
+       << " EXCL_WALL_NSEC: " << node->exclusive_wall_nsec()
+       << " KERNELS: " << inclusive.num_kernels
+       << " EXCL_KERNELS: " << node->num_kernels
+       << " KERNEL_NSEC: " << inclusive.kernel_nsec
+       << " EXCL_KERNEL_NSEC: " << node->kernel_nsec << "\n";
+
+    for (const auto& kv: inclusive.counters) {
+      auto it = node->counters.find(kv.first);
+      uint64_t exclusive = (it != node->counters.end()) ? it->second : 0;
+      
+      ss << "|REGION_COUNTER|" << node->path << ":" << region_event_name(kv.first)
+         << ": SUM: " << kv.second
+         << " EXCL_SUM: " << exclusive << "\n";
+    }
   }
 
-  uint32_t f32() const { return static_cast<uint32_t>(flags); }
-  
-  bool test(uint32_t f) const { return (f32() & f) == f; }
-  
-  bool has_region() const { return test(NVCD_TIMEFLAGS_REGION); }
-  bool has_kernel() const { return test(NVCD_TIMEFLAGS_KERNEL); }
-  bool has_run() const { return test(NVCD_TIMEFLAGS_RUN); }
+  ss << children_ss.str();
+
+  return inclusive;
+}
+
+// Folded stacks ("a;b;c <weight>", one line per node) weigh each node
+// by its exclusive value, so that flame graph tools recover
+// the inclusive values by summing over the stack.
+static void region_fold_node(const region_node* node,
+                             const std::string& stack,
+                             bool has_event,
+                             CUpti_EventID event,
+                             std::stringstream& ss) {
+  std::string frame;
   
-  void begin_region(const char* region_name) {
-    this->region_name = std::string(region_name);
-    if (has_region()) {
-      switch (f32()) {
-      case f_rkr:
-      case f_rk0:
-      case f_r0r:
-	set_to<timenode>{region};
-	break;
-      case f_r00:
-	set_to<timeleaf>{region}.then_start();
-	break;
-      }
+  if (node->parent != nullptr) {
+    // ';' separates frames and a space separates the weight
+    std::string name = node->name;
+    std::replace(name.begin(), name.end(), ';', '_');
+    std::replace(name.begin(), name.end(), ' ', '_');
+
+    frame = stack.empty() ? name : stack + ";" + name;
+    
+    uint64_t weight = node->exclusive_wall_nsec();
+    
+    if (has_event) {
+      auto it = node->counters.find(event);
+      weight = (it != node->counters.end()) ? it->second : 0;
+    }
+
+    if (weight > 0) {
+      ss << frame << " " << weight << "\n";
     }
   }
 
-  void begin_kernel() {
-    if (has_kernel()) {
-      switch (f32()) {
-      case f_rkr:
-      case f_0kr:
-	set_to<timenode>{kernel};
-	break;
-	
-      case f_rk0:
-      case f_0k0:
-	set_to<timeleaf>{kernel}.then_start();
-	break;
-      }
-    }    
+  for (const auto& kv: node->children) {
+    region_fold_node(kv.second.get(), frame, has_event, event, ss);
   }
+}
+
+static std::mutex g_region_fold_lock;
+
+static void region_fold(const char* filename) {
+  bool has_event = false;
+  CUpti_EventID event = 0;
+  
+  char* event_name = getenv(ENV_FOLDED_EVENT);
   
-  void begin_run() {
-    if (has_run()) {
-      set_to<timeleaf>{run}.then_start();
+  if (event_name != nullptr && event_name[0] != '\0') {
+    // the event might not have been requested, in which
+    // case every node weighs 0 and nothing is written
+    int ordinal = 0;
+    CUdevice device = 0;
+    CUDA_RUNTIME_FN(cudaGetDevice(&ordinal));
+    CUDA_DRIVER_FN(cuDeviceGet(&device, ordinal));
+    has_event = cuptiEventGetIdFromName(device, event_name, &event) == CUPTI_SUCCESS;
+
+    if (!has_event) {
+      msg_warnf("%s = %s is not an event; folding by exclusive wall time\n",
+                ENV_FOLDED_EVENT,
+                event_name);
     }
   }
+  
+  std::stringstream ss;
+  region_fold_node(g_region_root.get(), "", has_event, event, ss);
 
-  void end_run() {
-    if (has_run()) {
+  // every thread appends its own stacks to the same file
+  std::lock_guard<std::mutex> guard(g_region_fold_lock);
+  
+  std::ofstream out(filename, std::ios::app);
 
-      switch (f32()) {
-      case f_rkr:
-      case f_0kr:
-	stop{run}.then_push_to(kernel);
-	break;
-      case f_r0r:
-	stop{run}.then_push_to(region);
-	break;
-      case f_00r:
-	stop{run}.then_push_to(root);
-	break;
-      }
-    }
+  if (out) {
+    out << ss.str();
+  } else {
+    msg_warnf("could not open %s = %s\n", ENV_FOLDED, filename);
   }
+}
 
-  void end_kernel() {
-    if (has_kernel()) {
-      switch (f32()) {
-      case f_rk0:
-	stop{kernel}.then_push_to(region);	
-	break;
-
-      case f_0k0:
-	stop{kernel}.then_push_to(root);
-	break;
-	
-      case f_0kr:
-	push{kernel}.to(root);
-	break;
-	
-      case f_rkr:
-	push{kernel}.to(region);
-	break;
-      }
-    }
+struct merged_kernel_stats {
+  nvcd_stats_t kernel_nsec;
+  // by name, since the sessions which named
+  // the events have ended when they're reported
+  std::map<std::string, nvcd_stats_t> counters;
+
+  merged_kernel_stats()
+    : kernel_nsec(),
+      counters() {
   }
+};
+
+// by region path and kernel symbol
+static std::map<std::pair<std::string, uintptr_t>, merged_kernel_stats> g_merged_kernel_stats;
+static std::mutex g_merged_kernel_stats_lock;
+
+static void merge_kernel_stats_node(region_node* node, cupti_event_data_t* e) {
+  for (auto& kv: node->kernel_stats) {
+    region_kernel_stats& kstats = kv.second;
+
+    // the kernel wasn't launched since the last merge
+    if (kstats.kernel_nsec.count == 0 && kstats.counters.empty()) {
+      continue;
+    }
+    
+    merged_kernel_stats& merged = g_merged_kernel_stats[std::make_pair(node->path, kv.first)];
+
+    nvcd_stats_merge(&merged.kernel_nsec, &kstats.kernel_nsec);
 
-  void end_region() {
-    if (has_region()) {
-      switch (f32()) {
-      case f_r00:
-	stop{region}.then_push_to(root);
-	
-	break;
-      case f_r0r:
-      case f_rk0:
-      case f_rkr:
-	push{region}.to(root);
-	break;
+    for (auto& ckv: kstats.counters) {
+      if (ckv.second.count == 0) {
+        continue;
       }
+      
+      const char* event_name =
+        e != nullptr && e->initialized ? cupti_event_data_event_name(e, ckv.first) : nullptr;
+
+      std::string name = event_name != nullptr ? std::string(event_name) : region_event_name(ckv.first);
+      
+      nvcd_stats_merge(&merged.counters[name], &ckv.second);
+
+      // emptied rather than erased, so that the next
+      // entry of the region doesn't allocate
+      ckv.second = nvcd_stats_t();
     }
+
+    kstats.kernel_nsec = nvcd_stats_t();
   }
 
-  void record() {
-    ASSERT(!region_name.empty());
-    std::stringstream ss;
-    for (const auto& child_ptr: get_children(root)) {
-      ss << child_ptr->to_string(region_name, flags, 0);
+  for (const auto& kv: node->children) {
+    merge_kernel_stats_node(kv.second.get(), e);
+  }
+}
+
+// called at the end of the thread's outermost region,
+// while its session can still name the events
+static void merge_kernel_stats() {
+  if (g_region_root && stats_enabled()) {
+    bool locked = nvcd_lock_events();
+    cupti_event_data_t* e = locked ? nvcd_get_events() : nullptr;
+    
+    std::lock_guard<std::mutex> guard(g_merged_kernel_stats_lock);
+    merge_kernel_stats_node(g_region_root.get(), e);
+
+    if (locked) {
+      nvcd_release_events();
     }
-    add{ss.str()}.to(region_name);
   }
-};
+}
+
+static void kernel_stats_line(std::stringstream& ss,
+                              const std::string& prefix,
+                              const std::string& name,
+                              const nvcd_stats_t& stats) {
+  ss << "|KERNEL_STATS|" << prefix << ":" << name
+     << ": COUNT: " << stats.count
+     << " MEAN: " << stats.mean
+     << " STDDEV: " << std::sqrt(nvcd_stats_variance(&stats))
+     << " MIN: " << stats.min
+     << " P50: " << nvcd_stats_quantile(&stats, 0.5)
+     << " P90: " << nvcd_stats_quantile(&stats, 0.9)
+     << " P99: " << nvcd_stats_quantile(&stats, 0.99)
+     << " MAX: " << stats.max << "\n";
+}
 
-static std::unique_ptr<hook_time_info> g_timer{nullptr};
+// registered with atexit()
+static void kernel_stats_report() {
+  std::lock_guard<std::mutex> guard(g_merged_kernel_stats_lock);
 
-static void reset_timer() {
-  ASSERT(!g_enabled);
-  if (!g_enabled) {
-    if (g_timer) {
-      timeflags tmp(g_timer->flags);
-      g_timer.reset(new hook_time_info());
-      g_timer->flags = tmp;
+  if (g_merged_kernel_stats.empty()) {
+    return;
+  }
+  
+  std::stringstream ss;
+  
+  for (const auto& kv: g_merged_kernel_stats) {
+    std::stringstream prefix;
+    prefix << kv.first.first << ":0x" << std::hex << kv.first.second;
+
+    kernel_stats_line(ss, prefix.str(), "KERNEL_NSEC", kv.second.kernel_nsec);
+
+    for (const auto& ckv: kv.second.counters) {
+      kernel_stats_line(ss, prefix.str(), ckv.first, ckv.second);
     }
   }
+
+  msg_userf("%s", ss.str().c_str());
+
+  g_merged_kernel_stats.clear();
 }
 
-template <class TKernFunType,
-	  class ...TArgs>
-static inline cudaError_t nvcd_run_metrics2(const TKernFunType& kernel, 				     
-					    TArgs... args) {
-  cupti_event_data_t* __e = nvcd_get_events();                           
+static bool read_stats_enabled() {
+  bool enabled = env_var_flag(ENV_STATS);
+
+  if (enabled) {
+    msg_users("[HOOK STATS ON]");
+    atexit(kernel_stats_report);
+  }
+
+  return enabled;
+}
+
+static bool stats_enabled() {
+  static const bool enabled = read_stats_enabled();
+  return enabled;
+}
+
+static bool read_rotate_enabled() {
+  bool enabled = env_var_flag(ENV_ROTATE);
+
+  if (enabled) {
+    msg_users("[HOOK ROTATE MODE ON]");
+  }
+
+  return enabled;
+}
+
+static bool rotate_enabled() {
+  static const bool enabled = read_rotate_enabled();
+  return enabled;
+}
+
+// adds the counters of the pass that was just run to the kernel's stats
+static void rotate_add_counters(rotate_kernel_stats& kstats,
+                                region_kernel_stats* launch_stats,
+                                const cupti_counter_matrix_t& counters,
+                                uint64_t time_nsec) {
+  for (uint32_t row = 0; row < counters.num_rows; ++row) {
+    // another pass's event
+    if (!cupti_counter_matrix_filled(&counters, row)) {
+      continue;
+    }
+    
+    uint32_t num_instances = 0;
+    const uint64_t* values = cupti_counter_matrix_row(&counters, row, &num_instances);
+
+    cupti_counter_stats_t cstats;
+    cupti_counter_stats(values, num_instances, &cstats);
+    
+    rotate_event_stats& stats = kstats.events[counters.event_ids[row]];
+
+    // first time this event is seen for the current call
+    if (stats.last_call != kstats.num_calls) {
+      stats.last_call = kstats.num_calls;
+      stats.num_calls++;
+      stats.time_nsec += time_nsec;
+    }
   
-  ASSERT(__e->is_root == true);                                       
-  ASSERT(__e->initialized == true);                                   
-  ASSERT(__e->metric_data != NULL);                                   
-  ASSERT(__e->metric_data->initialized == true);                      
+    stats.sum += cstats.sum;
 
-  cudaError_t result = cudaSuccess;
-  for (uint32_t i = 0; result == cudaSuccess && i < __e->metric_data->num_metrics; ++i) {      
-    cupti_event_data_begin(&__e->metric_data->event_data[i]);         
+    region_add_counter(counters.event_ids[row], cstats.sum);
 
-    while (result == cudaSuccess && !cupti_event_data_callback_finished(&__e->metric_data->event_data[i])) {
-      if (g_timer) g_timer->begin_run();
-      kernel(args...);                       
-      CUDA_RUNTIME_FN(cudaDeviceSynchronize());
-      if (g_timer) g_timer->end_run();
-      g_run_info->run_kernel_count_inc();				
-    }                                                                 
-                                                                        
-    cupti_event_data_end(&__e->metric_data->event_data[i]);
+    if (launch_stats != nullptr) {
+      nvcd_stats_add(&launch_stats->counters[counters.event_ids[row]], cstats.sum);
+    }
   }
+}
 
+template <class TKernFunType, class ...TArgs>
+static inline cudaError_t nvcd_run_rotate(const void* func,
+                                          const TKernFunType& kernel,
+                                          TArgs... args) {
+  cudaError_t result = cudaSuccess;
+
+  cupti_event_data_t* e = nvcd_get_events();
+  
+  uint32_t num_passes = nvcd_has_events() ? cupti_event_data_num_passes(e) : 0;
+  
+  if (num_passes > 0) {
+    static std::once_flag metrics_warned;
+
+    if (nvcd_has_metrics()) {
+      std::call_once(metrics_warned, []() {
+	msg_warnf("%s is set; metrics are not computed, since their events "
+		  "are collected on different invocations\n",
+		  ENV_ROTATE);
+      });
+    }
+    
+    kernel_interval_params& params = g_call_counts[reinterpret_cast<uintptr_t>(func)];
+    
+    uint32_t pass = params.rotate_pass % num_passes;
+    params.rotate_pass++;
+    
+    cupti_event_data_select_pass(e, pass);
+    
+    cupti_event_data_begin(e);
+    if (g_timer) g_timer->begin_run();
+    result = kernel(func, args...);
+    nvcd_host_sync();
+    if (g_timer) g_timer->end_run();
+    g_run_info->run_kernel_count_inc();
+    cupti_event_data_end(e);
+
+    if (result == cudaSuccess) {
+      ASSERT(e->num_kernel_times == 1);
+      
+      rotate_kernel_stats& stats = region_top()->rotate_stats[reinterpret_cast<uintptr_t>(func)];
+
+      stats.num_calls++;
+      stats.num_passes = num_passes;
+      
+      region_add_kernel(e->kernel_times_nsec[0]);
+
+      region_kernel_stats* launch_stats = region_kernel_stats_for(func);
+
+      if (launch_stats != nullptr) {
+        nvcd_stats_add(&launch_stats->kernel_nsec, e->kernel_times_nsec[0]);
+      }
+
+      // rotated runs don't go through nvcd_host_end(),
+      // so the run's counter matrix is free to use
+      cupti_event_data_pass_counter_matrix(e, pass, &g_run_info->counters);
+      
+      rotate_add_counters(stats, launch_stats, g_run_info->counters, e->kernel_times_nsec[0]);
+
+      if (nvcd_record_enabled()) {
+	nvcd_host_record();
+      }
+    }
+  } else {
+    result = kernel(func, args...);
+  }
+  
   return result;
 }
 
+static void rotate_report(region_node* node) {
+  // no kernel ran in this thread's region, so there's
+  // no session to read the requested events from.
+  if (node->rotate_stats.empty() || !nvcd_lock_events()) {
+    return;
+  }
+
+  const char* region_name = node->path.c_str();
+  
+  cupti_event_data_t* e = nvcd_get_events();
+
+  int device_index = nvcd_device_index(e->cuda_device);
+  
+  char uuid[NVCD_UUID_STR_LENGTH];
+  nvcd_device_uuid_str(device_index, uuid, sizeof(uuid));
+  
+  std::stringstream ss;
+  
+  for (const auto& kv: node->rotate_stats) {
+    const rotate_kernel_stats& kstats = kv.second;
+
+    ss << "[HOOK ROTATE " << region_name
+       << "; symbol = 0x" << std::hex << kv.first << std::dec
+       << "] calls: " << kstats.num_calls
+       << ", passes: " << kstats.num_passes << "\n";
+
+    // events which were requested but never covered are
+    // still listed, so that missing coverage is visible.
+    for (uint32_t i = 0; e->initialized && i < e->num_requested_event_ids; ++i) {
+      CUpti_EventID event = e->requested_event_ids[i];
+
+      auto it = kstats.events.find(event);
+      
+      rotate_event_stats estats = (it != kstats.events.end()) ? it->second : rotate_event_stats();
+      
+      const char* event_name = cupti_event_data_event_name(e, event);
+      ASSERT(event_name != nullptr);
+
+      double rate = estats.time_nsec > 0 ?
+        static_cast<double>(estats.sum) / (static_cast<double>(estats.time_nsec) * 1e-9) :
+        0.0;
+      
+      double per_call = estats.num_calls > 0 ?
+        static_cast<double>(estats.sum) / static_cast<double>(estats.num_calls) :
+        0.0;
+      
+      ss << "|ROTATE|" << region_name << ":" << event_name
+         << ": RATE: " << rate << "/s"
+         << " PER_CALL: " << per_call
+         << " COVERAGE: " << estats.num_calls << "/" << kstats.num_calls
+         << " DEVICE: " << device_index << " UUID: " << uuid << "\n";
+    }
+  }
+  
+  nvcd_release_events();
+  
+  msg_userf("%s", ss.str().c_str());
+
+  node->rotate_stats.clear();
+}
 
 template <class TKernFunType, class ...TArgs>
 static inline cudaError_t nvcd_run2(const TKernFunType& kernel, 
@@ -548,28 +1045,71 @@ static inline cudaError_t nvcd_run2(const TKernFunType& kernel,
     cupti_event_data_begin(nvcd_get_events());  
     while (result == cudaSuccess && !nvcd_host_finished()) {
       if (g_timer) g_timer->begin_run();
-      result = kernel(args...);                       
-      CUDA_RUNTIME_FN(cudaDeviceSynchronize());
-      if (g_timer) g_timer->end_run();
+      result = kernel(args...);
+      // a run is read when the next one is launched, or by
+      // nvcd_host_end_deferred(); only timed runs wait for it here
+      if (g_timer) {
+        nvcd_host_sync();
+        g_timer->end_run();
+      }
       g_run_info->run_kernel_count_inc();			
     }                                                                   
     cupti_event_data_end(nvcd_get_events());
   }
 
-  if (result == cudaSuccess && nvcd_has_metrics()) {  
-    result = nvcd_run_metrics2(kernel, args...);
+  return result;
+}
+
+// the kernel of the calling thread's last launch, if
+// its nvcd_host_end_deferred() is still pending
+static thread_local const void* g_pending_func = nullptr;
+
+// attributes the counters of the last nvcd_host_end() to the current region
+static void region_add_run(const void* func) {
+  region_kernel_stats* launch_stats = region_kernel_stats_for(func);
+
+  if (g_run_info->kernel_timed) {
+    region_add_kernel(g_run_info->kernel_nsec);
+
+    if (launch_stats != nullptr) {
+      nvcd_stats_add(&launch_stats->kernel_nsec, g_run_info->kernel_nsec);
+    }
   }
 
-  return result;
+  const cupti_counter_matrix_t& counters = g_run_info->counters;
+
+  for (uint32_t row = 0; row < counters.num_rows; ++row) {
+    uint32_t num_instances = 0;
+    const uint64_t* values = cupti_counter_matrix_row(&counters, row, &num_instances);
+
+    cupti_counter_stats_t stats;
+    cupti_counter_stats(values, num_instances, &stats);
+    
+    region_add_counter(counters.event_ids[row], stats.sum);
+
+    if (launch_stats != nullptr) {
+      nvcd_stats_add(&launch_stats->counters[counters.event_ids[row]], stats.sum);
+    }
+  }
 }
 
 C_LINKAGE_START
 
-static char g_region_buffer[256] = {0};
+// Launches that are still running when the hook returns are attributed
+// at the thread's next launch, or when its current region is left.
+static void region_complete_run() {
+  if (g_pending_func != nullptr) {
+    nvcd_host_complete();
+    region_add_run(g_pending_func);
+    g_pending_func = nullptr;
+  }
+}
 
 typedef cudaError_t (*cudaLaunchKernel_fn_t)(const void* func, dim3 gridDim, dim3 blockDim, void** args, size_t sharedMem, cudaStream_t stream);
 
-static cudaLaunchKernel_fn_t real_cudaLaunchKernel = NULL;
+static cudaLaunchKernel_fn_t load_real_cudaLaunchKernel() {
+  return (cudaLaunchKernel_fn_t) dlsym(RTLD_NEXT, "cudaLaunchKernel");
+}
 
 void print_func(const void* func) {
   const char* f = static_cast<const char*>(func);
@@ -582,26 +1122,39 @@ NVCD_EXPORT __host__ cudaError_t cudaLaunchKernel(const void* func,
 						  void** args,
 						  size_t sharedMem,
 						  cudaStream_t stream) {
+  static const cudaLaunchKernel_fn_t real_cudaLaunchKernel = load_real_cudaLaunchKernel();
   cudaError_t ret = cudaSuccess;
-  if (real_cudaLaunchKernel == NULL) {
-    real_cudaLaunchKernel = (cudaLaunchKernel_fn_t) dlsym(RTLD_NEXT, "cudaLaunchKernel");
-  }
   if (g_enabled) {
     if (call_for(func).is_ready()) {
-      printf("[HOOK ON %s - %s; symbol = %p]\n", __FUNC__, g_region_buffer, func);
+      const char* region_path = region_top()->path.c_str();
+      msg_userf("[HOOK ON %s - %s; symbol = %p]\n", __FUNC__, region_path, func);
       if (g_timer) {
 	g_timer->begin_kernel();
       }
-      nvcd_host_begin(g_region_buffer, gridDim.x * gridDim.y * gridDim.z * blockDim.x * blockDim.y * blockDim.z);
-      ret = nvcd_run2(real_cudaLaunchKernel, func, gridDim, blockDim, args, sharedMem, stream);
-      nvcd_host_end();
+      region_complete_run();
+      int block_size = blockDim.x * blockDim.y * blockDim.z;
+      nvcd_host_begin(region_path, gridDim.x * gridDim.y * gridDim.z * block_size, stream, func, block_size);
+      if (rotate_enabled()) {
+	// results are accumulated across invocations,
+	// and reported in libnvcd_end()
+	ret = nvcd_run_rotate(func, real_cudaLaunchKernel, gridDim, blockDim, args, sharedMem, stream);
+	nvcd_release_events();
+      } else {
+	ret = nvcd_run2(real_cudaLaunchKernel, func, gridDim, blockDim, args, sharedMem, stream);
+	// with ENV_STREAM, the kernel is left to run
+	if (nvcd_host_end_deferred()) {
+	  g_pending_func = func;
+	} else {
+	  region_add_run(func);
+	}
+      }
       if (g_timer) {
 	g_timer->end_kernel();
       }
     }
   }
   else {
-    printf("[HOOK OFF %s]\n", __FUNC__);
+    msg_userf("[HOOK OFF %s]\n", __FUNC__);
     ret = real_cudaLaunchKernel(func, gridDim, blockDim, args, sharedMem, stream);
   }
   //  print_func(func);
@@ -618,34 +1171,115 @@ NVCD_EXPORT void libnvcd_time(uint32_t flags) {
     if (flags == 0) {
       g_timer.reset(nullptr);
     } else {
-      g_timer.reset(new hook_time_info());
-      g_timer->flags = timeflags(flags);
+      g_timer.reset(new hook_time_info(timeflags(flags)));
+    }
+  }
+}
+
+static constexpr uint32_t k_num_time_kinds = 3;
+
+static uint32_t time_kind(const std::string& title) {
+  return title == "region" ? 0 : (title == "kernel" ? 1 : 2);
+}
+
+static const char* const k_time_kind_titles[k_num_time_kinds] = { "region", "kernel", "run" };
+
+// prints an entry's spans as a tree, one line per span,
+// and adds their times to the stats of their kind
+static void time_entry_report(const std::string& region_name,
+                              const time_entry& entry,
+                              std::vector<uint64_t>& values,
+                              nvcd_stats_t* stats,
+                              std::stringstream& ss) {
+  const std::vector<std::string>& titles = time_map.at(entry.flags);
+  
+  uint32_t num_levels = static_cast<uint32_t>(titles.size());
+  uint32_t innermost_level = num_levels - 1;
+
+  const std::vector<time_span>& spans = entry.spans;
+
+  values.resize(spans.size());
+
+  // an outer span's children are the spans one level below it which
+  // follow it, up to the next span of its level or above, so going
+  // backwards they're summed before it's reached
+  uint64_t sums[k_num_time_kinds] = {0};
+  
+  for (size_t i = spans.size(); i > 0; --i) {
+    const time_span& span = spans[i - 1];
+    
+    uint64_t value = span.level == innermost_level ? span.nsec : sums[span.level + 1];
+
+    for (uint32_t level = span.level + 1; level < num_levels; ++level) {
+      sums[level] = 0;
     }
+
+    sums[span.level] += value;
+    values[i - 1] = value;
+  }
+
+  for (size_t i = 0; i < spans.size(); ++i) {
+    const std::string& title = titles[spans[i].level];
+    
+    ss << std::string(spans[i].level, '\t')
+       << "[HOOK TIME " << ((title == "region") ? ("region " + region_name) : title) << "] "
+       << static_cast<double>(values[i]) * 1e-9 << " seconds\n";
+
+    nvcd_stats_add(&stats[time_kind(title)], values[i]);
   }
 }
 
 NVCD_EXPORT void libnvcd_time_report() {
+  // records of the calling thread's open region are merged
+  // at its libnvcd_end(), same as every other thread's.
+  std::lock_guard<std::mutex> guard(g_merged_time_records_lock);
   std::stringstream ss;
-  for (const auto& region_entries: g_time_records) {
-    for (const auto& dump: region_entries.dumps) {
-      ss << dump;
+  std::vector<uint64_t> values;
+  for (const auto& record: g_merged_time_records) {
+    nvcd_stats_t stats[k_num_time_kinds] = {};
+    
+    for (const auto& entry: record.entries) {
+      time_entry_report(record.region_name, entry, values, stats, ss);
+    }
+
+    for (uint32_t kind = 0; kind < k_num_time_kinds; ++kind) {
+      if (stats[kind].count > 0) {
+        ss << "[HOOK TIME STATS region " << record.region_name << "] " << k_time_kind_titles[kind]
+           << " count: " << stats[kind].count
+           << ", mean: " << stats[kind].mean * 1e-9
+           << ", min: " << static_cast<double>(stats[kind].min) * 1e-9
+           << ", p50: " << static_cast<double>(nvcd_stats_quantile(&stats[kind], 0.5)) * 1e-9
+           << ", p99: " << static_cast<double>(nvcd_stats_quantile(&stats[kind], 0.99)) * 1e-9
+           << ", max: " << static_cast<double>(stats[kind].max) * 1e-9 << " seconds\n";
+      }
     }
   }
-  printf("%s\n", ss.str().c_str());
-  g_time_records.clear();
+  msg_userf("%s\n", ss.str().c_str());
+  g_merged_time_records.clear();
 }
 
+//
+// Regions may nest; kernels are attributed to the full path of
+// the innermost region. The session and the libnvcd_time() timer
+// span the outermost region.
+//
 NVCD_EXPORT void libnvcd_begin(const char* region_name) {
   // a null region name is totally useless,
   // and will also likely create a segfault,
   // so we may as well enforce non-null input.
   ASSERT(region_name != nullptr);
-  ASSERT(strlen(region_name) <= 256);
   if (region_name != nullptr) {
-    strncpy(g_region_buffer, region_name, 255);
+    bool outermost = !g_enabled;
+    region_complete_run();
+    region_node* node = region_push(region_name);
     g_enabled = true;
-    if (g_timer) {
-      g_timer->begin_region(region_name);
+    if (outermost) {
+      // event data is built on the first launch within the region
+      // and reused by every launch after it, until libnvcd_end().
+      nvcd_host_session_begin();
+      if (g_timer) {
+	g_timer->begin_region(node->path.c_str());
+      }
     }
   }
 }
@@ -657,15 +1291,49 @@ NVCD_EXPORT void libnvcd_end() {
   // coulud arise internally in the future.
   ASSERT(g_enabled == true);
   if (g_enabled) {
-    if (g_timer) { 
-      g_timer->end_region();
-      g_timer->record();   
-    }
-    // make sure this is set to false before
-    // reset_timer() is called
-    g_enabled = false;
-    reset_timer();
-    nvcd_run_info::num_runs = 0;
+    region_complete_run();
+    region_node* node = region_pop();
+    // rotate stats are kept per region, so
+    // they're reported for each nested region too
+    if (rotate_enabled()) {
+      rotate_report(node);
+    }
+    if (g_region_stack.empty()) {
+      if (g_timer) { 
+	g_timer->end_region();
+	g_timer->record();   
+      }
+      // make sure this is set to false before
+      // reset_timer() is called
+      g_enabled = false;
+      reset_timer();
+      merge_time_records();
+      merge_kernel_stats();
+      nvcd_host_session_end();
+      if (g_run_info != nullptr) {
+        g_run_info->num_runs = 0;
+      }
+    }
+  }
+}
+
+//
+// Reports the calling thread's region tree, with inclusive and
+// exclusive totals for each path. If ENV_FOLDED is set, the tree is
+// also appended to that file as folded stacks.
+// Regions that are still open are reported up to their last launch.
+//
+NVCD_EXPORT void libnvcd_region_report() {
+  region_complete_run();
+  if (g_region_root) {
+    std::stringstream ss;
+    region_report_node(g_region_root.get(), ss);
+    msg_userf("%s", ss.str().c_str());
+
+    char* folded = getenv(ENV_FOLDED);
+    if (folded != nullptr && folded[0] != '\0') {
+      region_fold(folded);
+    }
   }
 }
 
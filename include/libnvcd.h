@@ -9,6 +9,7 @@ typedef void (*libnvcd_begin_fn_t)(const char*);
 typedef void (*libnvcd_end_fn_t)(void);
 typedef void (*libnvcd_time_fn_t)(uint32_t);
 typedef void (*libnvcd_time_report_fn_t)(void);
+typedef void (*libnvcd_region_report_fn_t)(void);
 
 // these function pointers are dynamically loaded
 // from the preloaded hook.
@@ -16,6 +17,7 @@ static libnvcd_begin_fn_t libnvcd_begin = NULL;
 static libnvcd_end_fn_t libnvcd_end = NULL;
 static libnvcd_time_fn_t libnvcd_time = NULL;
 static libnvcd_time_report_fn_t libnvcd_time_report = NULL;
+static libnvcd_region_report_fn_t libnvcd_region_report = NULL;
 
 // Timeflags: a bitwise OR of any of these 
 // can be passed to libnvcd_time() to indicate
@@ -74,6 +76,7 @@ static inline void libnvcd_load(void) {
   LIBNVCD_LOAD_FN(libnvcd_end);
   LIBNVCD_LOAD_FN(libnvcd_time);
   LIBNVCD_LOAD_FN(libnvcd_time_report);
+  LIBNVCD_LOAD_FN(libnvcd_region_report);
 
 #undef LIBNVCD_LOAD_FN
 }
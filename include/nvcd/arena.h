@@ -0,0 +1,51 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "nvcd/commondef.h"
+
+C_LINKAGE_START
+
+//
+// Arena allocator
+//
+// Hands out memory from one block by bumping an offset, and releases
+// everything at once. When a block is exhausted a larger one is chained
+// on; the next reset replaces the chain with a single block that holds
+// everything the arena was asked for, so from then on a reset is O(1)
+// and an allocation pattern that repeats never reaches the heap.
+//
+// There is no per-allocation free; memory from an arena is valid until
+// the arena is reset or freed.
+//
+
+// every allocation is aligned to this
+#define NVCD_ARENA_ALIGN 16
+
+// the smallest block that's allocated
+#define NVCD_ARENA_MIN_BLOCK_SIZE ((size_t)1 << 16)
+
+typedef struct nvcd_arena_block nvcd_arena_block_t;
+
+typedef struct nvcd_arena {
+  nvcd_arena_block_t* block; // the most recent; links to the older ones
+  size_t used; // since the last reset, over all blocks
+} nvcd_arena_t;
+
+#define NVCD_ARENA_INIT { NULL, 0 }
+
+// Never returns NULL.
+NVCD_EXPORT void* nvcd_arena_malloc(nvcd_arena_t* arena, size_t size);
+
+NVCD_EXPORT void* nvcd_arena_zalloc(nvcd_arena_t* arena, size_t size);
+
+NVCD_EXPORT void* nvcd_arena_memdup(nvcd_arena_t* arena, const void* src, size_t size);
+
+// Invalidates everything allocated from the arena,
+// but keeps its memory for the next allocations.
+NVCD_EXPORT void nvcd_arena_reset(nvcd_arena_t* arena);
+
+NVCD_EXPORT void nvcd_arena_free(nvcd_arena_t* arena);
+
+C_LINKAGE_END
+
+#endif // __ARENA_H__
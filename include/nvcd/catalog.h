@@ -0,0 +1,187 @@
+#ifndef __CATALOG_H__
+#define __CATALOG_H__
+
+#include "nvcd/commondef.h"
+
+#include <cuda.h>
+
+C_LINKAGE_START
+
+//
+// Device counter catalog
+//
+// nvcdinfo writes one file per device, which lists every event with
+// its ID, domain and category, every metric with the events it depends
+// on, and the groups of events that can be collected together. Event and
+// metric names are indexed by a minimal perfect hash, so a name is
+// looked up in constant time without CUPTI or the heap.
+//
+// When ENV_CATALOG names the directory the files were written to,
+// libnvcd maps the file of each device it profiles and resolves the
+// names of ENV_EVENTS and ENV_METRICS through it. A file is only used if
+// it was written for the same device name, compute capability, and
+// driver and CUPTI versions.
+//
+// All offsets are in bytes from the start of the file; names are
+// offsets into the NVCD_CATALOG_STRINGS section, null terminated.
+//
+
+#define NVCD_CATALOG_MAGIC "NVCDCAT"
+#define NVCD_CATALOG_VERSION 1
+
+#define NVCD_CATALOG_ALIGN 8
+
+#define NVCD_CATALOG_DEVICE_NAME_LENGTH 256
+
+// no such index
+#define NVCD_CATALOG_NONE UINT32_MAX
+
+enum {
+  NVCD_CATALOG_DOMAINS = 0, // nvcd_catalog_domain_t
+  NVCD_CATALOG_EVENTS, // nvcd_catalog_event_t, ordered by domain
+  NVCD_CATALOG_METRICS, // nvcd_catalog_metric_t
+  NVCD_CATALOG_METRIC_EVENTS, // CUpti_EventID
+  NVCD_CATALOG_GROUPS, // nvcd_catalog_group_t
+  NVCD_CATALOG_GROUP_EVENTS, // CUpti_EventID
+  NVCD_CATALOG_EVENT_SEEDS, // uint32_t, one per bucket of the event name hash
+  NVCD_CATALOG_EVENT_SLOTS, // uint32_t, index into NVCD_CATALOG_EVENTS
+  NVCD_CATALOG_METRIC_SEEDS,
+  NVCD_CATALOG_METRIC_SLOTS, // index into NVCD_CATALOG_METRICS
+  NVCD_CATALOG_STRINGS, // char
+  NVCD_CATALOG_SECTION_COUNT
+};
+
+typedef struct nvcd_catalog_section {
+  uint32_t offset;
+  uint32_t count; // of elements
+} nvcd_catalog_section_t;
+
+// what the catalog was generated with; compared as a whole,
+// so unused bytes of the name are zero
+typedef struct nvcd_catalog_device {
+  char name[NVCD_CATALOG_DEVICE_NAME_LENGTH];
+  int32_t cc_major;
+  int32_t cc_minor;
+  int32_t driver_version;
+  uint32_t cupti_version;
+} nvcd_catalog_device_t;
+
+typedef struct nvcd_catalog_header {
+  char magic[8]; // NVCD_CATALOG_MAGIC, null terminated
+  uint32_t version;
+  uint32_t header_size; // sizeof(nvcd_catalog_header_t)
+  uint64_t size; // of the whole file
+  nvcd_catalog_device_t device;
+  nvcd_catalog_section_t sections[NVCD_CATALOG_SECTION_COUNT];
+} nvcd_catalog_header_t;
+
+typedef struct nvcd_catalog_domain {
+  uint32_t id; // CUpti_EventDomainID
+  uint32_t name;
+  uint32_t events_begin; // index into NVCD_CATALOG_EVENTS
+  uint32_t num_events;
+} nvcd_catalog_domain_t;
+
+typedef struct nvcd_catalog_event {
+  uint32_t id; // CUpti_EventID
+  uint32_t name;
+  uint32_t domain; // index into NVCD_CATALOG_DOMAINS
+  uint32_t category; // CUpti_EventCategory
+  uint32_t group; // index into NVCD_CATALOG_GROUPS
+  uint32_t reserved;
+} nvcd_catalog_event_t;
+
+typedef struct nvcd_catalog_metric {
+  uint32_t id; // CUpti_MetricID
+  uint32_t name;
+  uint32_t events_begin; // index into NVCD_CATALOG_METRIC_EVENTS
+  uint32_t num_events;
+  uint32_t supported; // nonzero if every event it needs is in the catalog
+  uint32_t reserved;
+} nvcd_catalog_metric_t;
+
+// events which nvcdinfo found can be collected together
+typedef struct nvcd_catalog_group {
+  uint32_t domain;
+  uint32_t events_begin; // index into NVCD_CATALOG_GROUP_EVENTS
+  uint32_t num_events;
+  uint32_t reserved;
+} nvcd_catalog_group_t;
+
+// Shared by the writer and the reader. A name is first hashed with
+// seed 0 to pick its bucket, then with the bucket's seed to pick its slot.
+static inline uint32_t nvcd_catalog_hash(const char* name, uint32_t seed) {
+  // FNV-1a, with a murmur3 finalizer so that nearby seeds diverge
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+
+  for (const char* c = name; *c != '\0'; ++c) {
+    h ^= (uint8_t) *c;
+    h *= 16777619u;
+  }
+
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+
+  return h;
+}
+
+// A mapped catalog file. The pointers refer to its sections.
+typedef struct nvcd_catalog {
+  const uint8_t* map;
+  size_t size;
+
+  const nvcd_catalog_header_t* header;
+  const nvcd_catalog_domain_t* domains;
+  const nvcd_catalog_event_t* events;
+  const nvcd_catalog_metric_t* metrics;
+  const uint32_t* metric_events;
+  const nvcd_catalog_group_t* groups;
+  const uint32_t* group_events;
+  const uint32_t* event_seeds;
+  const uint32_t* event_slots;
+  const uint32_t* metric_seeds;
+  const uint32_t* metric_slots;
+  const char* strings;
+} nvcd_catalog_t;
+
+static inline uint32_t nvcd_catalog_count(const nvcd_catalog_t* catalog, uint32_t section) {
+  return catalog->header->sections[section].count;
+}
+
+static inline const char* nvcd_catalog_string(const nvcd_catalog_t* catalog, uint32_t name) {
+  return catalog->strings + name;
+}
+
+// Fills in what a catalog for the device has to match.
+NVCD_EXPORT void nvcd_catalog_device(CUdevice device, nvcd_catalog_device_t* out);
+
+// Writes the path of the catalog for the device in dir to path,
+// which holds length characters.
+NVCD_EXPORT void nvcd_catalog_path(const nvcd_catalog_device_t* device,
+                                   const char* dir,
+                                   char* path,
+                                   size_t length);
+
+// Maps and validates the file. On failure, false is returned
+// and catalog is left empty.
+NVCD_EXPORT bool nvcd_catalog_open(nvcd_catalog_t* catalog, const char* path);
+
+NVCD_EXPORT void nvcd_catalog_close(nvcd_catalog_t* catalog);
+
+// Returns the catalog in ENV_CATALOG for the device, or NULL if there isn't
+// a matching one. It's opened by the first call and kept open until exit.
+NVCD_EXPORT const nvcd_catalog_t* nvcd_catalog_for_device(CUdevice device);
+
+// These return NULL if the name isn't in the catalog.
+NVCD_EXPORT const nvcd_catalog_event_t* nvcd_catalog_find_event(const nvcd_catalog_t* catalog,
+                                                                const char* name);
+
+NVCD_EXPORT const nvcd_catalog_metric_t* nvcd_catalog_find_metric(const nvcd_catalog_t* catalog,
+                                                                  const char* name);
+
+C_LINKAGE_END
+
+#endif // __CATALOG_H__
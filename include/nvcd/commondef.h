@@ -22,14 +22,18 @@
 #define msg_verbose_begin() {  }
 #define msg_verbose_end() {  }  
 
-#define msg_verbosef(msg, ...) msg_impl(MSG_LEVEL_VERBOSE, __LINE__, __FILE__, __FUNC__, msg, __VA_ARGS__)
-#define msg_verboses(msg) msg_impl(MSG_LEVEL_VERBOSE, __LINE__, __FILE__, __FUNC__, "%s\n", msg)
-#define msg_verboseline() msg_impl(MSG_LEVEL_VERBOSE, __LINE__, __FILE__, __FUNC__, "%s", "\n")
+// verbose and diagnostic output is usually off, so these
+// don't evaluate their arguments unless it's enabled
+#define msg_level_impl(m, ...) do { if (msg_enabled(m)) { msg_impl(m, __LINE__, __FILE__, __FUNC__, __VA_ARGS__); } } while (0)
 
-#define msg_diagf(msg, ...) msg_impl(MSG_LEVEL_DIAG, __LINE__, __FILE__, __FUNC__, msg, __VA_ARGS__)
-#define msg_diags(msg) msg_impl(MSG_LEVEL_DIAG, __LINE__, __FILE__, __FUNC__, "%s\n", msg)
+#define msg_verbosef(msg, ...) msg_level_impl(MSG_LEVEL_VERBOSE, msg, __VA_ARGS__)
+#define msg_verboses(msg) msg_level_impl(MSG_LEVEL_VERBOSE, "%s\n", msg)
+#define msg_verboseline() msg_level_impl(MSG_LEVEL_VERBOSE, "%s", "\n")
+
+#define msg_diagf(msg, ...) msg_level_impl(MSG_LEVEL_DIAG, msg, __VA_ARGS__)
+#define msg_diags(msg) msg_level_impl(MSG_LEVEL_DIAG, "%s\n", msg)
 #define msg_diagtagline(expr) msg_diagf("Executing %s...\n", #expr); expr
-#define msg_diagtab(N) msg_impl(MSG_LEVEL_DIAG, __LINE__, __FILE__, __FUNC__, "%s", STRFMT_TAB##N)
+#define msg_diagtab(N) msg_level_impl(MSG_LEVEL_DIAG, "%s", STRFMT_TAB##N)
   
 #define msg_errorf(msg, ...) msg_impl(MSG_LEVEL_ERROR, __LINE__, __FILE__, __FUNC__, msg, __VA_ARGS__)
 #define msg_errors(msg) msg_impl(MSG_LEVEL_ERROR, __LINE__, __FILE__, __FUNC__, "%s\n", msg)
@@ -124,6 +128,10 @@ typedef uint32_t bool32_t; // alignment and portability
 
 #define __FUNC__ __func__
 
+// Only for trivially constructible types;
+// C++ code should use thread_local for anything else.
+#define NVCD_THREAD_LOCAL __thread
+
 #define STRFMT_TAB1 "\t"
 #define STRFMT_TAB2 "\t\t"
 #define STRFMT_TAB3 "\t\t\t"
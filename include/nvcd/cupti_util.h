@@ -3,6 +3,8 @@
 #define __CUPTI_UTIL_H__
 
 #include "nvcd/commondef.h"
+#include "nvcd/name_table.h"
+#include "nvcd/arena.h"
 
 #include <cupti.h>
 #include <pthread.h>
@@ -31,9 +33,35 @@ typedef struct cupti_event_data {
 
   uint32_t* event_counter_buffer_offsets;
   uint32_t* event_id_buffer_offsets;
-  uint8_t* event_group_read_states; // not all event groups can be read simultaneously
 
-  uint8_t* event_groups_enabled;
+  // Dense indices of the requested events, assigned once the groups
+  // are built: counter_rows[i] is the row of event_id_buffer[i] in a
+  // counter matrix, or CED_COUNTER_ROW_NONE if it wasn't requested.
+  uint32_t* counter_rows;
+  // the layout of every counter matrix filled from this event data:
+  // the event of each row, and where its values start, with
+  // counter_row_offsets[num_counter_rows] == num_counter_values
+  CUpti_EventID* counter_row_events;
+  uint32_t* counter_row_offsets;
+  // not all event groups can be read simultaneously;
+  // CED_EVENT_GROUP_STATE_COUNT bitsets of num_event_group_words
+  // words each, see cupti_event_group_states()
+  uint64_t* event_group_states;
+
+  // The collection plan, computed once at initialization.
+  // Pass p enables the groups
+  //   pass_groups[pass_offsets[p]] ... pass_groups[pass_offsets[p + 1] - 1]
+  // which are known to be compatible with each other.
+  // Groups that can't be enabled at all are stored after
+  // pass_offsets[num_passes].
+  uint32_t* pass_groups;
+  uint32_t* pass_offsets;
+  
+  // The events which were explicitly requested through ENV_EVENTS,
+  // sorted by ID. The root event data collects these along with
+  // every event the requested metrics depend on, but only these
+  // are enumerated by cupti_event_data_enum_event_counters().
+  CUpti_EventID* requested_event_ids;
   
   // arbitrary, has a max size which can grow
   uint64_t* kernel_times_nsec;
@@ -42,7 +70,18 @@ typedef struct cupti_event_data {
   
   char * const * event_names;
 
+  // names of every event in the groups and of every
+  // requested metric, filled once by cupti_event_data_init()
+  nvcd_name_table_t event_name_table;
+  nvcd_name_table_t metric_name_table;
+
   cupti_metric_data_t* metric_data; // ONLY applies to the root event_data node
+
+  // Set by the owner before initialization. Every buffer of the
+  // event data and its metric data, apart from kernel_times_nsec and
+  // the name tables, is allocated from it, and
+  // cupti_event_data_free() resets it.
+  nvcd_arena_t* arena;
   
   uint64_t stage_time_nsec_start;
   
@@ -50,6 +89,13 @@ typedef struct cupti_event_data {
   CUdevice cuda_device;
 
   CUpti_SubscriberHandle subscriber;
+
+  // With stream_sync, only the stream the kernel was launched in is
+  // waited on, using events recorded around the launch, and not in
+  // the callback: see cupti_event_data_collect().
+  CUstream cuda_stream;
+  CUevent stage_event_start;
+  CUevent stage_event_end;
   
   // for asserting thread relationship
   // consistency
@@ -58,8 +104,21 @@ typedef struct cupti_event_data {
 
   
   uint32_t num_event_groups; 
+  uint32_t num_event_group_words;
   uint32_t num_kernel_times;
 
+  uint32_t num_passes;
+  uint32_t current_pass;
+  // the planned pass whose kernel may still be running,
+  // or CED_PASS_NONE once it's been read
+  uint32_t pending_pass;
+
+  uint32_t num_requested_event_ids;
+
+  // of a counter matrix that holds every requested event
+  uint32_t num_counter_rows;
+  uint32_t num_counter_values;
+
   //
   // event_groups_read length == num_event_groups;
   // once count_event_groups_read == num_event_groups,
@@ -81,15 +140,36 @@ typedef struct cupti_event_data {
   bool32_t is_root;
   bool32_t has_metrics;
   bool32_t has_events;
+  bool32_t stream_sync;
 } cupti_event_data_t;
 
 typedef struct cupti_metric_data {
   CUpti_MetricID* metric_ids;
   CUpti_MetricValue* metric_values;
-  cupti_event_data_t* event_data;
+
+  // which member of metric_values[i] is set; looked up
+  // once, when the metric IDs are
+  CUpti_MetricValueKind* value_kinds;
+
+  // The events each metric depends on. These are collected by the root
+  // event data along with everything else, so metric i's inputs are
+  //   event_ids[event_id_offsets[i]] ... event_ids[event_id_offsets[i + 1] - 1]
+  // looked up in the root's counter buffer.
+  CUpti_EventID* event_ids;
+  uint32_t* event_id_offsets;
+
+  // where each of event_ids is in the root's event_id_buffer,
+  // found once the root's buffers are set up
+  uint32_t* event_indices;
+  
   bool32_t* computed;
   CUptiResult* metric_get_value_results;
 
+  // scratch for cupti_event_data_calc_metrics(): the root's
+  // counters normalized per group, and the inputs of every metric
+  uint64_t* normalized_counters;
+  uint64_t* event_values;
+
   uint32_t num_metrics;
   bool32_t initialized;
 } cupti_metric_data_t;
@@ -101,6 +181,8 @@ typedef struct cupti_metric_data {
 #define PTHREAD_INITIALIZER (unsigned long)0
 #endif
 
+#define CED_PASS_NONE UINT32_MAX
+
 #define CUPTI_EVENT_DATA_INIT {                                         \
   /*.event_id_buffer =*/ NULL,                                          \
     /*.event_counter_buffer =*/ NULL,                                   \
@@ -109,20 +191,38 @@ typedef struct cupti_metric_data {
     /*.num_instances_per_group =*/ NULL,                                \
       /*.event_counter_buffer_offsets =*/ NULL,                         \
     /*.event_id_buffer_offsets =*/ NULL,                                \
-      /*.event_group_read_states =*/ NULL,                              \
-      /*.event_groups_enabled =*/ NULL,                                 \
+      /*.counter_rows =*/ NULL,                                         \
+      /*.counter_row_events =*/ NULL,                                   \
+      /*.counter_row_offsets =*/ NULL,                                  \
+      /*.event_group_states =*/ NULL,                                   \
+      /*.pass_groups =*/ NULL,                                          \
+      /*.pass_offsets =*/ NULL,                                         \
+      /*.requested_event_ids =*/ NULL,                                  \
     /*.kernel_times_nsec =*/ NULL,                                      \
     /*.event_groups =*/ NULL,                                           \
     /*.event_names =*/ NULL,                                            \
+      /*.event_name_table =*/ NVCD_NAME_TABLE_INIT,                     \
+      /*.metric_name_table =*/ NVCD_NAME_TABLE_INIT,                    \
       /*.metric_data =*/ NULL,                                          \
+      /*.arena =*/ NULL,                                                \
     /*.stage_time_nsec_start =*/ 0,                                     \
     /*.cuda_context =*/ NULL,                                           \
     /*.cuda_device =*/ CU_DEVICE_INVALID,                               \
     /*.subscriber =*/ NULL,                                             \
+      /*.cuda_stream =*/ NULL,                                          \
+      /*.stage_event_start =*/ NULL,                                    \
+      /*.stage_event_end =*/ NULL,                                      \
       /*.thread_event_data_init =*/ PTHREAD_INITIALIZER,                \
       /*.thread_event_callback =*/ PTHREAD_INITIALIZER,                 \
     /*.num_event_groups =*/ 0,                                          \
+      /*.num_event_group_words =*/ 0,                                   \
     /*.num_kernel_times =*/ 0,                                          \
+      /*.num_passes =*/ 0,                                              \
+      /*.current_pass =*/ 0,                                            \
+      /*.pending_pass =*/ CED_PASS_NONE,                                \
+      /*.num_requested_event_ids =*/ 0,                                 \
+      /*.num_counter_rows =*/ 0,                                        \
+      /*.num_counter_values =*/ 0,                                      \
     /*.count_event_groups_read =*/ 0,                                   \
     /*.event_counter_buffer_length =*/ 0,                               \
     /*.event_id_buffer_length =*/ 0,                                    \
@@ -131,7 +231,8 @@ typedef struct cupti_metric_data {
       /*.initialized =*/ false,                                         \
       /*.is_root =*/ false,						\
       /*.calc_metrics =*/ false,					\
-      /*.calc_events =*/ false						\
+      /*.calc_events =*/ false,						\
+      /*.stream_sync =*/ false						\
     }
 
 
@@ -155,13 +256,23 @@ typedef struct cupti_metric_data {
 //              which, at the time, have little specific information to go off of.
 //              providing the option to skip enables the event group to be ignored,
 //              which in turn allows us to at least keep everything else working
+//
+// Each state is a bitset over the groups, and every group is in exactly
+// one of them. Enabled is kept alongside, for the groups that are
+// currently enabled in CUPTI.
 enum {
   CED_EVENT_GROUP_UNREAD = 0,
   CED_EVENT_GROUP_READ = 1, 
   CED_EVENT_GROUP_DONT_READ = 2,
-  CED_EVENT_GROUP_SKIP = 3
+  CED_EVENT_GROUP_SKIP = 3,
+  CED_EVENT_GROUP_ENABLED = 4,
+  CED_EVENT_GROUP_STATE_COUNT
 };
 
+static inline uint64_t* cupti_event_group_states(cupti_event_data_t* e, uint32_t state) {
+  return e->event_group_states + (size_t) state * e->num_event_group_words;
+}
+
 typedef struct cupti_enum_event_counter_iteration {
   uint32_t instance;
   uint32_t num_instances;
@@ -189,6 +300,10 @@ NVCD_EXPORT void cupti_event_data_subscribe(cupti_event_data_t* e);
 
 NVCD_EXPORT void cupti_event_data_unsubscribe(cupti_event_data_t* e);
 
+// Releases the process-wide CUPTI subscriber shared by every thread.
+// It's created again by the next cupti_event_data_subscribe().
+NVCD_EXPORT void cupti_subscriber_terminate();
+
 NVCD_EXPORT void cupti_event_data_init_from_ids(cupti_event_data_t* e,
                                                 CUpti_EventID* event_ids,
                                                 uint32_t num_event_ids);
@@ -199,6 +314,11 @@ NVCD_EXPORT void cupti_event_data_set_null(cupti_event_data_t* e);
 
 NVCD_EXPORT void cupti_event_data_free(cupti_event_data_t* e);
 
+// Returns an initialized cupti_event_data_t* to the state it was in
+// directly after initialization, so that it can be used for another
+// kernel invocation without recreating its event groups or buffers.
+NVCD_EXPORT void cupti_event_data_reset(cupti_event_data_t* e);
+
 NVCD_EXPORT void cupti_event_data_begin(cupti_event_data_t* e);
 
 NVCD_EXPORT void cupti_event_data_end(cupti_event_data_t* e);
@@ -213,6 +333,20 @@ NVCD_EXPORT CUpti_MetricID* cupti_metric_get_ids(CUdevice dev,
 
 NVCD_EXPORT char* cupti_metric_get_name(CUpti_MetricID metric);
 
+// Interned names of the events and metrics the event data collects.
+// These return NULL for any other ID, and are valid until
+// cupti_event_data_free().
+NVCD_EXPORT const char* cupti_event_data_event_name(const cupti_event_data_t* e,
+                                                    CUpti_EventID eid);
+
+NVCD_EXPORT const char* cupti_event_data_metric_name(const cupti_event_data_t* e,
+                                                     CUpti_MetricID metric);
+
+// Returns false if the name isn't one of the collected events.
+NVCD_EXPORT bool cupti_event_data_find_event(const cupti_event_data_t* e,
+                                             const char* name,
+                                             CUpti_EventID* eid);
+
 NVCD_EXPORT uint32_t cupti_event_group_get_num_events(CUpti_EventGroup group);
 
 NVCD_EXPORT char* cupti_event_data_to_string(cupti_event_data_t* e);
@@ -221,6 +355,16 @@ NVCD_EXPORT void cupti_event_data_calc_metrics(cupti_event_data_t* e);
 
 NVCD_EXPORT bool cupti_event_data_callback_finished(cupti_event_data_t* e);
 
+// With stream_sync, the callback doesn't wait for a planned pass's
+// kernel to finish. The pass is read when the next one is launched,
+// or by this, which waits for the kernel if it has to. It must be
+// called before the counters or kernel times of the last pass are used.
+NVCD_EXPORT void cupti_event_data_collect(cupti_event_data_t* e);
+
+// true if a pass is left to read and its kernel hasn't finished yet;
+// doesn't wait
+NVCD_EXPORT bool cupti_event_data_running(cupti_event_data_t* e);
+
 NVCD_EXPORT char** cupti_get_event_names(cupti_event_data_t* e, size_t* out_len);
 
 NVCD_EXPORT uint32_t cupti_get_num_event_names(cupti_event_data_t* e);
@@ -228,5 +372,100 @@ NVCD_EXPORT uint32_t cupti_get_num_event_names(cupti_event_data_t* e);
 NVCD_EXPORT void cupti_event_data_enum_event_counters(cupti_event_data_t* e,
 						      cupti_event_data_enum_event_counters_fn_t fn);
 
+NVCD_EXPORT uint32_t cupti_event_data_num_passes(cupti_event_data_t* e);
+
+// Colors the conflict graph of n event groups so that no two groups
+// with conflicts[i * n + j] set share a color; each color is a
+// candidate pass. Uses DSatur, unless coloring the groups in order
+// needs fewer colors. Groups that aren't usable get UINT32_MAX.
+// Scratch space comes from arena. Returns the number of colors.
+NVCD_EXPORT uint32_t cupti_color_conflict_graph(nvcd_arena_t* arena,
+                                                uint32_t n,
+                                                const uint8_t* usable,
+                                                const uint8_t* conflicts,
+                                                uint32_t* colors);
+
+// Makes the next kernel invocation collect only the given pass
+// of the collection plan. Must be called on freshly
+// initialized or reset event data.
+NVCD_EXPORT void cupti_event_data_select_pass(cupti_event_data_t* e, uint32_t pass);
+
+// Like cupti_event_data_enum_event_counters(), but only for
+// the groups of a single pass.
+NVCD_EXPORT void cupti_event_data_enum_pass_counters(cupti_event_data_t* e,
+                                                     uint32_t pass,
+                                                     cupti_event_data_enum_event_counters_fn_t fn);
+
+//
+// Counters of the requested events as a dense matrix: one row per
+// event, holding the values of all of its instances contiguously.
+// CUPTI stores a group's counters instance by instance, so an event's
+// instances are otherwise strided across the group; copying them into
+// rows once lets each row be reduced as a plain array, without
+// a callback per value.
+//
+// Row i holds the event whose dense index is i (see
+// cupti_event_data_t::counter_rows), at the same place in every
+// fill from the same event data. A pass's matrix only fills
+// the rows of its own events; see cupti_counter_matrix_filled().
+// The buffers are kept and reused across fills.
+//
+#define CED_COUNTER_ROW_NONE UINT32_MAX
+
+typedef struct cupti_counter_matrix {
+  CUpti_EventID* event_ids; // of each row
+
+  // row i is values[row_offsets[i]] ... values[row_offsets[i + 1] - 1]
+  uint32_t* row_offsets;
+  uint64_t* values;
+
+  // bitset of the rows the last fill wrote
+  uint64_t* rows_filled;
+
+  uint32_t num_rows;
+
+  uint32_t rows_capacity;
+  uint32_t values_capacity;
+} cupti_counter_matrix_t;
+
+#define CUPTI_COUNTER_MATRIX_INIT { NULL, NULL, NULL, NULL, 0, 0, 0 }
+
+typedef struct cupti_counter_stats {
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  double mean;
+} cupti_counter_stats_t;
+
+static inline const uint64_t* cupti_counter_matrix_row(const cupti_counter_matrix_t* m,
+                                                       uint32_t row,
+                                                       uint32_t* out_num_instances) {
+  *out_num_instances = m->row_offsets[row + 1] - m->row_offsets[row];
+  return m->values + m->row_offsets[row];
+}
+
+static inline bool cupti_counter_matrix_filled(const cupti_counter_matrix_t* m, uint32_t row) {
+  return (m->rows_filled[row >> 6] >> (row & 63)) & 1;
+}
+
+// Fills m with the counters of every group. All of
+// them must have been read.
+NVCD_EXPORT void cupti_event_data_counter_matrix(cupti_event_data_t* e,
+                                                 cupti_counter_matrix_t* m);
+
+// Like cupti_event_data_counter_matrix(), but only the rows
+// of the events in the given pass are filled.
+NVCD_EXPORT void cupti_event_data_pass_counter_matrix(cupti_event_data_t* e,
+                                                      uint32_t pass,
+                                                      cupti_counter_matrix_t* m);
+
+NVCD_EXPORT void cupti_counter_matrix_free(cupti_counter_matrix_t* m);
+
+// Sum, minimum, maximum and mean of count values. All of them
+// are 0 if count is 0.
+NVCD_EXPORT void cupti_counter_stats(const uint64_t* values,
+                                     uint32_t count,
+                                     cupti_counter_stats_t* out);
+
 C_LINKAGE_END
 #endif //__CUPTI_UTIL_H__
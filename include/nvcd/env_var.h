@@ -15,11 +15,61 @@ C_LINKAGE_START
 
 #define ENV_SAMPLE "NVCD_SAMPLE"
 
+// when set to a nonzero value, each profiled kernel invocation
+// collects a single pass instead of being replayed; successive
+// invocations of the same kernel rotate through the passes.
+#define ENV_ROTATE "NVCD_ROTATE"
+
+// when set to a nonzero value, profiled kernels only wait on
+// the stream they were launched in, rather than the whole device.
+#define ENV_STREAM "NVCD_STREAM"
+
+// when set to a nonzero value, the kernel time and counters of every
+// profiled launch are summarized per region and kernel (see stats.h),
+// and reported when the process exits.
+#define ENV_STATS "NVCD_STATS"
+
+// when set to a nonzero value, kernels which call nvcd_device_begin()
+// and nvcd_device_end() are analyzed for load imbalance between SMs
+// after every profiled launch (see imbalance.h).
+#define ENV_IMBALANCE "NVCD_IMBALANCE"
+
+// file that libnvcd_region_report() appends the region tree to,
+// as folded stacks weighed by exclusive wall time in nanoseconds
+#define ENV_FOLDED "NVCD_FOLDED"
+
+// if set, folded stacks are weighed by this event's exclusive count instead
+#define ENV_FOLDED_EVENT "NVCD_FOLDED_EVENT"
+
+// file that profiled launches append binary records to (see record.h),
+// instead of printing their counters. %p is replaced by the process
+// ID and %r by the MPI rank; without either, ".<pid>" is appended
+#define ENV_RECORD "NVCD_RECORD"
+
+// what to do with output when the writer's queue is full:
+// block, drop, spill or sync (see writer.h)
+#define ENV_WRITER_POLICY "NVCD_WRITER_POLICY"
+
+// number of messages the writer's queue holds
+#define ENV_WRITER_QUEUE "NVCD_WRITER_QUEUE"
+
+// file that messages are spilled to, if ENV_WRITER_POLICY=spill
+#define ENV_WRITER_SPILL "NVCD_WRITER_SPILL"
+
+// directory that event group plans are cached in (see plan_cache.h)
+#define ENV_PLAN_CACHE "NVCD_PLAN_CACHE"
+
+// directory of the device catalogs written by nvcdinfo (see catalog.h)
+#define ENV_CATALOG "NVCD_CATALOG"
+
 #define ENV_DELIM ','
 #define ENV_ALL_EVENTS "ALL"
 
 char** env_var_list_read(const char* env_var_value, size_t* count);
 
+// true if the variable is set to anything other than "" or "0"
+NVCD_EXPORT bool env_var_flag(const char* name);
+
 
 
 C_LINKAGE_END
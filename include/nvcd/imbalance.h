@@ -0,0 +1,83 @@
+#ifndef __IMBALANCE_H__
+#define __IMBALANCE_H__
+
+#include "nvcd/commondef.h"
+
+C_LINKAGE_START
+
+//
+// Load imbalance
+//
+// Kernels which call nvcd_device_begin() and nvcd_device_end() record
+// each thread's time in clock cycles and the SM it ran on. From those,
+// the busy time of each SM is the sum of its threads' times, and a
+// kernel is only as fast as its busiest SM: the critical path. If the
+// work were spread evenly, every SM would be as busy as the mean, so
+// max / mean estimates the speedup of balancing it.
+//
+// Only host memory is read, so the analysis can be run on synthetic
+// arrays without a device.
+//
+
+// SMs are binned by busy time into this many equal
+// bins between the least and most busy
+#define NVCD_IMBALANCE_NUM_BINS 10
+
+// the smid of a thread that didn't call nvcd_device_end(),
+// which the device buffers are cleared to
+#define NVCD_IMBALANCE_SMID_NONE UINT32_MAX
+
+typedef struct nvcd_imbalance_sm {
+  uint32_t smid;
+  uint32_t num_threads;
+  uint32_t num_blocks; // 0 if the block size isn't known
+  uint64_t busy; // sum of thread times
+  clock64_t max_time; // of the longest thread
+} nvcd_imbalance_sm_t;
+
+typedef struct nvcd_imbalance {
+  // SMs which ran at least one thread, ordered by smid
+  nvcd_imbalance_sm_t* sms;
+  uint32_t num_sms;
+
+  // index into sms of the busiest SM
+  uint32_t critical_sm;
+
+  uint64_t min_busy;
+  uint64_t median_busy;
+  uint64_t max_busy;
+  double mean_busy;
+
+  // max_busy / median_busy, or 0 if the median is 0
+  double tail_ratio;
+  // max_busy / mean_busy, or 1 if nothing was busy
+  double speedup_if_balanced;
+
+  uint32_t histogram[NVCD_IMBALANCE_NUM_BINS];
+
+  // the buffers are kept between analyses
+  uint64_t* scratch;
+  uint32_t capacity;
+} nvcd_imbalance_t;
+
+#define NVCD_IMBALANCE_INIT { NULL, 0, 0, 0, 0, 0, 0.0, 0.0, 0.0, {0}, NULL, 0 }
+
+// true if ENV_IMBALANCE is set; read once
+NVCD_EXPORT bool nvcd_imbalance_enabled(void);
+
+// Thread i ran on smids[i] and took times[i] cycles. Threads are
+// assumed to be numbered block by block, so that thread i is in block
+// i / block_size; blocks aren't counted if block_size is 0. Threads
+// whose smid is NVCD_IMBALANCE_SMID_NONE weren't recorded, and aren't
+// counted on any SM. Replaces the result of the previous analysis.
+NVCD_EXPORT void nvcd_imbalance_analyze(nvcd_imbalance_t* imbalance,
+                                        const clock64_t* times,
+                                        const uint32_t* smids,
+                                        size_t num_threads,
+                                        uint32_t block_size);
+
+NVCD_EXPORT void nvcd_imbalance_free(nvcd_imbalance_t* imbalance);
+
+C_LINKAGE_END
+
+#endif // __IMBALANCE_H__
@@ -0,0 +1,54 @@
+#ifndef __NAME_TABLE_H__
+#define __NAME_TABLE_H__
+
+#include "nvcd/commondef.h"
+
+C_LINKAGE_START
+
+//
+// Interned names
+//
+// CUPTI returns a name by copying it into a caller supplied buffer,
+// one attribute query per call. A name table is filled once per
+// session with the names of the events (or metrics) that are
+// collected, and afterwards maps their IDs to names and names to IDs
+// without querying CUPTI or allocating. The names it returns stay
+// valid until the table is freed.
+//
+
+// Writes the name of id to name, which holds length characters.
+typedef void (*nvcd_name_query_fn_t)(uint32_t id, char* name, size_t length);
+
+typedef struct nvcd_name_table {
+  // sorted and unique
+  uint32_t* ids;
+  // names[i] is the offset of ids[i]'s name into strings
+  uint32_t* names;
+  // indices into ids, ordered by name
+  uint32_t* by_name;
+  char* strings;
+  uint32_t count;
+} nvcd_name_table_t;
+
+#define NVCD_NAME_TABLE_INIT { NULL, NULL, NULL, NULL, 0 }
+
+// Queries the names of the IDs, which may be unsorted and
+// contain duplicates. The table must be empty.
+NVCD_EXPORT void nvcd_name_table_build(nvcd_name_table_t* table,
+                                       const uint32_t* ids,
+                                       uint32_t num_ids,
+                                       nvcd_name_query_fn_t query);
+
+// Returns NULL if the ID isn't in the table.
+NVCD_EXPORT const char* nvcd_name_table_name(const nvcd_name_table_t* table, uint32_t id);
+
+// Returns false if the name isn't in the table.
+NVCD_EXPORT bool nvcd_name_table_find(const nvcd_name_table_t* table,
+                                      const char* name,
+                                      uint32_t* id);
+
+NVCD_EXPORT void nvcd_name_table_free(nvcd_name_table_t* table);
+
+C_LINKAGE_END
+
+#endif // __NAME_TABLE_H__
@@ -6,6 +6,9 @@
 #include <nvcd/env_var.h>
 #include <nvcd/cupti_util.h>
 #include <nvcd/nvcd.h>
+#include <nvcd/record.h>
+#include <nvcd/catalog.h>
+#include <nvcd/imbalance.h>
 
 #include <vector>
 #include <unordered_map>
@@ -18,6 +21,10 @@
 #include <type_traits>
 #include <sstream>
 #include <iomanip>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -78,8 +85,8 @@
 
 #define DEV_PRINT_PTR(v) msg_verbosef("&(%s) = %p, %s = %p\n", #v, &v, #v, v)
 
-#ifndef NVCD_OMIT_STANDALONE_EVENT_COUNTER
-
+// Events and metrics share the same event groups,
+// so a single replay loop collects both.
 #define NVCD_KERNEL_EXEC_KPARAMS_2(kname, kparam_1, kparam_2, ...)      \
   do {                                                                  \
     cupti_event_data_begin(nvcd_get_events());                          \
@@ -89,68 +96,47 @@
       g_run_info->run_kernel_count_inc();				\
     }                                                                   \
     cupti_event_data_end(nvcd_get_events());                            \
-    NVCD_KERNEL_EXEC_METRICS_KPARAMS_2(nvcd_get_events(),               \
-				       kname,				\
-				       kparam_1,			\
-				       kparam_2,			\
-				       __VA_ARGS__);			\
-  } while (0)
-
-  #else
-
-#define NVCD_KERNEL_EXEC_KPARAMS_2(kname, kparam_1, kparam_2, ...)      \
-  do {                                                                  \
-    NVCD_KERNEL_EXEC_METRICS_KPARAMS_2(nvcd_get_events(),               \
-				       kname,				\
-				       kparam_1,			\
-				       kparam_2,			\
-				       __VA_ARGS__);			\
   } while (0)
 
-#endif // NVCD_OMIT_STANDALONE_EVENT_COUNTER
-
-#define NVCD_KERNEL_EXEC_METRICS_KPARAMS_2(p_event_data, kname, kparam_1, kparam_2, ...) \
-  do {                                                                  \
-    cupti_event_data_t* __e = (p_event_data);                           \
-                                                                        \
-    ASSERT(__e->is_root == true);                                       \
-    ASSERT(__e->initialized == true);                                   \
-    ASSERT(__e->metric_data != NULL);                                   \
-    ASSERT(__e->metric_data->initialized == true);                      \
-                                                                        \
-    for (uint32_t i = 0; i < __e->metric_data->num_metrics; ++i) {      \
-      cupti_event_data_begin(&__e->metric_data->event_data[i]);         \
-      while (!cupti_event_data_callback_finished(&__e->metric_data->event_data[i])) { \
-        kname<<<kparam_1, kparam_2>>>(__VA_ARGS__);                     \
-        CUDA_RUNTIME_FN(cudaDeviceSynchronize());                       \
-        g_run_info->run_kernel_count_inc();				\
-      }                                                                 \
-                                                                        \
-      cupti_event_data_end(&__e->metric_data->event_data[i]);           \
-    }                                                                   \
-  } while (0)                                                           
-
 namespace detail {
   DEV clock64_t* dev_tstart = nullptr;
   DEV clock64_t* dev_ttime = nullptr;
-  DEV int* dev_num_iter = nullptr;
   DEV uint* dev_smids = nullptr;
+#ifdef NVCD_TEST_IMBALANCE
+  DEV int* dev_num_iter = nullptr;
+#endif
 }
 
 // Hook management
 
-extern "C" {  
-  extern size_t dev_tbuf_size;
-  extern size_t dev_num_iter_size;
-  extern size_t dev_smids_size;
+// The device buffers of one device. They're one allocation, laid out
+// as ttime, smids, tstart, each with room for capacity threads, and
+// are only ever grown. A recorded thread stores its smid + 1, so that
+// clearing smids to 0 is all that marks a thread as unrecorded.
+//
+// Like the device symbols that point to them, a device's buffers are
+// shared by every thread that profiles it. A thread only touches them
+// while it holds the device's event data, from nvcd_init_events() to
+// nvcd_release_events(), so the symbols only change when the pool
+// is reallocated.
+struct nvcd_device_pool {
+  void* base;
+  size_t capacity; // in threads
+  size_t num_threads; // of the launch using it
+};
+
+// indexed by device ordinal; sized once, by the first
+// nvcd_init(), so that the pools never move
+extern std::vector<nvcd_device_pool> dev_pools;
+extern std::once_flag dev_pools_init;
 
-  extern void* d_dev_tstart;
-  extern void* d_dev_ttime;
-  extern void* d_dev_num_iter;
-  extern void* d_dev_smids;
+static inline void nvcd_device_pool_get_smids(const nvcd_device_pool& pool, unsigned* out);
 
-  extern volatile bool test_imbalance_detect;
+static inline void nvcd_device_pool_get_ttime(const nvcd_device_pool& pool,
+                                              const unsigned* smids,
+                                              clock64_t* out);
 
+extern "C" {  
   NVCD_CUDA_EXPORT void nvcd_device_get_ttime(clock64_t* out);
 
   NVCD_CUDA_EXPORT void nvcd_device_get_smids(unsigned* out);
@@ -165,6 +151,182 @@ struct block {
   clock64_t time;
 };
 
+// The number of chunks parallel_chunks() splits n elements into:
+// one per hardware thread, with at least min_chunk elements each.
+NVCD_CUDA_EXPORT size_t parallel_num_chunks(size_t n, size_t min_chunk) {
+  size_t num_chunks = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  return std::max<size_t>(std::min(num_chunks, n / min_chunk), 1);
+}
+
+// The threads parallel_chunks() runs on: one less than there are
+// hardware threads, since the caller works too. They're started by
+// the first call with more than one chunk, and wait for the next
+// call in between, until the process exits.
+//
+// One call runs at a time, and its chunks go to whichever
+// thread is free next, the caller included.
+struct nvcd_chunk_pool {
+  typedef void (*chunk_fn_t)(void* arg, size_t chunk);
+  
+  std::vector<std::thread> workers;
+  std::once_flag started;
+  pid_t pid; // a forked child doesn't have the workers
+
+  // held for the whole of a call
+  std::mutex call_mutex;
+
+  std::mutex mutex;
+  std::condition_variable work_ready;
+  std::condition_variable work_done;
+
+  // the current call, guarded by mutex
+  chunk_fn_t fn;
+  void* arg;
+  size_t num_chunks;
+  size_t next_chunk;
+  size_t num_done;
+  uint64_t generation;
+  bool stopping;
+
+  nvcd_chunk_pool()
+    : pid(0),
+      fn(nullptr),
+      arg(nullptr),
+      num_chunks(0),
+      next_chunk(0),
+      num_done(0),
+      generation(0),
+      stopping(false)
+  {}
+
+  ~nvcd_chunk_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    
+    work_ready.notify_all();
+
+    for (auto& worker: workers) {
+      if (pid == getpid()) {
+        worker.join();
+      } else {
+        worker.detach();
+      }
+    }
+  }
+
+  // starts num_threads - 1 workers, or one per hardware thread but
+  // one if num_threads is 0; only the first call does anything
+  void start(size_t num_threads = 0) {
+    std::call_once(started,
+                   [this, num_threads]() -> void {
+                     pid = getpid();
+
+                     size_t n = num_threads;
+                     
+                     if (n == 0) {
+                       n = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+                     }
+    
+                     for (size_t t = 1; t < n; ++t) {
+                       workers.emplace_back(&nvcd_chunk_pool::worker_main, this);
+                     }
+                   });
+  }
+
+  // takes chunks until there are none left; lock holds mutex
+  void run_chunks(std::unique_lock<std::mutex>& lock) {
+    while (next_chunk < num_chunks) {
+      size_t chunk = next_chunk++;
+
+      lock.unlock();
+      fn(arg, chunk);
+      lock.lock();
+
+      if (++num_done == num_chunks) {
+        work_done.notify_one();
+      }
+    }
+  }
+
+  void worker_main() {
+    std::unique_lock<std::mutex> lock(mutex);
+    uint64_t seen = 0;
+
+    while (true) {
+      work_ready.wait(lock, [&]() -> bool { return stopping || generation != seen; });
+
+      if (stopping) {
+        return;
+      }
+
+      seen = generation;
+      run_chunks(lock);
+    }
+  }
+
+  // calls fn(arg, chunk) for each chunk in [0, num_chunks_),
+  // and returns once they've all returned
+  void run(size_t num_chunks_, chunk_fn_t fn_, void* arg_) {
+    start();
+
+    if (workers.empty() || pid != getpid()) {
+      for (size_t c = 0; c < num_chunks_; ++c) {
+        fn_(arg_, c);
+      }
+      
+      return;
+    }
+    
+    std::lock_guard<std::mutex> call_lock(call_mutex);
+    std::unique_lock<std::mutex> lock(mutex);
+
+    fn = fn_;
+    arg = arg_;
+    num_chunks = num_chunks_;
+    next_chunk = 0;
+    num_done = 0;
+    generation++;
+
+    work_ready.notify_all();
+
+    run_chunks(lock);
+
+    work_done.wait(lock, [&]() -> bool { return num_done == num_chunks; });
+  }
+};
+
+extern nvcd_chunk_pool g_chunk_pool;
+
+// Calls fn(begin, end, chunk) for num_chunks contiguous ranges
+// which cover [0, n), on the threads of g_chunk_pool.
+template <class TFn>
+NVCD_CUDA_EXPORT void parallel_chunks(size_t n, size_t num_chunks, TFn fn) {
+  ASSERT(num_chunks > 0);
+  
+  size_t chunk_size = (n + num_chunks - 1) / num_chunks;
+
+  if (num_chunks == 1) {
+    fn(0, n, 0);
+    return;
+  }
+
+  struct chunk_job {
+    TFn* fn;
+    size_t n;
+    size_t chunk_size;
+  } job = { &fn, n, chunk_size };
+
+  g_chunk_pool.run(num_chunks,
+                   [](void* arg, size_t chunk) -> void {
+                     chunk_job* j = static_cast<chunk_job*>(arg);
+                     size_t begin = std::min(chunk * j->chunk_size, j->n);
+                     (*j->fn)(begin, std::min(begin + j->chunk_size, j->n), chunk);
+                   },
+                   &job);
+}
+
 struct kernel_invoke_data {
   std::vector<block> load_minor;
   std::vector<block> load_major;
@@ -178,6 +340,10 @@ struct kernel_invoke_data {
   size_t num_threads;
 
   uint32_t exec_count;
+
+  // below this many threads per chunk, handing the
+  // chunk to a worker costs more than it saves
+  static constexpr size_t k_min_chunk = 1 << 20;
   
   kernel_invoke_data(size_t num_threads_)
     : times(num_threads_, 0),
@@ -190,25 +356,49 @@ struct kernel_invoke_data {
   ~kernel_invoke_data()
   {}
 
-  void fill_outliers(double bounds,
-                     double q1,
-                     double q3,
-		     const std::string& threshold,
-                     const std::vector<block>& in,
-                     std::vector<block>& out) {
-    
-    clock64_t max = static_cast<clock64_t>(q3) + static_cast<clock64_t>(bounds);
+  // reuses the buffers for another launch
+  void reset(size_t num_threads_) {
+    load_minor.clear();
+    load_major.clear();
+    times.resize(num_threads_);
+    smids.resize(num_threads_);
+    num_threads = num_threads_;
+    exec_count = 0;
+  }
 
-    #if 0
-    msg_userf(STATISTICS_TAG " [ticks measured for the region]{q1, q3, bounds, %s outlier threshold} = {%f, %f, %f, %" PRId64 "}\n",
-    	      threshold.c_str(),
-    	      q1, q3, bounds, max);
-    #endif
+  // the threads in [begin, end) which take longer than
+  // q3 + 1.5 IQR are minor outliers, and those which
+  // take longer than q3 + 3 IQR are major ones too.
+  // Also counts the threads which ran on each SM.
+  void scan(size_t begin,
+            size_t end,
+            clock64_t minor_max,
+            clock64_t major_max,
+            std::vector<block>& minor,
+            std::vector<block>& major,
+            std::vector<uint32_t>& sm_threads) const {
+    for (size_t i = begin; i < end; ++i) {
+      clock64_t time = times[i];
+      
+      if (time > minor_max) {
+        minor.push_back(block{static_cast<int>(i), time});
+
+        if (time > major_max) {
+          major.push_back(block{static_cast<int>(i), time});
+        }
+      }
+
+      uint32_t smid = smids[i];
 
-    for (const block& b: in) {
-      if (b.time > max) {
-        out.push_back(b);
+      if (smid == NVCD_IMBALANCE_SMID_NONE) {
+        continue;
       }
+      
+      if (smid >= sm_threads.size()) {
+        sm_threads.resize(smid + 1, 0);
+      }
+      
+      sm_threads[smid]++;
     }
   }
 
@@ -222,47 +412,91 @@ struct kernel_invoke_data {
 		   v[i].thread);
     }
   }
-  
-  void write() {
 
-    std::unordered_set<int> smids_used;
-    
-    for (size_t i = 0; i < num_threads; ++i) {
-      smids_used.insert(smids[i]);
-    }
+  // The times above which a thread is a minor, or a major, outlier.
+  // The quartiles are selected in linear time instead of sorting;
+  // each is the mean of two neighbouring order statistics.
+  void outlier_bounds(clock64_t& minor_max, clock64_t& major_max) const {
+    minor_max = std::numeric_limits<clock64_t>::max();
+    major_max = std::numeric_limits<clock64_t>::max();
 
-    msg_verbosef("Number of streaming multiprocessors used: %" PRIu64 "\n", smids_used.size());
+    size_t qlen = num_threads >> 2;
     
-    {
-      std::vector<block> sorted;
-
-      for (size_t i = 0; i < num_threads; ++i) {
-        sorted.push_back(block{static_cast<int>(i), times[i]}); 
-      }
-      
-      std::sort(sorted.begin(), sorted.end(), [](const block& a, const block& b) -> bool {
-						return a.time < b.time;
-					      });
+    if (qlen > 0) {
+      std::vector<clock64_t> order(times.begin(), times.begin() + num_threads);
 
-      size_t qlen = num_threads >> 2;
+      auto first = order.begin();
 
-      double q1 = static_cast<double>(sorted[qlen].time)
-        + static_cast<double>(sorted[qlen - 1].time);
+      // everything before first[qlen] is no greater than it, so
+      // the order statistic before it is the largest of them.
+      std::nth_element(first, first + qlen, order.end());
+      
+      double q1 = static_cast<double>(first[qlen])
+        + static_cast<double>(*std::max_element(first, first + qlen));
       q1 = q1 * 0.5;
 
-      double q3 = static_cast<double>(sorted[qlen * 3].time)
-        + static_cast<double>(sorted[(qlen * 3) - 1].time);
+      std::nth_element(first + qlen + 1, first + qlen * 3, order.end());
+      
+      double q3 = static_cast<double>(first[qlen * 3])
+        + static_cast<double>(*std::max_element(first + qlen, first + qlen * 3));
       q3 = q3 * 0.5;
 
       double iqr = q3 - q1;
 
-      double minorb = iqr * 1.5;
-      fill_outliers(minorb, q1, q3, "minor", sorted, load_minor);
+      minor_max = static_cast<clock64_t>(q3) + static_cast<clock64_t>(iqr * 1.5);
+      major_max = static_cast<clock64_t>(q3) + static_cast<clock64_t>(iqr * 3.0);
+    }
+  }
+
+  void write() {
+    write(parallel_num_chunks(num_threads, k_min_chunk));
+  }
+
+  // Scans the threads once, in num_chunks parallel chunks.
+  // Outliers are listed in thread order.
+  void write(size_t num_chunks) {
+    clock64_t minor_max = 0;
+    clock64_t major_max = 0;
 
-      double majorb = iqr * 3.0;
-      fill_outliers(majorb, q1, q3, "major", sorted, load_major);
+    outlier_bounds(minor_max, major_max);
+
+    std::vector<std::vector<block>> minor(num_chunks);
+    std::vector<std::vector<block>> major(num_chunks);
+    std::vector<std::vector<uint32_t>> sm_threads(num_chunks);
+    
+    parallel_chunks(num_threads,
+                    num_chunks,
+                    [&](size_t begin, size_t end, size_t chunk) -> void {
+                      scan(begin,
+                           end,
+                           minor_max,
+                           major_max,
+                           minor[chunk],
+                           major[chunk],
+                           sm_threads[chunk]);
+                    });
+
+    std::vector<uint32_t> threads_per_sm;
+    
+    for (size_t c = 0; c < num_chunks; ++c) {
+      load_minor.insert(load_minor.end(), minor[c].begin(), minor[c].end());
+      load_major.insert(load_major.end(), major[c].begin(), major[c].end());
+
+      if (sm_threads[c].size() > threads_per_sm.size()) {
+        threads_per_sm.resize(sm_threads[c].size(), 0);
+      }
+      
+      for (size_t sm = 0; sm < sm_threads[c].size(); ++sm) {
+        threads_per_sm[sm] += sm_threads[c][sm];
+      }
     }
 
+    size_t num_sms_used = static_cast<size_t>(std::count_if(threads_per_sm.begin(),
+                                                            threads_per_sm.end(),
+                                                            [](uint32_t n) -> bool { return n > 0; }));
+    
+    msg_verbosef("Number of streaming multiprocessors used: %" PRIu64 "\n", num_sms_used);
+    
     msg_verbosef("Major outlier thread block count: %" PRId64 "\n", load_major.size());
     msg_verbosef("Minor outlier thread block count: %" PRId64 "\n", load_minor.size());
     
@@ -334,6 +568,222 @@ NVCD_CUDA_EXPORT void print_path_error(const std::string& fn,
   perror(err.c_str());
 }
 
+//
+// Builds and writes a device catalog (see catalog.h).
+//
+struct nvcd_catalog_writer {
+  std::vector<nvcd_catalog_domain_t> domains;
+  std::vector<nvcd_catalog_event_t> events;
+  std::vector<nvcd_catalog_metric_t> metrics;
+  std::vector<uint32_t> metric_events;
+  std::vector<nvcd_catalog_group_t> groups;
+  std::vector<uint32_t> group_events;
+  std::vector<uint32_t> event_seeds;
+  std::vector<uint32_t> event_slots;
+  std::vector<uint32_t> metric_seeds;
+  std::vector<uint32_t> metric_slots;
+  std::string strings;
+
+  uint32_t add_string(const char* s) {
+    uint32_t offset = static_cast<uint32_t>(strings.size());
+    strings.append(s);
+    strings.push_back('\0');
+    return offset;
+  }
+
+  // Hash and displace: names are split into buckets by their hash,
+  // and each bucket, largest first, gets the first seed that moves all
+  // of its names into free slots. Lookups then take two hashes.
+  // keys holds indices of the entries whose names are indexed; names
+  // must be unique among them.
+  void build_index(const std::vector<uint32_t>& keys,
+                   const std::vector<const char*>& names,
+                   std::vector<uint32_t>& seeds,
+                   std::vector<uint32_t>& slots) {
+    seeds.clear();
+    slots.clear();
+
+    if (keys.empty()) {
+      return;
+    }
+
+    constexpr uint32_t max_seed = 1 << 20;
+
+    uint32_t num_buckets = static_cast<uint32_t>(keys.size() / 2) + 1;
+    uint32_t num_slots = static_cast<uint32_t>(keys.size());
+
+    bool built = false;
+
+    while (!built) {
+      std::vector<std::vector<uint32_t>> buckets(num_buckets);
+
+      for (uint32_t key: keys) {
+        buckets[nvcd_catalog_hash(names[key], 0) % num_buckets].push_back(key);
+      }
+
+      std::vector<uint32_t> order(num_buckets);
+      for (uint32_t b = 0; b < num_buckets; ++b) {
+        order[b] = b;
+      }
+
+      std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) -> bool {
+        return buckets[a].size() > buckets[b].size();
+      });
+
+      seeds.assign(num_buckets, 0);
+      slots.assign(num_slots, NVCD_CATALOG_NONE);
+
+      built = true;
+
+      std::vector<uint32_t> taken;
+
+      for (size_t i = 0; i < order.size() && built && !buckets[order[i]].empty(); ++i) {
+        const auto& bucket = buckets[order[i]];
+        bool placed = false;
+
+        for (uint32_t seed = 1; seed < max_seed && !placed; ++seed) {
+          taken.clear();
+          placed = true;
+
+          for (size_t k = 0; k < bucket.size() && placed; ++k) {
+            uint32_t slot = nvcd_catalog_hash(names[bucket[k]], seed) % num_slots;
+
+            placed =
+              slots[slot] == NVCD_CATALOG_NONE &&
+              std::find(taken.begin(), taken.end(), slot) == taken.end();
+
+            taken.push_back(slot);
+          }
+
+          if (placed) {
+            seeds[order[i]] = seed;
+
+            for (size_t k = 0; k < bucket.size(); ++k) {
+              slots[taken[k]] = bucket[k];
+            }
+          }
+        }
+
+        built = placed;
+      }
+
+      // a few spare slots make every bucket easier to place
+      num_slots += num_slots / 8 + 1;
+    }
+  }
+
+  template <class T>
+  static uint32_t names_of(const std::vector<T>& entries,
+                           const std::string& strings,
+                           std::vector<const char*>& names,
+                           std::vector<uint32_t>& keys) {
+    std::unordered_set<std::string> seen;
+
+    names.resize(entries.size());
+    keys.clear();
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+      names[i] = strings.c_str() + entries[i].name;
+
+      // a duplicate can only be found by its first entry
+      if (seen.insert(names[i]).second) {
+        keys.push_back(static_cast<uint32_t>(i));
+      }
+    }
+
+    return static_cast<uint32_t>(entries.size() - keys.size());
+  }
+
+  void build_indices() {
+    std::vector<const char*> names;
+    std::vector<uint32_t> keys;
+
+    uint32_t duplicates = names_of(events, strings, names, keys);
+    build_index(keys, names, event_seeds, event_slots);
+
+    duplicates += names_of(metrics, strings, names, keys);
+    build_index(keys, names, metric_seeds, metric_slots);
+
+    if (duplicates > 0) {
+      msg_warnf("%" PRIu32 " duplicate names were left out of the catalog's index\n",
+                duplicates);
+    }
+  }
+
+  template <class T>
+  static void place(std::vector<uint8_t>& out,
+                    nvcd_catalog_header_t& header,
+                    uint32_t section,
+                    const T* data,
+                    size_t count) {
+    size_t offset = (out.size() + (NVCD_CATALOG_ALIGN - 1)) & ~static_cast<size_t>(NVCD_CATALOG_ALIGN - 1);
+
+    header.sections[section].offset = static_cast<uint32_t>(offset);
+    header.sections[section].count = static_cast<uint32_t>(count);
+
+    out.resize(offset + sizeof(T) * count, 0);
+
+    if (count > 0) {
+      memcpy(&out[offset], data, sizeof(T) * count);
+    }
+  }
+
+  // Written to a temporary file and renamed,
+  // so a reader never maps a partial catalog.
+  bool write(const nvcd_catalog_device_t& device, const std::string& path) {
+    build_indices();
+
+    nvcd_catalog_header_t header;
+    memset(&header, 0, sizeof(header));
+
+    memcpy(&header.magic[0], NVCD_CATALOG_MAGIC, sizeof(NVCD_CATALOG_MAGIC));
+    header.version = NVCD_CATALOG_VERSION;
+    header.header_size = sizeof(header);
+    header.device = device;
+
+    std::vector<uint8_t> out(sizeof(header), 0);
+
+    place(out, header, NVCD_CATALOG_DOMAINS, domains.data(), domains.size());
+    place(out, header, NVCD_CATALOG_EVENTS, events.data(), events.size());
+    place(out, header, NVCD_CATALOG_METRICS, metrics.data(), metrics.size());
+    place(out, header, NVCD_CATALOG_METRIC_EVENTS, metric_events.data(), metric_events.size());
+    place(out, header, NVCD_CATALOG_GROUPS, groups.data(), groups.size());
+    place(out, header, NVCD_CATALOG_GROUP_EVENTS, group_events.data(), group_events.size());
+    place(out, header, NVCD_CATALOG_EVENT_SEEDS, event_seeds.data(), event_seeds.size());
+    place(out, header, NVCD_CATALOG_EVENT_SLOTS, event_slots.data(), event_slots.size());
+    place(out, header, NVCD_CATALOG_METRIC_SEEDS, metric_seeds.data(), metric_seeds.size());
+    place(out, header, NVCD_CATALOG_METRIC_SLOTS, metric_slots.data(), metric_slots.size());
+    // includes the null terminator of the last string
+    place(out, header, NVCD_CATALOG_STRINGS, strings.c_str(), strings.size() + 1);
+
+    header.size = out.size();
+    memcpy(&out[0], &header, sizeof(header));
+
+    std::stringstream tmp_path;
+    tmp_path << path << "." << getpid() << ".tmp";
+
+    FILE* f = fopen(tmp_path.str().c_str(), "wb");
+
+    bool ok = f != nullptr;
+
+    if (ok) {
+      ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+      ok = fclose(f) == 0 && ok;
+      ok = ok && rename(tmp_path.str().c_str(), path.c_str()) == 0;
+
+      if (!ok) {
+        unlink(tmp_path.str().c_str());
+      }
+    }
+
+    if (!ok) {
+      print_path_error("nvcd_catalog_writer::write", path);
+    }
+
+    return ok;
+  }
+};
+
 struct nvcd_device_info {
   struct entry {
     static constexpr uint32_t id_unset = static_cast<uint32_t>(-1);
@@ -387,6 +837,10 @@ struct nvcd_device_info {
   
   event_map_type events;
 
+  // per device, the position of each event name in events
+  std::unordered_map<std::string,
+                     std::unordered_map<std::string, size_t>> event_indices;
+
   metric_map_type metrics;
 
   std::vector<std::string> device_names;
@@ -421,28 +875,11 @@ struct nvcd_device_info {
 
   bool event_supported(const std::string& device,
                        const std::string& name) {
-    const auto& all_events = this->events.at(device);
-
-    size_t l = 0;
-
-    bool found = false;
-    bool supported = true;
-
-    entry ret;
-          
-    while (!found && l < all_events.size()) {
-      found = all_events.at(l).name == name;
-      
-      if (found) {
-        if (!all_events.at(l).supported) {
-          supported = false;
-        }
-      }
-                
-      l++;
-    }
+    const auto& index = this->event_indices.at(device);
+    auto it = index.find(name);
 
-    return supported;
+    // events that aren't listed aren't ruled out
+    return it == index.end() || this->events.at(device).at(it->second).supported;
   }
   
   bool all_events_supported(const std::string& device,
@@ -512,140 +949,411 @@ struct nvcd_device_info {
 
   using cupti_attr_str_t = std::array<char, 128>;
     
+  //
+  // Finds the fewest groups that cover a domain's events, or a subset of them.
+  //
+  // CUPTI's constraints are modeled as pairwise compatibility, probed once
+  // per pair, and a per-group capacity, which starts at the requested maximum
+  // and shrinks to the size of the first group CUPTI turns down as full.
+  // Groups are a coloring of the conflict graph in which no color holds
+  // more than capacity events: found exactly, by backtracking, for small
+  // sets, and with DSatur otherwise. Every group is verified by building it;
+  // events that CUPTI still rejects (e.g., through constraints between more
+  // than two events) are solved for again in another round.
+  //
   class domain_group_gen {
+    // sets at most this large are solved exactly
+    static constexpr size_t exact_max_events = 20;
+    // backtracking steps after which the heuristic's solution is kept
+    static constexpr uint64_t exact_max_steps = 1 << 22;
+    
     event_list_type events;
+    event_list_type unsupported;
     event_group_list_type groupings;
-    const size_t max_events_per_group;
+    std::unordered_set<std::string> found_names;
+    size_t capacity;
     const CUdevice device;
     const CUcontext context;
-    const CUpti_EventDomainID domain;    
+    const CUpti_EventDomainID domain;
 
-    void load_events() {      
+    // conflicts[i * events.size() + j] is nonzero if
+    // events i and j can't be in the same group
+    std::vector<uint8_t> conflicts;
+    std::vector<uint8_t> usable;
+    
+    using class_list_type = std::vector<std::vector<uint32_t>>;
+    
+    void load_events(const std::unordered_set<std::string>* subset) {      
       cupti_domain_event_enum_t::fill<&cuptiEventDomainGetNumEvents,
 				      &cuptiEventDomainEnumEvents>(domain,
-								   events);      
-      msg_userf(INFO_TAG "\tNumber of events available in this domain: %" PRIu64 "\n", events.size());      
-    }   
+								   events);
+
+      if (subset != nullptr) {
+        event_list_type selected;
+        
+        for (CUpti_EventID e: events) {
+          std::string name(event_name(e).data());
+          
+          if (subset->find(name) != subset->end()) {
+            selected.push_back(e);
+            found_names.insert(name);
+          }
+        }
+
+        events = std::move(selected);
+      }
+    }
 
-    bool try_events(event_list_type e, std::vector<CUpti_EventGroup>& ptrs) {      
-      ASSERT(!e.empty());
+    bool conflict(uint32_t i, uint32_t j) const {
+      return conflicts[i * events.size() + j] != 0;
+    }
+
+    static bool add_rejected(CUptiResult err) {
+      return err == CUPTI_ERROR_NOT_COMPATIBLE || err == CUPTI_ERROR_MAX_LIMIT_REACHED;
+    }
+
+    // One group per event, to which every later event is
+    // added and removed, so a pair costs two calls.
+    void probe_conflicts() {
+      size_t n = events.size();
       
-      CUpti_EventGroup group = nullptr;
-      CUPTI_FN(cuptiEventGroupCreate(context, &group, 0));
-      CUptiResult result = CUPTI_SUCCESS;
+      conflicts.assign(n * n, 0);
+      usable.assign(n, 1);
+
+      for (size_t i = 0; i < n; ++i) {
+        CUpti_EventGroup group = nullptr;
+        CUPTI_FN(cuptiEventGroupCreate(context, &group, 0));
+
+        CUptiResult err = cuptiEventGroupAddEvent(group, events[i]);
+
+        if (err == CUPTI_SUCCESS) {
+          for (size_t j = i + 1; j < n; ++j) {
+            err = cuptiEventGroupAddEvent(group, events[j]);
+
+            if (err == CUPTI_SUCCESS) {
+              CUPTI_FN(cuptiEventGroupRemoveEvent(group, events[j]));
+            } else if (add_rejected(err)) {
+              conflicts[i * n + j] = 1;
+              conflicts[j * n + i] = 1;
+            } else {
+              CUPTI_FN(err);
+            }
+          }
+        } else if (add_rejected(err)) {
+          usable[i] = 0;
+        } else {
+          CUPTI_FN(err);
+        }
+
+        CUPTI_FN(cuptiEventGroupDestroy(group));
+      }
+    }
+
+    // DSatur, limited to capacity events per color
+    class_list_type color_dsatur(const std::vector<uint32_t>& vertices) const {
+      size_t m = vertices.size();
       
-      size_t i = 0;
-      while (i < e.size() && result == CUPTI_SUCCESS) {
-	result = cuptiEventGroupAddEvent(group, e.at(i));
-	if (result == CUPTI_SUCCESS) {
-	  i++;
-	}
+      std::vector<uint32_t> color(m, UINT32_MAX);
+      std::vector<uint32_t> saturation(m, 0);
+      std::vector<uint32_t> degree(m, 0);
+      std::vector<std::vector<uint8_t>> neighbor_colors(m, std::vector<uint8_t>(m, 0));
+      class_list_type classes;
+
+      for (size_t a = 0; a < m; ++a) {
+        for (size_t b = 0; b < m; ++b) {
+          degree[a] += a != b && conflict(vertices[a], vertices[b]);
+        }
       }
-      ASSERT((
-	      (i == e.size())
-	      &&
-	      (result == CUPTI_SUCCESS)
-	      )
-	     ||
-	     (
-	      (i < e.size())
-	      &&
-	      (result != CUPTI_SUCCESS)
-	      ));
       
-      if (result == CUPTI_SUCCESS) {
-	ptrs.push_back(group);
-      } else {	
-	CUPTI_FN(cuptiEventGroupDestroy(group));
+      for (size_t step = 0; step < m; ++step) {
+        size_t v = m;
+        
+        for (size_t a = 0; a < m; ++a) {
+          if (color[a] == UINT32_MAX &&
+              (v == m ||
+               saturation[a] > saturation[v] ||
+               (saturation[a] == saturation[v] && degree[a] > degree[v]))) {
+            v = a;
+          }
+        }
+
+        uint32_t c = 0;
+        while (c < classes.size() &&
+               (neighbor_colors[v][c] || classes[c].size() >= capacity)) {
+          c++;
+        }
+
+        if (c == classes.size()) {
+          classes.emplace_back();
+        }
+
+        classes[c].push_back(vertices[v]);
+        color[v] = c;
+
+        for (size_t a = 0; a < m; ++a) {
+          if (color[a] == UINT32_MAX &&
+              conflict(vertices[a], vertices[v]) &&
+              !neighbor_colors[a][c]) {
+            neighbor_colors[a][c] = 1;
+            saturation[a]++;
+          }
+        }
       }
 
-      return result == CUPTI_SUCCESS;
+      return classes;
+    }
+
+    struct exact_state {
+      std::vector<uint32_t> conflict_masks; // per vertex, of the vertices it conflicts with
+      std::vector<uint32_t> members; // per color, as a mask of vertices
+      std::vector<uint32_t> sizes;
+      std::vector<uint32_t> assignment;
+      uint32_t num_colors;
+      uint32_t used;
+      uint64_t steps;
+    };
+
+    bool exact_assign(exact_state& s, uint32_t v) const {
+      if (v == s.assignment.size()) {
+        return true;
+      }
+
+      if (++s.steps > exact_max_steps) {
+        return false;
+      }
+
+      // a vertex only opens the next unused color,
+      // so colorings that differ by a renaming are skipped
+      uint32_t limit = std::min(s.used + 1, s.num_colors);
+
+      for (uint32_t c = 0; c < limit; ++c) {
+        if (s.sizes[c] < capacity && (s.members[c] & s.conflict_masks[v]) == 0) {
+          bool opened = c == s.used;
+          
+          s.members[c] |= 1u << v;
+          s.sizes[c]++;
+          s.assignment[v] = c;
+          s.used += opened;
+
+          if (exact_assign(s, v + 1)) {
+            return true;
+          }
+
+          s.used -= opened;
+          s.sizes[c]--;
+          s.members[c] &= ~(1u << v);
+
+          if (s.steps > exact_max_steps) {
+            return false;
+          }
+        }
+      }
+
+      return false;
+    }
+
+    // Tries every number of groups below the heuristic's, from the lower bound up.
+    class_list_type color_exact(const std::vector<uint32_t>& vertices,
+                                class_list_type heuristic) const {
+      uint32_t m = static_cast<uint32_t>(vertices.size());
+      uint32_t lower = static_cast<uint32_t>((m + capacity - 1) / capacity);
+
+      exact_state s;
+      s.conflict_masks.assign(m, 0);
+      s.assignment.assign(m, 0);
+
+      for (uint32_t a = 0; a < m; ++a) {
+        for (uint32_t b = 0; b < m; ++b) {
+          if (a != b && conflict(vertices[a], vertices[b])) {
+            s.conflict_masks[a] |= 1u << b;
+          }
+        }
+      }
+      
+      for (uint32_t k = std::max(lower, 1u); k < heuristic.size(); ++k) {
+        s.num_colors = k;
+        s.members.assign(k, 0);
+        s.sizes.assign(k, 0);
+        s.used = 0;
+        s.steps = 0;
+        
+        if (exact_assign(s, 0)) {
+          class_list_type classes(k);
+          
+          for (uint32_t a = 0; a < m; ++a) {
+            classes[s.assignment[a]].push_back(vertices[a]);
+          }
+          
+          return classes;
+        }
+
+        if (s.steps > exact_max_steps) {
+          break;
+        }
+      }
+
+      return heuristic;
+    }
+
+    // Builds a group for each class. Returns the events that couldn't be added.
+    // If CUPTI turned a group down as full, capacity has shrunk and
+    // the whole round is solved again, so every event is returned.
+    std::vector<uint32_t> verify(const class_list_type& classes) {
+      std::vector<uint32_t> rejected;
+      size_t round_begin = groupings.size();
+      size_t round_capacity = capacity;
+      
+      for (const auto& members: classes) {
+        CUpti_EventGroup group = nullptr;
+        CUPTI_FN(cuptiEventGroupCreate(context, &group, 0));
+        
+        event_list_type added;
+
+        for (uint32_t v: members) {
+          CUptiResult err = cuptiEventGroupAddEvent(group, events[v]);
+
+          if (err == CUPTI_SUCCESS) {
+            added.push_back(events[v]);
+          } else if (add_rejected(err)) {
+            if (err == CUPTI_ERROR_MAX_LIMIT_REACHED) {
+              capacity = std::max<size_t>(std::min(capacity, added.size()), 1);
+            }
+            rejected.push_back(v);
+          } else {
+            CUPTI_FN(err);
+          }
+        }
+
+        if (added.empty()) {
+          CUPTI_FN(cuptiEventGroupDestroy(group));
+        } else {
+          groupings.push_back({ added, group });
+        }
+      }
+
+      if (capacity < round_capacity) {
+        rejected.clear();
+        
+        for (const auto& members: classes) {
+          rejected.insert(rejected.end(), members.begin(), members.end());
+        }
+
+        for (size_t g = round_begin; g < groupings.size(); ++g) {
+          CUPTI_FN(cuptiEventGroupRemoveAllEvents(groupings[g].group));
+          CUPTI_FN(cuptiEventGroupDestroy(groupings[g].group));
+        }
+
+        groupings.resize(round_begin);
+      } else {
+        // events turned down because of a constraint that
+        // the pairs don't show may still fit another group
+        std::vector<uint32_t> unplaced;
+        
+        for (uint32_t v: rejected) {
+          bool placed = false;
+
+          for (size_t g = 0; g < groupings.size() && !placed; ++g) {
+            if (groupings[g].events.size() < capacity) {
+              CUptiResult err = cuptiEventGroupAddEvent(groupings[g].group, events[v]);
+
+              if (err == CUPTI_SUCCESS) {
+                groupings[g].events.push_back(events[v]);
+                placed = true;
+              } else if (!add_rejected(err)) {
+                CUPTI_FN(err);
+              }
+            }
+          }
+
+          if (!placed) {
+            unplaced.push_back(v);
+          }
+        }
+
+        rejected = std::move(unplaced);
+      }
+
+      return rejected;
     }
 
     void find_groups() {
-      // greedy brute force algorithm to grab as many events as possible
-      // for a single group. events are not duplicated across group
-      // combinations.
-      bool grouped = false;
-      std::vector<int> visited;
-      auto in_visited =
-	[&visited](int i) -> bool {	  
-	  for (int k : visited) if (i == k) return true;
-	  return false;
-	};
-      while (!grouped) {
-	event_list_type try_group{};
-	std::vector<CUpti_EventGroup> ptrs;
-	uint32_t i = 0;
-	while (i < events.size() && try_group.size() < max_events_per_group) {
-	  if (!in_visited(i)) {
-	    try_group.push_back(events.at(i));
-	    if (try_events(try_group, ptrs)) {
-	      visited.push_back(i);
-	    } else {
-	      try_group.pop_back();
-	    }	    	    
-	  }
-	  i++;
-	}
-	if (!ptrs.empty()) {
-	  CUpti_EventGroup largest = ptrs.back();
-	  // 'largest' is a group that contains the events
-	  // that these other groups contain, so we can do
-	  // without them.
-	  ptrs.pop_back();
-	  for (CUpti_EventGroup less: ptrs) {
-	    CUPTI_FN(cuptiEventGroupDestroy(less));
-	  }	  
-	  groupings.push_back({ try_group, largest });
-	}
-	grouped = visited.size() == events.size();
+      std::vector<uint32_t> remaining;
+      
+      for (uint32_t i = 0; i < events.size(); ++i) {
+        if (usable[i]) {
+          remaining.push_back(i);
+        } else {
+          unsupported.push_back(events[i]);
+        }
       }
 
-      // just a good faith brute force test to
-      // ensure we haven't duplicated events across multiple groups.
-      constexpr bool do_the_test = true;
-      if (do_the_test) {
-	// ensure we have the same size in the CSV file
-	volatile size_t count = 0;
-	for (const auto& g: groupings) {
-	  count += g.events.size();
-	}
-	ASSERT(count == events.size());
-
-	// ensure no duplicates; assuming both of these are true,
-	// we have what we want.
-	for (volatile size_t i = 0; i < groupings.size(); i++) {
-	  for (volatile size_t j = 0; j < groupings.size(); ++j) {
-	    if (i != j) {
-	      for (const auto& e0: groupings.at(i).events) {
-		for (const auto& e1: groupings.at(j).events) {
-		  ASSERT(e0 != e1);
-		}
-	      }
-	    }
-	  }
-	}
+      while (!remaining.empty()) {
+        size_t before = remaining.size();
+        
+        class_list_type classes = color_dsatur(remaining);
+
+        if (remaining.size() <= exact_max_events) {
+          classes = color_exact(remaining, std::move(classes));
+        }
+
+        size_t before_capacity = capacity;
+        
+        remaining = verify(classes);
+
+        // the first event of every class can be added by itself,
+        // and capacity only shrinks until it's 1
+        ASSERT(remaining.size() < before || capacity < before_capacity);
+      }
+
+      // each usable event is in exactly one group
+      std::unordered_set<CUpti_EventID> grouped;
+      
+      for (const auto& g: groupings) {
+        for (CUpti_EventID e: g.events) {
+          volatile bool inserted = grouped.insert(e).second;
+          ASSERT(inserted);
+        }
       }
+      
+      ASSERT(grouped.size() + unsupported.size() == events.size());
     }
     
   public:
-    domain_group_gen(CUdevice device, CUcontext context, CUpti_EventDomainID domain, size_t max_events)
-      : max_events_per_group(max_events),
+    // subset, if not null, holds the names of the events to group;
+    // otherwise, every event in the domain is grouped
+    domain_group_gen(CUdevice device,
+                     CUcontext context,
+                     CUpti_EventDomainID domain,
+                     size_t max_events,
+                     const std::unordered_set<std::string>* subset)
+      : capacity(std::max<size_t>(max_events, 1)),
 	device(device),
 	context(context),
 	domain(domain) {
 
-      load_events();
+      load_events(subset);
+      probe_conflicts();
       find_groups();
     }
 
     event_group_list_type operator()() {
       return groupings;
     }
+
+    size_t num_events() const {
+      return events.size();
+    }
+
+    const event_list_type& unsupported_events() const {
+      return unsupported;
+    }
+
+    const std::unordered_set<std::string>& subset_names_found() const {
+      return found_names;
+    }
   };
 
-  cupti_attr_str_t event_name(CUpti_EventID e) {
+  static cupti_attr_str_t event_name(CUpti_EventID e) {
     cupti_attr_str_t r{};
     r.fill(0);
     size_t sz = r.size() * sizeof(r[0]);
@@ -693,38 +1401,104 @@ struct nvcd_device_info {
 		       output_path.c_str());
     }
 
-  }
-  
-  void multiplex(uint32_t nvcd_index, uint32_t max_num) {        
-    std::vector<CUpti_EventDomainID> domain_buffer{};
+  }
+  
+  using domain_grouping_list_type = std::vector<std::pair<CUpti_EventDomainID,
+                                                         event_group_list_type>>;
+  
+  // Returns the groupings that were found for each domain.
+  // If subset isn't null, only the events it names are grouped, and
+  // domains without any of them are skipped. Domains are solved by
+  // num_threads threads; 0 uses one per hardware thread.
+  domain_grouping_list_type multiplex(uint32_t nvcd_index,
+                                      uint32_t max_num,
+                                      const std::unordered_set<std::string>* subset = nullptr,
+                                      size_t num_threads = 0) {        
+    std::vector<CUpti_EventDomainID> domain_buffer{};
+    domain_grouping_list_type domain_groupings;
+
+    // fill domain buffer with all domain IDs corresponding to
+    // the device referenced by nvcd_index.
+    cupti_device_domain_enum_t::fill<&cuptiDeviceGetNumEventDomains,
+				     &cuptiDeviceEnumEventDomains>(g_nvcd.devices[nvcd_index],
+								   domain_buffer);
+
+
+    puts("=======multiplex=========");
+
+    size_t smax_num =
+      max_num != UINT32_MAX
+      ? static_cast<size_t>(max_num)
+      : std::numeric_limits<size_t>::max();
+
+    // domains are independent, so each is solved by whichever
+    // thread takes it next; results are reported in domain order.
+    std::vector<std::unique_ptr<domain_group_gen>> generators(domain_buffer.size());
+    std::atomic<size_t> next_domain(0);
+
+    auto solve_domains =
+      [&]() -> void {
+        CUDA_DRIVER_FN(cuCtxSetCurrent(g_nvcd.contexts[nvcd_index]));
+        
+        for (size_t i = next_domain++; i < domain_buffer.size(); i = next_domain++) {
+          generators[i].reset(new domain_group_gen(g_nvcd.devices[nvcd_index],
+                                                   g_nvcd.contexts[nvcd_index],
+                                                   domain_buffer[i],
+                                                   smax_num,
+                                                   subset));
+        }
+      };
+
+    if (num_threads == 0) {
+      num_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+
+    num_threads = std::max<size_t>(std::min(num_threads, domain_buffer.size()), 1);
+    
+    {
+      std::vector<std::thread> pool;
+      
+      for (size_t t = 1; t < num_threads; ++t) {
+        pool.emplace_back(solve_domains);
+      }
+
+      solve_domains();
 
-    // fill domain buffer with all domain IDs corresponding to
-    // the device referenced by nvcd_index.
-    cupti_device_domain_enum_t::fill<&cuptiDeviceGetNumEventDomains,
-				     &cuptiDeviceEnumEventDomains>(g_nvcd.devices[nvcd_index],
-								   domain_buffer);
+      for (auto& thread: pool) {
+        thread.join();
+      }
+    }
 
+    std::unordered_set<std::string> subset_found;
+    
+    for (size_t d = 0; d < domain_buffer.size(); ++d) {
+      CUpti_EventDomainID domain = domain_buffer[d];
+      domain_group_gen& generator = *generators[d];
 
-    puts("=======multiplex=========");
+      if (subset != nullptr) {
+        if (generator.num_events() == 0) {
+          continue;
+        }
 
-    size_t smax_num =
-      max_num != UINT32_MAX
-      ? static_cast<size_t>(max_num)
-      : std::numeric_limits<size_t>::max();
-    
-    for (CUpti_EventDomainID domain: domain_buffer) {
+        subset_found.insert(generator.subset_names_found().begin(),
+                            generator.subset_names_found().end());
+      }
+      
       cupti_attr_str_t domain_name = event_domain_name(domain);
       
-            
       msg_userf(INFO_TAG "Processing domain: %s\n", domain_name.data());
-      
-      domain_group_gen generator(g_nvcd.devices[nvcd_index],
-				 g_nvcd.contexts[nvcd_index],
-				 domain,
-				 smax_num);
+      msg_userf(INFO_TAG "\tNumber of events available in this domain: %" PRIu64 "\n",
+                generator.num_events());
+
+      for (CUpti_EventID e: generator.unsupported_events()) {
+        msg_warnf("\t%s can't be added to an event group and is left out\n",
+                  event_name(e).data());
+      }
 
       auto groupings = generator();
 
+      msg_userf(INFO_TAG "\tNumber of groups: %" PRIu64 "\n", groupings.size());
+
       cupti_domain_csv_write(domain_name,
 			     groupings);
 
@@ -756,9 +1530,253 @@ struct nvcd_device_info {
 	  i++;
 	}
 	msg_verbosef("%s\n", ss.str().c_str());
-      }      
-    }    
-  } 
+      }
+
+      domain_groupings.emplace_back(domain, std::move(groupings));
+    }
+
+    if (subset != nullptr) {
+      for (const auto& name: *subset) {
+        if (subset_found.find(name) == subset_found.end()) {
+          msg_warnf("%s isn't an event of this device\n", name.c_str());
+        }
+      }
+    }
+
+    return domain_groupings;
+  }
+
+  uint32_t event_category(CUpti_EventID e) {
+    CUpti_EventCategory category = CUPTI_EVENT_CATEGORY_INSTRUCTION;
+    size_t sz = sizeof(category);
+    CUPTI_FN(cuptiEventGetAttribute(e, CUPTI_EVENT_ATTR_CATEGORY, &sz, &category));
+    return static_cast<uint32_t>(category);
+  }
+
+  // Writes the catalog of the device referenced by nvcd_index to dir,
+  // with the groupings multiplex() found for it. Returns the path,
+  // or an empty string if it couldn't be written.
+  std::string catalog_write(uint32_t nvcd_index,
+                            const domain_grouping_list_type& domain_groupings,
+                            const std::string& dir) {
+    CUdevice device = g_nvcd.devices[nvcd_index];
+    
+    nvcd_catalog_writer w;
+
+    std::unordered_map<CUpti_EventDomainID, uint32_t> domain_index;
+    std::unordered_map<CUpti_EventID, uint32_t> event_index;
+    
+    std::vector<CUpti_EventDomainID> domain_buffer{};
+    cupti_device_domain_enum_t::fill<&cuptiDeviceGetNumEventDomains,
+				     &cuptiDeviceEnumEventDomains>(device,
+								   domain_buffer);
+
+    for (CUpti_EventDomainID domain: domain_buffer) {
+      event_list_type domain_events{};
+      cupti_domain_event_enum_t::fill<&cuptiEventDomainGetNumEvents,
+				      &cuptiEventDomainEnumEvents>(domain,
+								   domain_events);
+      
+      nvcd_catalog_domain_t d{};
+      d.id = domain;
+      d.name = w.add_string(event_domain_name(domain).data());
+      d.events_begin = static_cast<uint32_t>(w.events.size());
+      d.num_events = static_cast<uint32_t>(domain_events.size());
+
+      domain_index[domain] = static_cast<uint32_t>(w.domains.size());
+
+      for (CUpti_EventID id: domain_events) {
+        nvcd_catalog_event_t e{};
+        e.id = id;
+        e.name = w.add_string(event_name(id).data());
+        e.domain = static_cast<uint32_t>(w.domains.size());
+        e.category = event_category(id);
+        e.group = NVCD_CATALOG_NONE;
+
+        event_index[id] = static_cast<uint32_t>(w.events.size());
+        w.events.push_back(e);
+      }
+
+      w.domains.push_back(d);
+    }
+
+    for (const auto& dg: domain_groupings) {
+      for (const auto& group: dg.second) {
+        nvcd_catalog_group_t g{};
+        g.domain = domain_index.at(dg.first);
+        g.events_begin = static_cast<uint32_t>(w.group_events.size());
+        g.num_events = static_cast<uint32_t>(group.events.size());
+
+        for (CUpti_EventID id: group.events) {
+          w.group_events.push_back(id);
+          w.events[event_index.at(id)].group = static_cast<uint32_t>(w.groups.size());
+        }
+
+        w.groups.push_back(g);
+      }
+    }
+
+    {
+      uint32_t num_metrics = 0;
+      CUpti_MetricID* metric_ids = cupti_metric_get_ids(device, &num_metrics);
+
+      for (uint32_t j = 0; j < num_metrics; ++j) {
+        char* name = cupti_metric_get_name(metric_ids[j]);
+
+        uint32_t num_events = 0;
+        CUpti_EventID* event_ids = cupti_metric_get_event_ids(metric_ids[j], &num_events);
+
+        nvcd_catalog_metric_t m{};
+        m.id = metric_ids[j];
+        m.name = w.add_string(name);
+        m.events_begin = static_cast<uint32_t>(w.metric_events.size());
+        m.num_events = num_events;
+        m.supported = 1;
+
+        for (uint32_t k = 0; k < num_events; ++k) {
+          w.metric_events.push_back(event_ids[k]);
+
+          if (event_index.find(event_ids[k]) == event_index.end()) {
+            m.supported = 0;
+          }
+        }
+
+        w.metrics.push_back(m);
+
+        free(event_ids);
+        free(name);
+      }
+
+      free(metric_ids);
+    }
+
+    nvcd_catalog_device_t desc;
+    nvcd_catalog_device(device, &desc);
+
+    std::vector<char> path(dir.size() + 64);
+    nvcd_catalog_path(&desc, dir.c_str(), path.data(), path.size());
+
+    return w.write(desc, path.data()) ? std::string(path.data()) : std::string();
+  }
+
+  // The number of passes CUPTI needs to collect the metric on its own,
+  // or 0 if it can't be collected on the device. The device's context
+  // must be current.
+  uint32_t metric_num_passes(uint32_t nvcd_index, CUpti_MetricID metric) {
+    CUpti_EventGroupSets* sets = nullptr;
+    uint32_t num_passes = 0;
+
+    CUptiResult err = cuptiMetricCreateEventGroupSets(g_nvcd.contexts[nvcd_index],
+                                                      sizeof(metric),
+                                                      &metric,
+                                                      &sets);
+    if (err == CUPTI_SUCCESS) {
+      num_passes = sets->numSets;
+      CUPTI_FN(cuptiEventGroupSetsDestroy(sets));
+    }
+
+    return num_passes;
+  }
+
+  // Writes ./metrics.csv, with one line per metric of the device referenced
+  // by nvcd_index: its name, the passes it needs, whether it's supported,
+  // and then the names of the events it depends on. Returns the number of
+  // metrics written.
+  uint32_t metrics_csv_write(uint32_t nvcd_index) {
+    const char* output_path = "./metrics.csv";
+
+    FILE* f = fopen(output_path, "wb");
+
+    if (f == nullptr) {
+      print_path_error("metrics_csv_write->fopen", output_path);
+      return 0;
+    }
+
+    CUDA_DRIVER_FN(cuCtxSetCurrent(g_nvcd.contexts[nvcd_index]));
+
+    std::string device(g_nvcd.device_names[nvcd_index]);
+
+    uint32_t num_metrics = 0;
+    CUpti_MetricID* metric_ids = cupti_metric_get_ids(g_nvcd.devices[nvcd_index],
+                                                      &num_metrics);
+
+    std::stringstream ss;
+
+    ss << "metric,passes,supported,events\n";
+
+    for (uint32_t j = 0; j < num_metrics; ++j) {
+      char* name = cupti_metric_get_name(metric_ids[j]);
+
+      uint32_t num_events = 0;
+      CUpti_EventID* event_ids = cupti_metric_get_event_ids(metric_ids[j], &num_events);
+
+      std::vector<std::string> event_names;
+      bool supported = true;
+
+      for (uint32_t k = 0; k < num_events; ++k) {
+        event_names.push_back(event_name(event_ids[k]).data());
+        supported = supported && event_supported(device, event_names.back());
+      }
+
+      uint32_t num_passes = metric_num_passes(nvcd_index, metric_ids[j]);
+
+      ss << name
+         << "," << num_passes
+         << "," << (supported && num_passes > 0 ? 1 : 0);
+
+      for (const auto& e: event_names) {
+        ss << "," << e;
+      }
+
+      ss << "\n";
+
+      free(event_ids);
+      free(name);
+    }
+
+    free(metric_ids);
+
+    fprintf(f, "%s", ss.str().c_str());
+    fclose(f);
+
+    return num_metrics;
+  }
+
+  struct pass_estimate {
+    // after the events of ENV_METRICS are merged with those of ENV_EVENTS
+    uint32_t num_events;
+    uint32_t num_metrics;
+    uint32_t num_groups;
+    // groups that can't be enabled in any pass, and are never read
+    uint32_t num_unusable_groups;
+    // kernel replays per profiled launch
+    uint32_t num_passes;
+  };
+
+  // Plans the events of the current ENV_EVENTS and ENV_METRICS for the
+  // device referenced by nvcd_index, the same way a profiled run does.
+  pass_estimate estimate_passes(uint32_t nvcd_index) {
+    nvcd_init_events(g_nvcd.devices[nvcd_index], g_nvcd.contexts[nvcd_index]);
+
+    cupti_event_data_t* e = nvcd_get_events();
+
+    pass_estimate r{};
+
+    if (e->has_events || e->has_metrics) {
+      r.num_events = e->num_requested_event_ids;
+      r.num_metrics = e->metric_data != nullptr ? e->metric_data->num_metrics : 0;
+      r.num_groups = e->num_event_groups;
+      r.num_passes = cupti_event_data_num_passes(e);
+      r.num_unusable_groups =
+        e->pass_offsets != nullptr
+        ? e->num_event_groups - e->pass_offsets[r.num_passes]
+        : e->num_event_groups;
+    }
+
+    nvcd_reset_event_data();
+
+    return r;
+  }
   
   nvcd_device_info() {
     ASSERT(g_nvcd.initialized == true);
@@ -804,6 +1822,13 @@ struct nvcd_device_info {
 
           list.push_back(e);
         }
+
+        auto& index = event_indices[device];
+
+        for (size_t j = 0; j < list.size(); ++j) {
+          // the first of duplicate names is the one that's found
+          index.emplace(list[j].name, j);
+        }
       }
 
       // device metrics
@@ -854,156 +1879,200 @@ struct nvcd_device_info {
 };
 
 
-using instance_vec_type = std::vector<uint64_t>;
-using counter_map_type = std::unordered_map<CUpti_EventID, instance_vec_type>;
-
-instance_vec_type operator - (const instance_vec_type& a, const instance_vec_type& b) {
-  ASSERT(a.size() == b.size());
-  // in case asserts are disabled (for whatever unlikely reason that may be...)
-  size_t sz = std::min(a.size(), b.size());
-  instance_vec_type diff(sz, 0);
-  for (size_t i = 0; i < sz; ++i) {
-    diff[i] = a[i] - b[i];
-  }
-  return diff;
-} 
-
-counter_map_type operator - (const counter_map_type& a, const counter_map_type& b) {
-  counter_map_type diff;
-  for (const auto& kv: a) {
-    const auto& key = kv.first;
-    const auto& value = kv.second;
-    const instance_vec_type& avec = value;
-    // b will be empty the first time this operator overload
-    // is called, but this is just a better catch all solution.
-    // sure, it's less efficient because b.empty() is simpler to check for.
-    // the map is unordered though, so b.find() should have little overhead.
-    if (b.find(key) != b.end()) {
-      const instance_vec_type& bvec = b.at(key);
-      diff[key] = avec - bvec;
-    }
-    else {
-      diff[key] = avec;
-    }
-  }
-  return diff;
-}
-
-extern struct nvcd_run_info* g_run_info;
+// one per host thread
+extern thread_local struct nvcd_run_info* g_run_info;
 
 struct nvcd_run_info {
   std::vector<kernel_invoke_data> kernel_stats;
-  
-  counter_map_type counters_start;
-  counter_map_type counters_end;
-  counter_map_type counters_diff;
+
+  // of the last run, one row per requested event
+  cupti_counter_matrix_t counters;
 
   std::string region_name;
   
   size_t curr_num_threads;
+  uint32_t curr_block_size; // 0 if unknown
   const char* func_name;
   uint32_t run_kernel_exec_count;
 
-  static size_t num_runs;
+  // of the last nvcd_host_begin()
+  int device_index;
+  uint64_t kernel_id;
+  uint32_t record_region_id; // only set if nvcd_record_enabled()
+
+  // of the last run, if nvcd_imbalance_enabled()
+  nvcd_imbalance_t imbalance;
+
+  // of the last run, if its kernel was timed; kept
+  // here since the event data is released after it
+  uint64_t kernel_nsec;
+  bool kernel_timed;
+
+  // of the thread's region, or session
+  size_t num_runs;
   
   nvcd_run_info()
-    : curr_num_threads(0),
+    : counters(CUPTI_COUNTER_MATRIX_INIT),
+      curr_num_threads(0),
+      curr_block_size(0),
       func_name(nullptr),
-      run_kernel_exec_count(0) {
+      run_kernel_exec_count(0),
+      device_index(0),
+      kernel_id(0),
+      record_region_id(0),
+      imbalance(NVCD_IMBALANCE_INIT),
+      kernel_nsec(0),
+      kernel_timed(false),
+      num_runs(0) {
   }
 
   ~nvcd_run_info() {
+    cupti_counter_matrix_free(&counters);
+    nvcd_imbalance_free(&imbalance);
   }
 
   void run_kernel_count_inc() {
     run_kernel_exec_count++;
   }
   
+  // Only touches the event data and this launch's device
+  // buffers, so any thread that holds them can call it.
   void update() {
     ASSERT(curr_num_threads != 0);
     
-    if (false) {        
-      kernel_invoke_data d(curr_num_threads);
+    // only the last launch is kept, and its buffers
+    // are reused by the next one
+    if (nvcd_imbalance_enabled()) {
+      if (kernel_stats.empty()) {
+        kernel_stats.emplace_back(curr_num_threads);
+      } else {
+        kernel_stats.back().reset(curr_num_threads);
+      }
+      
+      kernel_invoke_data& d = kernel_stats.back();
 
-      nvcd_device_get_smids(&d.smids[0]);
-      nvcd_device_get_ttime(&d.times[0]);
+      const nvcd_device_pool& pool = dev_pools[device_index];
       
-      d.exec_count = run_kernel_exec_count;
+      nvcd_device_pool_get_smids(pool, &d.smids[0]);
+      nvcd_device_pool_get_ttime(pool, &d.smids[0], &d.times[0]);
       
-      kernel_stats.push_back(std::move(d));
+      d.exec_count = run_kernel_exec_count;
+
+      nvcd_imbalance_analyze(&imbalance,
+                             &d.times[0],
+                             &d.smids[0],
+                             d.num_threads,
+                             curr_block_size);
     }
 
     curr_num_threads = 0;
+    curr_block_size = 0;
     run_kernel_exec_count = 0;
    
-    cupti_event_data_t* global = nvcd_get_events();
-    // we do this to compute the difference
-    // from the previous run
-    for (const auto& kv: counters_end) {
-      counters_start[kv.first] = kv.second;      
-    }
+    cupti_event_data_t* e = nvcd_get_events();
     
-    cupti_event_data_enum_event_counters(global, nvcd_run_info::enum_event_counters);    
+    kernel_timed = e->num_kernel_times > 0;
+    kernel_nsec = kernel_timed ? e->kernel_times_nsec[0] : 0;
     
-    counters_diff = counters_end - counters_start;
+    // the counters are reset before every run,
+    // so they only hold this run's values
+    cupti_event_data_counter_matrix(e, &counters);
 
     num_runs++;
   }
+  
+  // SMs are listed by smid, and the histogram
+  // from the least to the most busy bin
+  void report_imbalance(const char* uuid) {
+    if (imbalance.num_sms == 0 || imbalance.max_busy == 0) {
+      msg_verbosef("no thread times were recorded for \'%s\'\n", region_name.c_str());
+      return;
+    }
+
+    std::stringstream ss;
+
+    const nvcd_imbalance_sm_t& critical = imbalance.sms[imbalance.critical_sm];
+    
+    ss << "|IMBALANCE|" << region_name
+       << ": SMS: " << imbalance.num_sms
+       << " CRITICAL_SM: " << critical.smid
+       << " MAX_BUSY: " << imbalance.max_busy
+       << " MEDIAN_BUSY: " << imbalance.median_busy
+       << " MEAN_BUSY: " << imbalance.mean_busy
+       << " MIN_BUSY: " << imbalance.min_busy
+       << " TAIL_RATIO: " << imbalance.tail_ratio
+       << " SPEEDUP_IF_BALANCED: " << imbalance.speedup_if_balanced
+       << " DEVICE: " << device_index << " UUID: " << uuid << "\n";
+
+    ss << "|IMBALANCE_HISTOGRAM|" << region_name << ":";
+    
+    for (uint32_t bin = 0; bin < NVCD_IMBALANCE_NUM_BINS; ++bin) {
+      ss << " " << imbalance.histogram[bin];
+    }
 
-  static bool enum_event_counters(cupti_enum_event_counter_iteration_t* it) {    
-    if (g_run_info->counters_end[it->event].empty()) {
-      g_run_info->counters_end[it->event].resize(it->num_instances, 0);
+    ss << "\n";
+
+    for (uint32_t i = 0; i < imbalance.num_sms; ++i) {
+      const nvcd_imbalance_sm_t& sm = imbalance.sms[i];
+      
+      ss << "|IMBALANCE_SM|" << region_name << ":" << sm.smid
+         << ": THREADS: " << sm.num_threads
+         << " BLOCKS: " << sm.num_blocks
+         << " BUSY: " << sm.busy
+         << " MAX_THREAD: " << sm.max_time << "\n";
     }
-    ASSERT(it->instance < it->num_instances);
-    g_run_info->counters_end[it->event][it->instance] += it->value;
-    return true;
+
+    msg_userf("%s", ss.str().c_str());
+  }
+  
+  // appends the counters that were just collected to the ENV_RECORD file
+  void record() {
+    nvcd_record_event_data(nvcd_get_events(),
+                           record_region_id,
+                           kernel_id,
+                           static_cast<uint32_t>(device_index));
   }
   
   void report() {
     ASSERT(num_runs > 0);
+
+    char uuid[NVCD_UUID_STR_LENGTH];
+    nvcd_device_uuid_str(device_index, uuid, sizeof(uuid));
     
-    msg_userf("================================ invocation %" PRIu64 " for \'%s\' ================================\n",
+    msg_userf("================================ invocation %" PRIu64 " for \'%s\' on device %i (%s) ================================\n",
 	      num_runs - 1,
-	      region_name.c_str());
+	      region_name.c_str(),
+	      device_index,
+	      uuid);
    
-    if (!kernel_stats.empty()) kernel_stats.at(num_runs - 1).write();
+    if (!kernel_stats.empty()) {
+      kernel_stats.back().write();
+      report_imbalance(uuid);
+    }
 
+    cupti_event_data_t* e = nvcd_get_events();
+    
     std::stringstream ss;
-    msg_verbosef("counters_diff size: %" PRIu64 "\n", counters_diff.size());
-    for (const auto& kv : counters_diff) {
-      const auto& key = kv.first;
-      const auto& value = kv.second;
-      ASSERT(!value.empty());
-      char* event_name = cupti_event_get_name(key);
+    msg_verbosef("counters size: %" PRIu32 "\n", counters.num_rows);
+    for (uint32_t row = 0; row < counters.num_rows; ++row) {
+      uint32_t num_instances = 0;
+      const uint64_t* values = cupti_counter_matrix_row(&counters, row, &num_instances);
+      ASSERT(num_instances > 0);
+      const char* event_name = cupti_event_data_event_name(e, counters.event_ids[row]);
       ASSERT(event_name != nullptr);
-      double avg = 0;
-      uint64_t summation = 0;
-      uint64_t maximum = 0; // the lowest possible count
-      uint64_t minimum = std::numeric_limits<uint64_t>::max(); //something very large so that it changes
-      uint64_t temp_var = 0;
-      for (size_t index = 0; index < value.size(); ++index) {
-	temp_var = value.at(index);
-	summation += temp_var;
-	avg += temp_var;
-	maximum = (maximum < temp_var) ? temp_var : maximum;
-	minimum = (minimum > temp_var) ? temp_var : minimum;
-	//ss << "|COUNTER|" << region_name << ":" << event_name << ":" << value.at(index) << "\n";
-      }
-      avg /= static_cast<double>(value.size());
-      //ss << "|COUNTER|" << region_name << ":" << event_name << ":" << avg << "\n";
-      ss << "|COUNTER|" << region_name << ":" << event_name << ": SUM: " << summation << " AVG: " << avg << " MAX: " << maximum << " MIN: " << minimum << "\n";
-      free(event_name);
+      cupti_counter_stats_t stats;
+      cupti_counter_stats(values, num_instances, &stats);
+      ss << "|COUNTER|" << region_name << ":" << event_name << ": SUM: " << stats.sum << " AVG: " << stats.mean << " MAX: " << stats.max << " MIN: " << stats.min
+	 << " DEVICE: " << device_index << " UUID: " << uuid << "\n";
     }
     
     msg_userf("%s", ss.str().c_str());
     
-    cupti_report_event_data(nvcd_get_events());
+    cupti_report_event_data(e);
   }
 };
 
-size_t nvcd_run_info::num_runs = 0;
-
-extern nvcd_run_info* g_run_info;
+extern thread_local nvcd_run_info* g_run_info;
 
 //
 // Device functions
@@ -1022,12 +2091,14 @@ NVCD_DEV_EXPORT void nvcd_device_begin(int thread) {
 
 NVCD_DEV_EXPORT void nvcd_device_end(int thread) {
   detail::dev_ttime[thread] = clock64() - detail::dev_tstart[thread];
-  detail::dev_smids[thread] = get_smid();
+  // 0 is left for threads that aren't recorded
+  detail::dev_smids[thread] = get_smid() + 1;
 
   // DEV_PRINT_PTR(detail::dev_ttime);
   // DEV_PRINT_PTR(detail::dev_smids);
 }
 
+#ifdef NVCD_TEST_IMBALANCE
 NVCD_GLOBAL_EXPORT void nvcd_kernel_test() {
   int thread = blockIdx.x * blockDim.x + threadIdx.x;
 
@@ -1049,6 +2120,7 @@ NVCD_GLOBAL_EXPORT void nvcd_kernel_test() {
     nvcd_device_end(thread);
   }
 }
+#endif // NVCD_TEST_IMBALANCE
 
 
 //
@@ -1065,123 +2137,201 @@ static void cuda_safe_free(T*& ptr) {
 
 
 template <class T>
-static void cuda_memcpy_host_to_dev(void* dst, std::vector<T> host) {
-  size_t size = host.size() * sizeof(T);
+static void cuda_set_sym(const T& sym, void* value) {
+  CUDA_RUNTIME_FN(cudaMemcpyToSymbol(sym, &value, sizeof(value)));
+}
 
-  CUDA_RUNTIME_FN(cudaMemcpy(static_cast<void*>(dst),
-                             static_cast<void*>(host.data()),
-                             size,
-                             cudaMemcpyHostToDevice));
+// offsets of the buffers in a pool
+static inline size_t nvcd_device_pool_smids_offset(size_t capacity) {
+  return sizeof(clock64_t) * capacity;
 }
 
-template <class T>
-NVCD_CUDA_EXPORT void* __cuda_zalloc_sym(size_t size, const T& sym, const char* ssym) {
-  void* address_of_sym = nullptr;
-  CUDA_RUNTIME_FN(cudaGetSymbolAddress(&address_of_sym, sym));
-  ASSERT(address_of_sym != nullptr);
+static inline size_t nvcd_device_pool_tstart_offset(size_t capacity) {
+  return nvcd_device_pool_smids_offset(capacity) +
+    ((sizeof(uint) * capacity + sizeof(clock64_t) - 1) & ~(sizeof(clock64_t) - 1));
+}
 
-  CUDA_RUNTIME_FN(cudaMemset(address_of_sym, 0xFEED, sizeof(address_of_sym)));
-  
-  void* device_allocated_mem = nullptr;
+static inline size_t nvcd_device_pool_size(size_t capacity) {
+  return nvcd_device_pool_tstart_offset(capacity) + sizeof(clock64_t) * capacity;
+}
 
-  CUDA_RUNTIME_FN(cudaMalloc(&device_allocated_mem, size));
-  ASSERT(device_allocated_mem != nullptr);
+#ifdef NVCD_TEST_IMBALANCE
+// Test only: gives each thread of nvcd_kernel_test() a random
+// amount of work, with the last 100 threads doing the most.
+static void nvcd_device_test_imbalance(int num_threads) {
+  static thread_local void* d_dev_num_iter = nullptr;
 
-  CUDA_RUNTIME_FN(cudaMemset(device_allocated_mem, 0, size));
+  cuda_safe_free(d_dev_num_iter);
+  
+  CUDA_RUNTIME_FN(cudaMalloc(&d_dev_num_iter, sizeof(int) * static_cast<size_t>(num_threads)));
+  cuda_set_sym(detail::dev_num_iter, d_dev_num_iter);
+  
+  std::vector<int> host_num_iter(num_threads, 0);
 
-  CUDA_RUNTIME_FN(cudaMemcpy(address_of_sym,
-                             &device_allocated_mem,
-                             sizeof(device_allocated_mem),
-                             cudaMemcpyHostToDevice));
+  int iter_min = 100;
+  int iter_max = iter_min * 100;
+
+  srand(time(nullptr));
   
-  ASSERT(address_of_sym != nullptr);
+  for (size_t i = 0; i < host_num_iter.size(); ++i) {
+    if (i + 100 > host_num_iter.size()) {
+      iter_min = 1000;
+      iter_max = iter_min * 100;
+    }
 
-  // sanity check
-  {
-    void* check = nullptr;
-    
-    CUDA_RUNTIME_FN(cudaMemcpy(&check,
-                               address_of_sym,
-                               sizeof(check),
-                               cudaMemcpyDeviceToHost));
-
-    msg_verbosef("HOST-SIDE DEVICE ADDRESS FOR %s: %p. value: %p\n",
-		 ssym,
-		 address_of_sym,
-		 check);
-    
-    ASSERT(check == device_allocated_mem);
+    host_num_iter[i] = iter_min + (rand() % (iter_max - iter_min));
   }
-  return device_allocated_mem;
-}
 
-#define cuda_zalloc_sym(sz, sym) __cuda_zalloc_sym(sz, sym, #sym)
+  CUDA_RUNTIME_FN(cudaMemcpy(d_dev_num_iter,
+                             host_num_iter.data(),
+                             sizeof(int) * host_num_iter.size(),
+                             cudaMemcpyHostToDevice));
+}
+#endif // NVCD_TEST_IMBALANCE
 
 //
 // BASE API
 //
 
-extern "C" {
-  NVCD_CUDA_EXPORT void nvcd_device_free_mem() {
-    cuda_safe_free(d_dev_tstart);
-    cuda_safe_free(d_dev_ttime);
-    cuda_safe_free(d_dev_num_iter);
-    cuda_safe_free(d_dev_smids);
-  }
+// Threads that weren't recorded get NVCD_IMBALANCE_SMID_NONE
+static inline void nvcd_device_pool_get_smids(const nvcd_device_pool& pool, unsigned* out) {
+  CUDA_RUNTIME_FN(cudaMemcpy(out,
+                             static_cast<const uint8_t*>(pool.base) +
+                             nvcd_device_pool_smids_offset(pool.capacity),
+                             sizeof(uint) * pool.num_threads,
+                             cudaMemcpyDeviceToHost));
 
-  NVCD_CUDA_EXPORT void nvcd_device_init_mem(int num_threads) {
-    {       
-      dev_tbuf_size = sizeof(clock64_t) * static_cast<size_t>(num_threads);
+  for (size_t i = 0; i < pool.num_threads; ++i) {
+    out[i] = out[i] == 0 ? NVCD_IMBALANCE_SMID_NONE : out[i] - 1;
+  }
+}
 
-      d_dev_tstart = cuda_zalloc_sym(dev_tbuf_size, detail::dev_tstart);
-      d_dev_ttime = cuda_zalloc_sym(dev_tbuf_size, detail::dev_ttime);
+// ttime isn't cleared, so the times of threads that weren't
+// recorded are whatever an earlier launch left; they're set to 0
+// from smids, which must already have been read.
+static inline void nvcd_device_pool_get_ttime(const nvcd_device_pool& pool,
+                                              const unsigned* smids,
+                                              clock64_t* out) {
+  CUDA_RUNTIME_FN(cudaMemcpy(out,
+                             pool.base,
+                             sizeof(clock64_t) * pool.num_threads,
+                             cudaMemcpyDeviceToHost));
+
+  for (size_t i = 0; i < pool.num_threads; ++i) {
+    if (smids[i] == NVCD_IMBALANCE_SMID_NONE) {
+      out[i] = 0;
     }
+  }
+}
 
-    {
-      dev_smids_size = sizeof(uint) * static_cast<size_t>(num_threads);
-      
-      d_dev_smids = cuda_zalloc_sym(dev_smids_size, detail::dev_smids);
-    }
+static inline nvcd_device_pool& nvcd_device_current_pool() {
+  int device = 0;
+  CUDA_RUNTIME_FN(cudaGetDevice(&device));
+
+  ASSERT(static_cast<size_t>(device) < dev_pools.size() /* nvcd_init() must be called first */);
+  
+  return dev_pools[device];
+}
 
-    if (test_imbalance_detect) {
-      dev_num_iter_size = sizeof(int) * static_cast<size_t>(num_threads);
+// Reads, and then records or reports, the launch in run, which
+// needn't be the calling thread's: see nvcd_host_end_deferred().
+static inline void nvcd_run_end(nvcd_run_info* run) {
+  cupti_event_data_collect(nvcd_get_events());
+  
+  nvcd_calc_metrics();
 
-      d_dev_num_iter = cuda_zalloc_sym(dev_num_iter_size, detail::dev_num_iter);
+  run->update();
 
-      std::vector<int> host_num_iter(num_threads, 0);
+  // the records replace the text report, which
+  // is far too slow to produce for every launch
+  if (nvcd_record_enabled()) {
+    run->record();
+  } else {
+    run->report();
+  }
+}
 
-      int iter_min = 100;
-      int iter_max = iter_min * 100;
+static void nvcd_run_end_pending(void* run) {
+  nvcd_run_end(static_cast<nvcd_run_info*>(run));
+}
 
-      for (size_t i = 0; i < host_num_iter.size(); ++i) {
-        srand(time(nullptr));
+extern "C" {
+  // Releases the buffers on every device. No thread may be
+  // profiling a kernel. The next nvcd_device_init_mem()
+  // allocates them again, and resets the device symbols.
+  NVCD_CUDA_EXPORT void nvcd_device_free_mem() {
+    int device = 0;
+    CUDA_RUNTIME_FN(cudaGetDevice(&device));
 
-        if (i > host_num_iter.size() - 100) {
-          iter_min = 1000;
-          iter_max = iter_min * 100;
-        }
+    for (size_t i = 0; i < dev_pools.size(); ++i) {
+      nvcd_device_pool& pool = dev_pools[i];
 
-        host_num_iter[i] = iter_min + (rand() % (iter_max - iter_min));
+      if (pool.base != nullptr) {
+        CUDA_RUNTIME_FN(cudaSetDevice(static_cast<int>(i)));
+        cuda_safe_free(pool.base);
       }
 
-      cuda_memcpy_host_to_dev<int>(d_dev_num_iter, std::move(host_num_iter));
+      pool.capacity = 0;
+      pool.num_threads = 0;
+    }
+
+    CUDA_RUNTIME_FN(cudaSetDevice(device));
+  }
+
+  // Makes the buffers of the current device hold num_threads
+  // threads, and clears them before the next kernel in stream.
+  // The pool only reallocates, and updates the device symbols, when it
+  // has to grow; otherwise this is one asynchronous memset.
+  NVCD_CUDA_EXPORT void nvcd_device_init_mem(int num_threads,
+                                             cudaStream_t stream = 0) {
+    nvcd_device_pool& pool = nvcd_device_current_pool();
+    size_t n = static_cast<size_t>(num_threads);
+    
+    if (n > pool.capacity) {
+      cuda_safe_free(pool.base);
+
+      pool.capacity = std::max(n, pool.capacity << 1);
+      CUDA_RUNTIME_FN(cudaMalloc(&pool.base, nvcd_device_pool_size(pool.capacity)));
+
+      uint8_t* base = static_cast<uint8_t*>(pool.base);
+      
+      cuda_set_sym(detail::dev_ttime, base);
+      cuda_set_sym(detail::dev_smids, base + nvcd_device_pool_smids_offset(pool.capacity));
+      cuda_set_sym(detail::dev_tstart, base + nvcd_device_pool_tstart_offset(pool.capacity));
     }
+
+    pool.num_threads = n;
+    
+    // tstart is written before it's read, and a thread's time is only
+    // read if its smid was written, so only the used part of smids is
+    // cleared. A thread that isn't recorded keeps 0, which is read
+    // back as NVCD_IMBALANCE_SMID_NONE.
+    uint8_t* base = static_cast<uint8_t*>(pool.base);
+    
+    CUDA_RUNTIME_FN(cudaMemsetAsync(base + nvcd_device_pool_smids_offset(pool.capacity),
+                                    0,
+                                    sizeof(uint) * n,
+                                    stream));
+
+#ifdef NVCD_TEST_IMBALANCE
+    nvcd_device_test_imbalance(num_threads);
+#endif
   }
 
   NVCD_CUDA_EXPORT void nvcd_device_get_ttime(clock64_t* out) {
-    CUDA_RUNTIME_FN(cudaMemcpy(out,
-                               d_dev_ttime,
-                               dev_tbuf_size,
-                               cudaMemcpyDeviceToHost));
+    const nvcd_device_pool& pool = nvcd_device_current_pool();
+    std::vector<unsigned> smids(pool.num_threads);
+
+    nvcd_device_pool_get_smids(pool, smids.data());
+    nvcd_device_pool_get_ttime(pool, smids.data(), out);
   }
 
   NVCD_CUDA_EXPORT void nvcd_device_get_smids(unsigned* out) {
-    CUDA_RUNTIME_FN(cudaMemcpy(out,
-                               d_dev_smids,
-                               dev_smids_size,
-                               cudaMemcpyDeviceToHost));
+    nvcd_device_pool_get_smids(nvcd_device_current_pool(), out);
   }
 
+  NVCD_CUDA_EXPORT void nvcd_host_complete();
+
   NVCD_CUDA_EXPORT void nvcd_report() {
     ASSERT(g_run_info != nullptr);
     
@@ -1196,6 +2346,11 @@ extern "C" {
   NVCD_CUDA_EXPORT void nvcd_init() {
     nvcd_init_cuda();
 
+    std::call_once(dev_pools_init, []() {
+      dev_pools.resize(static_cast<size_t>(g_nvcd.num_devices), nvcd_device_pool{nullptr, 0, 0});
+      nvcd_set_device_free(nvcd_device_free_mem);
+    });
+    
     if (g_run_info == nullptr) {
       g_run_info = new nvcd_run_info();
     }
@@ -1204,20 +2359,69 @@ extern "C" {
     ASSERT(g_run_info != nullptr);
   }
 
-  NVCD_CUDA_EXPORT void nvcd_host_begin(const char* region_name, int num_cuda_threads) {     
+  //
+  // kernel identifies the kernel in records written when
+  // ENV_RECORD is set, and is otherwise unused.
+  //
+  // stream is the stream the kernel will be launched in.
+  // It's only used when ENV_STREAM is set, in which case
+  // nothing outside of it is waited on.
+  //
+  // block_size is the number of threads per block, which
+  // ENV_IMBALANCE uses to count the blocks on each SM.
+  //
+  NVCD_CUDA_EXPORT void nvcd_host_begin(const char* region_name,
+                                        int num_cuda_threads,
+                                        cudaStream_t stream = 0,
+                                        const void* kernel = nullptr,
+                                        int block_size = 0) {     
     nvcd_init();
 
-    g_run_info->region_name = std::string(region_name);
+    // g_run_info may still hold the last launch
+    nvcd_host_complete();
+
+    if (g_run_info->region_name != region_name) {
+      g_run_info->region_name = std::string(region_name);
+
+      if (nvcd_record_enabled()) {
+        g_run_info->record_region_id = nvcd_record_region(region_name);
+      }
+    }
+
+    g_run_info->kernel_id = reinterpret_cast<uint64_t>(kernel);
 
     ASSERT(g_nvcd.initialized == true);
     ASSERT(g_run_info != nullptr);
 
-    nvcd_device_init_mem(num_cuda_threads);
+    // each launch is profiled on the device
+    // and in the context it's going to run in
+    CUcontext context = nullptr;
+    int device = nvcd_current_device(&context);
+    
+    nvcd_init_events(g_nvcd.devices[device], context);
+
+    g_run_info->device_index = device;
+
+    cupti_event_data_t* e = nvcd_get_events();
+    
+    e->cuda_stream = reinterpret_cast<CUstream>(stream);
+    
+    nvcd_device_init_mem(num_cuda_threads, stream);
 
     g_run_info->curr_num_threads = static_cast<size_t>(num_cuda_threads);
+    g_run_info->curr_block_size = static_cast<uint32_t>(block_size);
+  }
 
-    nvcd_init_events(g_nvcd.devices[0],
-                     g_nvcd.contexts[0]);
+  // waits for a profiled kernel to finish
+  NVCD_CUDA_EXPORT void nvcd_host_sync() {
+    cupti_event_data_t* e = nvcd_get_events();
+
+    if (e->stream_sync) {
+      // only the kernel, which is read at the same time
+      cupti_event_data_collect(e);
+    } else {
+      CUDA_RUNTIME_FN(cudaDeviceSynchronize());
+    }
   }
 
   NVCD_CUDA_EXPORT bool nvcd_host_finished() {
@@ -1226,43 +2430,83 @@ extern "C" {
 
   NVCD_CUDA_EXPORT void nvcd_terminate();
 
+  // appends the counters that were just collected to the ENV_RECORD file
+  NVCD_CUDA_EXPORT void nvcd_host_record() {
+    g_run_info->record();
+  }
+
   NVCD_CUDA_EXPORT void nvcd_host_end() {
     ASSERT(g_nvcd.initialized == true);
     
-    nvcd_calc_metrics();
+    nvcd_run_end(g_run_info);
+
+    // the event data is reused by the next invocation
+    // in the session, and freed in nvcd_host_session_end().
+    // Either way, other threads can now launch on the device.
+    // The device buffers are kept.
+    if (nvcd_session_active()) {
+      nvcd_release_events();
+    } else {
+      nvcd_terminate();
+    }
+  }
 
-    g_run_info->update();
+  //
+  // Like nvcd_host_end(), unless the kernel's still running in its
+  // stream, which only happens with ENV_STREAM set, in a session.
+  // Then the event data is released right away, and the launch is
+  // read and reported once it's needed: by the calling thread's
+  // nvcd_host_complete(), or by the next thread to launch on the
+  // device. Until nvcd_host_complete() is called, g_run_info holds
+  // the launch, and must be left alone.
+  //
+  // Returns true if the launch is still pending.
+  //
+  NVCD_CUDA_EXPORT bool nvcd_host_end_deferred() {
+    ASSERT(g_nvcd.initialized == true);
 
-    nvcd_report();
-    
-    nvcd_device_free_mem();   
+    if (nvcd_session_active() && cupti_event_data_running(nvcd_get_events())) {
+      nvcd_release_events_pending(nvcd_run_end_pending, g_run_info);
+      return true;
+    }
+
+    nvcd_host_end();
+    return false;
+  }
+
+  // finishes the calling thread's nvcd_host_end_deferred(), if it's pending
+  NVCD_CUDA_EXPORT void nvcd_host_complete() {
+    nvcd_complete_pending();
+  }
+  
+  //
+  // Every nvcd_host_begin()/nvcd_host_end() pair that's called
+  // between these two shares the same CUDA initialization, CUPTI event
+  // groups and device buffers.
+  //
+  NVCD_CUDA_EXPORT void nvcd_host_session_begin() {
+    nvcd_init();
+    nvcd_session_begin();
+  }
 
-    nvcd_terminate();
+  NVCD_CUDA_EXPORT void nvcd_host_session_end() {
+    nvcd_session_end();
+
+    if (nvcd_cuda_initialized()) {
+      nvcd_terminate();
+    }
   }
   
   NVCD_CUDA_EXPORT nvcd_device_info::ptr_type nvcd_host_get_device_info() {
     ASSERT(g_nvcd.initialized == true);
     nvcd_device_info::ptr_type ptr(new nvcd_device_info());
-    return std::move(ptr);
+    return ptr;
   }
 
   NVCD_CUDA_EXPORT void nvcd_terminate() {
     nvcd_reset_event_data();
- 
-    for (int i = 0; i < g_nvcd.num_devices; ++i) {
-      ASSERT(g_nvcd.contexts[i] != NULL);
-      safe_free_v(g_nvcd.device_names[i]);
-            
-      if (g_nvcd.contexts_ext[i] == false) {
-	CUDA_DRIVER_FN(cuCtxDestroy(g_nvcd.contexts[i]));
-      }
-    }
-
-    safe_free_v(g_nvcd.device_names);
-    safe_free_v(g_nvcd.devices);
-    safe_free_v(g_nvcd.contexts);
 
-    g_nvcd.initialized = false;
+    nvcd_terminate_cuda();
   }
 }
 
@@ -1273,50 +2517,15 @@ extern "C" {
 //
 #ifdef NVCD_HEADER_IMPL
 
-extern "C" {
-
-  size_t dev_tbuf_size = 0;
-  size_t dev_num_iter_size = 0;
-  size_t dev_smids_size = 0;
-
-  void* d_dev_tstart = nullptr;
-  void* d_dev_ttime = nullptr;
-  void* d_dev_num_iter = nullptr;
-  void* d_dev_smids = nullptr;
-
-  volatile bool test_imbalance_detect = true;
-}
-
-nvcd_run_info* g_run_info = nullptr;
+std::vector<nvcd_device_pool> dev_pools;
+std::once_flag dev_pools_init;
 
-template <class SThreadType, 
-	  class TKernFunType, 
-	  class ...TArgs>
-static inline void nvcd_run_metrics(const TKernFunType& kernel, 
-				    const SThreadType& block_size, 
-				    const SThreadType& threads_per_block,
-				    TArgs... args) {
-  cupti_event_data_t* __e = nvcd_get_events();                           
-  
-  ASSERT(__e->is_root == true);                                       
-  ASSERT(__e->initialized == true);                                   
-  ASSERT(__e->metric_data != NULL);                                   
-  ASSERT(__e->metric_data->initialized == true);                      
-                                                                        
-  for (uint32_t i = 0; i < __e->metric_data->num_metrics; ++i) {      
-    cupti_event_data_begin(&__e->metric_data->event_data[i]);         
-
-    while (!cupti_event_data_callback_finished(&__e->metric_data->event_data[i])) {
-      kernel<<<block_size, threads_per_block>>>(args...);                       
-      CUDA_RUNTIME_FN(cudaDeviceSynchronize());                       
-      g_run_info->run_kernel_count_inc();				
-    }                                                                 
-                                                                        
-    cupti_event_data_end(&__e->metric_data->event_data[i]);           
-  }                                                                     
-}
+nvcd_chunk_pool g_chunk_pool;
 
+thread_local nvcd_run_info* g_run_info = nullptr;
 
+// needs nvcc; see test/ for launching from host compilers
+#ifdef __CUDACC__
 template <class SThreadType, 
 	  class TKernFunType, 
 	  class ...TArgs>
@@ -1335,9 +2544,8 @@ static inline void nvcd_run(const TKernFunType& kernel,
     g_run_info->run_kernel_count_inc();				
   }                                                                   
   cupti_event_data_end(nvcd_get_events());    
-
-  nvcd_run_metrics(kernel, block_size, threads_per_block, args...);
 }
+#endif // __CUDACC__
 
 #endif // NVCD_HEADER_IMPL
 
@@ -24,19 +24,80 @@ typedef struct nvcd {
 
 typedef struct cupti_event_data cupti_event_data_t;
 
+// "GPU-" followed by 32 hex digits, 4 dashes and a null terminator
+#define NVCD_UUID_STR_LENGTH 41
+
 // see nvcd.cuh
 NVCD_EXPORT extern nvcd_t g_nvcd;
 
+// Every thread that calls nvcd_init_cuda() must call
+// nvcd_terminate_cuda() when it's done; the last one
+// to do so releases the contexts and device info.
 NVCD_EXPORT void nvcd_init_cuda();
 
+NVCD_EXPORT void nvcd_terminate_cuda();
+
+typedef void (*nvcd_device_free_fn_t)(void);
+
+// fn is called by the last nvcd_terminate_cuda(), before the contexts
+// are released, to free what was allocated on the devices.
+NVCD_EXPORT void nvcd_set_device_free(nvcd_device_free_fn_t fn);
+
+// true if the calling thread has called nvcd_init_cuda()
+NVCD_EXPORT bool nvcd_cuda_initialized();
+
+// index into g_nvcd's arrays
+NVCD_EXPORT int nvcd_device_index(CUdevice device);
+
+// Returns the index of the device that the calling thread's next
+// launch goes to, and writes the context it'll run in.
+NVCD_EXPORT int nvcd_current_device(CUcontext* context);
+
+// writes the device's UUID in the same format as nvidia-smi -L
+NVCD_EXPORT const char* nvcd_device_uuid_str(int device_index, char* buffer, size_t length);
+
+// If a session is active on the calling thread, the event data
+// created by nvcd_init_events() is kept after each invocation and
+// only reset, rather than recreated, on the next call
+// for the same device and event/metric lists.
+NVCD_EXPORT void nvcd_session_begin();
+
+NVCD_EXPORT void nvcd_session_end();
+
+NVCD_EXPORT bool nvcd_session_active();
+
+// Locks the event data of the given device for the calling thread's
+// next launch. Only one thread can hold a device's event data at a
+// time; it's released by nvcd_release_events() once the launch is
+// done, or by nvcd_reset_event_data().
 NVCD_EXPORT void nvcd_init_events(CUdevice device, CUcontext context);
 
+NVCD_EXPORT void nvcd_release_events();
+
+typedef void (*nvcd_pending_fn_t)(void* arg);
+
+// Releases the event data before the launch is done with it, in a
+// session. fn(arg) is called to finish the launch, with the event data
+// locked, by the next thread to lock it, or by the calling thread's
+// nvcd_complete_pending(), whichever comes first.
+NVCD_EXPORT void nvcd_release_events_pending(nvcd_pending_fn_t fn, void* arg);
+
+// Finishes the calling thread's last launch that was released with
+// nvcd_release_events_pending(), unless another thread already has.
+NVCD_EXPORT void nvcd_complete_pending();
+
+// Locks the event data of the calling thread's last launch again,
+// to report on it. Returns false if there hasn't been one.
+NVCD_EXPORT bool nvcd_lock_events();
+
 NVCD_EXPORT void nvcd_calc_metrics();
 
 NVCD_EXPORT bool nvcd_has_metrics();
 
 NVCD_EXPORT bool nvcd_has_events();
 
+// Leaves every session the calling thread has joined, and frees the
+// event data that no other thread's session is using.
 NVCD_EXPORT void nvcd_reset_event_data();
 
 NVCD_EXPORT cupti_event_data_t* nvcd_get_events();
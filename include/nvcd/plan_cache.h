@@ -0,0 +1,66 @@
+#ifndef __PLAN_CACHE_H__
+#define __PLAN_CACHE_H__
+
+#include "nvcd/commondef.h"
+
+#include <cuda.h>
+#include <cupti.h>
+
+C_LINKAGE_START
+
+//
+// Event group plan cache
+//
+// Resolving the requested events, assigning them to groups and
+// planning the passes costs a CUPTI call per event and per pair of
+// groups, which is seconds' worth with ENV_EVENTS=ALL. When
+// ENV_PLAN_CACHE names a directory, the result is saved there once and
+// later processes (e.g., every rank on a node) load it instead.
+//
+// A cache file is keyed by the device's name and compute capability,
+// the driver and CUPTI versions, and the values of ENV_EVENTS and
+// ENV_METRICS. Files are written to a temporary name and renamed,
+// so concurrent processes never see a partial file.
+//
+
+#define NVCD_PLAN_CACHE_MAGIC "NVCDPLN"
+#define NVCD_PLAN_CACHE_VERSION 1
+
+typedef struct nvcd_plan {
+  // sorted and unique, as in cupti_event_data_t
+  CUpti_EventID* requested_event_ids;
+  uint32_t num_requested_event_ids;
+
+  // the events of group i are
+  // group_event_ids[group_offsets[i]] up to group_event_ids[group_offsets[i + 1]]
+  CUpti_EventID* group_event_ids;
+  uint32_t* group_offsets;
+  uint32_t num_groups;
+
+  // same layout as cupti_event_data_t's pass_groups and pass_offsets:
+  // pass_groups holds every group, with those that fit no pass
+  // stored after pass_offsets[num_passes]
+  uint32_t* pass_groups;
+  uint32_t* pass_offsets;
+  uint32_t num_passes;
+} nvcd_plan_t;
+
+#define NVCD_PLAN_INIT { NULL, 0, NULL, NULL, 0, NULL, NULL, 0 }
+
+// True if ENV_PLAN_CACHE is set.
+NVCD_EXPORT bool nvcd_plan_cache_enabled();
+
+// Loads the plan for the device and the current ENV_EVENTS and
+// ENV_METRICS into plan. Returns false if there's no valid cache file,
+// in which case plan is left empty.
+NVCD_EXPORT bool nvcd_plan_cache_load(CUdevice device, nvcd_plan_t* plan);
+
+// Writes the plan for the device and the current ENV_EVENTS and
+// ENV_METRICS. Failures are reported as warnings.
+NVCD_EXPORT void nvcd_plan_cache_save(CUdevice device, const nvcd_plan_t* plan);
+
+NVCD_EXPORT void nvcd_plan_free(nvcd_plan_t* plan);
+
+C_LINKAGE_END
+
+#endif // __PLAN_CACHE_H__
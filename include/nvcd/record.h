@@ -0,0 +1,131 @@
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+#include "nvcd/commondef.h"
+
+#include <stdint.h>
+
+C_LINKAGE_START
+
+//
+// Binary record stream
+//
+// When ENV_RECORD is set, every profiled launch appends its raw
+// counters to a memory-mapped file instead of formatting them as text.
+// The file is a nvcd_record_file_header_t followed by records, each
+// starting with a nvcd_record_header_t. Records are 8 byte aligned.
+//
+// Region, event, metric and device names are written once, as
+// NVCD_RECORD_NAME records, before the first record that refers to them;
+// every other record only holds their IDs. nvcddump decodes the file.
+//
+// This header is shared with nvcddump, so it
+// must not depend on CUDA or CUPTI.
+//
+
+#define NVCD_RECORD_MAGIC "NVCDREC"
+#define NVCD_RECORD_VERSION 1
+
+// length of every record is a multiple of this
+#define NVCD_RECORD_ALIGN 8
+
+typedef struct nvcd_record_file_header {
+  char magic[8]; // NVCD_RECORD_MAGIC, null terminated
+  uint32_t version;
+  uint32_t header_size; // sizeof(nvcd_record_file_header_t)
+
+  // Bytes of records following this header. Only written when the file
+  // is closed; if it's 0, records are read until one of type
+  // NVCD_RECORD_NONE, since the unwritten part of the file is zeroed.
+  uint64_t length;
+} nvcd_record_file_header_t;
+
+enum {
+  NVCD_RECORD_NONE = 0,
+  NVCD_RECORD_NAME,
+  NVCD_RECORD_COUNTERS,
+  NVCD_RECORD_METRIC
+};
+
+enum {
+  NVCD_RECORD_NAME_REGION = 0,
+  NVCD_RECORD_NAME_EVENT,
+  NVCD_RECORD_NAME_METRIC,
+  NVCD_RECORD_NAME_DEVICE, // name is the device's UUID
+  NVCD_RECORD_NAME_COUNT
+};
+
+typedef struct nvcd_record_header {
+  uint32_t type;
+  uint32_t size; // of the whole record, including this header
+} nvcd_record_header_t;
+
+// followed by length characters and a null terminator
+typedef struct nvcd_record_name {
+  nvcd_record_header_t header;
+  uint32_t kind;
+  uint32_t id;
+  uint32_t length;
+  uint32_t reserved;
+} nvcd_record_name_t;
+
+// The counters of one event for one profiled launch,
+// followed by num_instances uint64_t values.
+typedef struct nvcd_record_counters {
+  nvcd_record_header_t header;
+  uint64_t kernel_id; // the kernel's symbol address
+  uint64_t launch; // sequence number of the profiled launch, per file
+  uint64_t kernel_time_nsec;
+  uint32_t region_id;
+  uint32_t device; // index, named by NVCD_RECORD_NAME_DEVICE
+  uint32_t pass; // of the collection plan; UINT32_MAX if unplanned
+  uint32_t event_id;
+  uint32_t num_instances;
+  uint32_t reserved;
+} nvcd_record_counters_t;
+
+typedef struct nvcd_record_metric {
+  nvcd_record_header_t header;
+  uint64_t kernel_id;
+  uint64_t launch;
+  uint32_t region_id;
+  uint32_t device;
+  uint32_t metric_id;
+  uint32_t kind; // a CUpti_MetricValueKind, or NVCD_RECORD_METRIC_NOT_COMPUTED
+  uint64_t value; // bits of the CUpti_MetricValue
+} nvcd_record_metric_t;
+
+#define NVCD_RECORD_METRIC_NOT_COMPUTED UINT32_MAX
+
+static inline uint32_t nvcd_record_align(uint32_t size) {
+  return (size + (NVCD_RECORD_ALIGN - 1)) & ~((uint32_t)NVCD_RECORD_ALIGN - 1);
+}
+
+#ifndef NVCD_RECORD_NO_WRITER
+
+typedef struct cupti_event_data cupti_event_data_t;
+
+// True if ENV_RECORD is set. The file is created by the first call,
+// at the path ENV_RECORD names with its %p or %r expanded, and closed
+// at exit.
+NVCD_EXPORT bool nvcd_record_enabled();
+
+// Returns the ID of the region, writing its name the first time it's seen.
+NVCD_EXPORT uint32_t nvcd_record_region(const char* name);
+
+// Appends the counters of every group that's been read,
+// and the metrics if they've been calculated.
+NVCD_EXPORT void nvcd_record_event_data(cupti_event_data_t* e,
+                                        uint32_t region_id,
+                                        uint64_t kernel_id,
+                                        uint32_t device);
+
+// Truncates the file to the records written and unmaps it.
+// Called at exit; further records are dropped.
+NVCD_EXPORT void nvcd_record_close();
+
+#endif // NVCD_RECORD_NO_WRITER
+
+C_LINKAGE_END
+
+#endif // __RECORD_H__
@@ -0,0 +1,53 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "nvcd/commondef.h"
+
+C_LINKAGE_START
+
+//
+// Streaming statistics
+//
+// Summarizes a stream of unsigned values in constant memory: the count,
+// the running mean and variance (Welford), the extrema, and a
+// log-linear histogram that answers quantile queries. Each power of
+// two is split into NVCD_STATS_SUB_BUCKETS buckets of equal width, so
+// a quantile is within half a bucket, i.e. about 3% of the exact value,
+// and values below NVCD_STATS_SUB_BUCKETS are exact. Adding a value is
+// O(1), and two summaries merge into the summary of both streams.
+//
+// A zeroed nvcd_stats_t is empty.
+//
+
+#define NVCD_STATS_SUB_BUCKET_BITS 4
+#define NVCD_STATS_SUB_BUCKETS (1 << NVCD_STATS_SUB_BUCKET_BITS)
+
+// one range of NVCD_STATS_SUB_BUCKETS for the values below it,
+// and one for each power of two from there to 2^63
+#define NVCD_STATS_NUM_BUCKETS \
+  ((64 - NVCD_STATS_SUB_BUCKET_BITS + 1) * NVCD_STATS_SUB_BUCKETS)
+
+typedef struct nvcd_stats {
+  uint64_t count;
+  double mean;
+  double m2; // sum of squared differences from the mean
+  uint64_t min;
+  uint64_t max;
+  // saturate instead of wrapping around
+  uint32_t buckets[NVCD_STATS_NUM_BUCKETS];
+} nvcd_stats_t;
+
+NVCD_EXPORT void nvcd_stats_add(nvcd_stats_t* stats, uint64_t value);
+
+// dst becomes the summary of both streams
+NVCD_EXPORT void nvcd_stats_merge(nvcd_stats_t* dst, const nvcd_stats_t* src);
+
+// of the population; 0 if fewer than two values were added
+NVCD_EXPORT double nvcd_stats_variance(const nvcd_stats_t* stats);
+
+// q is in [0, 1]; returns 0 if no values were added
+NVCD_EXPORT uint64_t nvcd_stats_quantile(const nvcd_stats_t* stats, double q);
+
+C_LINKAGE_END
+
+#endif // __STATS_H__
@@ -12,7 +12,7 @@
 
 C_LINKAGE_START
 
-void exit_msg(FILE* out, int error, const char* message, ...);
+NVCD_EXPORT void exit_msg(FILE* out, int error, const char* message, ...);
 
 // Reallocates a buffer of size
 // elem_size * (*current_length)
@@ -37,6 +37,10 @@ typedef enum msg_level
    MSG_LEVEL_DIAG
   } msg_level_t;
 
+// Checked by the msg_verbose* and msg_diag* macros before their
+// arguments are evaluated, and by msg_impl() before anything's formatted.
+NVCD_EXPORT bool msg_enabled(msg_level_t m);
+
 NVCD_EXPORT void msg_impl(msg_level_t m, int line, const char* file, const char* fn, const char* msg, ...);
 
 NVCD_EXPORT void* zalloc(size_t sz);
@@ -255,6 +259,77 @@ typedef enum darray_error
     return i;								\
   }
 
+//
+// Bitsets, stored in 64 bit words. Bits beyond the size of
+// a set are kept clear, so whole words can be counted and combined.
+//
+
+#define BITSET_WORD_BITS 64
+
+#define BITSET_NUM_WORDS(num_bits) (((num_bits) + BITSET_WORD_BITS - 1) / BITSET_WORD_BITS)
+
+static inline bool bitset_test(const uint64_t* set, uint32_t i) {
+  return (set[i / BITSET_WORD_BITS] >> (i % BITSET_WORD_BITS)) & 1;
+}
+
+static inline void bitset_set(uint64_t* set, uint32_t i) {
+  set[i / BITSET_WORD_BITS] |= UINT64_C(1) << (i % BITSET_WORD_BITS);
+}
+
+static inline void bitset_clear(uint64_t* set, uint32_t i) {
+  set[i / BITSET_WORD_BITS] &= ~(UINT64_C(1) << (i % BITSET_WORD_BITS));
+}
+
+// sets bits [0, num_bits) and clears the rest of the last word
+static inline void bitset_fill(uint64_t* set, uint32_t num_bits) {
+  uint32_t num_words = BITSET_NUM_WORDS(num_bits);
+
+  for (uint32_t w = 0; w < num_words; ++w) {
+    set[w] = UINT64_MAX;
+  }
+
+  if (num_bits % BITSET_WORD_BITS != 0) {
+    set[num_words - 1] = (UINT64_C(1) << (num_bits % BITSET_WORD_BITS)) - 1;
+  }
+}
+
+static inline uint32_t bitset_count(const uint64_t* set, uint32_t num_words) {
+  uint32_t count = 0;
+
+  for (uint32_t w = 0; w < num_words; ++w) {
+    count += (uint32_t) __builtin_popcountll(set[w]);
+  }
+
+  return count;
+}
+
+// Returns the index of the first set bit at or after i,
+// or UINT32_MAX if there isn't one. Visiting every set bit
+// this way reads each word once.
+static inline uint32_t bitset_next(const uint64_t* set, uint32_t num_words, uint32_t i) {
+  uint32_t w = i / BITSET_WORD_BITS;
+
+  if (w >= num_words) {
+    return UINT32_MAX;
+  }
+
+  uint64_t bits = set[w] & (UINT64_MAX << (i % BITSET_WORD_BITS));
+
+  while (bits == 0) {
+    if (++w == num_words) {
+      return UINT32_MAX;
+    }
+
+    bits = set[w];
+  }
+
+  return w * BITSET_WORD_BITS + (uint32_t) __builtin_ctzll(bits);
+}
+
+#define BITSET_FOR_EACH(set, num_words, i)              \
+  for (uint32_t i = bitset_next((set), (num_words), 0); \
+       i != UINT32_MAX;                                 \
+       i = bitset_next((set), (num_words), i + 1))
 
 C_LINKAGE_END
 
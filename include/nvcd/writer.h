@@ -0,0 +1,43 @@
+#ifndef __WRITER_H__
+#define __WRITER_H__
+
+#include "nvcd/commondef.h"
+
+#include <stddef.h>
+
+C_LINKAGE_START
+
+//
+// Background writer
+//
+// Text output is pushed into a bounded lock-free queue and written
+// by a dedicated thread, so that profiled launches never wait on
+// the filesystem. What happens when the queue is full is set by
+// ENV_WRITER_POLICY:
+//
+//   block  the producer waits for a free slot (default)
+//   drop   the message is dropped and counted
+//   spill  the message is written by the producer to ENV_WRITER_SPILL
+//   sync   there's no queue or thread; every message is written directly
+//
+// Everything queued is written at exit, or by nvcd_writer_flush().
+//
+
+typedef enum nvcd_writer_policy
+  {
+   NVCD_WRITER_BLOCK = 0,
+   NVCD_WRITER_DROP,
+   NVCD_WRITER_SPILL,
+   NVCD_WRITER_SYNC
+  } nvcd_writer_policy_t;
+
+// Queues length bytes of data for stdout.
+NVCD_EXPORT void nvcd_writer_write(const char* data, size_t length);
+
+// Returns once everything that's been queued
+// by any thread has been written and flushed.
+NVCD_EXPORT void nvcd_writer_flush();
+
+C_LINKAGE_END
+
+#endif // __WRITER_H__
@@ -0,0 +1,441 @@
+// Decodes a record file written with NVCD_RECORD set (see nvcd/record.h).
+// Only the record format is shared with libnvcd, so this doesn't
+// need CUDA or CUPTI to build or run.
+#define NVCD_RECORD_NO_WRITER
+#include <nvcd/record.h>
+#undef NVCD_RECORD_NO_WRITER
+
+#include <string>
+#include <sstream>
+#include <unordered_map>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum output_format
+  {
+   FORMAT_TEXT = 0,
+   FORMAT_CSV,
+   FORMAT_JSON
+  };
+
+static void exit_with_help(int code) {
+  puts("Usage:\n"
+       "nvcddump [-h] [-f $format] $file\n"
+       "\t-f\tOutput format: text, csv or json. If unspecified, text will be used.\n"
+       "\t\tcsv has one row per counter instance; text and json have one entry per event and launch.\n"
+       "\t-h\tPrints this help message and exits.");
+  exit(code);
+}
+
+static output_format g_format = FORMAT_TEXT;
+static const char* g_path = nullptr;
+
+static void parse_args(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "f:h")) != -1) {
+    switch (opt) {
+    case 'h':
+      exit_with_help(EHELP);
+      break;
+    case 'f':
+      if (strcmp(optarg, "text") == 0) {
+        g_format = FORMAT_TEXT;
+      } else if (strcmp(optarg, "csv") == 0) {
+        g_format = FORMAT_CSV;
+      } else if (strcmp(optarg, "json") == 0) {
+        g_format = FORMAT_JSON;
+      } else {
+        printf("Unrecognized format %s\n", optarg);
+        exit_with_help(EBAD_INPUT);
+      }
+      break;
+    default:
+      puts("Unrecognized input");
+      exit_with_help(EBAD_INPUT);
+      break;
+    }
+  }
+
+  if (optind != argc - 1) {
+    puts("Expected a single record file");
+    exit_with_help(EBAD_INPUT);
+  }
+
+  g_path = argv[optind];
+}
+
+struct name_tables {
+  std::unordered_map<uint32_t, std::string> names[NVCD_RECORD_NAME_COUNT];
+
+  const std::string& get(uint32_t kind, uint32_t id) {
+    std::string& name = names[kind][id];
+    if (name.empty()) {
+      std::stringstream ss;
+      ss << "<unnamed " << id << ">";
+      name = ss.str();
+    }
+    return name;
+  }
+};
+
+// same values as CUpti_MetricValueKind
+static const char* metric_kind_str(uint32_t kind) {
+  switch (kind) {
+  case 0: return "double";
+  case 1: return "uint64";
+  case 2: return "percent";
+  case 3: return "throughput";
+  case 4: return "int64";
+  case 5: return "utilization_level";
+  default: break;
+  }
+  return "not_computed";
+}
+
+static std::string metric_value_str(const nvcd_record_metric_t* r) {
+  std::stringstream ss;
+  double d = 0.0;
+  int64_t i = 0;
+
+  switch (r->kind) {
+  case 0:
+  case 2:
+    memcpy(&d, &r->value, sizeof(d));
+    ss << d;
+    break;
+  case 3:
+  case 4:
+    memcpy(&i, &r->value, sizeof(i));
+    ss << i;
+    break;
+  case 1:
+    ss << r->value;
+    break;
+  case 5:
+    // the low 32 bits hold a CUpti_MetricValueUtilizationLevel
+    ss << static_cast<uint32_t>(r->value);
+    break;
+  default:
+    ss << "null";
+    break;
+  }
+  return ss.str();
+}
+
+// Names are identifiers or UUIDs, but they're read from the file,
+// so anything that would break the string is escaped.
+static std::string quoted(const std::string& s) {
+  std::string ret = "\"";
+  for (char c: s) {
+    if (c == '"' || c == '\\') {
+      ret += '\\';
+      ret += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+      ret += escaped;
+    } else {
+      ret += c;
+    }
+  }
+  ret += "\"";
+  return ret;
+}
+
+// as RFC 4180 has it: quotes are doubled, and
+// separators and line breaks are left as they are
+static std::string csv_quoted(const std::string& s) {
+  std::string ret = "\"";
+  for (char c: s) {
+    if (c == '"') {
+      ret += '"';
+    }
+    ret += c;
+  }
+  ret += "\"";
+  return ret;
+}
+
+// The records' sizes are checked against the file before they're
+// dispatched; these check that what they hold fits in that size.
+static bool name_valid(const nvcd_record_name_t* r) {
+  return r->header.size >= sizeof(*r) && r->length <= r->header.size - sizeof(*r);
+}
+
+static bool counters_valid(const nvcd_record_counters_t* r) {
+  return
+    r->header.size >= sizeof(*r) &&
+    r->num_instances <= (r->header.size - sizeof(*r)) / sizeof(uint64_t);
+}
+
+static bool metric_valid(const nvcd_record_metric_t* r) {
+  return r->header.size >= sizeof(*r);
+}
+
+struct dumper {
+  name_tables names;
+  bool first_json_entry;
+
+  dumper()
+    : first_json_entry(true) {
+  }
+
+  void begin() {
+    switch (g_format) {
+    case FORMAT_CSV:
+      puts("\"type\",\"launch\",\"region\",\"kernel\",\"device\",\"uuid\",\"pass\",\"kernel_time_nsec\",\"name\",\"instance\",\"value\",\"kind\"");
+      break;
+    case FORMAT_JSON:
+      puts("[");
+      break;
+    default:
+      break;
+    }
+  }
+
+  void end() {
+    if (g_format == FORMAT_JSON) {
+      puts(first_json_entry ? "]" : "\n]");
+    }
+  }
+
+  void json_separator() {
+    if (!first_json_entry) {
+      puts(",");
+    }
+    first_json_entry = false;
+  }
+
+  void name(const nvcd_record_name_t* r) {
+    if (r->kind < NVCD_RECORD_NAME_COUNT) {
+      const char* chars = reinterpret_cast<const char*>(r + 1);
+      names.names[r->kind][r->id] = std::string(chars, r->length);
+    }
+  }
+
+  void counters(const nvcd_record_counters_t* r) {
+    const uint64_t* values = reinterpret_cast<const uint64_t*>(r + 1);
+
+    const std::string& region = names.get(NVCD_RECORD_NAME_REGION, r->region_id);
+    const std::string& event = names.get(NVCD_RECORD_NAME_EVENT, r->event_id);
+    const std::string& uuid = names.get(NVCD_RECORD_NAME_DEVICE, r->device);
+
+    int32_t pass = r->pass == UINT32_MAX ? -1 : static_cast<int32_t>(r->pass);
+
+    switch (g_format) {
+    case FORMAT_TEXT: {
+      uint64_t sum = 0;
+      uint64_t maximum = 0;
+      uint64_t minimum = r->num_instances > 0 ? UINT64_MAX : 0;
+      for (uint32_t i = 0; i < r->num_instances; ++i) {
+        sum += values[i];
+        maximum = values[i] > maximum ? values[i] : maximum;
+        minimum = values[i] < minimum ? values[i] : minimum;
+      }
+      double avg = r->num_instances > 0 ? static_cast<double>(sum) / static_cast<double>(r->num_instances) : 0.0;
+
+      printf("|COUNTER|%s:%s: SUM: %" PRIu64 " AVG: %f MAX: %" PRIu64 " MIN: %" PRIu64
+             " DEVICE: %" PRIu32 " UUID: %s LAUNCH: %" PRIu64 " KERNEL: 0x%" PRIx64 " PASS: %" PRId32 "\n",
+             region.c_str(), event.c_str(), sum, avg, maximum, minimum,
+             r->device, uuid.c_str(), r->launch, r->kernel_id, pass);
+    } break;
+
+    case FORMAT_CSV: {
+      std::string region_field = csv_quoted(region);
+      std::string uuid_field = csv_quoted(uuid);
+      std::string event_field = csv_quoted(event);
+      for (uint32_t i = 0; i < r->num_instances; ++i) {
+        printf("\"counter\",%" PRIu64 ",%s,\"0x%" PRIx64 "\",%" PRIu32 ",%s,%" PRId32 ",%" PRIu64 ",%s,%" PRIu32 ",%" PRIu64 ",\n",
+               r->launch, region_field.c_str(), r->kernel_id, r->device, uuid_field.c_str(),
+               pass, r->kernel_time_nsec, event_field.c_str(), i, values[i]);
+      }
+    } break;
+
+    case FORMAT_JSON: {
+      json_separator();
+      printf("  {\"type\": \"counter\", \"launch\": %" PRIu64 ", \"region\": %s, \"kernel\": \"0x%" PRIx64 "\", "
+             "\"device\": %" PRIu32 ", \"uuid\": %s, \"pass\": %" PRId32 ", \"kernel_time_nsec\": %" PRIu64 ", "
+             "\"event\": %s, \"values\": [",
+             r->launch, quoted(region).c_str(), r->kernel_id, r->device, quoted(uuid).c_str(),
+             pass, r->kernel_time_nsec, quoted(event).c_str());
+      for (uint32_t i = 0; i < r->num_instances; ++i) {
+        printf(i == 0 ? "%" PRIu64 : ", %" PRIu64, values[i]);
+      }
+      printf("]}");
+    } break;
+    }
+  }
+
+  void metric(const nvcd_record_metric_t* r) {
+    const std::string& region = names.get(NVCD_RECORD_NAME_REGION, r->region_id);
+    const std::string& metric = names.get(NVCD_RECORD_NAME_METRIC, r->metric_id);
+    const std::string& uuid = names.get(NVCD_RECORD_NAME_DEVICE, r->device);
+    std::string value = metric_value_str(r);
+    const char* kind = metric_kind_str(r->kind);
+
+    switch (g_format) {
+    case FORMAT_TEXT: {
+      printf("|METRIC|%s:%s: (%s) %s DEVICE: %" PRIu32 " UUID: %s LAUNCH: %" PRIu64 " KERNEL: 0x%" PRIx64 "\n",
+             region.c_str(), metric.c_str(), kind, value.c_str(),
+             r->device, uuid.c_str(), r->launch, r->kernel_id);
+    } break;
+
+    case FORMAT_CSV: {
+      printf("\"metric\",%" PRIu64 ",%s,\"0x%" PRIx64 "\",%" PRIu32 ",%s,,,%s,,%s,%s\n",
+             r->launch, csv_quoted(region).c_str(), r->kernel_id, r->device, csv_quoted(uuid).c_str(),
+             csv_quoted(metric).c_str(), value == "null" ? "" : value.c_str(), csv_quoted(kind).c_str());
+    } break;
+
+    case FORMAT_JSON: {
+      json_separator();
+      printf("  {\"type\": \"metric\", \"launch\": %" PRIu64 ", \"region\": %s, \"kernel\": \"0x%" PRIx64 "\", "
+             "\"device\": %" PRIu32 ", \"uuid\": %s, \"metric\": %s, \"kind\": \"%s\", \"value\": %s}",
+             r->launch, quoted(region).c_str(), r->kernel_id, r->device, quoted(uuid).c_str(),
+             quoted(metric).c_str(), kind, value.c_str());
+    } break;
+    }
+  }
+};
+
+int main(int argc, char** argv) {
+  parse_args(argc, argv);
+
+  int fd = open(g_path, O_RDONLY);
+  if (fd == -1) {
+    printf("Could not open %s\n", g_path);
+    return EBAD_INPUT;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(nvcd_record_file_header_t)) {
+    printf("%s is not a record file\n", g_path);
+    return EBAD_INPUT;
+  }
+
+  size_t file_size = static_cast<size_t>(st.st_size);
+
+  void* map = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    printf("Could not map %s\n", g_path);
+    return EBAD_INPUT;
+  }
+
+  const uint8_t* base = static_cast<const uint8_t*>(map);
+  const nvcd_record_file_header_t* header = reinterpret_cast<const nvcd_record_file_header_t*>(base);
+
+  if (memcmp(header->magic, NVCD_RECORD_MAGIC, sizeof(NVCD_RECORD_MAGIC)) != 0 ||
+      header->version != NVCD_RECORD_VERSION) {
+    printf("%s is not a version %d record file\n", g_path, NVCD_RECORD_VERSION);
+    return EBAD_INPUT;
+  }
+
+  // records are aligned from the end of the header
+  if (header->header_size < sizeof(*header) ||
+      header->header_size % NVCD_RECORD_ALIGN != 0 ||
+      header->header_size > file_size) {
+    printf("%s has a bad header size of %" PRIu32 "\n", g_path, header->header_size);
+    return EBAD_INPUT;
+  }
+
+  // The length is 0 if the writer didn't get to close the file,
+  // in which case we read up until the zeroed part. Otherwise,
+  // a file that's shorter than its records is truncated.
+  size_t end = file_size;
+  bool truncated = false;
+
+  if (header->length != 0) {
+    if (header->length > file_size - header->header_size) {
+      truncated = true;
+    } else {
+      end = header->header_size + header->length;
+    }
+  }
+
+  dumper d;
+  d.begin();
+
+  size_t offset = header->header_size;
+  bool corrupt = false;
+
+  while (offset < end) {
+    const nvcd_record_header_t* r = reinterpret_cast<const nvcd_record_header_t*>(base + offset);
+
+    if (offset + sizeof(*r) > end) {
+      truncated = true;
+      break;
+    }
+
+    if (r->type == NVCD_RECORD_NONE && header->length == 0) {
+      break;
+    }
+
+    if (r->type == NVCD_RECORD_NONE || r->size < sizeof(*r) || r->size % NVCD_RECORD_ALIGN != 0) {
+      corrupt = true;
+      break;
+    }
+
+    if (r->size > end - offset) {
+      truncated = true;
+      break;
+    }
+
+    // unlike a truncated file, a record that doesn't
+    // fit in its own size means the file is corrupt
+    bool valid = true;
+
+    switch (r->type) {
+    case NVCD_RECORD_NAME:
+      valid = name_valid(reinterpret_cast<const nvcd_record_name_t*>(r));
+      if (valid) {
+        d.name(reinterpret_cast<const nvcd_record_name_t*>(r));
+      }
+      break;
+    case NVCD_RECORD_COUNTERS:
+      valid = counters_valid(reinterpret_cast<const nvcd_record_counters_t*>(r));
+      if (valid) {
+        d.counters(reinterpret_cast<const nvcd_record_counters_t*>(r));
+      }
+      break;
+    case NVCD_RECORD_METRIC:
+      valid = metric_valid(reinterpret_cast<const nvcd_record_metric_t*>(r));
+      if (valid) {
+        d.metric(reinterpret_cast<const nvcd_record_metric_t*>(r));
+      }
+      break;
+    default:
+      // from a newer writer; its size still lets us skip it
+      break;
+    }
+
+    if (!valid) {
+      corrupt = true;
+      break;
+    }
+
+    offset += r->size;
+  }
+
+  d.end();
+
+  munmap(map, file_size);
+  close(fd);
+
+  if (corrupt) {
+    fprintf(stderr, "%s: record at offset %zu is corrupt, stopped there\n", g_path, offset);
+    return EBAD_INPUT;
+  }
+
+  if (truncated) {
+    fprintf(stderr, "%s: truncated at offset %zu, stopped there\n", g_path, offset);
+    return EBAD_INPUT;
+  }
+
+  return 0;
+}
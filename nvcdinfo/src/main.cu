@@ -4,23 +4,34 @@
 
 #include <vector>
 #include <string>
-#include <sstream>
-
-#define DEVICE_BLOCK "\n===================================\n"
-#define SECTION_BLOCK "\n----------------------------------\n"
+#include <unordered_set>
 
 static void exit_with_help(int code) {
   puts("Usage:\n"
-       "nvcdinfo [-h] [-n $num] [-d $device]\n"
+       "nvcdinfo [-h] [-n $num] [-d $device] [-s $events] [-j $threads] [-m] [-p]\n"
        "\t-d\tUses the device index represented by $device to query event information. If unspecified, 0 will be used. Allowed range is [0, 3].\n"
        "\t-n\tWill only print event groups with sizes that are less than or equal to the integer specified by $num.\n"
        "\t\tNote that if $num is less than or equal to 0, then the program will exit.\n"
+       "\t-s\tOnly groups the events in the comma separated list $events, rather than every event of the device.\n"
+       "\t-j\tSolves event domains with $threads threads. If unspecified, one per hardware thread is used.\n"
+       "\tA CSV file is written for each event domain of the device, as well as a binary catalog of its\n"
+       "\tevents, metrics and groups. The catalog is written to the directory named by " ENV_CATALOG ",\n"
+       "\tor the current directory if it's unset.\n"
+       "\t-m\tWrites metrics.csv instead, which lists every metric of the device with the number of passes\n"
+       "\t\tit needs on its own and the events it depends on.\n"
+       "\t-p\tPrints how many replays of each profiled kernel the events of " ENV_EVENTS " and " ENV_METRICS " need\n"
+       "\t\ton the device, and roughly how much longer a profiled kernel runs, and exits.\n"
        "\t-h\tPrints this help message and exits.");
   exit(code);
 }
 
 static uint32_t g_max = UINT32_MAX;
 static uint32_t g_dev = 0;
+static uint32_t g_threads = 0;
+static std::unordered_set<std::string> g_subset;
+static bool g_use_subset = false;
+static bool g_metrics = false;
+static bool g_estimate = false;
 
 uint32_t parse_uint(long int min, long int max) {
   long int n = strtol(optarg, nullptr, 10);
@@ -36,7 +47,7 @@ uint32_t parse_uint(long int min, long int max) {
 
 void parse_args(int argc, char** argv) {
   int opt;
-  while ((opt = getopt(argc, argv, "d:n:h")) != -1) {
+  while ((opt = getopt(argc, argv, "d:n:s:j:mph")) != -1) {
     switch (opt) {
     case 'h':
       exit_with_help(EHELP);
@@ -47,6 +58,24 @@ void parse_args(int argc, char** argv) {
     case 'n':
       g_max = parse_uint(1, 100);
       break;
+    case 'j':
+      g_threads = parse_uint(1, 256);
+      break;
+    case 'm':
+      g_metrics = true;
+      break;
+    case 'p':
+      g_estimate = true;
+      break;
+    case 's': {
+      size_t count = 0;
+      char** list = env_var_list_read(optarg, &count);
+      for (size_t i = 0; i < count; ++i) {
+        g_subset.insert(list[i]);
+      }
+      free_strlist(list, count);
+      g_use_subset = true;
+    } break;
     default:
       puts("Unrecognized input");
       exit_with_help(EBAD_INPUT);
@@ -55,6 +84,45 @@ void parse_args(int argc, char** argv) {
   }
 }
 
+static void print_estimate(nvcd_device_info& info) {
+  const char* events = getenv(ENV_EVENTS);
+  const char* metrics = getenv(ENV_METRICS);
+
+  msg_userf(INFO_TAG "Device: %s\n", g_nvcd.device_names[g_dev]);
+  msg_userf(INFO_TAG ENV_EVENTS ": %s\n", events != nullptr ? events : "");
+  msg_userf(INFO_TAG ENV_METRICS ": %s\n", metrics != nullptr ? metrics : "");
+
+  nvcd_device_info::pass_estimate r = info.estimate_passes(g_dev);
+
+  if (r.num_events == 0) {
+    msg_users(INFO_TAG "No events are requested, so kernels are not replayed");
+    return;
+  }
+
+  msg_userf(INFO_TAG "Events: %" PRIu32 ", including those of %" PRIu32 " metrics\n",
+            r.num_events,
+            r.num_metrics);
+  msg_userf(INFO_TAG "Event groups: %" PRIu32 "\n", r.num_groups);
+  msg_userf(INFO_TAG "Replays per profiled launch: %" PRIu32 "\n", r.num_passes);
+
+  // every pass runs the whole kernel, and waits for it to finish
+  // before its counters are read
+  msg_userf(INFO_TAG "Estimated overhead: about %" PRIu32 "x the kernel's run time, "
+            "plus a synchronization and a counter read per replay\n",
+            r.num_passes);
+
+  if (env_var_flag(ENV_ROTATE)) {
+    msg_userf(INFO_TAG ENV_ROTATE " is set: each launch runs once, and a kernel has to be launched "
+              "%" PRIu32 " times for every event to be recorded\n",
+              r.num_passes);
+  }
+
+  if (r.num_unusable_groups > 0) {
+    msg_warnf("%" PRIu32 " event groups can't be collected on this device, and their events won't be recorded\n",
+              r.num_unusable_groups);
+  }
+}
+
 int main(int argc, char** argv) {
   parse_args(argc, argv);
   
@@ -63,106 +131,35 @@ int main(int argc, char** argv) {
   nvcd_device_info::ptr_type info =
     nvcd_host_get_device_info();
 
-  info->multiplex(g_dev, g_max);
-
-  // The following just prints out additional information on metrics and events.
-  // Not particulalry important at this time, but it's kept in the event
-  // that it might be useful. Should probably be deleted if it isn't used
-  // anytime soon though.
-  
-#if 0
-  std::stringstream ss;
-
-  auto print_metrics = [&ss](const std::string& title,
-                             const std::vector<nvcd_device_info::metric_entry>& metrics) -> void {
-    ss << SECTION_BLOCK
-       << title
-       << SECTION_BLOCK;
-      
-    for (size_t j = 0; j < metrics.size(); ++j) {
-      ss << "[" << j << "]: " << metrics.at(j).name << "\n";
-
-      for (auto& event_name: metrics.at(j).events) {
-        ss << "\tevent IDs corresponding to \"" << event_name.first << "\": ";
-
-        if (event_name.second.size() == 1) {
-          ss << STREAM_HEX(4) << event_name.second.at(0) << std::dec << "\n";
-        } else {
-          ss << "\n";
-          for (auto& eid: event_name.second) {
-            ss << "\t\t" << STREAM_HEX(4) << eid << std::dec << "\n";
-          }
-        }
-      }
-    }
-  };
-
-  auto print_events = [&ss](const std::string& title,
-                            const std::vector<std::string>& events) -> void {
-
-
-    ss << SECTION_BLOCK
-       << title
-       << "|Count = " << events.size() 
-       << SECTION_BLOCK;
-
-    for (size_t j = 0; j < events.size(); ++j) {
-      ss << "[" << j << "]: " << events.at(j) << "\n";
-    }
-    
-  };
-
-
-  for (size_t i = 0; i < info->device_names.size(); ++i) {
-    nvcd_device_info::name_list_type& events =
-      info->events[info->device_names[i]];
+  if (g_estimate) {
+    print_estimate(*info);
+    nvcd_terminate();
+    return 0;
+  }
 
-    {
-      std::vector<std::string> supported;
-      std::vector<std::string> unsupported;
+  if (g_metrics) {
+    uint32_t num_metrics = info->metrics_csv_write(g_dev);
+    msg_userf(INFO_TAG "%" PRIu32 " metrics written to ./metrics.csv\n", num_metrics);
+    nvcd_terminate();
+    return 0;
+  }
 
-      for (const auto& entry: events) {
-        if (entry.supported) {
-          supported.push_back(entry.name);
-        } else {
-          unsupported.push_back(entry.name);
-        }
-      }
+  auto domain_groupings = info->multiplex(g_dev,
+                                          g_max,
+                                          g_use_subset ? &g_subset : nullptr,
+                                          g_threads);
 
-      ss << DEVICE_BLOCK
-         << "[" << i << "]: "
-         << info->device_names[i];
+  {
+    const char* dir = getenv(ENV_CATALOG);
 
-      print_events("EVENTS - SUPPORTED", supported);
-      
-      print_events("EVENTS - UNSUPPORTED", unsupported);
-      
-      ss << SECTION_BLOCK;
-    }
+    std::string path = info->catalog_write(g_dev,
+                                           domain_groupings,
+                                           dir != nullptr && dir[0] != '\0' ? dir : ".");
 
-    {
-      
-      std::vector< nvcd_device_info::metric_entry > supported;
-      std::vector< nvcd_device_info::metric_entry > unsupported;
-
-      auto& metrics = info->metrics[info->device_names[i]];
-      
-      for (size_t k = 0; k < metrics.size(); ++k) {
-        if (metrics[k].supported) {
-          supported.push_back(metrics[k]);
-        } else {
-          unsupported.push_back(metrics[k]);
-        }
-      }
-      
-      print_metrics("METRICS - SUPPORTED", supported);
-      print_metrics("METRICS - UNSUPPORTED", unsupported);
+    if (!path.empty()) {
+      msg_userf(INFO_TAG "Catalog written to %s\n", path.c_str());
     }
   }
-  printf("%s\n", ss.str().c_str());
-#endif
-
-
 
   nvcd_terminate();
 
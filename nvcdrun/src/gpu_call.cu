@@ -86,7 +86,10 @@ extern "C" {
       threads = num_threads / nblock;
       nvcd_kernel_test<<<nblock, threads>>>();
 
+      // attributed to "REGION B/KERNEL 2"
+      libnvcd_begin("KERNEL 2");
       kernel2<<<nblock, threads>>>();
+      libnvcd_end();
     }
     
     libnvcd_end();
@@ -97,5 +100,7 @@ extern "C" {
     nvcd_kernel_test<<<nblock, threads>>>();
 
     libnvcd_time_report();
+
+    libnvcd_region_report();
   }
 }
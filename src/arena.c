@@ -0,0 +1,120 @@
+#include "nvcd/arena.h"
+#include "nvcd/util.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+C_LINKAGE_START
+
+struct nvcd_arena_block {
+  nvcd_arena_block_t* prev;
+  size_t size; // of the data
+  size_t offset; // of the next allocation into the data
+};
+
+// the data follows the header
+#define ARENA_HEADER_SIZE ARENA_ALIGN_UP(sizeof(nvcd_arena_block_t))
+
+#define ARENA_ALIGN_UP(x) (((x) + NVCD_ARENA_ALIGN - 1) & ~((size_t)NVCD_ARENA_ALIGN - 1))
+
+static inline uint8_t* arena_block_data(nvcd_arena_block_t* block) {
+  return (uint8_t*) block + ARENA_HEADER_SIZE;
+}
+
+static nvcd_arena_block_t* arena_block_new(nvcd_arena_block_t* prev, size_t size) {
+  nvcd_arena_block_t* block = mallocNN(ARENA_HEADER_SIZE + size);
+
+  block->prev = prev;
+  block->size = size;
+  block->offset = 0;
+
+  return block;
+}
+
+static void arena_blocks_free(nvcd_arena_block_t* block) {
+  while (block != NULL) {
+    nvcd_arena_block_t* prev = block->prev;
+    free(block);
+    block = prev;
+  }
+}
+
+NVCD_EXPORT void* nvcd_arena_malloc(nvcd_arena_t* arena, size_t size) {
+  ASSERT(arena != NULL);
+
+  size = ARENA_ALIGN_UP(size);
+
+  nvcd_arena_block_t* block = arena->block;
+
+  if (block == NULL || block->size - block->offset < size) {
+    // doubling keeps the number of blocks logarithmic
+    // until the next reset merges them
+    size_t block_size = block != NULL ? block->size << 1 : NVCD_ARENA_MIN_BLOCK_SIZE;
+
+    if (block_size < size) {
+      block_size = size;
+    }
+
+    block = arena_block_new(block, block_size);
+    arena->block = block;
+  }
+
+  void* p = arena_block_data(block) + block->offset;
+
+  block->offset += size;
+  arena->used += size;
+
+  return p;
+}
+
+NVCD_EXPORT void* nvcd_arena_zalloc(nvcd_arena_t* arena, size_t size) {
+  void* p = nvcd_arena_malloc(arena, size);
+  memset(p, 0, size);
+  return p;
+}
+
+NVCD_EXPORT void* nvcd_arena_memdup(nvcd_arena_t* arena, const void* src, size_t size) {
+  void* p = nvcd_arena_malloc(arena, size);
+  
+  if (size > 0) {
+    memcpy(p, src, size);
+  }
+  
+  return p;
+}
+
+NVCD_EXPORT void nvcd_arena_reset(nvcd_arena_t* arena) {
+  ASSERT(arena != NULL);
+
+  nvcd_arena_block_t* block = arena->block;
+
+  if (block != NULL) {
+    if (block->prev != NULL) {
+      // one block which fits everything that was used
+      // replaces the chain
+      size_t size = block->size;
+
+      if (size < arena->used) {
+        size = arena->used;
+      }
+
+      arena_blocks_free(block);
+      arena->block = arena_block_new(NULL, size);
+    } else {
+      block->offset = 0;
+    }
+  }
+
+  arena->used = 0;
+}
+
+NVCD_EXPORT void nvcd_arena_free(nvcd_arena_t* arena) {
+  ASSERT(arena != NULL);
+
+  arena_blocks_free(arena->block);
+
+  arena->block = NULL;
+  arena->used = 0;
+}
+
+C_LINKAGE_END
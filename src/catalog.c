@@ -0,0 +1,348 @@
+#include "nvcd/catalog.h"
+#include "nvcd/util.h"
+#include "nvcd/env_var.h"
+
+#include <cupti.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+C_LINKAGE_START
+
+typedef struct catalog_entry {
+  CUdevice device;
+  nvcd_catalog_t* catalog; // NULL if there isn't a usable one
+} catalog_entry_t;
+
+// one per device that's been asked for
+static catalog_entry_t* g_catalog_entries = NULL;
+static uint32_t g_num_catalog_entries = 0;
+static uint32_t g_catalog_entries_capacity = 0;
+
+static pthread_mutex_t g_catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const size_t g_catalog_element_size[NVCD_CATALOG_SECTION_COUNT] = {
+  sizeof(nvcd_catalog_domain_t),
+  sizeof(nvcd_catalog_event_t),
+  sizeof(nvcd_catalog_metric_t),
+  sizeof(uint32_t),
+  sizeof(nvcd_catalog_group_t),
+  sizeof(uint32_t),
+  sizeof(uint32_t),
+  sizeof(uint32_t),
+  sizeof(uint32_t),
+  sizeof(uint32_t),
+  sizeof(char)
+};
+
+NVCD_EXPORT void nvcd_catalog_device(CUdevice device, nvcd_catalog_device_t* out) {
+  memset(out, 0, sizeof(*out));
+
+  CUDA_DRIVER_FN(cuDeviceGetName(&out->name[0], sizeof(out->name) - 1, device));
+
+  int value = 0;
+
+  CUDA_DRIVER_FN(cuDeviceGetAttribute(&value, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, device));
+  out->cc_major = value;
+
+  CUDA_DRIVER_FN(cuDeviceGetAttribute(&value, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, device));
+  out->cc_minor = value;
+
+  CUDA_DRIVER_FN(cuDriverGetVersion(&value));
+  out->driver_version = value;
+
+  CUPTI_FN(cuptiGetVersion(&out->cupti_version));
+}
+
+NVCD_EXPORT void nvcd_catalog_path(const nvcd_catalog_device_t* device,
+                                   const char* dir,
+                                   char* path,
+                                   size_t length) {
+  // 64 bit FNV-1a of the whole device description
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  const uint8_t* bytes = (const uint8_t*) device;
+
+  for (size_t i = 0; i < sizeof(*device); ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  snprintf(path, length, "%s/nvcd_catalog.%016" PRIx64 ".bin", dir, hash);
+}
+
+// Everything that's used as an index is checked once here,
+// so that lookups don't have to.
+static bool catalog_validate(const nvcd_catalog_t* c) {
+  const nvcd_catalog_header_t* h = c->header;
+
+  for (uint32_t s = 0; s < NVCD_CATALOG_SECTION_COUNT; ++s) {
+    uint64_t end =
+      (uint64_t) h->sections[s].offset +
+      (uint64_t) h->sections[s].count * g_catalog_element_size[s];
+
+    if (h->sections[s].offset % NVCD_CATALOG_ALIGN != 0 || end > c->size) {
+      return false;
+    }
+  }
+
+  uint32_t num_strings = nvcd_catalog_count(c, NVCD_CATALOG_STRINGS);
+  uint32_t num_domains = nvcd_catalog_count(c, NVCD_CATALOG_DOMAINS);
+  uint32_t num_events = nvcd_catalog_count(c, NVCD_CATALOG_EVENTS);
+  uint32_t num_metrics = nvcd_catalog_count(c, NVCD_CATALOG_METRICS);
+  uint32_t num_groups = nvcd_catalog_count(c, NVCD_CATALOG_GROUPS);
+
+  if (num_strings == 0 || c->strings[num_strings - 1] != '\0') {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < num_domains; ++i) {
+    if (c->domains[i].name >= num_strings ||
+        (uint64_t) c->domains[i].events_begin + c->domains[i].num_events > num_events) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    if (c->events[i].name >= num_strings ||
+        c->events[i].domain >= num_domains ||
+        (c->events[i].group >= num_groups && c->events[i].group != NVCD_CATALOG_NONE)) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < num_metrics; ++i) {
+    if (c->metrics[i].name >= num_strings ||
+        (uint64_t) c->metrics[i].events_begin + c->metrics[i].num_events >
+        nvcd_catalog_count(c, NVCD_CATALOG_METRIC_EVENTS)) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < num_groups; ++i) {
+    if (c->groups[i].domain >= num_domains ||
+        (uint64_t) c->groups[i].events_begin + c->groups[i].num_events >
+        nvcd_catalog_count(c, NVCD_CATALOG_GROUP_EVENTS)) {
+      return false;
+    }
+  }
+
+  // lookups take the hash modulo these
+  if ((num_events > 0 && (nvcd_catalog_count(c, NVCD_CATALOG_EVENT_SEEDS) == 0 ||
+                          nvcd_catalog_count(c, NVCD_CATALOG_EVENT_SLOTS) == 0)) ||
+      (num_metrics > 0 && (nvcd_catalog_count(c, NVCD_CATALOG_METRIC_SEEDS) == 0 ||
+                           nvcd_catalog_count(c, NVCD_CATALOG_METRIC_SLOTS) == 0))) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < nvcd_catalog_count(c, NVCD_CATALOG_EVENT_SLOTS); ++i) {
+    if (c->event_slots[i] >= num_events && c->event_slots[i] != NVCD_CATALOG_NONE) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < nvcd_catalog_count(c, NVCD_CATALOG_METRIC_SLOTS); ++i) {
+    if (c->metric_slots[i] >= num_metrics && c->metric_slots[i] != NVCD_CATALOG_NONE) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+#define CATALOG_SECTION(c, type, section)                               \
+  ((const type*) ((c)->map + (c)->header->sections[(section)].offset))
+
+NVCD_EXPORT bool nvcd_catalog_open(nvcd_catalog_t* catalog, const char* path) {
+  memset(catalog, 0, sizeof(*catalog));
+
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat st;
+  void* map = MAP_FAILED;
+  size_t size = 0;
+
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(nvcd_catalog_header_t)) {
+    size = (size_t) st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  catalog->map = (const uint8_t*) map;
+  catalog->size = size;
+  catalog->header = (const nvcd_catalog_header_t*) map;
+
+  const nvcd_catalog_header_t* h = catalog->header;
+
+  bool ok =
+    memcmp(&h->magic[0], NVCD_CATALOG_MAGIC, sizeof(NVCD_CATALOG_MAGIC)) == 0 &&
+    h->version == NVCD_CATALOG_VERSION &&
+    h->header_size == sizeof(*h) &&
+    h->size == size;
+
+  if (ok) {
+    catalog->domains = CATALOG_SECTION(catalog, nvcd_catalog_domain_t, NVCD_CATALOG_DOMAINS);
+    catalog->events = CATALOG_SECTION(catalog, nvcd_catalog_event_t, NVCD_CATALOG_EVENTS);
+    catalog->metrics = CATALOG_SECTION(catalog, nvcd_catalog_metric_t, NVCD_CATALOG_METRICS);
+    catalog->metric_events = CATALOG_SECTION(catalog, uint32_t, NVCD_CATALOG_METRIC_EVENTS);
+    catalog->groups = CATALOG_SECTION(catalog, nvcd_catalog_group_t, NVCD_CATALOG_GROUPS);
+    catalog->group_events = CATALOG_SECTION(catalog, uint32_t, NVCD_CATALOG_GROUP_EVENTS);
+    catalog->event_seeds = CATALOG_SECTION(catalog, uint32_t, NVCD_CATALOG_EVENT_SEEDS);
+    catalog->event_slots = CATALOG_SECTION(catalog, uint32_t, NVCD_CATALOG_EVENT_SLOTS);
+    catalog->metric_seeds = CATALOG_SECTION(catalog, uint32_t, NVCD_CATALOG_METRIC_SEEDS);
+    catalog->metric_slots = CATALOG_SECTION(catalog, uint32_t, NVCD_CATALOG_METRIC_SLOTS);
+    catalog->strings = CATALOG_SECTION(catalog, char, NVCD_CATALOG_STRINGS);
+
+    ok = catalog_validate(catalog);
+  }
+
+  if (!ok) {
+    msg_warnf("%s is not a valid version %d catalog\n", path, NVCD_CATALOG_VERSION);
+    nvcd_catalog_close(catalog);
+  }
+
+  return ok;
+}
+
+#undef CATALOG_SECTION
+
+NVCD_EXPORT void nvcd_catalog_close(nvcd_catalog_t* catalog) {
+  if (catalog->map != NULL) {
+    munmap((void*) catalog->map, catalog->size);
+  }
+
+  memset(catalog, 0, sizeof(*catalog));
+}
+
+static nvcd_catalog_t* catalog_load(CUdevice device) {
+  const char* dir = getenv(ENV_CATALOG);
+
+  if (dir == NULL || dir[0] == '\0') {
+    return NULL;
+  }
+
+  nvcd_catalog_device_t desc;
+  nvcd_catalog_device(device, &desc);
+
+  size_t length = strlen(dir) + 64;
+  char* path = mallocNN(length);
+  nvcd_catalog_path(&desc, dir, path, length);
+
+  nvcd_catalog_t* catalog = zallocNN(sizeof(*catalog));
+
+  if (nvcd_catalog_open(catalog, path)) {
+    if (memcmp(&catalog->header->device, &desc, sizeof(desc)) != 0) {
+      msg_warnf("%s was generated for another device or driver; ignoring it\n", path);
+      nvcd_catalog_close(catalog);
+      safe_free_v(catalog);
+    }
+  } else {
+    safe_free_v(catalog);
+  }
+
+  msg_verbosef("catalog for device %d: %s (%s)\n",
+               device,
+               path,
+               catalog != NULL ? "found" : "not found");
+
+  free(path);
+
+  return catalog;
+}
+
+NVCD_EXPORT const nvcd_catalog_t* nvcd_catalog_for_device(CUdevice device) {
+  C_ASSERT(pthread_mutex_lock(&g_catalog_lock) == 0);
+
+  nvcd_catalog_t* catalog = NULL;
+  bool found = false;
+
+  for (uint32_t i = 0; i < g_num_catalog_entries && !found; ++i) {
+    if (g_catalog_entries[i].device == device) {
+      catalog = g_catalog_entries[i].catalog;
+      found = true;
+    }
+  }
+
+  if (!found) {
+    if (g_catalog_entries == NULL) {
+      g_catalog_entries_capacity = 4;
+      g_catalog_entries = zallocNN(sizeof(g_catalog_entries[0]) * g_catalog_entries_capacity);
+    }
+
+    MAYBE_GROW_BUFFER_U32_NN(g_catalog_entries,
+                             g_num_catalog_entries,
+                             g_catalog_entries_capacity);
+
+    catalog = catalog_load(device);
+
+    g_catalog_entries[g_num_catalog_entries].device = device;
+    g_catalog_entries[g_num_catalog_entries].catalog = catalog;
+    g_num_catalog_entries++;
+  }
+
+  C_ASSERT(pthread_mutex_unlock(&g_catalog_lock) == 0);
+
+  return catalog;
+}
+
+static uint32_t catalog_find(const uint32_t* seeds,
+                             uint32_t num_seeds,
+                             const uint32_t* slots,
+                             uint32_t num_slots,
+                             const char* name) {
+  if (num_seeds == 0 || num_slots == 0) {
+    return NVCD_CATALOG_NONE;
+  }
+
+  uint32_t bucket = nvcd_catalog_hash(name, 0) % num_seeds;
+
+  return slots[nvcd_catalog_hash(name, seeds[bucket]) % num_slots];
+}
+
+NVCD_EXPORT const nvcd_catalog_event_t* nvcd_catalog_find_event(const nvcd_catalog_t* catalog,
+                                                                const char* name) {
+  uint32_t index = catalog_find(catalog->event_seeds,
+                                nvcd_catalog_count(catalog, NVCD_CATALOG_EVENT_SEEDS),
+                                catalog->event_slots,
+                                nvcd_catalog_count(catalog, NVCD_CATALOG_EVENT_SLOTS),
+                                name);
+
+  // names that aren't in the catalog hash to some other name's slot
+  if (index != NVCD_CATALOG_NONE &&
+      strcmp(nvcd_catalog_string(catalog, catalog->events[index].name), name) == 0) {
+    return &catalog->events[index];
+  }
+
+  return NULL;
+}
+
+NVCD_EXPORT const nvcd_catalog_metric_t* nvcd_catalog_find_metric(const nvcd_catalog_t* catalog,
+                                                                  const char* name) {
+  uint32_t index = catalog_find(catalog->metric_seeds,
+                                nvcd_catalog_count(catalog, NVCD_CATALOG_METRIC_SEEDS),
+                                catalog->metric_slots,
+                                nvcd_catalog_count(catalog, NVCD_CATALOG_METRIC_SLOTS),
+                                name);
+
+  if (index != NVCD_CATALOG_NONE &&
+      strcmp(nvcd_catalog_string(catalog, catalog->metrics[index].name), name) == 0) {
+    return &catalog->metrics[index];
+  }
+
+  return NULL;
+}
+
+C_LINKAGE_END
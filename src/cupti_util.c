@@ -3,8 +3,9 @@
 #include <inttypes.h>
 #include "nvcd/util.h"
 #include "nvcd/env_var.h"
-
-#define MAX_EVENT_GROUPS_PER_EVENT_DATA 250
+#include "nvcd/plan_cache.h"
+#include "nvcd/catalog.h"
+#include "nvcd/arena.h"
 
 typedef CUpti_EventID cupti_event_id;
 DARRAY(cupti_event_id, 128, 128);
@@ -20,6 +21,19 @@ DARRAY(cupti_event_id, 128, 128);
 	       (v##enum_value));					\
   } while (0)
 
+// nvcd_name_query_fn_t for the name tables
+static void query_event_name(uint32_t eid, char* name, size_t length) {
+  size_t sz = length;
+  
+  CUPTI_FN(cuptiEventGetAttribute(eid, CUPTI_EVENT_ATTR_NAME, &sz, name));
+}
+
+static void query_metric_name(uint32_t metric, char* name, size_t length) {
+  size_t sz = length;
+  
+  CUPTI_FN(cuptiMetricGetAttribute(metric, CUPTI_METRIC_ATTR_NAME, &sz, (void*) name));
+}
+
 static void print_event_group_attr_info(CUpti_EventGroup group, const char* opt_tag) {
   if (group != NULL) {
     msg_verbose_begin();
@@ -159,8 +173,30 @@ static darray_cupti_event_id_t* query_event_list(cupti_event_data_t* e) {
   return ret;
 }
 
+// The catalog already holds every event's name.
+static char** catalog_get_event_names(const nvcd_catalog_t* catalog, size_t* out_len) {
+  uint32_t num_events = nvcd_catalog_count(catalog, NVCD_CATALOG_EVENTS);
+  
+  char** event_names = mallocNN((num_events + 1) * sizeof(char*));
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    event_names[i] = NOT_NULL(strdup(nvcd_catalog_string(catalog, catalog->events[i].name)));
+  }
+
+  IF_NN_THEN(out_len,
+             *out_len = num_events);
+
+  return event_names;
+}
+
 NVCD_EXPORT char** cupti_get_event_names(cupti_event_data_t* e, size_t* out_len) {  
   char** event_names = NULL;
+
+  const nvcd_catalog_t* catalog = nvcd_catalog_for_device(e->cuda_device);
+
+  if (catalog != NULL) {
+    return catalog_get_event_names(catalog, out_len);
+  }
   
   darray_cupti_event_id_t* event_id_list = query_event_list(e);
   
@@ -202,14 +238,28 @@ static CUpti_runtime_api_trace_cbid g_cupti_runtime_cbids[] = {
 
 static void init_cupti_event_buffers(cupti_event_data_t* e);
 
+// Puts every group back in the unread state, with none enabled.
+static void reset_event_group_states(cupti_event_data_t* e) {
+  ZERO_MEM(e->event_group_states,
+           (size_t) e->num_event_group_words * CED_EVENT_GROUP_STATE_COUNT);
+  
+  bitset_fill(cupti_event_group_states(e, CED_EVENT_GROUP_UNREAD),
+              e->num_event_groups);
+}
+
 static void fill_event_groups(cupti_event_data_t* e,
                               CUpti_EventGroup* local_eg_assign,
                               uint32_t num_egs) {
   ASSERT(e->has_events == true);
   e->num_event_groups = num_egs;
-  e->event_groups = zallocNN(sizeof(e->event_groups[0]) * e->num_event_groups);
-  e->event_group_read_states = zallocNN(sizeof(e->event_group_read_states[0]) * e->num_event_groups);
-  e->event_groups_enabled = zallocNN(sizeof(e->event_groups_enabled[0]) * e->num_event_groups);
+  e->event_groups = nvcd_arena_zalloc(e->arena,
+                                      sizeof(e->event_groups[0]) * e->num_event_groups);
+  e->num_event_group_words = BITSET_NUM_WORDS(e->num_event_groups);
+  e->event_group_states = nvcd_arena_zalloc(e->arena,
+                                            sizeof(e->event_group_states[0]) *
+                                            e->num_event_group_words *
+                                            CED_EVENT_GROUP_STATE_COUNT);
+  reset_event_group_states(e);
   
   for (uint32_t i = 0; i < e->num_event_groups; ++i) {
     ASSERT(local_eg_assign[i] != NULL);
@@ -286,6 +336,45 @@ static bool find_event_group(cupti_event_data_t* e,
   return found;
 }
 
+//
+// Names are resolved through the device's catalog when
+// there is one, and through CUPTI otherwise.
+//
+
+static CUptiResult event_id_from_name(CUdevice device, const char* name, CUpti_EventID* id) {
+  const nvcd_catalog_t* catalog = nvcd_catalog_for_device(device);
+
+  if (catalog != NULL) {
+    const nvcd_catalog_event_t* event = nvcd_catalog_find_event(catalog, name);
+
+    if (event == NULL) {
+      return CUPTI_ERROR_INVALID_EVENT_NAME;
+    }
+
+    *id = event->id;
+    return CUPTI_SUCCESS;
+  }
+
+  return cuptiEventGetIdFromName(device, name, id);
+}
+
+static CUptiResult metric_id_from_name(CUdevice device, const char* name, CUpti_MetricID* id) {
+  const nvcd_catalog_t* catalog = nvcd_catalog_for_device(device);
+
+  if (catalog != NULL) {
+    const nvcd_catalog_metric_t* metric = nvcd_catalog_find_metric(catalog, name);
+
+    if (metric == NULL) {
+      return CUPTI_ERROR_INVALID_METRIC_NAME;
+    }
+
+    *id = metric->id;
+    return CUPTI_SUCCESS;
+  }
+
+  return cuptiMetricGetIdFromName(device, name, id);
+}
+
 static CUpti_MetricID* fetch_metric_ids_from_device(CUdevice device, uint32_t* num_metrics) {
 
   msg_verboses("Fetching all metric IDs from device");
@@ -328,9 +417,9 @@ static CUpti_MetricID* fetch_metric_ids_from_names(cupti_event_data_t* e_root,
   
   while (i < *num_metrics && j < desired) {
     CUpti_MetricID id;
-    CUptiResult err = cuptiMetricGetIdFromName(device,
-					       metric_names[j],
-					       &id);
+    CUptiResult err = metric_id_from_name(device,
+                                          metric_names[j],
+                                          &id);
 
     if (err != CUPTI_SUCCESS) {
       msg_verbosef("fetch_metric_ids_from_names: Could not find metric name \'%s\'\n",
@@ -423,58 +512,97 @@ static void init_cupti_metric_data(cupti_event_data_t* e) {
 
   if (e->has_metrics) {
     ASSERT(metric_id_buffer != NULL && num_metrics > 0);
-    cupti_metric_data_t* metric_buffer = zallocNN(sizeof(*metric_buffer));
+    cupti_metric_data_t* metric_buffer = nvcd_arena_zalloc(e->arena, sizeof(*metric_buffer));
 
     metric_buffer->num_metrics = num_metrics;
-    metric_buffer->metric_ids = metric_id_buffer;
+    metric_buffer->metric_ids = nvcd_arena_memdup(e->arena,
+                                                  metric_id_buffer,
+                                                  sizeof(metric_id_buffer[0]) * num_metrics);
+    free(metric_id_buffer);
+
+    nvcd_name_table_build(&e->metric_name_table,
+                          metric_buffer->metric_ids,
+                          num_metrics,
+                          query_metric_name);
+
+    metric_buffer->metric_values =
+      nvcd_arena_zalloc(e->arena,
+                        sizeof(metric_buffer->metric_values[0]) *
+                        metric_buffer->num_metrics);
+
+    metric_buffer->value_kinds =
+      nvcd_arena_zalloc(e->arena,
+                        sizeof(metric_buffer->value_kinds[0]) *
+                        metric_buffer->num_metrics);
 
-    metric_buffer->metric_values = zallocNN(sizeof(metric_buffer->metric_values[0]) *
-					    metric_buffer->num_metrics);
+    for (uint32_t i = 0; i < metric_buffer->num_metrics; ++i) {
+      size_t kind_sz = sizeof(metric_buffer->value_kinds[i]);
+
+      CUPTI_FN(cuptiMetricGetAttribute(metric_buffer->metric_ids[i],
+                                       CUPTI_METRIC_ATTR_VALUE_KIND,
+                                       &kind_sz,
+                                       (void*) &metric_buffer->value_kinds[i]));
+    }
   
-    metric_buffer->event_data = zallocNN(sizeof(metric_buffer->event_data[0]) *
-					 metric_buffer->num_metrics);
+    metric_buffer->event_id_offsets =
+      nvcd_arena_zalloc(e->arena,
+                        sizeof(metric_buffer->event_id_offsets[0]) *
+                        (metric_buffer->num_metrics + 1));
 
-    metric_buffer->computed = zallocNN(sizeof(metric_buffer->computed[0]) *
-				       metric_buffer->num_metrics);
+    metric_buffer->computed =
+      nvcd_arena_zalloc(e->arena,
+                        sizeof(metric_buffer->computed[0]) *
+                        metric_buffer->num_metrics);
 
     metric_buffer->metric_get_value_results =
-      zallocNN(sizeof(metric_buffer->metric_get_value_results[0]) *
-	       metric_buffer->num_metrics);
+      nvcd_arena_zalloc(e->arena,
+                        sizeof(metric_buffer->metric_get_value_results[0]) *
+                        metric_buffer->num_metrics);
+
+    // the events for every metric are stored in one buffer,
+    // so we need the total count first
+    uint32_t num_event_ids = 0;
+
+    for (uint32_t i = 0; i < metric_buffer->num_metrics; ++i) {
+      uint32_t num_events = 0;
+      CUPTI_FN(cuptiMetricGetNumEvents(metric_buffer->metric_ids[i], &num_events));
+
+      metric_buffer->event_id_offsets[i] = num_event_ids;
+      num_event_ids += num_events;
+    }
+
+    metric_buffer->event_id_offsets[metric_buffer->num_metrics] = num_event_ids;
+
+    metric_buffer->event_ids = nvcd_arena_zalloc(e->arena,
+                                                 sizeof(metric_buffer->event_ids[0]) *
+                                                 num_event_ids);
+
+    metric_buffer->event_values = nvcd_arena_zalloc(e->arena,
+                                                    sizeof(metric_buffer->event_values[0]) *
+                                                    num_event_ids);
                                                      
 #define _index_ "[%" PRIu32 "] "
     msg_verbose_begin();
     for (uint32_t i = 0; i < metric_buffer->num_metrics; ++i) {
-      char* name = cupti_metric_get_name(metric_buffer->metric_ids[i]);
+      const char* name = cupti_event_data_metric_name(e, metric_buffer->metric_ids[i]);
       msg_verbosef( _index_ "Processing metric %s...\n", i, name);
     
-      uint32_t num_events = 0;
-      CUPTI_FN(cuptiMetricGetNumEvents(metric_buffer->metric_ids[i], &num_events));
+      uint32_t offset = metric_buffer->event_id_offsets[i];
+      uint32_t num_events = metric_buffer->event_id_offsets[i + 1] - offset;
       msg_verbosef(_index_ "event count is %" PRIu32 "\n", i, num_events);
 
       size_t event_array_size = sizeof(CUpti_EventID) * num_events;
     
-      CUpti_EventID* events = zallocNN(event_array_size);
-    
       CUPTI_FN(cuptiMetricEnumEvents(metric_buffer->metric_ids[i],
 				     &event_array_size,
-				     &events[0]));
-    
-      cupti_event_data_set_null(&metric_buffer->event_data[i]);
+				     &metric_buffer->event_ids[offset]));
 
-      metric_buffer->event_data[i].cuda_device = e->cuda_device;
-      metric_buffer->event_data[i].cuda_context = e->cuda_context;
-    
-      cupti_event_data_init_from_ids(&metric_buffer->event_data[i],
-				     &events[0],
-				     num_events);
-    
-      // TODO: take each group and compute the needed values...
-    
-      free(name);
+      ASSERT(event_array_size == sizeof(CUpti_EventID) * num_events);
 
       msg_verboses("---");
     }
     msg_verbose_end();
+#undef _index_
   
     metric_buffer->initialized = true;
 
@@ -482,6 +610,42 @@ static void init_cupti_metric_data(cupti_event_data_t* e) {
   }
 }
 
+static int event_id_cmp(const void* a, const void* b) {
+  CUpti_EventID x = *(const CUpti_EventID*) a;
+  CUpti_EventID y = *(const CUpti_EventID*) b;
+
+  return (x > y) - (x < y);
+}
+
+// sorts the IDs and removes duplicates;
+// returns the new length
+static uint32_t event_ids_sort_unique(CUpti_EventID* ids, uint32_t num_ids) {
+  uint32_t len = 0;
+  
+  if (num_ids > 0) {
+    qsort(ids, num_ids, sizeof(ids[0]), event_id_cmp);
+
+    len = 1;
+    
+    for (uint32_t i = 1; i < num_ids; ++i) {
+      if (ids[i] != ids[len - 1]) {
+        ids[len] = ids[i];
+        len++;
+      }
+    }
+  }
+
+  return len;
+}
+
+static bool event_ids_contain(const CUpti_EventID* sorted_ids,
+                              uint32_t num_ids,
+                              CUpti_EventID id) {
+  return
+    num_ids > 0 &&
+    bsearch(&id, sorted_ids, num_ids, sizeof(id), event_id_cmp) != NULL;
+}
+
 static uint32_t derive_event_count(cupti_event_data_t* e) {
   uint32_t ret = 0;
 
@@ -498,13 +662,6 @@ static uint32_t derive_event_count(cupti_event_data_t* e) {
 //
 static void normalize_counters(cupti_event_data_t* e, uint64_t* normalized) {
   for (uint32_t j = 0; j < e->num_event_groups; ++j) {
-    CUpti_EventDomainID domain_id;
-    size_t domain_id_sz = sizeof(domain_id);
-    CUPTI_FN(cuptiEventGroupGetAttribute(e->event_groups[j],
-                                         CUPTI_EVENT_GROUP_ATTR_EVENT_DOMAIN_ID,
-                                         &domain_id_sz,
-                                         (void*) &domain_id));
-    
     uint32_t total_instance_count = 1;
 
     // Querying for this value will throw
@@ -517,7 +674,14 @@ static void normalize_counters(cupti_event_data_t* e, uint64_t* normalized) {
     // interfacing with teh metrics appear to be fine)
     // Note that if the reader tries this on their machine,
     // it may work fine. This was tested with cuda 9.2 on a GTX 960 M.
-#if 0    
+#if 0
+    CUpti_EventDomainID domain_id;
+    size_t domain_id_sz = sizeof(domain_id);
+    CUPTI_FN(cuptiEventGroupGetAttribute(e->event_groups[j],
+                                         CUPTI_EVENT_GROUP_ATTR_EVENT_DOMAIN_ID,
+                                         &domain_id_sz,
+                                         (void*) &domain_id));
+    
     size_t total_instance_count_sz = sizeof(total_instance_count);
     CUPTI_FN(cuptiEventDomainGetAttribute(domain_id,
                                           CUPTI_EVENT_DOMAIN_ATTR_TOTAL_INSTANCE_COUNT,
@@ -544,46 +708,44 @@ static void normalize_counters(cupti_event_data_t* e, uint64_t* normalized) {
   }
 }
 
-static void print_cupti_metric(cupti_metric_data_t* metric_data, uint32_t index) {
+// Each metric is written as one message, so that it's formatted once
+// and its line can't be split by another thread's output.
+static void print_cupti_metric(cupti_event_data_t* e, uint32_t index) {
+  cupti_metric_data_t* metric_data = e->metric_data;
+  
   //ASSERT(metric_data->computed[index] == true);
 
   CUpti_MetricID m = metric_data->metric_ids[index];
   CUpti_MetricValue v = metric_data->metric_values[index];
 
-  char* name = cupti_metric_get_name(m);
-    
-  msg_userf(METRICS_TAG "index[%" PRIu32 "] %s = ", index, name);
+  const char* name = cupti_event_data_metric_name(e, m);
+  ASSERT(name != NULL);
   
   if (metric_data->computed[index] == true) {
   
-    CUpti_MetricValueKind kind;
-  
-    size_t kind_sz = sizeof(kind);
-  
-    CUPTI_FN(cuptiMetricGetAttribute(m,
-                                     CUPTI_METRIC_ATTR_VALUE_KIND,
-                                     &kind_sz,
-                                     (void*) &kind));
+    CUpti_MetricValueKind kind = metric_data->value_kinds[index];
+
+    char value[128] = {0};
   
     switch (kind) {
     case CUPTI_METRIC_VALUE_KIND_DOUBLE: {
-      msg_userf("(double) %f", v.metricValueDouble);
+      snprintf(value, sizeof(value), "(double) %f", v.metricValueDouble);
     } break;
     
     case CUPTI_METRIC_VALUE_KIND_UINT64: {
-      msg_userf("(uint64) %" PRIu64, v.metricValueUint64);
+      snprintf(value, sizeof(value), "(uint64) %" PRIu64, v.metricValueUint64);
     } break;
     
     case CUPTI_METRIC_VALUE_KIND_INT64: {
-      msg_userf("(int64) %" PRId64, v.metricValueInt64);
+      snprintf(value, sizeof(value), "(int64) %" PRId64, v.metricValueInt64);
     } break;
     
     case CUPTI_METRIC_VALUE_KIND_PERCENT: {
-      msg_userf("(percent) %f", v.metricValuePercent);
+      snprintf(value, sizeof(value), "(percent) %f", v.metricValuePercent);
     } break;
     
     case CUPTI_METRIC_VALUE_KIND_THROUGHPUT: {
-      msg_userf("(bytes/second) %" PRId64, v.metricValueThroughput);
+      snprintf(value, sizeof(value), "(bytes/second) %" PRId64, v.metricValueThroughput);
     } break;
     
     case CUPTI_METRIC_VALUE_KIND_UTILIZATION_LEVEL: {
@@ -617,16 +779,23 @@ static void print_cupti_metric(cupti_metric_data_t* metric_data, uint32_t index)
         break;
       }
     
-      msg_userf("(utilization level) %" PRIu32 " =  %s ",
-		v.metricValueUtilizationLevel,
-		level);
+      snprintf(value,
+               sizeof(value),
+               "(utilization level) %" PRIu32 " =  %s ",
+               v.metricValueUtilizationLevel,
+               level);
     } break;
 
     default:
       //ASSERT(false /* bad metric value kind received */);
-      msg_warnf(METRICS_TAG "bad metric value kind received: 0x%" PRIx32 " ", kind);
-      break;
+      msg_warnf(METRICS_TAG "index[%" PRIu32 "] %s: bad metric value kind received: 0x%" PRIx32 "\n",
+                index,
+                name,
+                kind);
+      return;
     }
+
+    msg_userf(METRICS_TAG "index[%" PRIu32 "] %s = %s\n", index, name, value);
   } else {
     const char* result_string = NULL;
 
@@ -642,39 +811,70 @@ static void print_cupti_metric(cupti_metric_data_t* metric_data, uint32_t index)
     CUPTI_FN(cuptiGetResultString(metric_data->metric_get_value_results[index],
 				  &result_string));
     
-    msg_warnf(METRICS_TAG "metric NOT computed - Error code received: %" PRIu32 " = %s",
+    msg_warnf(METRICS_TAG "index[%" PRIu32 "] %s: metric NOT computed - Error code received: %" PRIu32 " = %s\n",
+              index,
+              name,
 	      metric_data->metric_get_value_results[index],
 	      result_string);
   }
-  
-  msg_userline();
+}
+
+static uint32_t find_event_index(cupti_event_data_t* e, CUpti_EventID id) {
+  uint32_t i = 0;
+
+  while (i < e->event_id_buffer_length && e->event_id_buffer[i] != id) {
+    i++;
+  }
+
+  ASSERT(i < e->event_id_buffer_length /* every metric event is part of the root's event set */);
+
+  return i;
+}
+
+static void init_cupti_metric_event_indices(cupti_event_data_t* e) {
+  cupti_metric_data_t* m = e->metric_data;
+  uint32_t num_event_ids = m->event_id_offsets[m->num_metrics];
 
-  free(name);
+  m->event_indices = nvcd_arena_malloc(e->arena,
+                                       sizeof(m->event_indices[0]) * num_event_ids);
+
+  for (uint32_t i = 0; i < num_event_ids; ++i) {
+    m->event_indices[i] = find_event_index(e, m->event_ids[i]);
+  }
 }
 
-static void calc_cupti_metrics(cupti_metric_data_t* m) {
+static void calc_cupti_metrics(cupti_event_data_t* e) {
+  cupti_metric_data_t* m = e->metric_data;
+  
   ASSERT(m->initialized == true);
   ASSERT(m->num_metrics < 2000);
   
-  for (uint32_t i = 0; i < m->num_metrics; ++i) {
-    cupti_event_data_t* e = &m->event_data[i];
-    
-    ASSERT(e->event_id_buffer_length ==
-           derive_event_count(&m->event_data[i]));
+  ASSERT(e->event_id_buffer_length == derive_event_count(e));
 
-    ASSERT(e->num_kernel_times > 0 && e->num_kernel_times < 100);
+  ASSERT(e->num_kernel_times > 0 && e->num_kernel_times < 100);
     
-    uint64_t* normalized = zallocNN(e->event_id_buffer_length *
-                                    sizeof(normalized[0]));
+  uint64_t* normalized = m->normalized_counters;
+
+  ZERO_MEM(normalized, e->event_id_buffer_length);
+  
+  normalize_counters(e, normalized);
+
+  uint64_t* values = m->event_values;
+  
+  for (uint32_t i = 0; i < m->num_metrics; ++i) {
+    uint32_t offset = m->event_id_offsets[i];
+    uint32_t num_events = m->event_id_offsets[i + 1] - offset;
     
-    normalize_counters(e, normalized);
+    for (uint32_t j = 0; j < num_events; ++j) {
+      values[offset + j] = normalized[m->event_indices[offset + j]];
+    }
     
     CUptiResult err = cuptiMetricGetValue(e->cuda_device,
                                           m->metric_ids[i],
-                                          sizeof(e->event_id_buffer[0]) * e->event_id_buffer_length,
-                                          &e->event_id_buffer[0],
-                                          sizeof(normalized[0]) * e->event_id_buffer_length,
-                                          &normalized[0],
+                                          sizeof(m->event_ids[0]) * num_events,
+                                          &m->event_ids[offset],
+                                          sizeof(values[0]) * num_events,
+                                          &values[offset],
                                           e->kernel_times_nsec[0],
                                           &m->metric_values[i]);
 
@@ -684,8 +884,8 @@ static void calc_cupti_metrics(cupti_metric_data_t* m) {
       m->computed[i] = true;
     } else if (err != CUPTI_ERROR_INVALID_METRIC_VALUE) {
       msg_warnf(METRICS_TAG "error for metric %" PRIu32 " = 0x%" PRIx32 "\n", i, m->metric_ids[i]);
-      for (uint32_t j = 0; j < e->event_id_buffer_length; ++j) {
-        msg_warnf(METRICS_TAG "\tEvent ID %" PRIu32 " = 0x%" PRIx32 "\n", j, e->event_id_buffer[j]);
+      for (uint32_t j = 0; j < num_events; ++j) {
+        msg_warnf(METRICS_TAG "\tEvent ID %" PRIu32 " = 0x%" PRIx32 "\n", j, m->event_ids[offset + j]);
       }
       CUPTI_FN_WARN(err);
     }
@@ -711,11 +911,18 @@ static uint32_t g_group_info_size = 0;
 
 static void group_info_append(group_info_t* info, uint32_t group) {
   if (g_group_info_buffer == NULL) {
-    g_group_info_size = 50;
+    g_group_info_size = 64;
     g_group_info_buffer = zallocNN(g_group_info_size * sizeof(*g_group_info_buffer));
   }
 
-  ASSERT(group < g_group_info_size /* TODO: use double_buffer_size() in util.h */); 
+  while (group >= g_group_info_size) {
+    size_t size = g_group_info_size;
+    
+    g_group_info_buffer = NOT_NULL(double_buffer_size(g_group_info_buffer,
+                                                      sizeof(*g_group_info_buffer),
+                                                      &size));
+    g_group_info_size = (uint32_t) size;
+  }
   
   memcpy(&g_group_info_buffer[group], info, sizeof(*info));
   g_group_info_count++;
@@ -741,10 +948,10 @@ static void group_info_validate(cupti_event_data_t* e,
   for (uint32_t i = 0; i < info->num_events; ++i) {
     ASSERT(base[i] == info->events[i]);
 
-    char* name = cupti_event_get_name(info->events[i]);
-    char* name2 = cupti_event_get_name(base[i]);
+    const char* name = cupti_event_data_event_name(e, info->events[i]);
+    const char* name2 = cupti_event_data_event_name(e, base[i]);
 
-    ASSERT(strcmp(name, name2) == 0);
+    ASSERT(name != NULL && name == name2);
 
 #if 0
     uint64_t* soa_counters = &e->event_counter_buffer[e->event_counter_buffer_offsets[group]];
@@ -757,8 +964,6 @@ static void group_info_validate(cupti_event_data_t* e,
 #endif
     
     msg_verbosef("\t[%" PRIu32 "] %s|%s is good...\n", i, name, name2);
-    free(name);
-    free(name2);
   }
 
   ASSERT(info->num_instances == 1);
@@ -867,22 +1072,13 @@ static void read_group_per_event(cupti_event_data_t* e, uint32_t group) {
   group_info_append(info, group);
 }
 
-static void init_cupti_event_groups(cupti_event_data_t* e) {
-  ASSERT(e->has_events == true);
-  msg_verbosef("%s\n", "init_cupti_event_groups_entered");
-  
-  // static default; increase if more groups become necessary
-  uint32_t max_egs = MAX_EVENT_GROUPS_PER_EVENT_DATA; 
-  uint32_t num_egs = 0;
-
-  // we use a local buffer with an estimate,
-  // so when we store the memory we aren't using
-  // more than we need
-  CUpti_EventGroup local_eg_assign[MAX_EVENT_GROUPS_PER_EVENT_DATA];
-
-  // CUpti_EventGroup is just a typedef for a pointer
-  for (uint32_t i = 0; i < max_egs; ++i)
-    local_eg_assign[i] = NULL;
+// Resolves the names given through ENV_EVENTS to IDs.
+// Events which aren't available on this device are omitted.
+static void init_cupti_requested_event_ids(cupti_event_data_t* e) {
+  e->requested_event_ids = nvcd_arena_zalloc(e->arena,
+                                             sizeof(e->requested_event_ids[0]) *
+                                             (e->event_names_buffer_length + 1));
+  e->num_requested_event_ids = 0;
   
   for (uint32_t i = 0; i < e->event_names_buffer_length; ++i) {
     CUpti_EventID event_id = V_UNSET;
@@ -892,9 +1088,9 @@ static void init_cupti_event_groups(cupti_event_data_t* e) {
             "; event [%" PRId32"] = %s\n", e->cuda_device,
             i, e->event_names[i]);
     
-    CUptiResult err = cuptiEventGetIdFromName(e->cuda_device,
-                                              e->event_names[i],
-                                              &event_id);
+    CUptiResult err = event_id_from_name(e->cuda_device,
+                                         e->event_names[i],
+                                         &event_id);
 
     //-------------------------------------------------
     // FIXME(?): this routine was written when a static list of counters
@@ -925,22 +1121,81 @@ static void init_cupti_event_groups(cupti_event_data_t* e) {
     }
     
     if (available) {
-      bool found = find_event_group(e,
-                                    &local_eg_assign[0],
-                                    event_id,
-                                    max_egs,
-                                    &num_egs);
-      ASSERT(found);
+      e->requested_event_ids[e->num_requested_event_ids] = event_id;
+      e->num_requested_event_ids++;
     }
 
-    msg_verbosef("(%s) group found for index %u => %s:0x%x\n",
+    msg_verbosef("(%s) ID found for index %u => %s:0x%x\n",
 		 available ? "available" : "unavailable",
 		 i,
 		 e->event_names[i],
 		 event_id);
   }
 
-  ASSERT(num_egs <= max_egs /* see the declaration of max_egs if this fails */);
+  e->num_requested_event_ids = event_ids_sort_unique(e->requested_event_ids,
+                                                     e->num_requested_event_ids);
+}
+
+//
+// The root event data collects a single set of events:
+// those requested through ENV_EVENTS, as well as every event
+// that the requested metrics depend on. Events that are shared
+// are only counted once, so all of them can be collected
+// in the same set of passes.
+//
+static void init_cupti_event_groups(cupti_event_data_t* e) {
+  ASSERT(e->has_events == true || e->has_metrics == true);
+  msg_verbosef("%s\n", "init_cupti_event_groups_entered");
+
+  init_cupti_requested_event_ids(e);
+  
+  uint32_t num_metric_event_ids =
+    e->metric_data != NULL ?
+    e->metric_data->event_id_offsets[e->metric_data->num_metrics] :
+    0;
+  
+  uint32_t num_event_ids = e->num_requested_event_ids + num_metric_event_ids;
+  
+  CUpti_EventID* event_ids = nvcd_arena_zalloc(e->arena,
+                                               sizeof(event_ids[0]) * (num_event_ids + 1));
+
+  memcpy(&event_ids[0],
+         e->requested_event_ids,
+         sizeof(event_ids[0]) * e->num_requested_event_ids);
+
+  if (num_metric_event_ids > 0) {
+    memcpy(&event_ids[e->num_requested_event_ids],
+           e->metric_data->event_ids,
+           sizeof(event_ids[0]) * num_metric_event_ids);
+  }
+
+  num_event_ids = event_ids_sort_unique(event_ids, num_event_ids);
+
+  msg_verbosef("%" PRIu32 " requested events and %" PRIu32 " metric events "
+               "share %" PRIu32 " unique events\n",
+               e->num_requested_event_ids,
+               num_metric_event_ids,
+               num_event_ids);
+  
+  // an event always fits a group of its own,
+  // so there are never more groups than events
+  uint32_t max_egs = num_event_ids;
+  uint32_t num_egs = 0;
+
+  // CUpti_EventGroup is just a typedef for a pointer
+  CUpti_EventGroup* local_eg_assign =
+    nvcd_arena_zalloc(e->arena, sizeof(local_eg_assign[0]) * (max_egs + 1));
+  
+  for (uint32_t i = 0; i < num_event_ids; ++i) {
+    bool found = find_event_group(e,
+                                  &local_eg_assign[0],
+                                  event_ids[i],
+                                  max_egs,
+                                  &num_egs);
+    ASSERT(found);
+  }
+  
+  ASSERT(num_egs <= max_egs);
 
   if (num_egs == 0) {
     exit_msg(stdout,
@@ -950,6 +1205,8 @@ static void init_cupti_event_groups(cupti_event_data_t* e) {
              "Support can vary between device and compute capability.");
   }
 
+  e->has_events = true;
+  
   fill_event_groups(e, &local_eg_assign[0], num_egs);
 }
 
@@ -962,9 +1219,6 @@ static void init_cupti_event_names(cupti_event_data_t* e) {
     size_t count = 0;
     char** list = env_var_list_read(env_string, &count);
 
-    // Sanity check
-    ASSERT(count < 0x1FF);
-
     if (list != NULL) {
       size_t i = 0;
 
@@ -1017,14 +1271,17 @@ static void init_cupti_event_buffers(cupti_event_data_t* e) {
   ASSERT(e->has_events == true);
   // get instance and event counts for each group
   {
-    e->num_events_per_group = zallocNN(sizeof(e->num_events_per_group[0]) *
-                                       e->num_event_groups);
+    e->num_events_per_group = nvcd_arena_zalloc(e->arena,
+                                                sizeof(e->num_events_per_group[0]) *
+                                                e->num_event_groups);
 
-    e->num_events_read_per_group = zallocNN(sizeof(e->num_events_read_per_group[0]) *
-                                            e->num_event_groups);
+    e->num_events_read_per_group = nvcd_arena_zalloc(e->arena,
+                                                     sizeof(e->num_events_read_per_group[0]) *
+                                                     e->num_event_groups);
     
-    e->num_instances_per_group = zallocNN(sizeof(e->num_instances_per_group[0]) *
-                                          e->num_event_groups);
+    e->num_instances_per_group = nvcd_arena_zalloc(e->arena,
+                                                   sizeof(e->num_instances_per_group[0]) *
+                                                   e->num_event_groups);
 
     for (uint32_t i = 0; i < e->num_event_groups; ++i) {
       // instance count
@@ -1056,8 +1313,9 @@ static void init_cupti_event_buffers(cupti_event_data_t* e) {
   // and allocate the memory.
   // for all groups
   {
-    e->event_id_buffer_offsets = mallocNN(sizeof(e->event_id_buffer_offsets[0]) *
-                                          e->num_event_groups);
+    e->event_id_buffer_offsets = nvcd_arena_malloc(e->arena,
+                                                   sizeof(e->event_id_buffer_offsets[0]) *
+                                                   e->num_event_groups);
     
     e->event_id_buffer_length = 0;
     
@@ -1066,11 +1324,63 @@ static void init_cupti_event_buffers(cupti_event_data_t* e) {
       e->event_id_buffer_length += e->num_events_per_group[i];
     }
 
-    // is meant to be written to after the counter measurements
-    // have been taken.
-    e->event_id_buffer = zallocNN(sizeof(e->event_id_buffer[0]) *
-                                  e->event_id_buffer_length);
+    // cuptiEventGroupReadAllEvents() writes each group's IDs again
+    // when its counters are read, in the same order
+    e->event_id_buffer = nvcd_arena_zalloc(e->arena,
+                                           sizeof(e->event_id_buffer[0]) *
+                                           e->event_id_buffer_length);
+
+    for (uint32_t i = 0; i < e->num_event_groups; ++i) {
+      size_t ids_size = sizeof(e->event_id_buffer[0]) * e->num_events_per_group[i];
+      
+      CUPTI_FN(cuptiEventGroupGetAttribute(e->event_groups[i],
+                                           CUPTI_EVENT_GROUP_ATTR_EVENTS,
+                                           &ids_size,
+                                           &e->event_id_buffer[e->event_id_buffer_offsets[i]]));
+    }
+  }
+
+  // dense indices of the requested events, which are
+  // the rows of counter matrices
+  {
+    e->counter_rows = nvcd_arena_malloc(e->arena,
+                                        sizeof(e->counter_rows[0]) *
+                                        (e->event_id_buffer_length + 1));
+    e->counter_row_events = nvcd_arena_malloc(e->arena,
+                                              sizeof(e->counter_row_events[0]) *
+                                              (e->event_id_buffer_length + 1));
+    e->counter_row_offsets = nvcd_arena_malloc(e->arena,
+                                               sizeof(e->counter_row_offsets[0]) *
+                                               (e->event_id_buffer_length + 1));
     
+    e->num_counter_rows = 0;
+    e->num_counter_values = 0;
+    
+    for (uint32_t i = 0; i < e->num_event_groups; ++i) {
+      uint32_t ib_offset = e->event_id_buffer_offsets[i];
+      
+      for (uint32_t j = 0; j < e->num_events_per_group[i]; ++j) {
+        // the root's groups also hold events that are only
+        // there for the metrics; those aren't reported.
+        bool requested =
+          !e->is_root ||
+          event_ids_contain(e->requested_event_ids,
+                            e->num_requested_event_ids,
+                            e->event_id_buffer[ib_offset + j]);
+        
+        if (requested) {
+          e->counter_rows[ib_offset + j] = e->num_counter_rows;
+          e->counter_row_events[e->num_counter_rows] = e->event_id_buffer[ib_offset + j];
+          e->counter_row_offsets[e->num_counter_rows] = e->num_counter_values;
+          e->num_counter_rows++;
+          e->num_counter_values += e->num_instances_per_group[i];
+        } else {
+          e->counter_rows[ib_offset + j] = CED_COUNTER_ROW_NONE;
+        }
+      }
+    }
+
+    e->counter_row_offsets[e->num_counter_rows] = e->num_counter_values;
   }
   
   // compute offset indices for the event counter buffer,
@@ -1078,7 +1388,8 @@ static void init_cupti_event_buffers(cupti_event_data_t* e) {
   // for all groups
   {
     e->event_counter_buffer_offsets =
-      mallocNN(sizeof(e->event_counter_buffer_offsets[0]) * e->num_event_groups);
+      nvcd_arena_malloc(e->arena,
+                        sizeof(e->event_counter_buffer_offsets[0]) * e->num_event_groups);
     
     e->event_counter_buffer_length = 0;
     
@@ -1097,76 +1408,337 @@ static void init_cupti_event_buffers(cupti_event_data_t* e) {
     }
     
     e->event_counter_buffer =
-      zallocNN(sizeof(e->event_counter_buffer[0]) * e->event_counter_buffer_length);  
+      nvcd_arena_zalloc(e->arena,
+                        sizeof(e->event_counter_buffer[0]) * e->event_counter_buffer_length);  
   }
 }
 
-static const size_t PEG_BUFFER_SZ = 1 << 20;
-static char* _peg_buffer = NULL;
-
-static void print_event_group_soa(cupti_event_data_t* e, uint32_t group) {
-  if (_peg_buffer == NULL) {
-    _peg_buffer = zallocNN(PEG_BUFFER_SZ);
-  }
-  // used for iterative bounds checking
-#define peg_buffer_length PEG_BUFFER_SZ - 1
-  
-  memset(&_peg_buffer[0], 0, PEG_BUFFER_SZ);
-  
-  uint64_t* pcounters = &e->event_counter_buffer[0];
-  
-  uint32_t ib_offset = e->event_id_buffer_offsets[group];
-  uint32_t cb_offset = e->event_counter_buffer_offsets[group];
-  
-  uint32_t nepg = e->num_events_per_group[group];
-  uint32_t nipg = e->num_instances_per_group[group];
+//
+// Pass planning
+//
+// Rather than discovering which groups can be enabled together
+// by trial and error on every kernel invocation, we probe each pair
+// of groups once, color the resulting conflict graph and
+// verify each color class against CUPTI. Each verified class
+// is one pass (i.e., one kernel replay).
+//
 
-  IF_ASSERTS_ENABLED(volatile uint32_t next_cb_offset = 0;
-		     volatile uint32_t next_ib_offset = 0;);
+static inline bool group_enable_incompatible(CUptiResult err) {
+  // see the CUPTI_ERROR_UNKNOWN case in cupti_event_callback()
+  return err == CUPTI_ERROR_NOT_COMPATIBLE || err == CUPTI_ERROR_UNKNOWN;
+}
 
+static void plan_probe_conflicts(cupti_event_data_t* e,
+                                 uint8_t* usable,
+                                 uint8_t* conflicts) {
+  uint32_t n = e->num_event_groups;
 
-  int ptr = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    CUptiResult err = cuptiEventGroupEnable(e->event_groups[i]);
+    
+    usable[i] = err == CUPTI_SUCCESS;
+    
+    if (usable[i]) {
+      CUPTI_FN(cuptiEventGroupDisable(e->event_groups[i]));
+    } else if (err == CUPTI_ERROR_INVALID_PARAMETER) {
+      msg_warnf("Group %" PRIu32 " can't be enabled; it will be skipped\n", i);
+      CUPTI_FN_WARN(err);
+    } else {
+      CUPTI_FN(err);
+    }
+  }
   
-  IF_ASSERTS_ENABLED({
-      // bounds check ordering for
-      // event_counter_buffer_offsets      
-      volatile uint32_t prev_cb_offset = (group > 0) ?
+  for (uint32_t i = 0; i < n; ++i) {
+    if (usable[i]) {
+      CUPTI_FN(cuptiEventGroupEnable(e->event_groups[i]));
       
-	e->event_counter_buffer_offsets[group - 1] :
-	0;
+      for (uint32_t j = i + 1; j < n; ++j) {
+        if (usable[j]) {
+          CUptiResult err = cuptiEventGroupEnable(e->event_groups[j]);
+
+          if (err == CUPTI_SUCCESS) {
+            CUPTI_FN(cuptiEventGroupDisable(e->event_groups[j]));
+          } else if (group_enable_incompatible(err)) {
+            conflicts[i * n + j] = conflicts[j * n + i] = 1;
+          } else {
+            CUPTI_FN(err);
+          }
+        }
+      }
+      
+      CUPTI_FN(cuptiEventGroupDisable(e->event_groups[i]));
+    }
+  }
+}
 
-      volatile uint32_t prev_cb_offset_add = (group > 0) ?
+// DSatur: repeatedly color the uncolored group with the most
+// distinctly colored neighbors (ties broken by degree), using the
+// smallest color none of its neighbors have.
+NVCD_EXPORT uint32_t cupti_color_conflict_graph(nvcd_arena_t* arena,
+                                                uint32_t n,
+                                                const uint8_t* usable,
+                                                const uint8_t* conflicts,
+                                                uint32_t* colors) {
+  uint32_t num_colors = 0;
+  uint32_t num_usable = 0;
+  
+  uint32_t* degree = nvcd_arena_zalloc(arena, sizeof(degree[0]) * n);
+  uint8_t* seen = nvcd_arena_zalloc(arena, sizeof(seen[0]) * (n + 1));
+
+  for (uint32_t i = 0; i < n; ++i) {
+    colors[i] = UINT32_MAX;
+    
+    if (usable[i]) {
+      num_usable++;
+      
+      for (uint32_t j = 0; j < n; ++j) {
+        degree[i] += conflicts[i * n + j];
+      }
+    }
+  }
 
-	(e->num_events_per_group[group - 1] *
-	 e->num_instances_per_group[group - 1]) :
-	0;
+  for (uint32_t step = 0; step < num_usable; ++step) {
+    uint32_t best = UINT32_MAX;
+    uint32_t best_sat = 0;
+    
+    for (uint32_t i = 0; i < n; ++i) {
+      if (usable[i] && colors[i] == UINT32_MAX) {
+        ZERO_MEM(seen, num_colors);
+        
+        uint32_t sat = 0;
+        
+        for (uint32_t j = 0; j < n; ++j) {
+          if (conflicts[i * n + j] && colors[j] != UINT32_MAX && !seen[colors[j]]) {
+            seen[colors[j]] = 1;
+            sat++;
+          }
+        }
 
-      ASSERT(prev_cb_offset + prev_cb_offset_add == cb_offset);
+        if (best == UINT32_MAX ||
+            sat > best_sat ||
+            (sat == best_sat && degree[i] > degree[best])) {
+          best = i;
+          best_sat = sat;
+        }
+      }
     }
 
-    {    
-      // bounds check ordering for
-      // event_id_buffer_offsets
-      volatile uint32_t prev_ib_offset = (group > 0) ?
+    ASSERT(best != UINT32_MAX);
+    
+    ZERO_MEM(seen, num_colors + 1);
+    
+    for (uint32_t j = 0; j < n; ++j) {
+      if (conflicts[best * n + j] && colors[j] != UINT32_MAX) {
+        seen[colors[j]] = 1;
+      }
+    }
 
-	e->event_id_buffer_offsets[group - 1] :
-	0;
+    uint32_t c = 0;
+    while (seen[c]) {
+      c++;
+    }
 
-      volatile uint32_t prev_ib_offset_add = (group > 0) ?
-      
-	e->num_events_per_group[group - 1] :
-	0;
+    colors[best] = c;
 
-      ASSERT(prev_ib_offset + prev_ib_offset_add == ib_offset);
+    if (c == num_colors) {
+      num_colors++;
     }
+  }
 
-    {
-      // used for iterative bounds checking
-      next_cb_offset =
-	group < (e->num_event_groups - 1) ?
-	e->event_counter_buffer_offsets[group + 1] :
-	e->event_counter_buffer_length;
-    }
+  // DSatur isn't always better than coloring the groups in order, which
+  // is what launches did before passes were planned; keep whichever
+  // needs fewer passes
+  uint32_t* in_order = nvcd_arena_malloc(arena, sizeof(in_order[0]) * n);
+  uint32_t num_in_order = 0;
+
+  for (uint32_t i = 0; i < n; ++i) {
+    in_order[i] = UINT32_MAX;
+    
+    if (usable[i]) {
+      ZERO_MEM(seen, num_in_order + 1);
+      
+      for (uint32_t j = 0; j < i; ++j) {
+        if (conflicts[i * n + j] && in_order[j] != UINT32_MAX) {
+          seen[in_order[j]] = 1;
+        }
+      }
+
+      uint32_t c = 0;
+      while (seen[c]) {
+        c++;
+      }
+
+      in_order[i] = c;
+
+      if (c == num_in_order) {
+        num_in_order++;
+      }
+    }
+  }
+
+  if (num_in_order < num_colors) {
+    memcpy(colors, in_order, sizeof(colors[0]) * n);
+    num_colors = num_in_order;
+  }
+
+  return num_colors;
+}
+
+static void plan_event_group_passes(cupti_event_data_t* e) {
+  uint32_t n = e->num_event_groups;
+
+  uint8_t* usable = nvcd_arena_zalloc(e->arena, sizeof(usable[0]) * n);
+  uint8_t* conflicts = nvcd_arena_zalloc(e->arena, sizeof(conflicts[0]) * n * n);
+  uint32_t* colors = nvcd_arena_zalloc(e->arena, sizeof(colors[0]) * n);
+  
+  // candidates for the pass currently being verified:
+  // groups carried over from the previous pass, followed
+  // by the groups of the current color.
+  uint32_t* candidates = nvcd_arena_zalloc(e->arena, sizeof(candidates[0]) * n);
+  uint32_t* carried = nvcd_arena_zalloc(e->arena, sizeof(carried[0]) * n);
+  uint32_t num_carried = 0;
+
+  e->pass_groups = nvcd_arena_zalloc(e->arena, sizeof(e->pass_groups[0]) * n);
+  e->pass_offsets = nvcd_arena_zalloc(e->arena, sizeof(e->pass_offsets[0]) * (n + 1));
+  e->num_passes = 0;
+  e->current_pass = 0;
+  
+  plan_probe_conflicts(e, usable, conflicts);
+
+  uint32_t num_colors = cupti_color_conflict_graph(e->arena, n, usable, conflicts, colors);
+
+  uint32_t num_planned = 0;
+  uint32_t color = 0;
+  
+  // Pairwise compatibility doesn't imply that a whole color class
+  // can be enabled at once (e.g., counter capacity within a domain),
+  // so each pass is verified. Groups that don't fit are carried over
+  // to the next pass.
+  while (color < num_colors || num_carried > 0) {
+    uint32_t num_candidates = 0;
+
+    if (color < num_colors) {
+      for (uint32_t i = 0; i < n; ++i) {
+        if (usable[i] && colors[i] == color) {
+          candidates[num_candidates++] = i;
+        }
+      }
+    }
+
+    memcpy(&candidates[num_candidates], carried, sizeof(carried[0]) * num_carried);
+    num_candidates += num_carried;
+    num_carried = 0;
+
+    uint32_t pass_begin = num_planned;
+    
+    for (uint32_t k = 0; k < num_candidates; ++k) {
+      uint32_t g = candidates[k];
+      CUptiResult err = cuptiEventGroupEnable(e->event_groups[g]);
+
+      if (err == CUPTI_SUCCESS) {
+        e->pass_groups[num_planned++] = g;
+      } else if (group_enable_incompatible(err)) {
+        carried[num_carried++] = g;
+      } else {
+        CUPTI_FN(err);
+      }
+    }
+
+    for (uint32_t k = pass_begin; k < num_planned; ++k) {
+      CUPTI_FN(cuptiEventGroupDisable(e->event_groups[e->pass_groups[k]]));
+    }
+
+    // every group can be enabled by itself, so
+    // the first candidate always succeeds.
+    ASSERT(num_planned > pass_begin);
+    
+    e->pass_offsets[e->num_passes] = pass_begin;
+    e->num_passes++;
+    color++;
+  }
+
+  e->pass_offsets[e->num_passes] = num_planned;
+
+  for (uint32_t i = 0; i < n; ++i) {
+    if (!usable[i]) {
+      e->pass_groups[num_planned++] = i;
+    }
+  }
+
+  ASSERT(num_planned == n);
+
+  msg_verbosef("%" PRIu32 " event groups planned for %" PRIu32 " passes (%" PRIu32 " colors)\n",
+               n,
+               e->num_passes,
+               num_colors);
+}
+
+static const size_t PEG_BUFFER_SZ = 1 << 20;
+static NVCD_THREAD_LOCAL char* _peg_buffer = NULL;
+
+static void print_event_group_soa(cupti_event_data_t* e, uint32_t group) {
+  if (_peg_buffer == NULL) {
+    _peg_buffer = zallocNN(PEG_BUFFER_SZ);
+  }
+  // used for iterative bounds checking
+#define peg_buffer_length PEG_BUFFER_SZ - 1
+  
+  memset(&_peg_buffer[0], 0, PEG_BUFFER_SZ);
+  
+  uint64_t* pcounters = &e->event_counter_buffer[0];
+  
+  uint32_t ib_offset = e->event_id_buffer_offsets[group];
+  uint32_t cb_offset = e->event_counter_buffer_offsets[group];
+  
+  uint32_t nepg = e->num_events_per_group[group];
+  uint32_t nipg = e->num_instances_per_group[group];
+
+  IF_ASSERTS_ENABLED(volatile uint32_t next_cb_offset = 0;
+		     volatile uint32_t next_ib_offset = 0;);
+
+
+  int ptr = 0;
+  
+  IF_ASSERTS_ENABLED({
+      // bounds check ordering for
+      // event_counter_buffer_offsets      
+      volatile uint32_t prev_cb_offset = (group > 0) ?
+      
+	e->event_counter_buffer_offsets[group - 1] :
+	0;
+
+      volatile uint32_t prev_cb_offset_add = (group > 0) ?
+
+	(e->num_events_per_group[group - 1] *
+	 e->num_instances_per_group[group - 1]) :
+	0;
+
+      ASSERT(prev_cb_offset + prev_cb_offset_add == cb_offset);
+    }
+
+    {    
+      // bounds check ordering for
+      // event_id_buffer_offsets
+      volatile uint32_t prev_ib_offset = (group > 0) ?
+
+	e->event_id_buffer_offsets[group - 1] :
+	0;
+
+      volatile uint32_t prev_ib_offset_add = (group > 0) ?
+      
+	e->num_events_per_group[group - 1] :
+	0;
+
+      ASSERT(prev_ib_offset + prev_ib_offset_add == ib_offset);
+    }
+
+    {
+      // used for iterative bounds checking
+      next_cb_offset =
+	group < (e->num_event_groups - 1) ?
+	e->event_counter_buffer_offsets[group + 1] :
+	e->event_counter_buffer_length;
+    }
   
     {
       // used for iterative bounds checking
@@ -1182,17 +1754,11 @@ static void print_event_group_soa(cupti_event_data_t* e, uint32_t group) {
 
     CUpti_EventID eid = e->event_id_buffer[ib_offset + i];
     
-    {
-      char* name = cupti_event_get_name(eid);
-      
-      ptr += sprintf(&_peg_buffer[ptr],
-                     "event[%" PRIu32 "](id = 0x%" PRIx32 ", name = %s)\n",
-                     i,
-                     eid,
-                     name);
-
-      free(name);
-    }
+    ptr += sprintf(&_peg_buffer[ptr],
+                   "event[%" PRIu32 "](id = 0x%" PRIx32 ", name = %s)\n",
+                   i,
+                   eid,
+                   cupti_event_data_event_name(e, eid));
     
     for (uint32_t j = 0; j < nipg; ++j) {
       uint32_t k = cb_offset + j * nepg + i;
@@ -1225,7 +1791,7 @@ static void print_event_group_aos(cupti_event_data_t* e, uint32_t group) {
   msg_verbosef("======(AOS) GROUP %" PRIu32  "=======\n", group);
   
   for (uint32_t i = 0; i < info->num_events; ++i){
-    char* name = cupti_event_get_name(info->events[i]);
+    const char* name = cupti_event_data_event_name(e, info->events[i]);
 
     msg_verbosef("[%" PRIu32 "] %s\n", i, name);
     
@@ -1234,8 +1800,6 @@ static void print_event_group_aos(cupti_event_data_t* e, uint32_t group) {
 		   j,
 		   info->counters[i * info->num_instances + j]);
     }
-
-    free(name);
   }
 
   msg_verboses("===");
@@ -1265,7 +1829,7 @@ NVCD_EXPORT void cupti_report_event_data(cupti_event_data_t* e) {
     ASSERT(e->metric_data != NULL);
     
     for (uint32_t i = 0; i < e->metric_data->num_metrics; ++i) {
-      print_cupti_metric(e->metric_data, i);
+      print_cupti_metric(e, i);
     }    
   }
   else {
@@ -1273,60 +1837,237 @@ NVCD_EXPORT void cupti_report_event_data(cupti_event_data_t* e) {
   }
 }
 
-static void collect_group_events(cupti_event_data_t* e) {
-  for (uint32_t i = 0; i < e->num_event_groups; ++i) {
-    if (e->event_group_read_states[i] == CED_EVENT_GROUP_UNREAD) {
-      read_group_all_events(e, i);
+static inline void read_group(cupti_event_data_t* e, uint32_t i) {
+  read_group_all_events(e, i);
 
-      if (g_process_group_aos) {
-        read_group_per_event(e, i);
-        group_info_validate(e,
-                            &g_group_info_buffer[i],
-                            i);
-      }
-    }
+  if (g_process_group_aos) {
+    read_group_per_event(e, i);
+    group_info_validate(e,
+                        &g_group_info_buffer[i],
+                        i);
   }
+}
 
-  // errornous groups;
-  // These were never enabled, and the errors they triggered
-  // don't have anything to do with compatibility with other enabled groups.
-  // So, they don't need to be disabled by cupti. Increment is still
-  // necessary for the host to be aware that profiling the kernel is finished.
-  for (uint32_t i = 0; i < e->num_event_groups; ++i) {
-    if (e->event_group_read_states[i] == CED_EVENT_GROUP_SKIP) {
-      e->event_group_read_states[i] = CED_EVENT_GROUP_READ;
-      e->count_event_groups_read++;     
+// Enables the groups of the current planned pass. Every pass
+// has been verified by plan_event_group_passes(), so there's
+// no need to handle incompatibility here.
+static void enable_planned_pass(cupti_event_data_t* e) {
+  uint32_t begin = e->pass_offsets[e->current_pass];
+  uint32_t end = e->pass_offsets[e->current_pass + 1];
+
+  uint64_t* unread = cupti_event_group_states(e, CED_EVENT_GROUP_UNREAD);
+  uint64_t* enabled = cupti_event_group_states(e, CED_EVENT_GROUP_ENABLED);
+
+  for (uint32_t k = begin; k < end; ++k) {
+    uint32_t g = e->pass_groups[k];
+
+    ASSERT(bitset_test(unread, g));
+    
+    CUPTI_FN(cuptiEventGroupEnable(e->event_groups[g]));
+    bitset_set(enabled, g);
+  }
+
+  msg_verbosef("Pass %" PRIu32 " of %" PRIu32 ": %" PRIu32 " groups enabled.\n",
+               e->current_pass + 1,
+               e->num_passes,
+               end - begin);
+}
+
+// Reads the groups of the given pass, once its kernel has finished.
+static void read_planned_pass(cupti_event_data_t* e, uint32_t pass) {
+  uint32_t begin = e->pass_offsets[pass];
+  uint32_t end = e->pass_offsets[pass + 1];
+
+  uint64_t* enabled = cupti_event_group_states(e, CED_EVENT_GROUP_ENABLED);
+
+  for (uint32_t k = begin; k < end; ++k) {
+    uint32_t g = e->pass_groups[k];
+    
+    read_group(e, g);
+
+    bitset_clear(enabled, g);
+    CUPTI_FN(cuptiEventGroupDisable(e->event_groups[g]));
+  }
+}
+
+// Counts the groups of the current pass as read, and moves on to
+// the next one. The groups themselves are read by read_planned_pass(),
+// which may happen later.
+static void finish_planned_pass(cupti_event_data_t* e) {
+  uint32_t begin = e->pass_offsets[e->current_pass];
+  uint32_t end = e->pass_offsets[e->current_pass + 1];
+
+  uint64_t* unread = cupti_event_group_states(e, CED_EVENT_GROUP_UNREAD);
+  uint64_t* read = cupti_event_group_states(e, CED_EVENT_GROUP_READ);
+
+  for (uint32_t k = begin; k < end; ++k) {
+    uint32_t g = e->pass_groups[k];
+
+    bitset_clear(unread, g);
+    bitset_set(read, g);
+  }
+
+  e->count_event_groups_read += end - begin;
+
+  // groups which couldn't be enabled by themselves during planning
+  // are stored after the last pass. As with CED_EVENT_GROUP_SKIP,
+  // they're counted as read so the host knows when we're done.
+  if (e->current_pass == 0) {
+    for (uint32_t k = e->pass_offsets[e->num_passes];
+         k < e->num_event_groups;
+         ++k) {
+      bitset_clear(unread, e->pass_groups[k]);
+      bitset_set(read, e->pass_groups[k]);
     }
+
+    e->count_event_groups_read += e->num_event_groups - e->pass_offsets[e->num_passes];
   }
 
+  e->current_pass++;
+}
+
+static inline bool has_planned_pass(cupti_event_data_t* e) {
+  return e->current_pass < e->num_passes;
+}
+
+// The groups' states are updated a word (64 groups) at a time.
+static void collect_group_events(cupti_event_data_t* e) {
+  uint64_t* unread = cupti_event_group_states(e, CED_EVENT_GROUP_UNREAD);
+  uint64_t* read = cupti_event_group_states(e, CED_EVENT_GROUP_READ);
+  uint64_t* dont_read = cupti_event_group_states(e, CED_EVENT_GROUP_DONT_READ);
+  uint64_t* skip = cupti_event_group_states(e, CED_EVENT_GROUP_SKIP);
+  uint64_t* enabled = cupti_event_group_states(e, CED_EVENT_GROUP_ENABLED);
+  
+  BITSET_FOR_EACH(unread, e->num_event_group_words, i) {
+    read_group(e, i);
+  }
 
   // Groups which we've read for this particular callback instance
-  for (uint32_t i = 0; i < e->num_event_groups; ++i) {
-    if (e->event_group_read_states[i] == CED_EVENT_GROUP_UNREAD) {
-      e->event_group_read_states[i] = CED_EVENT_GROUP_READ;
-      e->count_event_groups_read++;
+  BITSET_FOR_EACH(unread, e->num_event_group_words, i) {
+    CUPTI_FN(cuptiEventGroupDisable(e->event_groups[i]));
+  }
 
-      e->event_groups_enabled[i] = false;
-      CUPTI_FN(cuptiEventGroupDisable(e->event_groups[i]));
-    }
+  for (uint32_t w = 0; w < e->num_event_group_words; ++w) {
+    // errornous groups;
+    // These were never enabled, and the errors they triggered
+    // don't have anything to do with compatibility with other enabled groups.
+    // So, they don't need to be disabled by cupti. Counting them as read is still
+    // necessary for the host to be aware that profiling the kernel is finished.
+    uint64_t done = unread[w] | skip[w];
+    
+    read[w] |= done;
+    enabled[w] &= ~unread[w];
+    e->count_event_groups_read += (uint32_t) __builtin_popcountll(done);
+
+    // Groups which we haven't read yet, but weren't compatible
+    // with the ones already enabled. Some of these may have returned
+    // CUPTI_ERROR_UNKNOWN instead of CUPTI_ERROR_NOT_COMPATIBLE. SO far,
+    // when this happens it appears to be the same kind of problem, just a 
+    // different error code is used (for whatever reason). There hasn't been a situation
+    // yet where these groups in particular weren't later enabled.
+    unread[w] = dont_read[w];
+    dont_read[w] = 0;
+    skip[w] = 0;
   }
+}
 
-  // Groups which we haven't read yet, but weren't compatible
-  // with the ones already enabled. Some of these may have returned
-  // CUPTI_ERROR_UNKNOWN instead of CUPTI_ERROR_NOT_COMPATIBLE. SO far,
-  // when this happens it appears to be the same kind of problem, just a 
-  // different error code is used (for whatever reason). There hasn't been a situation
-  // yet where these groups in particular weren't later enabled.
-  for (uint32_t i = 0; i < e->num_event_groups; ++i) {
-    if (e->event_group_read_states[i] == CED_EVENT_GROUP_DONT_READ) {
-      e->event_group_read_states[i] = CED_EVENT_GROUP_UNREAD;
-    }
+
+static volatile bool _error_unknown_reported = false;
+
+//
+// CUPTI only allows one subscriber per process, so every thread
+// shares this one. Runtime API callbacks are invoked on the thread
+// which made the call, so each thread's active event data
+// is kept in thread local storage, and the callback dispatches to it.
+// Launches made by threads that aren't currently profiling are ignored.
+//
+static CUpti_SubscriberHandle g_subscriber = NULL;
+static pthread_mutex_t g_subscriber_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static NVCD_THREAD_LOCAL cupti_event_data_t* t_active_event_data = NULL;
+
+//
+// With stream_sync, kernel boundaries are recorded as CUDA events
+// in the kernel's stream. Since collection is done in kernel mode,
+// only the profiled kernel contributes to the counters, so there's
+// no need to wait on (or serialize) work in other streams.
+//
+// The callback doesn't wait for the end of a planned pass's kernel
+// either: the pass is left pending, and cupti_event_data_collect()
+// reads it once the counters are needed, by which time the kernel
+// has usually finished.
+//
+static void stage_begin_stream(cupti_event_data_t* e) {
+  if (e->stage_event_start == NULL) {
+    CUDA_RUNTIME_FN(cudaEventCreate((cudaEvent_t*) &e->stage_event_start));
+    CUDA_RUNTIME_FN(cudaEventCreate((cudaEvent_t*) &e->stage_event_end));
+  }
+
+  CUDA_RUNTIME_FN(cudaEventRecord((cudaEvent_t) e->stage_event_start,
+                                  (cudaStream_t) e->cuda_stream));
+}
+
+static void stage_end_stream(cupti_event_data_t* e) {
+  CUDA_RUNTIME_FN(cudaEventRecord((cudaEvent_t) e->stage_event_end,
+                                  (cudaStream_t) e->cuda_stream));
+}
+
+static bool stage_stream_done(cupti_event_data_t* e) {
+  cudaError_t err = cudaEventQuery((cudaEvent_t) e->stage_event_end);
+
+  if (err == cudaErrorNotReady) {
+    return false;
+  }
+
+  CUDA_RUNTIME_FN(err);
+
+  return true;
+}
+
+// returns the kernel's run time
+static uint64_t stage_wait_stream(cupti_event_data_t* e) {
+  float msec = 0.0f;
+  
+  // the counters can't be read until the kernel has finished
+  if (!stage_stream_done(e)) {
+    CUDA_RUNTIME_FN(cudaEventSynchronize((cudaEvent_t) e->stage_event_end));
   }
+
+  CUDA_RUNTIME_FN(cudaEventElapsedTime(&msec,
+                                       (cudaEvent_t) e->stage_event_start,
+                                       (cudaEvent_t) e->stage_event_end));
+
+  return (uint64_t) ((double) msec * 1e6);
+}
+
+static void add_kernel_time(cupti_event_data_t* e, uint64_t kernel_time) {
+  MAYBE_GROW_BUFFER_U32_NN(e->kernel_times_nsec,
+                           e->num_kernel_times,
+                           e->kernel_times_nsec_buffer_length);
+
+  e->kernel_times_nsec[e->num_kernel_times] = kernel_time;
+
+  e->num_kernel_times++;
 }
 
+NVCD_EXPORT void cupti_event_data_collect(cupti_event_data_t* e) {
+  ASSERT(e != NULL);
+  
+  if (e->pending_pass != CED_PASS_NONE) {
+    uint32_t pass = e->pending_pass;
 
-static bool _message_reported = false;
-static bool _error_unknown_reported = false;
+    e->pending_pass = CED_PASS_NONE;
+    
+    add_kernel_time(e, stage_wait_stream(e));
+    read_planned_pass(e, pass);
+  }
+}
+
+NVCD_EXPORT bool cupti_event_data_running(cupti_event_data_t* e) {
+  ASSERT(e != NULL);
+  
+  return e->pending_pass != CED_PASS_NONE && !stage_stream_done(e);
+}
 
 NVCD_EXPORT void CUPTIAPI cupti_event_callback(void* userdata,
                                                CUpti_CallbackDomain domain,
@@ -1344,41 +2085,27 @@ NVCD_EXPORT void CUPTIAPI cupti_event_callback(void* userdata,
     ASSERT(found);
   }
 
-  cupti_event_data_t* event_data = (cupti_event_data_t*) userdata;
+  // userdata is unused; see g_subscriber
+  cupti_event_data_t* event_data = t_active_event_data;
 
-  msg_verbosef("[cupti_event_callback] for event_data = %p\n", event_data);
+  if (event_data == NULL) {
+    return;
+  }
   
-  // For now it appears that the threads are the same between the main thread
-  // and the thread this callback is installed in. The check is important though
-  // since this could technically change. Some might consider this pedantic, but non-thread-safe
-  // event handlers with user pointer data are a thing, and device synchronization waits
-  // can obviously happen across multiple threads.  
-  {
-    event_data->thread_event_callback = pthread_self();
-    
-    volatile int threads_eq = pthread_equal(event_data->thread_event_callback,
-                                            event_data->thread_event_data_init);
+  msg_verbosef("[cupti_event_callback] for event_data = %p\n", event_data);
 
-    if (threads_eq != 0) {
-      if (!_message_reported) {
-        msg_verbosef("%s is launched on the same thread as the main thread (this is good)\n", __FUNC__);
-        _message_reported = true;
-      }
-    } else {
-      exit_msg(stdout,
-               ERACE_CONDITION,
-               "Race condition detected in %s. "
-               "Synchronization primitives will be needed for "
-               "nvcd_host_begin() caller's thread wait loop and "
-               "the thread for this callback.\n", __FUNC__);
-    }
-  }
+  event_data->thread_event_callback = pthread_self();
 
   // actual event handling
   {
     switch (callback_info->callbackSite) {
     case CUPTI_API_ENTER: {
-      CUDA_RUNTIME_FN(cudaDeviceSynchronize());
+      // the previous pass's groups are still enabled
+      cupti_event_data_collect(event_data);
+      
+      if (!event_data->stream_sync) {
+        CUDA_RUNTIME_FN(cudaDeviceSynchronize());
+      }
 
       CUPTI_FN(cuptiSetEventCollectionMode(callback_info->context,
                                            CUPTI_EVENT_COLLECTION_MODE_KERNEL));
@@ -1393,15 +2120,28 @@ NVCD_EXPORT void CUPTIAPI cupti_event_callback(void* userdata,
       // The state tracking is handled in this loop,
       // as well as in collect_group_events()
       //
+      // Normally, the groups for each invocation are chosen ahead of time
+      // by plan_event_group_passes(), and the loop below is only a fallback
+      // for groups left over once the plan has been exhausted.
+      //
 
-      for (uint32_t i = 0; i < event_data->num_event_groups; ++i) {
-        if (event_data->event_group_read_states[i] == CED_EVENT_GROUP_UNREAD) {
+      if (has_planned_pass(event_data)) {
+        enable_planned_pass(event_data);
+      } else {
+        uint64_t* unread = cupti_event_group_states(event_data, CED_EVENT_GROUP_UNREAD);
+        uint64_t* dont_read = cupti_event_group_states(event_data, CED_EVENT_GROUP_DONT_READ);
+        uint64_t* skip = cupti_event_group_states(event_data, CED_EVENT_GROUP_SKIP);
+        uint64_t* enabled = cupti_event_group_states(event_data, CED_EVENT_GROUP_ENABLED);
+        
+        // groups leave the unread set as they're visited,
+        // which bitset_next() doesn't mind
+        BITSET_FOR_EACH(unread, event_data->num_event_group_words, i) {
           ASSERT(event_data->event_groups[i] != NULL);
-          
+        
           CUptiResult err = cuptiEventGroupEnable(event_data->event_groups[i]);
 
           msg_verbosef("Enabling Group %" PRIu32 " = %p....\n", i, event_data->event_groups[i]);
-          
+        
           if (err != CUPTI_SUCCESS) {
             if (err == CUPTI_ERROR_NOT_COMPATIBLE) {
               msg_verbosef("Group %" PRIu32 " out of "
@@ -1409,7 +2149,8 @@ NVCD_EXPORT void CUPTIAPI cupti_event_callback(void* userdata,
 			   i,
 			   event_data->num_event_groups);
 
-              event_data->event_group_read_states[i] = CED_EVENT_GROUP_DONT_READ;
+              bitset_clear(unread, i);
+              bitset_set(dont_read, i);
             } else if (err == CUPTI_ERROR_INVALID_PARAMETER) {
               // This issue (so far) will only occurr if the amount of groups
               // is only one for an event batch. The docs state
@@ -1421,9 +2162,10 @@ NVCD_EXPORT void CUPTIAPI cupti_event_callback(void* userdata,
               // At this point, error has only occurred on xsede's pascal 100 node
               // a GTX 960 M. 
               ASSERT(event_data->subscriber != NULL);
-              
+            
               msg_warns("BAD_GROUP found");
-              event_data->event_group_read_states[i] = CED_EVENT_GROUP_SKIP;
+              bitset_clear(unread, i);
+              bitset_set(skip, i);
               CUPTI_FN_WARN(err);
             } else if (err == CUPTI_ERROR_UNKNOWN) {
               // This has been known to happen on Lassen, so far when BENCH_EVENTS=ALL is specified.
@@ -1434,7 +2176,8 @@ NVCD_EXPORT void CUPTIAPI cupti_event_callback(void* userdata,
               // returned when we try to enable an incompatible group with others. Otherwise, we DO run the risk
               // of an infinite loop, since we need the group counter to be incremented, and this is only bumped
               // when a group has been read or explicitly marked skipped.
-              event_data->event_group_read_states[i] = CED_EVENT_GROUP_DONT_READ;
+              bitset_clear(unread, i);
+              bitset_set(dont_read, i);
               if (!_error_unknown_reported) {
                 msg_warns("UNKNOWN ERROR produced when group was attempted to be added. Skipping");
                 _error_unknown_reported = true;
@@ -1444,33 +2187,56 @@ NVCD_EXPORT void CUPTIAPI cupti_event_callback(void* userdata,
               CUPTI_FN(err);
             }
           } else {
-            event_data->event_groups_enabled[i] = true;
+            bitset_set(enabled, i);
             msg_verbosef("Group %" PRIu32 " enabled.\n", i);
           }
         }
       }
 
-      CUPTI_FN(cuptiDeviceGetTimestamp(callback_info->context,
-                                       &event_data->stage_time_nsec_start));
+      if (event_data->stream_sync) {
+        stage_begin_stream(event_data);
+      } else {
+        CUPTI_FN(cuptiDeviceGetTimestamp(callback_info->context,
+                                         &event_data->stage_time_nsec_start));
+      }
     } break;
 
     case CUPTI_API_EXIT: {
-      size_t finish_time = 0;
+      if (event_data->stream_sync && has_planned_pass(event_data)) {
+        // the kernel is left to run, and the
+        // pass is read by cupti_event_data_collect()
+        stage_end_stream(event_data);
+        
+        event_data->pending_pass = event_data->current_pass;
+        finish_planned_pass(event_data);
+        break;
+      }
       
-      CUDA_RUNTIME_FN(cudaDeviceSynchronize());
-      CUPTI_FN(cuptiDeviceGetTimestamp(callback_info->context,
-                                       &finish_time));
+      uint64_t kernel_time = 0;
 
-      collect_group_events(event_data);
+      if (event_data->stream_sync) {
+        // groups left over once the plan has been
+        // exhausted are read right away
+        stage_end_stream(event_data);
+        kernel_time = stage_wait_stream(event_data);
+      } else {
+        uint64_t finish_time = 0;
+        
+        CUDA_RUNTIME_FN(cudaDeviceSynchronize());
+        CUPTI_FN(cuptiDeviceGetTimestamp(callback_info->context,
+                                         &finish_time));
 
-      MAYBE_GROW_BUFFER_U32_NN(event_data->kernel_times_nsec,
-                               event_data->num_kernel_times,
-                               event_data->kernel_times_nsec_buffer_length);
+        kernel_time = finish_time - event_data->stage_time_nsec_start;
+      }
 
-      event_data->kernel_times_nsec[event_data->num_kernel_times] =
-        finish_time - event_data->stage_time_nsec_start;
+      if (has_planned_pass(event_data)) {
+        read_planned_pass(event_data, event_data->current_pass);
+        finish_planned_pass(event_data);
+      } else {
+        collect_group_events(event_data);
+      }
 
-      event_data->num_kernel_times++;
+      add_kernel_time(event_data, kernel_time);
     } break;
 
     default:
@@ -1480,41 +2246,74 @@ NVCD_EXPORT void CUPTIAPI cupti_event_callback(void* userdata,
   }
 }
 
-static inline void cupti_event_data_subscribe_callbacks(cupti_event_data_t* e, bool enable) {
-  uint32_t u32e = (uint32_t) enable;
-  ASSERT(u32e == 0 || u32e == 1);
+static void cupti_subscriber_init() {
+  if (__atomic_load_n(&g_subscriber, __ATOMIC_ACQUIRE) == NULL) {
+    C_ASSERT(pthread_mutex_lock(&g_subscriber_lock) == 0);
+
+    if (g_subscriber == NULL) {
+      CUpti_SubscriberHandle subscriber = NULL;
+      
+      CUPTI_FN(cuptiSubscribe(&subscriber,
+                              (CUpti_CallbackFunc)cupti_event_callback,
+                              NULL));
+
+      // callbacks stay enabled until cupti_subscriber_terminate();
+      // they're ignored by threads which aren't profiling.
+      for (uint32_t i = 0; i < NUM_CUPTI_RUNTIME_CBIDS; ++i) {
+        CUPTI_FN(cuptiEnableCallback(1,
+                                     subscriber,
+                                     CUPTI_CB_DOMAIN_RUNTIME_API,
+                                     g_cupti_runtime_cbids[i]));
+      }
+      
+      __atomic_store_n(&g_subscriber, subscriber, __ATOMIC_RELEASE);
+    }
+    
+    C_ASSERT(pthread_mutex_unlock(&g_subscriber_lock) == 0);
+  }
+}
+
+NVCD_EXPORT void cupti_subscriber_terminate() {
+  C_ASSERT(pthread_mutex_lock(&g_subscriber_lock) == 0);
   
-  for (uint32_t i = 0; i < NUM_CUPTI_RUNTIME_CBIDS; ++i) {
-    CUPTI_FN(cuptiEnableCallback(u32e,
-                                 e->subscriber,
-                                 CUPTI_CB_DOMAIN_RUNTIME_API,
-                                 g_cupti_runtime_cbids[i]));
+  if (g_subscriber != NULL) {
+    for (uint32_t i = 0; i < NUM_CUPTI_RUNTIME_CBIDS; ++i) {
+      CUPTI_FN(cuptiEnableCallback(0,
+                                   g_subscriber,
+                                   CUPTI_CB_DOMAIN_RUNTIME_API,
+                                   g_cupti_runtime_cbids[i]));
+    }
+    
+    CUPTI_FN(cuptiUnsubscribe(g_subscriber));
+
+    __atomic_store_n(&g_subscriber, NULL, __ATOMIC_RELEASE);
   }
+  
+  C_ASSERT(pthread_mutex_unlock(&g_subscriber_lock) == 0);
 }
 
 NVCD_EXPORT void cupti_event_data_subscribe(cupti_event_data_t* e) {
   ASSERT(e != NULL
-         /*&& e->subscriber == NULL*/
+         && e->subscriber == NULL
          && e->initialized);
+  ASSERT(t_active_event_data == NULL /* one event data per thread at a time */);
 
-  if (e->subscriber == NULL) {
-    CUPTI_FN(cuptiSubscribe(&e->subscriber,
-                            (CUpti_CallbackFunc)cupti_event_callback,
-                            (void*) e));
-  
-  }
+  cupti_subscriber_init();
 
-  cupti_event_data_subscribe_callbacks(e, true);
+  e->subscriber = g_subscriber;
+  
+  t_active_event_data = e;
 }
 
 NVCD_EXPORT void cupti_event_data_unsubscribe(cupti_event_data_t* e) {
   ASSERT(e != NULL && e->initialized && e->subscriber != NULL);
+  ASSERT(t_active_event_data == e);
 
-  cupti_event_data_subscribe_callbacks(e, false);
+  t_active_event_data = NULL;
 
-  CUPTI_FN(cuptiUnsubscribe(e->subscriber));
-  //
-  //  e->subscriber = NULL;
+  // the shared subscriber is kept; this only marks
+  // the event data as no longer being collected.
+  e->subscriber = NULL;
 }
 
 static inline void __cupti_event_data_init_base(cupti_event_data_t* e) {
@@ -1526,6 +2325,137 @@ static inline void __cupti_event_data_init_base(cupti_event_data_t* e) {
 				  e->kernel_times_nsec_buffer_length);
 
   init_cupti_event_buffers(e);
+
+  if (e->metric_data != NULL) {
+    e->metric_data->normalized_counters =
+      nvcd_arena_malloc(e->arena,
+                        sizeof(e->metric_data->normalized_counters[0]) *
+                        e->event_id_buffer_length);
+
+    init_cupti_metric_event_indices(e);
+  }
+
+  // every event that's reported is in one of the groups
+  nvcd_name_table_build(&e->event_name_table,
+                        e->event_id_buffer,
+                        e->event_id_buffer_length,
+                        query_event_name);
+
+  CUPTI_FN(cuptiSetEventCollectionMode(e->cuda_context,
+                                       CUPTI_EVENT_COLLECTION_MODE_KERNEL));
+
+  // a plan loaded from the cache is already set
+  if (e->pass_groups == NULL) {
+    plan_event_group_passes(e);
+  }
+}
+
+//
+// Plan caching (see plan_cache.h)
+//
+// A cached plan lists the events of every group in the order
+// CUPTI reported them, so each group is rebuilt with one
+// cuptiEventGroupAddEvent() per event, and the passes are used as
+// they were verified by the process that saved them.
+//
+
+static bool init_cupti_event_groups_from_cache(cupti_event_data_t* e) {
+  nvcd_plan_t plan = NVCD_PLAN_INIT;
+
+  bool ok = nvcd_plan_cache_load(e->cuda_device, &plan);
+
+  if (ok) {
+    CUpti_EventGroup* groups = nvcd_arena_zalloc(e->arena, sizeof(groups[0]) * plan.num_groups);
+    
+    for (uint32_t i = 0; i < plan.num_groups && ok; ++i) {
+      ok = cuptiEventGroupCreate(e->cuda_context, &groups[i], 0) == CUPTI_SUCCESS;
+      
+      for (uint32_t j = plan.group_offsets[i]; j < plan.group_offsets[i + 1] && ok; ++j) {
+        ok = cuptiEventGroupAddEvent(groups[i], plan.group_event_ids[j]) == CUPTI_SUCCESS;
+      }
+    }
+
+    if (ok) {
+      e->has_events = true;
+      
+      fill_event_groups(e, groups, plan.num_groups);
+
+      e->requested_event_ids =
+        nvcd_arena_memdup(e->arena,
+                          plan.requested_event_ids,
+                          sizeof(plan.requested_event_ids[0]) * plan.num_requested_event_ids);
+      e->num_requested_event_ids = plan.num_requested_event_ids;
+      e->pass_groups =
+        nvcd_arena_memdup(e->arena,
+                          plan.pass_groups,
+                          sizeof(plan.pass_groups[0]) * plan.num_groups);
+      e->pass_offsets =
+        nvcd_arena_memdup(e->arena,
+                          plan.pass_offsets,
+                          sizeof(plan.pass_offsets[0]) * (plan.num_passes + 1));
+      e->num_passes = plan.num_passes;
+      e->current_pass = 0;
+
+      msg_verbosef("%" PRIu32 " event groups and %" PRIu32 " passes loaded from %s\n",
+                   e->num_event_groups,
+                   e->num_passes,
+                   ENV_PLAN_CACHE);
+    } else {
+      // e.g., the events of the file belong to another device
+      // with the same name; the groups are built as usual
+      msg_warnf("the plan in %s was rejected by CUPTI and will be rebuilt\n",
+                ENV_PLAN_CACHE);
+      
+      for (uint32_t i = 0; i < plan.num_groups; ++i) {
+        if (groups[i] != NULL) {
+          CUPTI_FN_WARN(cuptiEventGroupRemoveAllEvents(groups[i]));
+          CUPTI_FN_WARN(cuptiEventGroupDestroy(groups[i]));
+        }
+      }
+    }
+  }
+
+  nvcd_plan_free(&plan);
+  
+  return ok;
+}
+
+static void save_cupti_event_plan(cupti_event_data_t* e) {
+  if (!nvcd_plan_cache_enabled()) {
+    return;
+  }
+
+  nvcd_plan_t plan = NVCD_PLAN_INIT;
+
+  // everything but the group events is e's
+  plan.requested_event_ids = e->requested_event_ids;
+  plan.num_requested_event_ids = e->num_requested_event_ids;
+  plan.pass_groups = e->pass_groups;
+  plan.pass_offsets = e->pass_offsets;
+  plan.num_passes = e->num_passes;
+  plan.num_groups = e->num_event_groups;
+
+  plan.group_offsets = zallocNN(sizeof(plan.group_offsets[0]) * (e->num_event_groups + 1));
+  plan.group_event_ids = zallocNN(sizeof(plan.group_event_ids[0]) * (e->event_id_buffer_length + 1));
+
+  for (uint32_t i = 0; i < e->num_event_groups; ++i) {
+    uint32_t offset = e->event_id_buffer_offsets[i];
+    size_t size = sizeof(plan.group_event_ids[0]) * e->num_events_per_group[i];
+
+    CUPTI_FN(cuptiEventGroupGetAttribute(e->event_groups[i],
+                                         CUPTI_EVENT_GROUP_ATTR_EVENTS,
+                                         &size,
+                                         &plan.group_event_ids[offset]));
+
+    plan.group_offsets[i] = offset;
+  }
+
+  plan.group_offsets[e->num_event_groups] = e->event_id_buffer_length;
+
+  nvcd_plan_cache_save(e->cuda_device, &plan);
+
+  free(plan.group_offsets);
+  free(plan.group_event_ids);
 }
 
 NVCD_EXPORT void cupti_event_data_init_from_ids(cupti_event_data_t* e,
@@ -1534,6 +2464,7 @@ NVCD_EXPORT void cupti_event_data_init_from_ids(cupti_event_data_t* e,
   ASSERT(e != NULL);
   ASSERT(e->cuda_context != NULL);
   ASSERT(e->cuda_device >= 0);
+  ASSERT(e->arena != NULL);
   ASSERT(!e->is_root);
 
   if (!e->initialized) {
@@ -1542,9 +2473,10 @@ NVCD_EXPORT void cupti_event_data_init_from_ids(cupti_event_data_t* e,
     
     // event group initialization
     {
-      CUpti_EventGroup eg_buf[MAX_EVENT_GROUPS_PER_EVENT_DATA] = { 0 };
+      // at most one group per event
+      uint32_t max_egs = num_event_ids;
       uint32_t num_egs = 0;
-      uint32_t max_egs = MAX_EVENT_GROUPS_PER_EVENT_DATA;
+      CUpti_EventGroup* eg_buf = nvcd_arena_zalloc(e->arena, sizeof(eg_buf[0]) * (max_egs + 1));
       
       for (uint32_t i = 0; i < num_event_ids; ++i) {
         volatile bool found = find_event_group(e,
@@ -1573,18 +2505,32 @@ NVCD_EXPORT void cupti_event_data_init(cupti_event_data_t* e) {
   ASSERT(e != NULL);
   ASSERT(e->cuda_context != NULL);
   ASSERT(e->cuda_device >= 0);
+  ASSERT(e->arena != NULL);
   ASSERT(e->is_root == true);
   
   if (!e->initialized) {
 
-    init_cupti_event_names(e);
+    e->stream_sync = env_var_flag(ENV_STREAM);
+
+    // a cached plan already holds the IDs of the
+    // requested events, so their names aren't needed
+    bool cached = init_cupti_event_groups_from_cache(e);
+
+    if (!cached) {
+      init_cupti_event_names(e);
+    }
+
+    // the metrics' events are part of
+    // the root's event groups
+    init_cupti_metric_data(e);
     
-    if (e->has_events) {
+    if (cached) {
+      __cupti_event_data_init_base(e);
+    } else if (e->has_events || e->has_metrics) {
       init_cupti_event_groups(e);
       __cupti_event_data_init_base(e);
+      save_cupti_event_plan(e);
     }
-
-    init_cupti_metric_data(e);
     
     e->initialized = true;
   }
@@ -1625,9 +2571,9 @@ NVCD_EXPORT void cupti_event_data_free(cupti_event_data_t* e) {
       msg_diagtab(2); msg_diags("Group is NOT NULL");
 
       msg_diagtab(2);
-      if (e->event_groups_enabled[i] == true) {
+      if (bitset_test(cupti_event_group_states(e, CED_EVENT_GROUP_ENABLED), i)) {
         msg_diagtagline(CUPTI_FN(cuptiEventGroupDisable(e->event_groups[i])));
-        e->event_groups_enabled[i] = false;
+        bitset_clear(cupti_event_group_states(e, CED_EVENT_GROUP_ENABLED), i);
       } else {
 	msg_diags("Group already disabled");
       }
@@ -1646,20 +2592,15 @@ NVCD_EXPORT void cupti_event_data_free(cupti_event_data_t* e) {
     }
   }
   
-  msg_diagtab(1); msg_diagtagline(safe_free_v(e->event_id_buffer));
-  msg_diagtab(1); msg_diagtagline(safe_free_v(e->event_counter_buffer));
-  
-  msg_diagtab(1); msg_diagtagline(safe_free_v(e->num_events_per_group));
-  msg_diagtab(1); msg_diagtagline(safe_free_v(e->num_instances_per_group));
-  msg_diagtab(1); msg_diagtagline(safe_free_v(e->num_events_read_per_group));
-  
-  msg_diagtab(1); msg_diagtagline(safe_free_v(e->event_counter_buffer_offsets));
-  msg_diagtab(1); msg_diagtagline(safe_free_v(e->event_id_buffer_offsets));
-  msg_diagtab(1); msg_diagtagline(safe_free_v(e->event_group_read_states));
+  msg_diagtab(1); msg_diagtagline(nvcd_name_table_free(&e->event_name_table));
+  msg_diagtab(1); msg_diagtagline(nvcd_name_table_free(&e->metric_name_table));
   
   msg_diagtab(1); msg_diagtagline(safe_free_v(e->kernel_times_nsec));
-    
-  msg_diagtab(1); msg_diagtagline(safe_free_v(e->event_groups));
+
+  if (e->stage_event_start != NULL) {
+    msg_diagtab(1); msg_diagtagline(CUDA_RUNTIME_FN(cudaEventDestroy((cudaEvent_t) e->stage_event_start)));
+    msg_diagtab(1); msg_diagtagline(CUDA_RUNTIME_FN(cudaEventDestroy((cudaEvent_t) e->stage_event_end)));
+  }
   
   // TODO: event names may be either a subset of a static buffer
   // initialized in the .data section,
@@ -1670,27 +2611,53 @@ NVCD_EXPORT void cupti_event_data_free(cupti_event_data_t* e) {
     if (e->metric_data != NULL) {
       msg_diagtab(2); msg_diags("e->metric_data is NOT NULL");
       ASSERT(e->metric_data->initialized == true);
-      
-      for (uint32_t i = 0; i < e->metric_data->num_metrics; ++i) {
-	msg_diagtab(3);
-	msg_diagf("For " STRFMT_UINT32_VALUE(i) ": ", i);
-        msg_diagtagline(cupti_event_data_free(&e->metric_data->event_data[i]));
-      }
-
-      msg_diagtab(2); msg_diagtagline(safe_free_v(e->metric_data->metric_ids));
-      msg_diagtab(2); msg_diagtagline(safe_free_v(e->metric_data->metric_values));
-      msg_diagtab(2); msg_diagtagline(safe_free_v(e->metric_data->computed));
-      msg_diagtab(2); msg_diagtagline(safe_free_v(e->metric_data->metric_get_value_results));
     }
   } else {
     msg_diagtab(1); msg_diags("e->is_root is false");
   }
 
+  // every other buffer of e and its metric data
+  if (e->arena != NULL) {
+    msg_diagtab(1); msg_diagtagline(nvcd_arena_reset(e->arena));
+  }
+
   msg_diagtab(1); msg_diagtagline(cupti_event_data_set_null(e));
 
   msg_diags("END FREE");
 }
 
+NVCD_EXPORT void cupti_event_data_reset(cupti_event_data_t* e) {
+  ASSERT(e != NULL);
+  ASSERT(e->initialized == true);
+  ASSERT(e->subscriber == NULL);
+
+  if (e->has_events) {
+    uint64_t* enabled = cupti_event_group_states(e, CED_EVENT_GROUP_ENABLED);
+    
+    BITSET_FOR_EACH(enabled, e->num_event_group_words, i) {
+      CUPTI_FN(cuptiEventGroupDisable(e->event_groups[i]));
+    }
+
+    reset_event_group_states(e);
+    ZERO_MEM(e->event_counter_buffer, e->event_counter_buffer_length);
+    
+    e->count_event_groups_read = 0;
+    e->num_kernel_times = 0;
+    e->current_pass = 0;
+    e->pending_pass = CED_PASS_NONE;
+  }
+
+  if (e->is_root == true && e->metric_data != NULL) {
+    cupti_metric_data_t* m = e->metric_data;
+    
+    ASSERT(m->initialized == true);
+
+    ZERO_MEM(m->metric_values, m->num_metrics);
+    ZERO_MEM(m->computed, m->num_metrics);
+    ZERO_MEM(m->metric_get_value_results, m->num_metrics);
+  }
+}
+
 NVCD_EXPORT void cupti_event_data_begin(cupti_event_data_t* e) {
   ASSERT(e != NULL);
 
@@ -1708,9 +2675,7 @@ typedef char name_str_t[256];
 NVCD_EXPORT char* cupti_event_get_name(CUpti_EventID eid) {
   name_str_t name = {0};
 
-  size_t sz = sizeof(name);
-  
-  CUPTI_FN(cuptiEventGetAttribute(eid, CUPTI_EVENT_ATTR_NAME, &sz, &name[0]));
+  query_event_name(eid, &name[0], sizeof(name));
 
   return strdup(name);
 }
@@ -1746,16 +2711,27 @@ NVCD_EXPORT CUpti_MetricID* cupti_metric_get_ids(CUdevice dev, uint32_t* num_met
 NVCD_EXPORT char* cupti_metric_get_name(CUpti_MetricID metric) {
   name_str_t name = {0};
 
-  size_t sz = sizeof(name);
-          
-  CUPTI_FN(cuptiMetricGetAttribute(metric,
-                                   CUPTI_METRIC_ATTR_NAME,
-                                   &sz,
-                                   (void*) &name[0]));
+  query_metric_name(metric, &name[0], sizeof(name));
 
   return strdup(name);
 }
 
+NVCD_EXPORT const char* cupti_event_data_event_name(const cupti_event_data_t* e,
+                                                    CUpti_EventID eid) {
+  return nvcd_name_table_name(&e->event_name_table, eid);
+}
+
+NVCD_EXPORT const char* cupti_event_data_metric_name(const cupti_event_data_t* e,
+                                                     CUpti_MetricID metric) {
+  return nvcd_name_table_name(&e->metric_name_table, metric);
+}
+
+NVCD_EXPORT bool cupti_event_data_find_event(const cupti_event_data_t* e,
+                                             const char* name,
+                                             CUpti_EventID* eid) {
+  return nvcd_name_table_find(&e->event_name_table, name, eid);
+}
+
 NVCD_EXPORT uint32_t cupti_event_group_get_num_events(CUpti_EventGroup group) {
   ASSERT(group != NULL);
 
@@ -1786,8 +2762,7 @@ NVCD_EXPORT char* cupti_event_data_to_string(cupti_event_data_t* e) {
 
           STRFMT_TAB1 STRFMT_PTR_VALUE(uint32_t*, e->event_counter_buffer_offsets) STRFMT_MEMBER_SEP STRFMT_NEWL1
           STRFMT_TAB1 STRFMT_PTR_VALUE(uint32_t*, e->event_id_buffer_offsets) STRFMT_MEMBER_SEP STRFMT_NEWL1
-          STRFMT_TAB1 STRFMT_PTR_VALUE(uint8_t*, e->event_group_read_states) STRFMT_MEMBER_SEP STRFMT_NEWL1
-          STRFMT_TAB1 STRFMT_PTR_VALUE(uint8_t*, e->event_groups_enabled) STRFMT_MEMBER_SEP STRFMT_NEWL1         
+          STRFMT_TAB1 STRFMT_PTR_VALUE(uint64_t*, e->event_group_states) STRFMT_MEMBER_SEP STRFMT_NEWL1
 
           STRFMT_TAB1 STRFMT_PTR_VALUE(uint64_t*, e->kernel_times_nsec) STRFMT_MEMBER_SEP STRFMT_NEWL1
 
@@ -1833,9 +2808,7 @@ NVCD_EXPORT char* cupti_event_data_to_string(cupti_event_data_t* e) {
           
           (void*) e->event_counter_buffer_offsets,
           (void*) e->event_id_buffer_offsets,
-          (void*) e->event_group_read_states,
-
-          (void*) e->event_groups_enabled,
+          (void*) e->event_group_states,
           
           (void*) e->kernel_times_nsec,
 
@@ -1879,120 +2852,317 @@ NVCD_EXPORT void cupti_event_data_calc_metrics(cupti_event_data_t* e) {
   ASSERT(e->is_root == true);
   ASSERT(e->metric_data != NULL);
   
-  calc_cupti_metrics(e->metric_data);
+  calc_cupti_metrics(e);
 }
 
 NVCD_EXPORT bool cupti_event_data_callback_finished(cupti_event_data_t* e) {
   ASSERT(e->count_event_groups_read
          <= e->num_event_groups /* serious problem if this fails */);
+  ASSERT(e->count_event_groups_read
+         == bitset_count(cupti_event_group_states(e, CED_EVENT_GROUP_READ),
+                         e->num_event_group_words));
   
   return e->count_event_groups_read
     == e->num_event_groups;
 }
 
-void cupti_event_data_enum_event_counters(cupti_event_data_t* e,
-					  cupti_event_data_enum_event_counters_fn_t fn) {
-  ASSERT(e->count_event_groups_read == e->num_event_groups);
+// returns false if fn() asked to stop iterating
+static bool enum_group_event_counters(cupti_event_data_t* e,
+                                      uint32_t group,
+                                      cupti_event_data_enum_event_counters_fn_t fn) {
   bool keep_iterating = true;
   uint64_t* pcounters = &e->event_counter_buffer[0];
   //ib = id buffer
   //cb = counter buffer
   //nepg = number of events per group
   //nipg = number of instances per group (for each event)  
+  uint32_t ib_offset = e->event_id_buffer_offsets[group];
+  uint32_t cb_offset = e->event_counter_buffer_offsets[group];
+
+  uint32_t nepg = e->num_events_per_group[group];
+  uint32_t nipg = e->num_instances_per_group[group];
+
+  // If asserts are enabled, then what's listed here is just
+  // a series of assertions copy/pasted from print_event_group_soa(). 
+  //
+  // They're used to make sure that the layout of the data
+  // used to track the counters within the groups is correct.
+  //
+  // Scroll further downward for the actual
+  // iteration.
+  IF_ASSERTS_ENABLED(
+      volatile uint32_t next_cb_offset = 0;
+      volatile uint32_t next_ib_offset = 0;
+      {
+      // bounds check ordering for
+      // event_counter_buffer_offsets      
+      volatile uint32_t prev_cb_offset = (group > 0) ?
+    
+        e->event_counter_buffer_offsets[group - 1] :
+        0;
+
+      volatile uint32_t prev_cb_offset_add = (group > 0) ?
+
+        (e->num_events_per_group[group - 1] *
+         e->num_instances_per_group[group - 1]) :
+        0;
+
+      ASSERT(prev_cb_offset + prev_cb_offset_add == cb_offset);
+    }
+
+    {    
+      // bounds check ordering for
+      // event_id_buffer_offsets
+      volatile uint32_t prev_ib_offset = (group > 0) ?
+
+        e->event_id_buffer_offsets[group - 1] :
+        0;
+
+      volatile uint32_t prev_ib_offset_add = (group > 0) ?
+    
+        e->num_events_per_group[group - 1] :
+        0;
+
+      ASSERT(prev_ib_offset + prev_ib_offset_add == ib_offset);
+    }
+
+    {
+      // used for iterative bounds checking
+      next_cb_offset =
+        group < (e->num_event_groups - 1) ?
+        e->event_counter_buffer_offsets[group + 1] :
+        e->event_counter_buffer_length;
+    }
+
+    {
+      // used for iterative bounds checking
+      next_ib_offset =
+        group < (e->num_event_groups - 1) ?
+        e->event_id_buffer_offsets[group + 1] :
+        e->event_id_buffer_length;
+    });    
+  //
+  // This is where the rest of the iteration is actually performed.
+  //
+  uint32_t event = 0;
+  while (event < nepg && keep_iterating) {
+    ASSERT(ib_offset + event < next_ib_offset);      
+
+    bool requested = e->counter_rows[ib_offset + event] != CED_COUNTER_ROW_NONE;
+    
+    uint32_t event_instance = 0;
+    while (requested && event_instance < nipg && keep_iterating) {
+      uint32_t k = cb_offset + event_instance * nepg + event;
+
+      ASSERT(k < next_cb_offset);
+    
+      cupti_enum_event_counter_iteration_t it =
+        {
+         .instance = event_instance,
+         .num_instances = nipg,
+         .value = pcounters[k],
+         .event = e->event_id_buffer[ib_offset + event],
+         .group = e->event_groups[group]
+        };
+
+      keep_iterating = fn(&it);
+      event_instance++;
+    }
+    event++;
+  }
+
+  return keep_iterating;
+}
+
+void cupti_event_data_enum_event_counters(cupti_event_data_t* e,
+					  cupti_event_data_enum_event_counters_fn_t fn) {
+  ASSERT(e->count_event_groups_read == e->num_event_groups);
+  bool keep_iterating = true;
   uint32_t group = 0;
   while (group < e->num_event_groups && keep_iterating) {
-    uint32_t ib_offset = e->event_id_buffer_offsets[group];
-    uint32_t cb_offset = e->event_counter_buffer_offsets[group];
+    keep_iterating = enum_group_event_counters(e, group, fn);
+    group++;
+  }
+}
+
+NVCD_EXPORT uint32_t cupti_event_data_num_passes(cupti_event_data_t* e) {
+  ASSERT(e->initialized == true);
+  return e->num_passes;
+}
+
+NVCD_EXPORT void cupti_event_data_select_pass(cupti_event_data_t* e, uint32_t pass) {
+  ASSERT(e->initialized == true);
+  ASSERT(e->count_event_groups_read == 0 /* must be called after a reset */);
+  ASSERT(pass < e->num_passes);
   
-    uint32_t nepg = e->num_events_per_group[group];
-    uint32_t nipg = e->num_instances_per_group[group];
+  e->current_pass = pass;
+}
 
-    // If asserts are enabled, then what's listed here is just
-    // a series of assertions copy/pasted from print_event_group_soa(). 
-    //
-    // They're used to make sure that the layout of the data
-    // used to track the counters within the groups is correct.
-    //
-    // Scroll further downward for the actual
-    // iteration.
-    IF_ASSERTS_ENABLED(
-	volatile uint32_t next_cb_offset = 0;
-	volatile uint32_t next_ib_offset = 0;
-	{
-	// bounds check ordering for
-	// event_counter_buffer_offsets      
-	volatile uint32_t prev_cb_offset = (group > 0) ?
-      
-	  e->event_counter_buffer_offsets[group - 1] :
-	  0;
+NVCD_EXPORT void cupti_event_data_enum_pass_counters(cupti_event_data_t* e,
+                                                     uint32_t pass,
+                                                     cupti_event_data_enum_event_counters_fn_t fn) {
+  ASSERT(pass < e->num_passes);
+  bool keep_iterating = true;
+  uint32_t k = e->pass_offsets[pass];
+  while (k < e->pass_offsets[pass + 1] && keep_iterating) {
+    ASSERT(bitset_test(cupti_event_group_states(e, CED_EVENT_GROUP_READ), e->pass_groups[k]));
+    keep_iterating = enum_group_event_counters(e, e->pass_groups[k], fn);
+    k++;
+  }
+}
+
+//
+// Counter matrices
+//
+
+static void counter_matrix_reserve(cupti_counter_matrix_t* m,
+                                   uint32_t num_rows,
+                                   uint32_t num_values) {
+  // never empty, so there's always a row_offsets[0]
+  num_rows = num_rows > 0 ? num_rows : 1;
+  num_values = num_values > 0 ? num_values : 1;
+  
+  if (num_rows > m->rows_capacity) {
+    safe_free_v(m->event_ids);
+    safe_free_v(m->row_offsets);
+    safe_free_v(m->rows_filled);
+    
+    m->event_ids = mallocNN(sizeof(m->event_ids[0]) * num_rows);
+    m->row_offsets = mallocNN(sizeof(m->row_offsets[0]) * (num_rows + 1));
+    m->rows_filled = mallocNN(sizeof(m->rows_filled[0]) * BITSET_NUM_WORDS(num_rows));
+    m->rows_capacity = num_rows;
+  }
 
-	volatile uint32_t prev_cb_offset_add = (group > 0) ?
+  if (num_values > m->values_capacity) {
+    safe_free_v(m->values);
+    
+    m->values = mallocNN(sizeof(m->values[0]) * num_values);
+    m->values_capacity = num_values;
+  }
+}
 
-	  (e->num_events_per_group[group - 1] *
-	   e->num_instances_per_group[group - 1]) :
-	  0;
+// groups are groups[0] ... groups[num_groups - 1], or every group if groups is NULL
+static void counter_matrix_fill(cupti_event_data_t* e,
+                                const uint32_t* groups,
+                                uint32_t num_groups,
+                                cupti_counter_matrix_t* m) {
+  uint32_t num_rows = e->num_counter_rows;
+  
+  // Every fill of a session fits in the buffers of a
+  // full one, so they're only allocated by the first.
+  counter_matrix_reserve(m, num_rows, e->num_counter_values);
 
-	ASSERT(prev_cb_offset + prev_cb_offset_add == cb_offset);
-      }
+  // the layout is the event data's
+  memcpy(m->event_ids, e->counter_row_events, sizeof(m->event_ids[0]) * num_rows);
+  memcpy(m->row_offsets, e->counter_row_offsets, sizeof(m->row_offsets[0]) * (num_rows + 1));
+  ZERO_MEM(m->rows_filled, BITSET_NUM_WORDS(num_rows));
+  
+  m->num_rows = num_rows;
+
+  for (uint32_t k = 0; k < num_groups; ++k) {
+    uint32_t g = groups != NULL ? groups[k] : k;
 
-      {    
-	// bounds check ordering for
-	// event_id_buffer_offsets
-	volatile uint32_t prev_ib_offset = (group > 0) ?
+    uint32_t ib_offset = e->event_id_buffer_offsets[g];
+    uint32_t cb_offset = e->event_counter_buffer_offsets[g];
+    uint32_t nepg = e->num_events_per_group[g];
+    uint32_t nipg = e->num_instances_per_group[g];
 
-	  e->event_id_buffer_offsets[group - 1] :
-	  0;
+    const uint64_t* src = &e->event_counter_buffer[cb_offset];
 
-	volatile uint32_t prev_ib_offset_add = (group > 0) ?
+    for (uint32_t event = 0; event < nepg; ++event) {
+      uint32_t row = e->counter_rows[ib_offset + event];
       
-	  e->num_events_per_group[group - 1] :
-	  0;
+      if (row != CED_COUNTER_ROW_NONE) {
+        uint64_t* dst = &m->values[m->row_offsets[row]];
 
-	ASSERT(prev_ib_offset + prev_ib_offset_add == ib_offset);
-      }
+        // instances of the same event are nepg apart
+        for (uint32_t instance = 0; instance < nipg; ++instance) {
+          dst[instance] = src[instance * nepg + event];
+        }
 
-      {
-	// used for iterative bounds checking
-	next_cb_offset =
-	  group < (e->num_event_groups - 1) ?
-	  e->event_counter_buffer_offsets[group + 1] :
-	  e->event_counter_buffer_length;
+        bitset_set(m->rows_filled, row);
       }
+    }
+  }
+}
+
+NVCD_EXPORT void cupti_event_data_counter_matrix(cupti_event_data_t* e,
+                                                 cupti_counter_matrix_t* m) {
+  ASSERT(e->count_event_groups_read == e->num_event_groups);
+  counter_matrix_fill(e, NULL, e->num_event_groups, m);
+}
+
+NVCD_EXPORT void cupti_event_data_pass_counter_matrix(cupti_event_data_t* e,
+                                                      uint32_t pass,
+                                                      cupti_counter_matrix_t* m) {
+  ASSERT(pass < e->num_passes);
   
-      {
-	// used for iterative bounds checking
-	next_ib_offset =
-	  group < (e->num_event_groups - 1) ?
-	  e->event_id_buffer_offsets[group + 1] :
-	  e->event_id_buffer_length;
-      });    
-    //
-    // This is where the rest of the iteration is actually performed.
-    //
-    uint32_t event = 0;
-    while (event < nepg && keep_iterating) {
-      ASSERT(ib_offset + event < next_ib_offset);      
+  uint32_t begin = e->pass_offsets[pass];
+  uint32_t end = e->pass_offsets[pass + 1];
+
+  IF_ASSERTS_ENABLED(
+    for (uint32_t k = begin; k < end; ++k) {
+      ASSERT(bitset_test(cupti_event_group_states(e, CED_EVENT_GROUP_READ), e->pass_groups[k]));
+    });
+  
+  counter_matrix_fill(e, &e->pass_groups[begin], end - begin, m);
+}
+
+NVCD_EXPORT void cupti_counter_matrix_free(cupti_counter_matrix_t* m) {
+  safe_free_v(m->event_ids);
+  safe_free_v(m->row_offsets);
+  safe_free_v(m->values);
+  safe_free_v(m->rows_filled);
+
+  m->num_rows = 0;
+  m->rows_capacity = 0;
+  m->values_capacity = 0;
+}
+
+// Four independent lanes, so that there's no dependency from one
+// value to the next and the compiler is free to vectorize the loop.
+#define COUNTER_STATS_LANES 4
 
-      uint32_t event_instance = 0;
-      while (event_instance < nipg && keep_iterating) {
-	uint32_t k = cb_offset + event_instance * nepg + event;
+NVCD_EXPORT void cupti_counter_stats(const uint64_t* values,
+                                     uint32_t count,
+                                     cupti_counter_stats_t* out) {
+  uint64_t sum[COUNTER_STATS_LANES] = { 0 };
+  uint64_t min[COUNTER_STATS_LANES];
+  uint64_t max[COUNTER_STATS_LANES] = { 0 };
+
+  for (uint32_t l = 0; l < COUNTER_STATS_LANES; ++l) {
+    min[l] = UINT64_MAX;
+  }
 
-	ASSERT(k < next_cb_offset);
+  uint32_t i = 0;
+  uint32_t bulk = count - count % COUNTER_STATS_LANES;
+  
+  for (; i < bulk; i += COUNTER_STATS_LANES) {
+    for (uint32_t l = 0; l < COUNTER_STATS_LANES; ++l) {
+      uint64_t v = values[i + l];
       
-	cupti_enum_event_counter_iteration_t it =
-	  {
-	   .instance = event_instance,
-	   .num_instances = nipg,
-	   .value = pcounters[k],
-	   .event = e->event_id_buffer[ib_offset + event],
-	   .group = e->event_groups[group]
-	  };
-
-	keep_iterating = fn(&it);
-	event_instance++;
-      }
-      event++;
+      sum[l] += v;
+      min[l] = v < min[l] ? v : min[l];
+      max[l] = v > max[l] ? v : max[l];
     }
-    group++;
   }
+
+  for (; i < count; ++i) {
+    uint64_t v = values[i];
+    
+    sum[0] += v;
+    min[0] = v < min[0] ? v : min[0];
+    max[0] = v > max[0] ? v : max[0];
+  }
+
+  for (uint32_t l = 1; l < COUNTER_STATS_LANES; ++l) {
+    sum[0] += sum[l];
+    min[0] = min[l] < min[0] ? min[l] : min[0];
+    max[0] = max[l] > max[0] ? max[l] : max[0];
+  }
+
+  out->sum = sum[0];
+  out->min = count > 0 ? min[0] : 0;
+  out->max = max[0];
+  out->mean = count > 0 ? (double) sum[0] / (double) count : 0.0;
 }
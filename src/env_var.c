@@ -164,4 +164,13 @@ char** env_var_list_read(const char* env_var_value, size_t* count) {
   return ctx.list;
 }
 
+bool env_var_flag(const char* name) {
+  const char* value = getenv(name);
+  
+  return
+    value != NULL &&
+    value[0] != '\0' &&
+    strcmp(value, "0") != 0;
+}
+
 C_LINKAGE_END
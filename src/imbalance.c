@@ -0,0 +1,185 @@
+#include "nvcd/imbalance.h"
+#include "nvcd/env_var.h"
+#include "nvcd/util.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+C_LINKAGE_START
+
+static pthread_once_t g_imbalance_once = PTHREAD_ONCE_INIT;
+static bool g_imbalance_enabled = false;
+
+static void imbalance_read_enabled() {
+  g_imbalance_enabled = env_var_flag(ENV_IMBALANCE);
+}
+
+NVCD_EXPORT bool nvcd_imbalance_enabled(void) {
+  pthread_once(&g_imbalance_once, imbalance_read_enabled);
+  return g_imbalance_enabled;
+}
+
+static int imbalance_busy_cmp(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+
+  return (x > y) - (x < y);
+}
+
+// makes room for the SMs with smid < num_slots
+static void imbalance_reserve(nvcd_imbalance_t* imbalance, uint32_t num_slots) {
+  if (num_slots > imbalance->capacity) {
+    safe_free_v(imbalance->sms);
+    safe_free_v(imbalance->scratch);
+
+    imbalance->sms = mallocNN(sizeof(imbalance->sms[0]) * num_slots);
+    imbalance->scratch = mallocNN(sizeof(imbalance->scratch[0]) * num_slots);
+    imbalance->capacity = num_slots;
+  }
+}
+
+NVCD_EXPORT void nvcd_imbalance_analyze(nvcd_imbalance_t* imbalance,
+                                        const clock64_t* times,
+                                        const uint32_t* smids,
+                                        size_t num_threads,
+                                        uint32_t block_size) {
+  ASSERT(imbalance != NULL);
+
+  nvcd_imbalance_sm_t* sms = NULL;
+  uint32_t num_slots = 0;
+
+  // smids are small and dense, so the SMs are
+  // indexed by smid until they're compacted
+  for (size_t i = 0; i < num_threads; ++i) {
+    if (smids[i] != NVCD_IMBALANCE_SMID_NONE && smids[i] >= num_slots) {
+      num_slots = smids[i] + 1;
+    }
+  }
+
+  imbalance_reserve(imbalance, num_slots);
+
+  sms = imbalance->sms;
+  memset(sms, 0, sizeof(sms[0]) * num_slots);
+
+  for (size_t i = 0; i < num_threads; ++i) {
+    if (smids[i] == NVCD_IMBALANCE_SMID_NONE) {
+      continue;
+    }
+    
+    nvcd_imbalance_sm_t* sm = &sms[smids[i]];
+    // tstart isn't cleared, so a thread that called nvcd_device_end()
+    // without nvcd_device_begin() can have a negative time
+    clock64_t time = times[i] > 0 ? times[i] : 0;
+
+    sm->num_threads++;
+    sm->busy += (uint64_t) time;
+
+    if (time > sm->max_time) {
+      sm->max_time = time;
+    }
+  }
+
+  // a block runs on a single SM, so its first
+  // recorded thread's SM is the block's
+  if (block_size > 0) {
+    for (size_t block = 0; block < num_threads; block += block_size) {
+      size_t end = block + block_size < num_threads ? block + block_size : num_threads;
+      
+      for (size_t i = block; i < end; ++i) {
+        if (smids[i] != NVCD_IMBALANCE_SMID_NONE) {
+          sms[smids[i]].num_blocks++;
+          break;
+        }
+      }
+    }
+  }
+
+  uint32_t num_sms = 0;
+  uint64_t total_busy = 0;
+
+  for (uint32_t smid = 0; smid < num_slots; ++smid) {
+    if (sms[smid].num_threads > 0) {
+      // num_sms <= smid, so nothing that's still to be read is overwritten
+      sms[num_sms] = sms[smid];
+      sms[num_sms].smid = smid;
+
+      imbalance->scratch[num_sms] = sms[smid].busy;
+      total_busy += sms[smid].busy;
+
+      num_sms++;
+    }
+  }
+
+  imbalance->num_sms = num_sms;
+  imbalance->critical_sm = 0;
+  imbalance->min_busy = 0;
+  imbalance->median_busy = 0;
+  imbalance->max_busy = 0;
+  imbalance->mean_busy = 0.0;
+  imbalance->tail_ratio = 0.0;
+  imbalance->speedup_if_balanced = 1.0;
+
+  memset(imbalance->histogram, 0, sizeof(imbalance->histogram));
+
+  if (num_sms == 0) {
+    return;
+  }
+
+  for (uint32_t i = 1; i < num_sms; ++i) {
+    if (sms[i].busy > sms[imbalance->critical_sm].busy) {
+      imbalance->critical_sm = i;
+    }
+  }
+
+  // there are at most a few hundred SMs
+  qsort(imbalance->scratch, num_sms, sizeof(imbalance->scratch[0]), imbalance_busy_cmp);
+
+  imbalance->min_busy = imbalance->scratch[0];
+  imbalance->max_busy = imbalance->scratch[num_sms - 1];
+  imbalance->median_busy = imbalance->scratch[num_sms >> 1];
+
+  if ((num_sms & 1) == 0) {
+    uint64_t low = imbalance->scratch[(num_sms >> 1) - 1];
+    imbalance->median_busy = low + (imbalance->median_busy - low) / 2;
+  }
+  imbalance->mean_busy = (double) total_busy / (double) num_sms;
+
+  if (imbalance->median_busy > 0) {
+    imbalance->tail_ratio = (double) imbalance->max_busy / (double) imbalance->median_busy;
+  }
+
+  if (imbalance->mean_busy > 0.0) {
+    imbalance->speedup_if_balanced = (double) imbalance->max_busy / imbalance->mean_busy;
+  }
+
+  uint64_t range = imbalance->max_busy - imbalance->min_busy;
+
+  for (uint32_t i = 0; i < num_sms; ++i) {
+    uint32_t bin = 0;
+
+    if (range > 0) {
+      double x = (double) (sms[i].busy - imbalance->min_busy) / (double) range;
+      bin = (uint32_t) (x * NVCD_IMBALANCE_NUM_BINS);
+
+      // the most busy SM is in the last bin
+      if (bin >= NVCD_IMBALANCE_NUM_BINS) {
+        bin = NVCD_IMBALANCE_NUM_BINS - 1;
+      }
+    }
+
+    imbalance->histogram[bin]++;
+  }
+}
+
+NVCD_EXPORT void nvcd_imbalance_free(nvcd_imbalance_t* imbalance) {
+  ASSERT(imbalance != NULL);
+
+  safe_free_v(imbalance->sms);
+  safe_free_v(imbalance->scratch);
+
+  imbalance->num_sms = 0;
+  imbalance->capacity = 0;
+}
+
+C_LINKAGE_END
@@ -0,0 +1,160 @@
+#include "nvcd/name_table.h"
+#include "nvcd/util.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+C_LINKAGE_START
+
+// CUPTI's names are shorter than this
+#define NAME_TABLE_NAME_LENGTH 256
+
+typedef struct name_table_sort_entry {
+  const char* name;
+  uint32_t index;
+} name_table_sort_entry_t;
+
+static int name_table_id_cmp(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*) a;
+  uint32_t y = *(const uint32_t*) b;
+
+  return (x > y) - (x < y);
+}
+
+static int name_table_name_cmp(const void* a, const void* b) {
+  return strcmp(((const name_table_sort_entry_t*) a)->name,
+                ((const name_table_sort_entry_t*) b)->name);
+}
+
+NVCD_EXPORT void nvcd_name_table_build(nvcd_name_table_t* table,
+                                       const uint32_t* ids,
+                                       uint32_t num_ids,
+                                       nvcd_name_query_fn_t query) {
+  ASSERT(table != NULL);
+  ASSERT(table->ids == NULL);
+  ASSERT(query != NULL);
+
+  if (num_ids == 0) {
+    return;
+  }
+
+  ASSERT(ids != NULL);
+
+  table->ids = mallocNN(sizeof(table->ids[0]) * num_ids);
+  memcpy(table->ids, ids, sizeof(table->ids[0]) * num_ids);
+
+  qsort(table->ids, num_ids, sizeof(table->ids[0]), name_table_id_cmp);
+
+  uint32_t count = 1;
+
+  for (uint32_t i = 1; i < num_ids; ++i) {
+    if (table->ids[i] != table->ids[count - 1]) {
+      table->ids[count] = table->ids[i];
+      count++;
+    }
+  }
+
+  table->count = count;
+  table->names = mallocNN(sizeof(table->names[0]) * count);
+  table->by_name = mallocNN(sizeof(table->by_name[0]) * count);
+
+  // every name is appended to one buffer, which is
+  // doubled as needed
+  size_t capacity = (size_t) count * 32;
+  size_t length = 0;
+
+  table->strings = mallocNN(capacity);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    char name[NAME_TABLE_NAME_LENGTH] = {0};
+
+    query(table->ids[i], &name[0], sizeof(name));
+    name[sizeof(name) - 1] = '\0';
+
+    size_t name_length = strlen(name) + 1;
+
+    while (length + name_length > capacity) {
+      capacity *= 2;
+      table->strings = NOT_NULL(realloc(table->strings, capacity));
+    }
+
+    memcpy(&table->strings[length], name, name_length);
+
+    ASSERT(length <= UINT32_MAX);
+    table->names[i] = (uint32_t) length;
+    length += name_length;
+  }
+
+  // the strings don't move anymore
+  name_table_sort_entry_t* entries = mallocNN(sizeof(entries[0]) * count);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    entries[i].name = &table->strings[table->names[i]];
+    entries[i].index = i;
+  }
+
+  qsort(entries, count, sizeof(entries[0]), name_table_name_cmp);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    table->by_name[i] = entries[i].index;
+  }
+
+  free(entries);
+}
+
+NVCD_EXPORT const char* nvcd_name_table_name(const nvcd_name_table_t* table, uint32_t id) {
+  if (table->count == 0) {
+    return NULL;
+  }
+
+  const uint32_t* found = bsearch(&id,
+                                  table->ids,
+                                  table->count,
+                                  sizeof(table->ids[0]),
+                                  name_table_id_cmp);
+
+  return found != NULL ?
+    &table->strings[table->names[found - table->ids]] :
+    NULL;
+}
+
+NVCD_EXPORT bool nvcd_name_table_find(const nvcd_name_table_t* table,
+                                      const char* name,
+                                      uint32_t* id) {
+  ASSERT(name != NULL);
+  ASSERT(id != NULL);
+
+  uint32_t lo = 0;
+  uint32_t hi = table->count;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    uint32_t index = table->by_name[mid];
+
+    int c = strcmp(name, &table->strings[table->names[index]]);
+
+    if (c == 0) {
+      *id = table->ids[index];
+      return true;
+    } else if (c < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  return false;
+}
+
+NVCD_EXPORT void nvcd_name_table_free(nvcd_name_table_t* table) {
+  ASSERT(table != NULL);
+
+  safe_free_v(table->ids);
+  safe_free_v(table->names);
+  safe_free_v(table->by_name);
+  safe_free_v(table->strings);
+
+  table->count = 0;
+}
+
+C_LINKAGE_END
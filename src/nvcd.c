@@ -1,8 +1,64 @@
 #include "nvcd/nvcd.h"
 #include "nvcd/cupti_util.h"
 #include "nvcd/util.h"
+#include "nvcd/env_var.h"
 
-static cupti_event_data_t g_event_data = CUPTI_EVENT_DATA_INIT;
+#include <string.h>
+
+#include <pthread.h>
+
+//
+// There's one session per device, each of which owns the event data
+// for that device. The event data is only rebuilt when the requested
+// events/metrics change; otherwise it's reset and reused.
+//
+// A thread holds the session's lock for a single launch, from
+// nvcd_init_events() to nvcd_release_events(), so threads that profile
+// the same device take turns launch by launch and are free to wait on
+// each other in between. Each thread that's in a session joins the
+// session of every device it launches on, and the event data is only
+// freed once the last of them has left it in nvcd_reset_event_data().
+//
+// A launch whose kernel is still running can be released with its end
+// pending, see nvcd_release_events_pending(). The next thread to lock
+// the session completes it first, so the event data is never reset
+// under a launch that hasn't been read.
+//
+typedef struct nvcd_session {
+  cupti_event_data_t event_data;
+  // holds the event data's buffers; kept across
+  // event sets, so that rebuilding one doesn't reach the heap
+  nvcd_arena_t arena;
+  char* events_key;
+  char* metrics_key;
+  // threads in a session that have joined this one
+  uint32_t num_users;
+  nvcd_pending_fn_t pending_fn;
+  void* pending_arg;
+  pthread_mutex_t lock;
+} nvcd_session_t;
+
+static nvcd_session_t* g_sessions = NULL;
+
+// the session of the calling thread's last launch
+static NVCD_THREAD_LOCAL nvcd_session_t* t_session = NULL;
+static NVCD_THREAD_LOCAL bool32_t t_session_locked = false;
+
+// the sessions the calling thread has joined, by device index
+static NVCD_THREAD_LOCAL uint64_t* t_joined = NULL;
+
+// the session the calling thread last left a pending launch in
+static NVCD_THREAD_LOCAL nvcd_session_t* t_pending = NULL;
+
+// true between nvcd_session_begin() and nvcd_session_end()
+static NVCD_THREAD_LOCAL bool32_t t_session_active = false;
+
+// Guards initialization and teardown of g_nvcd and g_sessions,
+// which are shared by every thread that's called nvcd_init_cuda().
+static pthread_mutex_t g_nvcd_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t g_nvcd_users = 0;
+static NVCD_THREAD_LOCAL bool32_t t_nvcd_user = false;
+static nvcd_device_free_fn_t g_device_free = NULL;
 
 nvcd_t g_nvcd =
   {
@@ -16,21 +72,50 @@ nvcd_t g_nvcd =
    .opt_diagnostic_output = false
   };
 
-static inline void print_device_info(int device_index) {
-  msg_userf("GPU %i\n", device_index);
+const char* nvcd_device_uuid_str(int device_index, char* buffer, size_t length) {
+  ASSERT(0 <= device_index && device_index < g_nvcd.num_devices);
+  ASSERT(length >= NVCD_UUID_STR_LENGTH);
 
   uint8_t* uuid = (uint8_t*) &g_nvcd.device_uuids[device_index].bytes[0];
+  
+  // same format as nvidia-smi -L
+  snprintf(buffer,
+           length,
+           "GPU-%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+           uuid[0],uuid[1],uuid[2],uuid[3],
+           uuid[4],uuid[5],uuid[6],uuid[7],
+           uuid[8],uuid[9],uuid[10],uuid[11],
+           uuid[12],uuid[13],uuid[14],uuid[15]);
+
+  return buffer;
+}
+
+static inline void print_device_info(int device_index) {
+  char uuid[NVCD_UUID_STR_LENGTH];
+  
+  msg_userf("GPU %i\n", device_index);
 
   msg_userf("\tgpu_name = %s\n", &g_nvcd.device_names[device_index][0]);
 
-  msg_userf("\tgpu_uuid = GPU-%x%x%x%x-%x%x-%x%x-%x%x-%x%x%x%x%x%x\n",
-	    uuid[0],uuid[1],uuid[2],uuid[3],
-	    uuid[4],uuid[5],uuid[6],uuid[7],
-	    uuid[8],uuid[9],uuid[10],uuid[11],
-	    uuid[12],uuid[13],uuid[14],uuid[15]);
+  msg_userf("\tgpu_uuid = %s\n", nvcd_device_uuid_str(device_index, uuid, sizeof(uuid)));
+}
+
+static void nvcd_init_sessions() {
+  g_sessions = zallocNN(sizeof(g_sessions[0]) * g_nvcd.num_devices);
+
+  for (int i = 0; i < g_nvcd.num_devices; ++i) {
+    cupti_event_data_set_null(&g_sessions[i].event_data);
+    C_ASSERT(pthread_mutex_init(&g_sessions[i].lock, NULL) == 0);
+  }
 }
 
 void nvcd_init_cuda() {
+  if (t_nvcd_user) {
+    return;
+  }
+
+  C_ASSERT(pthread_mutex_lock(&g_nvcd_lock) == 0);
+  
   if (!g_nvcd.initialized) {
     CUDA_DRIVER_FN(cuInit(0));
   
@@ -52,24 +137,31 @@ void nvcd_init_cuda() {
 					   g_nvcd.num_devices);
 
     const size_t MAX_STRING_LENGTH = 128;
-      
+
+    // The calling thread's current context only belongs to one device,
+    // so every other device gets its primary context, which is the one
+    // the runtime API launches kernels in.
+    CUcontext current_context = NULL;
+    CUdevice current_device = 0;
+    
+    CUDA_DRIVER_FN(cuCtxGetCurrent(&current_context));
+
+    if (current_context != NULL) {
+      CUDA_DRIVER_FN(cuCtxGetDevice(&current_device));
+    }
+    
     for (int i = 0; i < g_nvcd.num_devices; ++i) {
       CUDA_DRIVER_FN(cuDeviceGet(&g_nvcd.devices[i], i));
 
-      //
-      // NOTE: this obviously isn't device specific.
-      // Should look into cuDevicePrimaryCtxRetain/cuDevicePrimaryCtxRelease
-      // for that. It may be that we can get away with those alone and nothing else,
-      // but I'm not sure. Will need time to read more on context management...
-      //         
-      CUDA_DRIVER_FN(cuCtxGetCurrent(&g_nvcd.contexts[i]));
-
-      g_nvcd.contexts_ext[i] = g_nvcd.contexts[i] != NULL;
+      g_nvcd.contexts_ext[i] =
+        current_context != NULL &&
+        current_device == g_nvcd.devices[i];
       
-      if (g_nvcd.contexts_ext[i] == false) {
-	CUDA_DRIVER_FN(cuCtxCreate(&g_nvcd.contexts[i],
-				   0,
-				   g_nvcd.devices[i]));
+      if (g_nvcd.contexts_ext[i]) {
+        g_nvcd.contexts[i] = current_context;
+      } else {
+	CUDA_DRIVER_FN(cuDevicePrimaryCtxRetain(&g_nvcd.contexts[i],
+                                                g_nvcd.devices[i]));
       }
 
       ASSERT(g_nvcd.contexts[i] != NULL);
@@ -86,35 +178,343 @@ void nvcd_init_cuda() {
 
       print_device_info(i);
     }
+
+    nvcd_init_sessions();
     
     g_nvcd.initialized = true;
   }
+
+  g_nvcd_users++;
+  t_nvcd_user = true;
+
+  C_ASSERT(pthread_mutex_unlock(&g_nvcd_lock) == 0);
+}
+
+bool nvcd_cuda_initialized() {
+  return t_nvcd_user;
+}
+
+void nvcd_set_device_free(nvcd_device_free_fn_t fn) {
+  C_ASSERT(pthread_mutex_lock(&g_nvcd_lock) == 0);
+  g_device_free = fn;
+  C_ASSERT(pthread_mutex_unlock(&g_nvcd_lock) == 0);
+}
+
+static inline void session_event_data_free(nvcd_session_t* session);
+
+static void session_clear_key(nvcd_session_t* session);
+
+void nvcd_terminate_cuda() {
+  if (!t_nvcd_user) {
+    return;
+  }
+  
+  ASSERT(t_session == NULL /* nvcd_reset_event_data() must be called first */);
+  
+  C_ASSERT(pthread_mutex_lock(&g_nvcd_lock) == 0);
+
+  ASSERT(g_nvcd_users > 0);
+  g_nvcd_users--;
+  t_nvcd_user = false;
+  
+  // the last thread tears everything down
+  if (g_nvcd_users == 0) {
+    for (int i = 0; i < g_nvcd.num_devices; ++i) {
+      session_event_data_free(&g_sessions[i]);
+      session_clear_key(&g_sessions[i]);
+      nvcd_arena_free(&g_sessions[i].arena);
+      pthread_mutex_destroy(&g_sessions[i].lock);
+    }
+
+    safe_free_v(g_sessions);
+
+    cupti_subscriber_terminate();
+
+    if (g_device_free != NULL) {
+      g_device_free();
+    }
+    
+    for (int i = 0; i < g_nvcd.num_devices; ++i) {
+      ASSERT(g_nvcd.contexts[i] != NULL);
+      safe_free_v(g_nvcd.device_names[i]);
+            
+      if (g_nvcd.contexts_ext[i] == false) {
+	CUDA_DRIVER_FN(cuDevicePrimaryCtxRelease(g_nvcd.devices[i]));
+      }
+    }
+
+    safe_free_v(g_nvcd.device_names);
+    safe_free_v(g_nvcd.device_uuids);
+    safe_free_v(g_nvcd.contexts_ext);
+    safe_free_v(g_nvcd.devices);
+    safe_free_v(g_nvcd.contexts);
+
+    g_nvcd.num_devices = 0;
+    g_nvcd.initialized = false;
+  }
+
+  C_ASSERT(pthread_mutex_unlock(&g_nvcd_lock) == 0);
+}
+
+static inline bool session_key_eq(const char* key, const char* env_value) {
+  return
+    (key == NULL && env_value == NULL) ||
+    (key != NULL && env_value != NULL && strcmp(key, env_value) == 0);
+}
+
+static inline char* session_key_dup(const char* env_value) {
+  return env_value != NULL ? NOT_NULL(strdup(env_value)) : NULL;
+}
+
+static void session_clear_key(nvcd_session_t* session) {
+  safe_free_v(session->events_key);
+  safe_free_v(session->metrics_key);
+}
+
+static inline void session_event_data_free(nvcd_session_t* session) {
+  if (session->event_data.initialized) {
+    cupti_event_data_free(&session->event_data);
+  }
+  
+  cupti_event_data_set_null(&session->event_data);
+}
+
+static bool session_reusable(nvcd_session_t* session, CUcontext context) {
+  return
+    t_session_active &&
+    session->event_data.initialized &&
+    session->event_data.cuda_context == context &&
+    session_key_eq(session->events_key, getenv(ENV_EVENTS)) &&
+    session_key_eq(session->metrics_key, getenv(ENV_METRICS));
+}
+
+int nvcd_device_index(CUdevice device) {
+  int i = 0;
+  
+  while (i < g_nvcd.num_devices && g_nvcd.devices[i] != device) {
+    i++;
+  }
+
+  ASSERT(i < g_nvcd.num_devices);
+
+  return i;
+}
+
+int nvcd_current_device(CUcontext* context) {
+  ASSERT(g_nvcd.initialized == true);
+  ASSERT(context != NULL);
+  
+  CUcontext current = NULL;
+  int index = 0;
+  
+  CUDA_DRIVER_FN(cuCtxGetCurrent(&current));
+
+  if (current != NULL) {
+    CUdevice device = 0;
+    CUDA_DRIVER_FN(cuCtxGetDevice(&device));
+    index = nvcd_device_index(device);
+  } else {
+    // the runtime hasn't made a context current yet,
+    // so the launch will go to the primary context
+    CUDA_RUNTIME_FN(cudaGetDevice(&index));
+    current = g_nvcd.contexts[index];
+  }
+
+  *context = current;
+  
+  return index;
+}
+
+static void session_unlock() {
+  if (t_session_locked) {
+    C_ASSERT(pthread_mutex_unlock(&t_session->lock) == 0);
+    t_session_locked = false;
+  }
+}
+
+// Only one session is locked at a time; a thread
+// can walk every device, as nvcd_device_info does.
+static void session_lock(nvcd_session_t* session) {
+  if (t_session != session) {
+    session_unlock();
+  }
+
+  if (!t_session_locked) {
+    C_ASSERT(pthread_mutex_lock(&session->lock) == 0);
+    t_session_locked = true;
+  }
+
+  t_session = session;
+}
+
+// whichever thread left it
+static void session_complete_pending(nvcd_session_t* session) {
+  ASSERT(t_session == session && t_session_locked);
+
+  nvcd_pending_fn_t fn = session->pending_fn;
+  
+  if (fn != NULL) {
+    session->pending_fn = NULL;
+    fn(session->pending_arg);
+    session->pending_arg = NULL;
+  }
+}
+
+static void session_join(nvcd_session_t* session) {
+  ASSERT(t_session == session && t_session_locked);
+
+  if (t_session_active) {
+    uint32_t index = (uint32_t) (session - g_sessions);
+    
+    if (t_joined == NULL) {
+      t_joined = zallocNN(sizeof(t_joined[0]) * BITSET_NUM_WORDS(g_nvcd.num_devices));
+    }
+
+    if (!bitset_test(t_joined, index)) {
+      bitset_set(t_joined, index);
+      session->num_users++;
+    }
+  }
+}
+
+// The event data is kept while another thread's
+// session might launch with it again.
+static void session_leave(nvcd_session_t* session) {
+  ASSERT(t_session == session && t_session_locked);
+  
+  uint32_t index = (uint32_t) (session - g_sessions);
+
+  if (t_joined != NULL && bitset_test(t_joined, index)) {
+    bitset_clear(t_joined, index);
+
+    ASSERT(session->num_users > 0);
+    session->num_users--;
+  }
+
+  if (session->num_users == 0) {
+    session_event_data_free(session);
+    session_clear_key(session);
+  }
+}
+
+void nvcd_session_begin() {
+  ASSERT(t_session_active == false);
+  t_session_active = true;
+}
+
+void nvcd_session_end() {
+  ASSERT(t_session_active == true);
+  t_session_active = false;
+}
+
+bool nvcd_session_active() {
+  return t_session_active;
 }
 
 void nvcd_init_events(CUdevice device, CUcontext context) {
-  g_event_data.cuda_context = context;
-  g_event_data.cuda_device = device;
-  g_event_data.is_root = true;
+  ASSERT(g_nvcd.initialized == true);
+
+  nvcd_session_t* session = &g_sessions[nvcd_device_index(device)];
 
-  cupti_event_data_init(&g_event_data);
+  session_lock(session);
+  session_complete_pending(session);
+  session_join(session);
+  
+  if (session_reusable(session, context)) {
+    cupti_event_data_reset(&session->event_data);
+    return;
+  }
+
+  session_event_data_free(session);
+  session_clear_key(session);
+
+  if (t_session_active) {
+    session->events_key = session_key_dup(getenv(ENV_EVENTS));
+    session->metrics_key = session_key_dup(getenv(ENV_METRICS));
+  }
+
+  cupti_event_data_t* e = &session->event_data;
+  
+  e->cuda_context = context;
+  e->cuda_device = device;
+  e->arena = &session->arena;
+  e->is_root = true;
+
+  cupti_event_data_init(e);
 }
 
 void nvcd_calc_metrics() {
   if (nvcd_has_metrics()) {
-    cupti_event_data_calc_metrics(&g_event_data);
+    cupti_event_data_calc_metrics(nvcd_get_events());
+  }
+}
+
+NVCD_EXPORT bool nvcd_has_metrics() { return nvcd_get_events()->has_metrics; }
+
+NVCD_EXPORT bool nvcd_has_events() { return nvcd_get_events()->has_events; }
+
+void nvcd_release_events() {
+  session_unlock();
+}
+
+void nvcd_release_events_pending(nvcd_pending_fn_t fn, void* arg) {
+  ASSERT(t_session_locked);
+  ASSERT(t_session->pending_fn == NULL);
+  ASSERT(fn != NULL);
+
+  t_session->pending_fn = fn;
+  t_session->pending_arg = arg;
+  t_pending = t_session;
+
+  session_unlock();
+}
+
+void nvcd_complete_pending() {
+  if (t_pending != NULL) {
+    session_lock(t_pending);
+    session_complete_pending(t_pending);
+    session_unlock();
+    
+    t_pending = NULL;
   }
 }
 
-NVCD_EXPORT bool nvcd_has_metrics() { return g_event_data.has_metrics; }
+bool nvcd_lock_events() {
+  if (t_session != NULL) {
+    session_lock(t_session);
+    session_complete_pending(t_session);
+  }
+  
+  return t_session != NULL;
+}
 
-NVCD_EXPORT bool nvcd_has_events() { return g_event_data.has_events; }
 void nvcd_reset_event_data() {
-  cupti_event_data_free(&g_event_data);
-  cupti_event_data_set_null(&g_event_data);
+  nvcd_complete_pending();
+  
+  if (t_session != NULL) {
+    session_lock(t_session);
+    session_complete_pending(t_session);
+    session_leave(t_session);
+    session_unlock();
+  }
+
+  if (t_joined != NULL) {
+    BITSET_FOR_EACH(t_joined, BITSET_NUM_WORDS(g_nvcd.num_devices), i) {
+      session_lock(&g_sessions[i]);
+      session_complete_pending(&g_sessions[i]);
+      session_leave(&g_sessions[i]);
+      session_unlock();
+    }
+
+    safe_free_v(t_joined);
+  }
+
+  t_session = NULL;
 }
 
 cupti_event_data_t* nvcd_get_events() {
-  return &g_event_data;
+  ASSERT(t_session_locked /* nvcd_init_events() or nvcd_lock_events() must be called first */);
+  return &t_session->event_data;
 }
 
 //#include "device.cuh"
@@ -0,0 +1,409 @@
+#include "nvcd/plan_cache.h"
+#include "nvcd/util.h"
+#include "nvcd/env_var.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+C_LINKAGE_START
+
+#define PLAN_CACHE_DEVICE_NAME_LENGTH 256
+
+// Everything that has to match for a cache file to be used.
+// Compared with memcmp, so it's zeroed before being filled in.
+typedef struct plan_cache_key {
+  char device_name[PLAN_CACHE_DEVICE_NAME_LENGTH];
+  int32_t cc_major;
+  int32_t cc_minor;
+  int32_t driver_version;
+  uint32_t cupti_version;
+  uint64_t set_hash;
+  uint32_t set_length; // of the event set string, including the null terminator
+  uint32_t reserved;
+} plan_cache_key_t;
+
+// The file is this header, followed by the event set string
+// (padded to a multiple of 4 bytes), followed by the plan's arrays
+// in the order of the counts below.
+typedef struct plan_cache_file_header {
+  char magic[8]; // NVCD_PLAN_CACHE_MAGIC, null terminated
+  uint32_t version;
+  uint32_t header_size; // sizeof(plan_cache_file_header_t)
+  plan_cache_key_t key;
+  uint32_t num_requested_event_ids;
+  uint32_t num_group_event_ids;
+  uint32_t num_groups; // group_offsets has num_groups + 1 entries, pass_groups has num_groups
+  uint32_t num_passes; // pass_offsets has num_passes + 1 entries
+} plan_cache_file_header_t;
+
+static uint64_t plan_cache_hash(uint64_t hash, const void* data, size_t length) {
+  // 64 bit FNV-1a
+  const uint8_t* bytes = (const uint8_t*) data;
+
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+#define PLAN_CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+static inline uint32_t plan_cache_pad4(uint32_t size) {
+  return (size + 3) & ~(uint32_t)3;
+}
+
+// The requested event set is the values of ENV_EVENTS and ENV_METRICS,
+// as given; an unset variable is left out, so it differs from an empty one.
+static char* plan_cache_event_set() {
+  const char* names[] = { ENV_EVENTS, ENV_METRICS };
+
+  size_t length = 0;
+
+  for (size_t i = 0; i < ARRAY_LENGTH(names); ++i) {
+    const char* value = getenv(names[i]);
+
+    if (value != NULL) {
+      length += strlen(names[i]) + strlen(value) + 2;
+    }
+  }
+
+  char* set = zallocNN(length + 1);
+  char* p = set;
+
+  for (size_t i = 0; i < ARRAY_LENGTH(names); ++i) {
+    const char* value = getenv(names[i]);
+
+    if (value != NULL) {
+      p += sprintf(p, "%s=%s\n", names[i], value);
+    }
+  }
+
+  return set;
+}
+
+static void plan_cache_make_key(CUdevice device, const char* set, plan_cache_key_t* key) {
+  memset(key, 0, sizeof(*key));
+
+  CUDA_DRIVER_FN(cuDeviceGetName(&key->device_name[0],
+                                 sizeof(key->device_name) - 1,
+                                 device));
+
+  int value = 0;
+
+  CUDA_DRIVER_FN(cuDeviceGetAttribute(&value, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, device));
+  key->cc_major = value;
+
+  CUDA_DRIVER_FN(cuDeviceGetAttribute(&value, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, device));
+  key->cc_minor = value;
+
+  CUDA_DRIVER_FN(cuDriverGetVersion(&value));
+  key->driver_version = value;
+
+  CUPTI_FN(cuptiGetVersion(&key->cupti_version));
+
+  key->set_length = (uint32_t) strlen(set) + 1;
+  key->set_hash = plan_cache_hash(PLAN_CACHE_HASH_INIT, set, key->set_length);
+}
+
+// Files are named after a hash of the whole key,
+// so every device and event set gets its own.
+static char* plan_cache_path(const plan_cache_key_t* key) {
+  const char* dir = getenv(ENV_PLAN_CACHE);
+  ASSERT(dir != NULL);
+
+  uint64_t hash = plan_cache_hash(PLAN_CACHE_HASH_INIT, key, sizeof(*key));
+
+  size_t length = strlen(dir) + 64;
+  char* path = mallocNN(length);
+
+  snprintf(path, length, "%s/nvcd_plan.%016" PRIx64 ".bin", dir, hash);
+
+  return path;
+}
+
+static size_t plan_cache_file_size(const plan_cache_file_header_t* header) {
+  size_t num_u32 =
+    (size_t) header->num_requested_event_ids +
+    (size_t) header->num_group_event_ids +
+    (size_t) header->num_groups + 1 + // group_offsets
+    (size_t) header->num_groups + // pass_groups
+    (size_t) header->num_passes + 1; // pass_offsets
+
+  return
+    sizeof(*header) +
+    plan_cache_pad4(header->key.set_length) +
+    num_u32 * sizeof(uint32_t);
+}
+
+// The file has been keyed correctly, but may still have been
+// truncated or corrupted, so everything used as an index is checked.
+static bool plan_cache_validate(const nvcd_plan_t* plan) {
+  if (plan->num_groups == 0 || plan->num_passes > plan->num_groups) {
+    return false;
+  }
+
+  if (plan->group_offsets[0] != 0) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < plan->num_groups; ++i) {
+    if (plan->group_offsets[i] >= plan->group_offsets[i + 1]) {
+      return false;
+    }
+  }
+
+  if (plan->pass_offsets[0] != 0 ||
+      plan->pass_offsets[plan->num_passes] > plan->num_groups) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < plan->num_passes; ++i) {
+    if (plan->pass_offsets[i] >= plan->pass_offsets[i + 1]) {
+      return false;
+    }
+  }
+
+  // every group is stored exactly once
+  uint8_t* seen = zallocNN(sizeof(seen[0]) * plan->num_groups);
+  bool valid = true;
+
+  for (uint32_t i = 0; i < plan->num_groups && valid; ++i) {
+    uint32_t g = plan->pass_groups[i];
+    valid = g < plan->num_groups && !seen[g];
+
+    if (valid) {
+      seen[g] = 1;
+    }
+  }
+
+  free(seen);
+
+  return valid;
+}
+
+static const uint32_t* plan_cache_copy(uint32_t** dst,
+                                       const uint32_t* src,
+                                       uint32_t count,
+                                       uint32_t capacity) {
+  *dst = zallocNN(sizeof(uint32_t) * (capacity + 1));
+  memcpy(*dst, src, sizeof(uint32_t) * count);
+  return src + count;
+}
+
+NVCD_EXPORT bool nvcd_plan_cache_enabled() {
+  const char* dir = getenv(ENV_PLAN_CACHE);
+  return dir != NULL && dir[0] != '\0';
+}
+
+NVCD_EXPORT bool nvcd_plan_cache_load(CUdevice device, nvcd_plan_t* plan) {
+  nvcd_plan_t empty = NVCD_PLAN_INIT;
+  *plan = empty;
+
+  if (!nvcd_plan_cache_enabled()) {
+    return false;
+  }
+
+  char* set = plan_cache_event_set();
+
+  plan_cache_key_t key;
+  plan_cache_make_key(device, set, &key);
+
+  char* path = plan_cache_path(&key);
+
+  bool loaded = false;
+
+  int fd = open(path, O_RDONLY);
+
+  if (fd != -1) {
+    struct stat st;
+    void* map = MAP_FAILED;
+    size_t size = 0;
+
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(plan_cache_file_header_t)) {
+      size = (size_t) st.st_size;
+      map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    close(fd);
+
+    if (map != MAP_FAILED) {
+      const plan_cache_file_header_t* header = (const plan_cache_file_header_t*) map;
+      const char* file_set = (const char*) (header + 1);
+
+      loaded =
+        memcmp(&header->magic[0], NVCD_PLAN_CACHE_MAGIC, sizeof(NVCD_PLAN_CACHE_MAGIC)) == 0 &&
+        header->version == NVCD_PLAN_CACHE_VERSION &&
+        header->header_size == sizeof(*header) &&
+        memcmp(&header->key, &key, sizeof(key)) == 0 &&
+        plan_cache_file_size(header) == size &&
+        memcmp(file_set, set, key.set_length) == 0;
+
+      if (loaded) {
+        const uint32_t* p =
+          (const uint32_t*) (file_set + plan_cache_pad4(key.set_length));
+
+        plan->num_requested_event_ids = header->num_requested_event_ids;
+        plan->num_groups = header->num_groups;
+        plan->num_passes = header->num_passes;
+
+        p = plan_cache_copy(&plan->requested_event_ids, p,
+                            header->num_requested_event_ids,
+                            header->num_requested_event_ids);
+        p = plan_cache_copy(&plan->group_event_ids, p,
+                            header->num_group_event_ids,
+                            header->num_group_event_ids);
+        p = plan_cache_copy(&plan->group_offsets, p,
+                            header->num_groups + 1,
+                            header->num_groups + 1);
+        p = plan_cache_copy(&plan->pass_groups, p,
+                            header->num_groups,
+                            header->num_groups);
+        // allocated for as many passes as there are groups,
+        // as plan_event_group_passes() does
+        p = plan_cache_copy(&plan->pass_offsets, p,
+                            header->num_passes + 1,
+                            header->num_groups + 1);
+
+        loaded =
+          plan->group_offsets[plan->num_groups] == header->num_group_event_ids &&
+          plan_cache_validate(plan);
+
+        if (!loaded) {
+          msg_warnf("ignoring invalid plan cache file %s\n", path);
+          nvcd_plan_free(plan);
+        }
+      }
+
+      munmap(map, size);
+    }
+  }
+
+  msg_verbosef("plan cache %s: %s\n", loaded ? "hit" : "miss", path);
+
+  free(path);
+  free(set);
+
+  return loaded;
+}
+
+static bool plan_cache_write_all(int fd, const uint8_t* data, size_t length) {
+  while (length > 0) {
+    ssize_t n = write(fd, data, length);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    data += n;
+    length -= (size_t) n;
+  }
+
+  return true;
+}
+
+static uint8_t* plan_cache_append(uint8_t* p, const uint32_t* src, uint32_t count) {
+  memcpy(p, src, sizeof(uint32_t) * count);
+  return p + sizeof(uint32_t) * count;
+}
+
+NVCD_EXPORT void nvcd_plan_cache_save(CUdevice device, const nvcd_plan_t* plan) {
+  if (!nvcd_plan_cache_enabled()) {
+    return;
+  }
+
+  char* set = plan_cache_event_set();
+
+  plan_cache_file_header_t header;
+  memset(&header, 0, sizeof(header));
+
+  memcpy(&header.magic[0], NVCD_PLAN_CACHE_MAGIC, sizeof(NVCD_PLAN_CACHE_MAGIC));
+  header.version = NVCD_PLAN_CACHE_VERSION;
+  header.header_size = sizeof(header);
+
+  plan_cache_make_key(device, set, &header.key);
+
+  header.num_requested_event_ids = plan->num_requested_event_ids;
+  header.num_group_event_ids = plan->group_offsets[plan->num_groups];
+  header.num_groups = plan->num_groups;
+  header.num_passes = plan->num_passes;
+
+  size_t size = plan_cache_file_size(&header);
+  uint8_t* data = zallocNN(size);
+  uint8_t* p = data;
+
+  memcpy(p, &header, sizeof(header));
+  p += sizeof(header);
+
+  memcpy(p, set, header.key.set_length);
+  p += plan_cache_pad4(header.key.set_length);
+
+  p = plan_cache_append(p, plan->requested_event_ids, header.num_requested_event_ids);
+  p = plan_cache_append(p, plan->group_event_ids, header.num_group_event_ids);
+  p = plan_cache_append(p, plan->group_offsets, header.num_groups + 1);
+  p = plan_cache_append(p, plan->pass_groups, header.num_groups);
+  p = plan_cache_append(p, plan->pass_offsets, header.num_passes + 1);
+
+  ASSERT((size_t)(p - data) == size);
+
+  const char* dir = getenv(ENV_PLAN_CACHE);
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    msg_warnf("could not create %s = %s\n", ENV_PLAN_CACHE, dir);
+  }
+
+  char* path = plan_cache_path(&header.key);
+
+  // every process writes its own file, and the
+  // rename replaces the cached one in a single step
+  size_t tmp_length = strlen(path) + 32;
+  char* tmp_path = mallocNN(tmp_length);
+  snprintf(tmp_path, tmp_length, "%s.%d.tmp", path, (int) getpid());
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool saved = fd != -1;
+
+  if (saved) {
+    saved = plan_cache_write_all(fd, data, size);
+    saved = close(fd) == 0 && saved;
+    saved = saved && rename(tmp_path, path) == 0;
+
+    if (!saved) {
+      unlink(tmp_path);
+    }
+  }
+
+  if (saved) {
+    msg_verbosef("plan cache saved: %s\n", path);
+  } else {
+    msg_warnf("could not write plan cache file %s\n", path);
+  }
+
+  free(tmp_path);
+  free(path);
+  free(data);
+  free(set);
+}
+
+NVCD_EXPORT void nvcd_plan_free(nvcd_plan_t* plan) {
+  safe_free_v(plan->requested_event_ids);
+  safe_free_v(plan->group_event_ids);
+  safe_free_v(plan->group_offsets);
+  safe_free_v(plan->pass_groups);
+  safe_free_v(plan->pass_offsets);
+
+  plan->num_requested_event_ids = 0;
+  plan->num_groups = 0;
+  plan->num_passes = 0;
+}
+
+C_LINKAGE_END
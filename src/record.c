@@ -0,0 +1,560 @@
+#include "nvcd/record.h"
+#include "nvcd/cupti_util.h"
+#include "nvcd/nvcd.h"
+#include "nvcd/util.h"
+#include "nvcd/env_var.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+C_LINKAGE_START
+
+// the file grows by doubling, starting from this
+#define RECORD_INITIAL_CAPACITY ((size_t)1 << 24)
+
+typedef struct record_writer {
+  int fd;
+  uint8_t* map;
+  size_t capacity; // of the mapping
+  size_t length; // used, including the file header
+
+  uint64_t num_launches;
+
+  // IDs whose names have been written, sorted per kind
+  uint32_t* named[NVCD_RECORD_NAME_COUNT];
+  uint32_t num_named[NVCD_RECORD_NAME_COUNT];
+  uint32_t named_capacity[NVCD_RECORD_NAME_COUNT];
+
+  // region IDs are indices into this
+  char** region_names;
+  uint32_t num_regions;
+  uint32_t region_names_capacity;
+
+  bool32_t open;
+} record_writer_t;
+
+static record_writer_t g_record = {
+  .fd = -1,
+  .map = NULL,
+  .capacity = 0,
+  .length = 0,
+  .num_launches = 0,
+  .named = { NULL },
+  .num_named = { 0 },
+  .named_capacity = { 0 },
+  .region_names = NULL,
+  .num_regions = 0,
+  .region_names_capacity = 0,
+  .open = false
+};
+
+// Every append is made under this, which is only
+// taken once per launch for the counters themselves.
+static pthread_mutex_t g_record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t g_record_once = PTHREAD_ONCE_INIT;
+
+static bool record_map(size_t capacity) {
+  bool ok =
+    C_ASSERT(ftruncate(g_record.fd, (off_t)capacity) == 0);
+
+  if (ok) {
+    void* map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, g_record.fd, 0);
+
+    ok = C_ASSERT(map != MAP_FAILED);
+
+    if (ok) {
+      g_record.map = (uint8_t*) map;
+      g_record.capacity = capacity;
+    }
+  }
+
+  return ok;
+}
+
+// the MPI rank, from the variables set by the common launchers
+static const char* record_rank() {
+  static const char* const vars[] = {
+    "OMPI_COMM_WORLD_RANK",
+    "PMI_RANK",
+    "PMIX_RANK",
+    "SLURM_PROCID"
+  };
+
+  for (size_t i = 0; i < ARRAY_LENGTH(vars); ++i) {
+    const char* rank = getenv(vars[i]);
+
+    if (rank != NULL && rank[0] != '\0') {
+      return rank;
+    }
+  }
+
+  return NULL;
+}
+
+// Expands %p to the process ID and %r to the rank (or the process ID,
+// outside of MPI) in ENV_RECORD, so that processes sharing the same
+// setting don't truncate each other's files. Without either, ".<pid>"
+// is appended.
+static char* record_path(const char* pattern) {
+  char pid[32];
+  snprintf(pid, sizeof(pid), "%ld", (long) getpid());
+
+  const char* rank = record_rank();
+
+  if (rank == NULL) {
+    rank = pid;
+  }
+
+  // every token grows by at most this much
+  size_t extra = strlen(pid) > strlen(rank) ? strlen(pid) : strlen(rank);
+  size_t capacity = strlen(pattern) * (extra + 1) + strlen(pid) + 2;
+
+  char* path = mallocNN(capacity);
+  size_t length = 0;
+  bool expanded = false;
+
+  for (const char* c = pattern; *c != '\0'; ++c) {
+    const char* token = NULL;
+
+    if (c[0] == '%' && c[1] == 'p') {
+      token = pid;
+    } else if (c[0] == '%' && c[1] == 'r') {
+      token = rank;
+    } else if (c[0] == '%' && c[1] == '%') {
+      token = "%";
+    }
+
+    if (token != NULL) {
+      expanded = expanded || c[1] != '%';
+      length += (size_t) sprintf(&path[length], "%s", token);
+      c++;
+    } else {
+      path[length++] = *c;
+    }
+  }
+
+  path[length] = '\0';
+
+  if (!expanded) {
+    sprintf(&path[length], ".%s", pid);
+  }
+
+  return path;
+}
+
+static void record_open() {
+  const char* pattern = getenv(ENV_RECORD);
+
+  if (pattern == NULL || pattern[0] == '\0') {
+    return;
+  }
+
+  char* path = record_path(pattern);
+
+  g_record.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+  if (g_record.fd == -1) {
+    msg_errorf("could not open %s = %s (%s)\n", ENV_RECORD, pattern, path);
+  }
+
+  free(path);
+
+  if (g_record.fd == -1) {
+    return;
+  }
+
+  if (!record_map(RECORD_INITIAL_CAPACITY)) {
+    close(g_record.fd);
+    g_record.fd = -1;
+    return;
+  }
+
+  nvcd_record_file_header_t* header = (nvcd_record_file_header_t*) g_record.map;
+
+  memcpy(&header->magic[0], NVCD_RECORD_MAGIC, sizeof(NVCD_RECORD_MAGIC));
+  header->version = NVCD_RECORD_VERSION;
+  header->header_size = sizeof(*header);
+  header->length = 0;
+
+  g_record.length = sizeof(*header);
+
+  for (uint32_t k = 0; k < NVCD_RECORD_NAME_COUNT; ++k) {
+    g_record.named_capacity[k] = 64;
+    g_record.named[k] = zallocNN(sizeof(g_record.named[k][0]) * g_record.named_capacity[k]);
+  }
+
+  g_record.region_names_capacity = 64;
+  g_record.region_names = zallocNN(sizeof(g_record.region_names[0]) *
+                                   g_record.region_names_capacity);
+
+  g_record.open = true;
+
+  atexit(nvcd_record_close);
+}
+
+// Returns space for size more bytes, which the caller fills in
+// before releasing g_record_lock. The mapping may move, so nothing
+// returned by a previous call can be used after this.
+static uint8_t* record_reserve(uint32_t size) {
+  ASSERT(size % NVCD_RECORD_ALIGN == 0);
+
+  uint8_t* ret = NULL;
+
+  if (g_record.open) {
+    size_t capacity = g_record.capacity;
+
+    while (g_record.length + size > capacity) {
+      capacity <<= 1;
+    }
+
+    bool ok = true;
+
+    if (capacity != g_record.capacity) {
+      C_ASSERT(munmap(g_record.map, g_record.capacity) == 0);
+      g_record.map = NULL;
+      ok = record_map(capacity);
+
+      // nothing more can be written, but what's
+      // there is still intact in the file
+      if (!ok) {
+        g_record.open = false;
+      }
+    }
+
+    if (ok) {
+      ret = &g_record.map[g_record.length];
+      g_record.length += size;
+    }
+  }
+
+  return ret;
+}
+
+static bool record_named(uint32_t kind, uint32_t id, uint32_t* index) {
+  uint32_t lo = 0;
+  uint32_t hi = g_record.num_named[kind];
+
+  while (lo < hi) {
+    uint32_t mid = lo + ((hi - lo) >> 1);
+
+    if (g_record.named[kind][mid] < id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  *index = lo;
+
+  return lo < g_record.num_named[kind] && g_record.named[kind][lo] == id;
+}
+
+// writes the name the first time the id is seen
+static void record_name(uint32_t kind, uint32_t id, const char* name) {
+  uint32_t index = 0;
+
+  if (record_named(kind, id, &index)) {
+    return;
+  }
+
+  MAYBE_GROW_BUFFER_U32_NN(g_record.named[kind],
+                           g_record.num_named[kind],
+                           g_record.named_capacity[kind]);
+
+  memmove(&g_record.named[kind][index + 1],
+          &g_record.named[kind][index],
+          sizeof(g_record.named[kind][0]) * (g_record.num_named[kind] - index));
+
+  g_record.named[kind][index] = id;
+  g_record.num_named[kind]++;
+
+  uint32_t length = (uint32_t) strlen(name);
+  uint32_t size = nvcd_record_align(sizeof(nvcd_record_name_t) + length + 1);
+
+  uint8_t* p = record_reserve(size);
+
+  if (p != NULL) {
+    nvcd_record_name_t* r = (nvcd_record_name_t*) p;
+
+    r->header.type = NVCD_RECORD_NAME;
+    r->header.size = size;
+    r->kind = kind;
+    r->id = id;
+    r->length = length;
+    r->reserved = 0;
+
+    // the padding is already zeroed by ftruncate()
+    memcpy(p + sizeof(*r), name, length);
+  }
+}
+
+static void record_event_name(cupti_event_data_t* e, CUpti_EventID event) {
+  uint32_t index = 0;
+
+  if (!record_named(NVCD_RECORD_NAME_EVENT, event, &index)) {
+    const char* name = cupti_event_data_event_name(e, event);
+    ASSERT(name != NULL);
+    record_name(NVCD_RECORD_NAME_EVENT, event, name);
+  }
+}
+
+static void record_metric_name(cupti_event_data_t* e, CUpti_MetricID metric) {
+  uint32_t index = 0;
+
+  if (!record_named(NVCD_RECORD_NAME_METRIC, metric, &index)) {
+    const char* name = cupti_event_data_metric_name(e, metric);
+    ASSERT(name != NULL);
+    record_name(NVCD_RECORD_NAME_METRIC, metric, name);
+  }
+}
+
+static void record_device_name(uint32_t device) {
+  uint32_t index = 0;
+
+  if (!record_named(NVCD_RECORD_NAME_DEVICE, device, &index)) {
+    char uuid[NVCD_UUID_STR_LENGTH];
+    record_name(NVCD_RECORD_NAME_DEVICE,
+                device,
+                nvcd_device_uuid_str((int) device, uuid, sizeof(uuid)));
+  }
+}
+
+// runs code for every group that's been read, with the pass it was read in
+#define RECORD_FOR_EACH_READ_GROUP(e, group, pass, code)                 \
+  do {                                                                  \
+    const uint64_t* read_ =                                             \
+      cupti_event_group_states((e), CED_EVENT_GROUP_READ);              \
+    if ((e)->num_passes > 0) {                                          \
+      for (uint32_t pass = 0; pass < (e)->num_passes; ++pass) {         \
+        for (uint32_t k_ = (e)->pass_offsets[pass];                     \
+             k_ < (e)->pass_offsets[pass + 1];                          \
+             ++k_) {                                                    \
+          uint32_t group = (e)->pass_groups[k_];                        \
+          if (bitset_test(read_, group)) {                              \
+            code;                                                       \
+          }                                                             \
+        }                                                               \
+      }                                                                 \
+    } else {                                                            \
+      uint32_t pass = UINT32_MAX;                                       \
+      BITSET_FOR_EACH(read_, (e)->num_event_group_words, group) {       \
+        code;                                                           \
+      }                                                                 \
+    }                                                                   \
+  } while (0)
+
+static void record_counters(cupti_event_data_t* e,
+                            uint32_t region_id,
+                            uint64_t kernel_id,
+                            uint32_t device,
+                            uint64_t launch) {
+  uint64_t kernel_time_nsec = e->num_kernel_times > 0 ? e->kernel_times_nsec[0] : 0;
+
+  // names first, so that they precede the records using them
+  uint64_t total = 0;
+
+  RECORD_FOR_EACH_READ_GROUP(e, group, pass, {
+      uint32_t ib_offset = e->event_id_buffer_offsets[group];
+      uint32_t nepg = e->num_events_per_group[group];
+      uint32_t nipg = e->num_instances_per_group[group];
+
+      for (uint32_t event = 0; event < nepg; ++event) {
+        record_event_name(e, e->event_id_buffer[ib_offset + event]);
+      }
+
+      total += (uint64_t) nepg *
+        nvcd_record_align(sizeof(nvcd_record_counters_t) + sizeof(uint64_t) * nipg);
+      (void) pass;
+    });
+
+  if (total == 0 || total > UINT32_MAX) {
+    ASSERT(total <= UINT32_MAX);
+    return;
+  }
+
+  // a single reservation for the whole launch
+  uint8_t* p = record_reserve((uint32_t) total);
+
+  if (p == NULL) {
+    return;
+  }
+
+  RECORD_FOR_EACH_READ_GROUP(e, group, pass, {
+      uint32_t ib_offset = e->event_id_buffer_offsets[group];
+      uint32_t cb_offset = e->event_counter_buffer_offsets[group];
+      uint32_t nepg = e->num_events_per_group[group];
+      uint32_t nipg = e->num_instances_per_group[group];
+      uint32_t size = nvcd_record_align(sizeof(nvcd_record_counters_t) + sizeof(uint64_t) * nipg);
+
+      for (uint32_t event = 0; event < nepg; ++event) {
+        nvcd_record_counters_t* r = (nvcd_record_counters_t*) p;
+
+        r->header.type = NVCD_RECORD_COUNTERS;
+        r->header.size = size;
+        r->kernel_id = kernel_id;
+        r->launch = launch;
+        r->kernel_time_nsec = kernel_time_nsec;
+        r->region_id = region_id;
+        r->device = device;
+        r->pass = pass;
+        r->event_id = e->event_id_buffer[ib_offset + event];
+        r->num_instances = nipg;
+        r->reserved = 0;
+
+        // instances of the same event are nepg apart
+        uint64_t* values = (uint64_t*) (p + sizeof(*r));
+        uint64_t* counters = &e->event_counter_buffer[cb_offset + event];
+
+        for (uint32_t instance = 0; instance < nipg; ++instance) {
+          values[instance] = counters[instance * nepg];
+        }
+
+        p += size;
+      }
+    });
+}
+
+static void record_metrics(cupti_event_data_t* e,
+                           uint32_t region_id,
+                           uint64_t kernel_id,
+                           uint32_t device,
+                           uint64_t launch) {
+  cupti_metric_data_t* m = e->metric_data;
+
+  for (uint32_t i = 0; i < m->num_metrics; ++i) {
+    record_metric_name(e, m->metric_ids[i]);
+  }
+
+  uint32_t size = sizeof(nvcd_record_metric_t);
+
+  ASSERT(size == nvcd_record_align(size));
+
+  uint8_t* p = record_reserve(size * m->num_metrics);
+
+  if (p == NULL) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < m->num_metrics; ++i) {
+    nvcd_record_metric_t* r = (nvcd_record_metric_t*) (p + size * i);
+
+    r->header.type = NVCD_RECORD_METRIC;
+    r->header.size = size;
+    r->kernel_id = kernel_id;
+    r->launch = launch;
+    r->region_id = region_id;
+    r->device = device;
+    r->metric_id = m->metric_ids[i];
+    r->kind = NVCD_RECORD_METRIC_NOT_COMPUTED;
+    r->value = 0;
+
+    if (m->computed[i]) {
+      r->kind = (uint32_t) m->value_kinds[i];
+
+      C_ASSERT(sizeof(m->metric_values[i]) == sizeof(r->value));
+      memcpy(&r->value, &m->metric_values[i], sizeof(r->value));
+    }
+  }
+}
+
+NVCD_EXPORT bool nvcd_record_enabled() {
+  pthread_once(&g_record_once, record_open);
+  return g_record.open;
+}
+
+NVCD_EXPORT uint32_t nvcd_record_region(const char* name) {
+  ASSERT(name != NULL);
+
+  uint32_t id = 0;
+
+  C_ASSERT(pthread_mutex_lock(&g_record_lock) == 0);
+
+  // there are few regions, and callers cache their ID
+  while (id < g_record.num_regions && strcmp(g_record.region_names[id], name) != 0) {
+    id++;
+  }
+
+  if (id == g_record.num_regions && g_record.open) {
+    MAYBE_GROW_BUFFER_U32_NN(g_record.region_names,
+                             g_record.num_regions,
+                             g_record.region_names_capacity);
+
+    g_record.region_names[id] = strdup(name);
+    g_record.num_regions++;
+
+    record_name(NVCD_RECORD_NAME_REGION, id, name);
+  }
+
+  C_ASSERT(pthread_mutex_unlock(&g_record_lock) == 0);
+
+  return id;
+}
+
+NVCD_EXPORT void nvcd_record_event_data(cupti_event_data_t* e,
+                                        uint32_t region_id,
+                                        uint64_t kernel_id,
+                                        uint32_t device) {
+  ASSERT(e->initialized == true);
+
+  C_ASSERT(pthread_mutex_lock(&g_record_lock) == 0);
+
+  if (g_record.open) {
+    uint64_t launch = g_record.num_launches++;
+
+    record_device_name(device);
+
+    if (e->has_events) {
+      record_counters(e, region_id, kernel_id, device, launch);
+    }
+
+    if (e->is_root && e->has_metrics) {
+      record_metrics(e, region_id, kernel_id, device, launch);
+    }
+  }
+
+  C_ASSERT(pthread_mutex_unlock(&g_record_lock) == 0);
+}
+
+NVCD_EXPORT void nvcd_record_close() {
+  C_ASSERT(pthread_mutex_lock(&g_record_lock) == 0);
+
+  if (g_record.map != NULL) {
+    nvcd_record_file_header_t* header = (nvcd_record_file_header_t*) g_record.map;
+
+    header->length = g_record.length - sizeof(*header);
+
+    C_ASSERT(munmap(g_record.map, g_record.capacity) == 0);
+    C_ASSERT(ftruncate(g_record.fd, (off_t) g_record.length) == 0);
+
+    g_record.map = NULL;
+  }
+
+  if (g_record.fd != -1) {
+    close(g_record.fd);
+    g_record.fd = -1;
+  }
+
+  for (uint32_t k = 0; k < NVCD_RECORD_NAME_COUNT; ++k) {
+    safe_free_v(g_record.named[k]);
+    g_record.num_named[k] = 0;
+  }
+
+  if (g_record.region_names != NULL) {
+    free_strlist(g_record.region_names, g_record.num_regions);
+    g_record.region_names = NULL;
+    g_record.num_regions = 0;
+  }
+
+  g_record.open = false;
+
+  C_ASSERT(pthread_mutex_unlock(&g_record_lock) == 0);
+}
+
+C_LINKAGE_END
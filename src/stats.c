@@ -0,0 +1,159 @@
+#include "nvcd/stats.h"
+#include "nvcd/util.h"
+
+C_LINKAGE_START
+
+static inline uint32_t stats_bucket_index(uint64_t value) {
+  if (value < NVCD_STATS_SUB_BUCKETS) {
+    return (uint32_t) value;
+  }
+
+  // value has e + 1 significant bits, of which the top
+  // NVCD_STATS_SUB_BUCKET_BITS + 1 select the bucket
+  uint32_t e = 63 - (uint32_t) __builtin_clzll(value);
+  uint32_t m = (uint32_t) (value >> (e - NVCD_STATS_SUB_BUCKET_BITS));
+
+  return (e - NVCD_STATS_SUB_BUCKET_BITS + 1) * NVCD_STATS_SUB_BUCKETS +
+    (m - NVCD_STATS_SUB_BUCKETS);
+}
+
+// the smallest value in the bucket, and the bucket's width
+static inline void stats_bucket_range(uint32_t index, uint64_t* low, uint64_t* width) {
+  if (index < NVCD_STATS_SUB_BUCKETS) {
+    *low = index;
+    *width = 1;
+  } else {
+    uint32_t e = index / NVCD_STATS_SUB_BUCKETS + NVCD_STATS_SUB_BUCKET_BITS - 1;
+    uint64_t m = index % NVCD_STATS_SUB_BUCKETS + NVCD_STATS_SUB_BUCKETS;
+
+    *low = m << (e - NVCD_STATS_SUB_BUCKET_BITS);
+    *width = 1ull << (e - NVCD_STATS_SUB_BUCKET_BITS);
+  }
+}
+
+NVCD_EXPORT void nvcd_stats_add(nvcd_stats_t* stats, uint64_t value) {
+  ASSERT(stats != NULL);
+
+  if (stats->count == 0) {
+    stats->min = value;
+    stats->max = value;
+  } else {
+    if (value < stats->min) {
+      stats->min = value;
+    }
+    if (value > stats->max) {
+      stats->max = value;
+    }
+  }
+
+  stats->count++;
+
+  double delta = (double) value - stats->mean;
+  stats->mean += delta / (double) stats->count;
+  stats->m2 += delta * ((double) value - stats->mean);
+
+  uint32_t* bucket = &stats->buckets[stats_bucket_index(value)];
+
+  if (*bucket != UINT32_MAX) {
+    (*bucket)++;
+  }
+}
+
+NVCD_EXPORT void nvcd_stats_merge(nvcd_stats_t* dst, const nvcd_stats_t* src) {
+  ASSERT(dst != NULL);
+  ASSERT(src != NULL);
+
+  if (src->count == 0) {
+    return;
+  }
+
+  if (dst->count == 0) {
+    *dst = *src;
+    return;
+  }
+
+  if (src->min < dst->min) {
+    dst->min = src->min;
+  }
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+
+  // Chan et al.'s pairwise update
+  double n_a = (double) dst->count;
+  double n_b = (double) src->count;
+  double n = n_a + n_b;
+  double delta = src->mean - dst->mean;
+
+  dst->mean += delta * n_b / n;
+  dst->m2 += src->m2 + delta * delta * n_a * n_b / n;
+  dst->count += src->count;
+
+  for (uint32_t i = 0; i < NVCD_STATS_NUM_BUCKETS; ++i) {
+    uint64_t sum = (uint64_t) dst->buckets[i] + src->buckets[i];
+    dst->buckets[i] = sum < UINT32_MAX ? (uint32_t) sum : UINT32_MAX;
+  }
+}
+
+NVCD_EXPORT double nvcd_stats_variance(const nvcd_stats_t* stats) {
+  ASSERT(stats != NULL);
+
+  return stats->count > 1 ? stats->m2 / (double) stats->count : 0.0;
+}
+
+NVCD_EXPORT uint64_t nvcd_stats_quantile(const nvcd_stats_t* stats, double q) {
+  ASSERT(stats != NULL);
+
+  if (stats->count == 0) {
+    return 0;
+  }
+
+  if (q <= 0.0) {
+    return stats->min;
+  }
+
+  if (q >= 1.0) {
+    return stats->max;
+  }
+
+  // saturated buckets undercount, so the rank is taken
+  // over what the buckets hold rather than stats->count
+  uint64_t total = 0;
+
+  for (uint32_t i = 0; i < NVCD_STATS_NUM_BUCKETS; ++i) {
+    total += stats->buckets[i];
+  }
+
+  uint64_t rank = (uint64_t) (q * (double) (total - 1));
+  uint64_t seen = 0;
+  uint32_t index = 0;
+
+  for (; index < NVCD_STATS_NUM_BUCKETS; ++index) {
+    seen += stats->buckets[index];
+
+    if (seen > rank) {
+      break;
+    }
+  }
+
+  ASSERT(index < NVCD_STATS_NUM_BUCKETS);
+
+  uint64_t low = 0;
+  uint64_t width = 0;
+
+  stats_bucket_range(index, &low, &width);
+
+  // the middle of the bucket, within what was actually seen
+  uint64_t value = low + width / 2;
+
+  if (value < stats->min) {
+    value = stats->min;
+  }
+  if (value > stats->max) {
+    value = stats->max;
+  }
+
+  return value;
+}
+
+C_LINKAGE_END
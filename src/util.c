@@ -1,11 +1,13 @@
 #include "nvcd/util.h"
 #include "nvcd/nvcd.h"
+#include "nvcd/writer.h"
 
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #define __USE_GNU // for RTLD_NEXT
 #include <dlfcn.h>
@@ -20,79 +22,130 @@ void exit_msg(FILE* out, int error, const char* message, ...) {
   vsprintf(buffer, message, ap);
   va_end(ap);
 
+  // so that this comes after everything that's been queued
+  nvcd_writer_flush();
+
   fprintf(out, "EXIT TRIGGERED. Reason: \"%s\". Code: 0x%x\n", buffer, error);
   
   exit(error);
 }
 
-static inline bool msg_ok(msg_level_t m) {
+NVCD_EXPORT bool msg_enabled(msg_level_t m) {
   return
     (m == MSG_LEVEL_VERBOSE && g_nvcd.opt_verbose_output == true) ||
     (m == MSG_LEVEL_DIAG && g_nvcd.opt_diagnostic_output == true) ||
     (m != MSG_LEVEL_VERBOSE && m != MSG_LEVEL_DIAG);
 }
 
-static const size_t MSG_BUFFER_SZ = 1 << 24;
-static char* g_msg_buffer = NULL;
+// indexed by msg_level_t; user messages have no prefix, since
+// there's no need to burden the user with detailed information
+static const char* const g_msg_level_names[] =
+  {
+   "VERBOSE",
+   "ERROR",
+   NULL,
+   "WARNING",
+   "DIAGNOSTIC"
+  };
+
+#define MSG_BUFFER_MIN_SIZE 4096
+
+// grows to fit the longest message the thread has written,
+// and is freed by g_msg_buffer_key's destructor when the thread exits
+static NVCD_THREAD_LOCAL char* g_msg_buffer = NULL;
+static NVCD_THREAD_LOCAL size_t g_msg_buffer_size = 0;
+
+static pthread_key_t g_msg_buffer_key;
+static pthread_once_t g_msg_buffer_once = PTHREAD_ONCE_INIT;
+
+static void msg_buffer_free(void* buffer) {
+  free(buffer);
+}
+
+static void msg_buffer_key_create() {
+  C_ASSERT(pthread_key_create(&g_msg_buffer_key, msg_buffer_free) == 0);
+}
+
+static void msg_buffer_reserve(size_t size) {
+  if (size > g_msg_buffer_size) {
+    size_t new_size = g_msg_buffer_size > 0 ? g_msg_buffer_size : MSG_BUFFER_MIN_SIZE;
+
+    while (new_size < size) {
+      new_size <<= 1;
+    }
+
+    C_ASSERT(pthread_once(&g_msg_buffer_once, msg_buffer_key_create) == 0);
+
+    g_msg_buffer = NOT_NULL(realloc(g_msg_buffer, new_size));
+    g_msg_buffer_size = new_size;
+
+    C_ASSERT(pthread_setspecific(g_msg_buffer_key, g_msg_buffer) == 0);
+  }
+}
 
 void msg_impl(msg_level_t m, int line, const char* file, const char* fn, const char* msg, ...) {
-  if (g_msg_buffer == NULL) {
-    g_msg_buffer = zallocNN(MSG_BUFFER_SZ);
+  if (!msg_enabled(m)) {
+    return;
   }
 
-  if (msg_ok(m)) {  
-    memset(g_msg_buffer, 0, MSG_BUFFER_SZ);
+  msg_buffer_reserve(MSG_BUFFER_MIN_SIZE);
 
-#if defined (NVCD_DEBUG)
-    char prefix[1024 + 256] = {0};
-    char sig[1024] = {0};
-#else
-    char prefix[256] = {0};
-#endif
-    
-    va_list ap;
-    va_start(ap, msg);
-    size_t count = (size_t) vsnprintf(g_msg_buffer, MSG_BUFFER_SZ, msg, ap);
-    va_end(ap);
-  
-    strcat(prefix, "[");
-    switch (m) {
-    case MSG_LEVEL_VERBOSE:
-      strcat(prefix, "VERBOSE");
-      break;
-    case MSG_LEVEL_ERROR:
-      strcat(prefix, "ERROR");
-      break;
-      // no need to burden user with
-      // detailed information - if anyone wishes to
-      // override this, we can change the behavior quickly.
-    case MSG_LEVEL_USER:
-      break;
-    case MSG_LEVEL_WARNING:
-      strcat(prefix, "WARNING");
-      break;
-    case MSG_LEVEL_DIAG:
-      strcat(prefix, "DIAGNOSTIC");
-      break;
-    }
+  // the prefix and message are queued together,
+  // so that they're never split by another thread's output
+  size_t prefix_length = 0;
 
-    strcat(prefix, "]");
-  
+  if (g_msg_level_names[m] != NULL) {
 #if defined(NVCD_DEBUG)
-    if (m != MSG_LEVEL_USER) {
-      strcat(prefix, "[");
-      snprintf(&sig[0], 1024, "%s:%s:%i", fn, file, line);
-      strcat(prefix, sig);
-      strcat(prefix, "]");
-    }
+    int n = snprintf(g_msg_buffer,
+                     g_msg_buffer_size,
+                     "[%s][%s:%s:%i]:",
+                     g_msg_level_names[m],
+                     fn,
+                     file,
+                     line);
+#else
+    int n = snprintf(g_msg_buffer, g_msg_buffer_size, "[%s]:", g_msg_level_names[m]);
 #endif
+    prefix_length = n > 0 ? (size_t) n : 0;
 
-    if (m != MSG_LEVEL_USER) {
-      fprintf(stdout, "%s:%s", prefix, g_msg_buffer);
-    } else {
-      fprintf(stdout, "%s", g_msg_buffer);
+    if (prefix_length >= g_msg_buffer_size) {
+      prefix_length = g_msg_buffer_size - 1;
     }
   }
+
+  va_list ap;
+  va_list retry;
+  va_start(ap, msg);
+  va_copy(retry, ap);
+
+  int count = vsnprintf(g_msg_buffer + prefix_length,
+                        g_msg_buffer_size - prefix_length,
+                        msg,
+                        ap);
+
+  // the prefix is kept by the realloc()
+  if (count > 0 && (size_t) count >= g_msg_buffer_size - prefix_length) {
+    msg_buffer_reserve(prefix_length + (size_t) count + 1);
+
+    count = vsnprintf(g_msg_buffer + prefix_length,
+                      g_msg_buffer_size - prefix_length,
+                      msg,
+                      retry);
+  }
+
+  va_end(retry);
+  va_end(ap);
+
+  if (count > 0) {
+    nvcd_writer_write(g_msg_buffer, prefix_length + (size_t) count);
+  } else if (prefix_length > 0) {
+    nvcd_writer_write(g_msg_buffer, prefix_length);
+  }
+
+  // in case the next thing that happens is a crash
+  if (m == MSG_LEVEL_ERROR) {
+    nvcd_writer_flush();
+  }
 }
 
 
@@ -190,6 +243,8 @@ NVCD_EXPORT void cuda_runtime_error_print_exit(cudaError_t status,
                                                const char* file,
                                                const char* expr) {
   if (status != cudaSuccess) {
+    nvcd_writer_flush();
+
     printf("CUDA RUNTIME: %s:%i:'%s' failed. [Reason] %s:%s\n",
            file,
            line,
@@ -206,6 +261,8 @@ NVCD_EXPORT void cuda_driver_error_print_exit(CUresult status,
                                               const char* file,
                                               const char* expr) {
   if (status != CUDA_SUCCESS) {
+    nvcd_writer_flush();
+
     printf("CUDA DRIVER: %s:%i:'%s' failed. [Reason] %i\n",
            file,
            line,
@@ -225,6 +282,8 @@ NVCD_EXPORT void cupti_error_print_exit(CUptiResult status,
     
     cuptiGetResultString(status, &error_string);
       
+    nvcd_writer_flush();
+
     printf("FATAL - CUPTI ERROR: %s:%i:'%s' failed. [Reason] %s\n",
            file,
            line,
@@ -244,8 +303,13 @@ NVCD_EXPORT void cupti_warn_print(CUptiResult status,
     
     cuptiGetResultString(status, &error_string);
       
-    printf("WARNING - CUPTI ERROR: %s:%i:'%s' failed. [Reason] %s\n",
-           file,
+    // queued, so that it's in order with the rest of the output
+    msg_impl(MSG_LEVEL_USER,
+             line,
+             file,
+             __FUNC__,
+             "WARNING - CUPTI ERROR: %s:%i:'%s' failed. [Reason] %s\n",
+             file,
            line,
            expr,
            error_string);
@@ -271,15 +335,18 @@ NVCD_EXPORT void write_logf_impl(const char* func,
 				 int line,
 				 const char* message,
 				 ...) {  
-  size_t len = strlen(message) + 256;
-  char* buffer = zallocNN(len * sizeof(char));  
-  
   va_list ap;
   va_start(ap, message);
-  vsprintf(buffer, message, ap);
+  int len = vsnprintf(NULL, 0, message, ap);
+  va_end(ap);
+
+  char* buffer = zallocNN(((len > 0 ? (size_t) len : 0) + 1) * sizeof(char));
+
+  va_start(ap, message);
+  vsnprintf(buffer, (len > 0 ? (size_t) len : 0) + 1, message, ap);
   va_end(ap);
 
-  fprintf(stdout, "[%s:%s:%i]: %s\n", func, file, line, buffer);
+  msg_impl(MSG_LEVEL_USER, line, file, func, "[%s:%s:%i]: %s\n", func, file, line, buffer);
 
   free(buffer);
 }
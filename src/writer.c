@@ -0,0 +1,444 @@
+#include "nvcd/writer.h"
+#include "nvcd/util.h"
+#include "nvcd/env_var.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+C_LINKAGE_START
+
+#define WRITER_DEFAULT_CAPACITY 4096
+#define WRITER_MAX_CAPACITY (1 << 20)
+
+// messages written between flushes of stdout
+#define WRITER_BATCH 256
+
+#define WRITER_CACHE_LINE 64
+
+typedef struct writer_msg {
+  size_t length;
+  char data[];
+} writer_msg_t;
+
+// Bounded multi-producer queue (D. Vyukov's design): each slot's
+// sequence number tells producers and the consumer whose turn it is,
+// so a push or pop is one CAS on the position in the common case.
+typedef struct writer_slot {
+  size_t seq;
+  writer_msg_t* msg;
+} writer_slot_t;
+
+typedef struct writer {
+  writer_slot_t* slots;
+  size_t mask;
+
+  // kept on separate cache lines, since producers
+  // and the writer thread update them concurrently
+  char pad0[WRITER_CACHE_LINE];
+  size_t enqueue_pos;
+  char pad1[WRITER_CACHE_LINE];
+  size_t dequeue_pos;
+  char pad2[WRITER_CACHE_LINE];
+
+  uint64_t num_pushed;
+  uint64_t num_written;
+  uint64_t num_dropped;
+
+  nvcd_writer_policy_t policy;
+
+  pthread_t thread;
+  pid_t pid; // of the process the thread runs in
+  bool32_t running;
+  bool32_t stopping;
+
+  // nvcd_writer_write() calls that saw the thread running
+  // and haven't queued their message yet
+  uint32_t num_writing;
+
+  // The thread waits on this once it's found the queue empty, and
+  // sets sleeping while it does, so that a push only signals it
+  // when the queue goes from empty to not.
+  pthread_mutex_t wake_lock;
+  pthread_cond_t wake;
+  bool32_t sleeping;
+
+  FILE* spill;
+  pthread_mutex_t spill_lock;
+} writer_t;
+
+static writer_t g_writer;
+
+static pthread_once_t g_writer_once = PTHREAD_ONCE_INIT;
+
+static bool writer_push(writer_msg_t* msg) {
+  size_t pos = __atomic_load_n(&g_writer.enqueue_pos, __ATOMIC_RELAXED);
+  writer_slot_t* slot = NULL;
+
+  for (;;) {
+    slot = &g_writer.slots[pos & g_writer.mask];
+
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+    if (diff == 0) {
+      // on failure, pos is updated to the current position
+      if (__atomic_compare_exchange_n(&g_writer.enqueue_pos,
+                                      &pos,
+                                      pos + 1,
+                                      true,
+                                      __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // full
+      return false;
+    } else {
+      pos = __atomic_load_n(&g_writer.enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->msg = msg;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+  __atomic_add_fetch(&g_writer.num_pushed, 1, __ATOMIC_RELEASE);
+
+  // orders the push before reading sleeping; the thread
+  // sets sleeping before it looks at the queue again
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&g_writer.sleeping, __ATOMIC_RELAXED)) {
+    C_ASSERT(pthread_mutex_lock(&g_writer.wake_lock) == 0);
+    C_ASSERT(pthread_cond_signal(&g_writer.wake) == 0);
+    C_ASSERT(pthread_mutex_unlock(&g_writer.wake_lock) == 0);
+  }
+
+  return true;
+}
+
+static bool writer_empty() {
+  size_t pos = __atomic_load_n(&g_writer.dequeue_pos, __ATOMIC_RELAXED);
+  size_t seq = __atomic_load_n(&g_writer.slots[pos & g_writer.mask].seq, __ATOMIC_ACQUIRE);
+
+  return seq != pos + 1;
+}
+
+static writer_msg_t* writer_pop() {
+  size_t pos = __atomic_load_n(&g_writer.dequeue_pos, __ATOMIC_RELAXED);
+  writer_slot_t* slot = NULL;
+
+  for (;;) {
+    slot = &g_writer.slots[pos & g_writer.mask];
+
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&g_writer.dequeue_pos,
+                                      &pos,
+                                      pos + 1,
+                                      true,
+                                      __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // empty
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&g_writer.dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  writer_msg_t* msg = slot->msg;
+
+  // frees the slot for the producer one lap ahead
+  __atomic_store_n(&slot->seq, pos + g_writer.mask + 1, __ATOMIC_RELEASE);
+
+  return msg;
+}
+
+// writes everything that's currently queued,
+// and returns how many messages that was
+static uint64_t writer_drain() {
+  uint64_t count = 0;
+  uint32_t batch = 0;
+  writer_msg_t* msg = NULL;
+
+  while ((msg = writer_pop()) != NULL) {
+    fwrite(&msg->data[0], 1, msg->length, stdout);
+    free(msg);
+
+    count++;
+    batch++;
+
+    if (batch == WRITER_BATCH) {
+      fflush(stdout);
+      __atomic_add_fetch(&g_writer.num_written, batch, __ATOMIC_RELEASE);
+      batch = 0;
+    }
+  }
+
+  if (batch > 0) {
+    fflush(stdout);
+    __atomic_add_fetch(&g_writer.num_written, batch, __ATOMIC_RELEASE);
+  }
+
+  return count;
+}
+
+static void* writer_main(void* arg) {
+  (void) arg;
+
+  for (;;) {
+    bool stopping = __atomic_load_n(&g_writer.stopping, __ATOMIC_ACQUIRE);
+
+    if (writer_drain() == 0) {
+      // stopping was read before the drain, so
+      // nothing pushed before it was set is left
+      if (stopping) {
+        break;
+      }
+
+      C_ASSERT(pthread_mutex_lock(&g_writer.wake_lock) == 0);
+
+      __atomic_store_n(&g_writer.sleeping, true, __ATOMIC_SEQ_CST);
+
+      // a push that missed sleeping is seen here
+      if (writer_empty() && !__atomic_load_n(&g_writer.stopping, __ATOMIC_SEQ_CST)) {
+        C_ASSERT(pthread_cond_wait(&g_writer.wake, &g_writer.wake_lock) == 0);
+      }
+
+      __atomic_store_n(&g_writer.sleeping, false, __ATOMIC_RELAXED);
+
+      C_ASSERT(pthread_mutex_unlock(&g_writer.wake_lock) == 0);
+    }
+  }
+
+  return NULL;
+}
+
+static void writer_write_direct(const char* data, size_t length) {
+  fwrite(data, 1, length, stdout);
+}
+
+static void writer_spill(const char* data, size_t length) {
+  C_ASSERT(pthread_mutex_lock(&g_writer.spill_lock) == 0);
+
+  if (g_writer.spill == NULL) {
+    const char* path = getenv(ENV_WRITER_SPILL);
+    char default_path[64];
+
+    if (path == NULL || path[0] == '\0') {
+      snprintf(default_path, sizeof(default_path), "nvcd_spill.%d.txt", (int) getpid());
+      path = default_path;
+    }
+
+    g_writer.spill = fopen(path, "w");
+  }
+
+  if (g_writer.spill != NULL) {
+    fwrite(data, 1, length, g_writer.spill);
+  } else {
+    __atomic_add_fetch(&g_writer.num_dropped, 1, __ATOMIC_RELAXED);
+  }
+
+  C_ASSERT(pthread_mutex_unlock(&g_writer.spill_lock) == 0);
+}
+
+static void writer_shutdown() {
+  if (!g_writer.running || g_writer.pid != getpid()) {
+    return;
+  }
+
+  // anything that's written from here on is written directly
+  __atomic_store_n(&g_writer.running, false, __ATOMIC_SEQ_CST);
+
+  C_ASSERT(pthread_mutex_lock(&g_writer.wake_lock) == 0);
+  __atomic_store_n(&g_writer.stopping, true, __ATOMIC_SEQ_CST);
+  C_ASSERT(pthread_cond_signal(&g_writer.wake) == 0);
+  C_ASSERT(pthread_mutex_unlock(&g_writer.wake_lock) == 0);
+
+  if (!pthread_equal(pthread_self(), g_writer.thread)) {
+    pthread_join(g_writer.thread, NULL);
+  }
+
+  // Writes that saw the thread running may still be
+  // queueing; they're drained here, which also makes room
+  // for those that block on a full queue.
+  while (__atomic_load_n(&g_writer.num_writing, __ATOMIC_SEQ_CST) > 0) {
+    writer_drain();
+    sched_yield();
+  }
+
+  writer_drain();
+
+  if (g_writer.num_dropped > 0) {
+    fprintf(stdout,
+            "[WARNING]:%" PRIu64 " messages were dropped, since the output queue was full (%s)\n",
+            g_writer.num_dropped,
+            ENV_WRITER_POLICY);
+  }
+
+  fflush(stdout);
+
+  if (g_writer.spill != NULL) {
+    fclose(g_writer.spill);
+    g_writer.spill = NULL;
+  }
+}
+
+static nvcd_writer_policy_t writer_read_policy() {
+  nvcd_writer_policy_t policy = NVCD_WRITER_BLOCK;
+
+  const char* value = getenv(ENV_WRITER_POLICY);
+
+  if (value != NULL && value[0] != '\0') {
+    if (strcmp(value, "block") == 0) {
+      policy = NVCD_WRITER_BLOCK;
+    } else if (strcmp(value, "drop") == 0) {
+      policy = NVCD_WRITER_DROP;
+    } else if (strcmp(value, "spill") == 0) {
+      policy = NVCD_WRITER_SPILL;
+    } else if (strcmp(value, "sync") == 0) {
+      policy = NVCD_WRITER_SYNC;
+    } else {
+      fprintf(stdout,
+              "[WARNING]:%s = %s is not one of block, drop, spill or sync; using block\n",
+              ENV_WRITER_POLICY,
+              value);
+    }
+  }
+
+  return policy;
+}
+
+static size_t writer_read_capacity() {
+  size_t capacity = WRITER_DEFAULT_CAPACITY;
+
+  const char* value = getenv(ENV_WRITER_QUEUE);
+
+  if (value != NULL && value[0] != '\0') {
+    long n = strtol(value, NULL, 10);
+
+    if (0 < n && n <= WRITER_MAX_CAPACITY) {
+      capacity = (size_t) n;
+    }
+  }
+
+  // the slot index is a mask of the position
+  size_t pow2 = 1;
+  while (pow2 < capacity) {
+    pow2 <<= 1;
+  }
+
+  return pow2;
+}
+
+static void writer_init() {
+  g_writer.policy = writer_read_policy();
+
+  if (g_writer.policy == NVCD_WRITER_SYNC) {
+    return;
+  }
+
+  size_t capacity = writer_read_capacity();
+
+  g_writer.slots = zallocNN(sizeof(g_writer.slots[0]) * capacity);
+  g_writer.mask = capacity - 1;
+
+  for (size_t i = 0; i < capacity; ++i) {
+    g_writer.slots[i].seq = i;
+  }
+
+  C_ASSERT(pthread_mutex_init(&g_writer.spill_lock, NULL) == 0);
+  C_ASSERT(pthread_mutex_init(&g_writer.wake_lock, NULL) == 0);
+  C_ASSERT(pthread_cond_init(&g_writer.wake, NULL) == 0);
+
+  g_writer.pid = getpid();
+
+  if (C_ASSERT(pthread_create(&g_writer.thread, NULL, writer_main, NULL) == 0)) {
+    g_writer.running = true;
+    atexit(writer_shutdown);
+  }
+}
+
+static inline bool writer_running() {
+  pthread_once(&g_writer_once, writer_init);
+
+  // a forked child doesn't have the thread
+  return
+    __atomic_load_n(&g_writer.running, __ATOMIC_SEQ_CST) &&
+    g_writer.pid == getpid();
+}
+
+// handles a message that didn't fit in the queue, as the policy says
+static void writer_push_full(writer_msg_t* msg, const char* data, size_t length) {
+  switch (g_writer.policy) {
+  case NVCD_WRITER_DROP:
+    __atomic_add_fetch(&g_writer.num_dropped, 1, __ATOMIC_RELAXED);
+    free(msg);
+    break;
+
+  case NVCD_WRITER_SPILL:
+    writer_spill(data, length);
+    free(msg);
+    break;
+
+  default:
+    // writer_shutdown() drains the queue until this returns,
+    // so only a forked child, which has no thread, gives up
+    while (!writer_push(msg)) {
+      if (g_writer.pid != getpid()) {
+        writer_write_direct(data, length);
+        free(msg);
+        break;
+      }
+      sched_yield();
+    }
+    break;
+  }
+}
+
+NVCD_EXPORT void nvcd_writer_write(const char* data, size_t length) {
+  if (length == 0) {
+    return;
+  }
+
+  // counted before running is read, so that writer_shutdown()
+  // either waits for this message or it's written directly
+  __atomic_add_fetch(&g_writer.num_writing, 1, __ATOMIC_SEQ_CST);
+
+  writer_msg_t* msg = writer_running() ? malloc(sizeof(*msg) + length) : NULL;
+
+  if (msg == NULL) {
+    writer_write_direct(data, length);
+  } else {
+    msg->length = length;
+    memcpy(&msg->data[0], data, length);
+
+    if (!writer_push(msg)) {
+      writer_push_full(msg, data, length);
+    }
+  }
+
+  __atomic_sub_fetch(&g_writer.num_writing, 1, __ATOMIC_SEQ_CST);
+}
+
+NVCD_EXPORT void nvcd_writer_flush() {
+  if (writer_running()) {
+    uint64_t target = __atomic_load_n(&g_writer.num_pushed, __ATOMIC_ACQUIRE);
+
+    while (__atomic_load_n(&g_writer.num_written, __ATOMIC_ACQUIRE) < target &&
+           writer_running()) {
+      sched_yield();
+    }
+  } else {
+    fflush(stdout);
+  }
+}
+
+C_LINKAGE_END
@@ -0,0 +1,181 @@
+//
+// The cost of turning a launch's counters into per-event stats: the
+// counter matrix against the maps of counters that nvcd_run_info used
+// to keep, where every value went through a callback into the end map,
+// the end map was copied to the start map, and the difference of the
+// two was a new map.
+//
+// Both read the same event data, from one launch of every stub event.
+//
+
+#include "test_nvcd.h"
+
+#include <unordered_map>
+#include <vector>
+
+static const int k_num_threads = 1 << 12;
+static const int k_block_size = 256;
+
+static const uint32_t k_iterations = 20000;
+
+using instance_vec_type = std::vector<uint64_t>;
+using counter_map_type = std::unordered_map<CUpti_EventID, instance_vec_type>;
+
+static instance_vec_type operator - (const instance_vec_type& a, const instance_vec_type& b) {
+  ASSERT(a.size() == b.size());
+  instance_vec_type diff(a.size(), 0);
+  for (size_t i = 0; i < a.size(); ++i) {
+    diff[i] = a[i] - b[i];
+  }
+  return diff;
+}
+
+static counter_map_type operator - (const counter_map_type& a, const counter_map_type& b) {
+  counter_map_type diff;
+  for (const auto& kv: a) {
+    if (b.find(kv.first) != b.end()) {
+      diff[kv.first] = kv.second - b.at(kv.first);
+    } else {
+      diff[kv.first] = kv.second;
+    }
+  }
+  return diff;
+}
+
+static counter_map_type g_counters_start;
+static counter_map_type g_counters_end;
+static counter_map_type g_counters_diff;
+
+static bool enum_event_counters(cupti_enum_event_counter_iteration_t* it) {
+  if (g_counters_end[it->event].empty()) {
+    g_counters_end[it->event].resize(it->num_instances, 0);
+  }
+  g_counters_end[it->event][it->instance] += it->value;
+  return true;
+}
+
+struct fill_cost {
+  uint64_t nsec;
+  uint64_t allocs;
+  uint64_t sum;
+  // so the rest of the stats aren't optimized out
+  double check;
+};
+
+static fill_cost maps_fill(cupti_event_data_t* e) {
+  fill_cost cost = {};
+
+  uint64_t allocs = test_allocs();
+  uint64_t start = test_now_nsec();
+
+  for (uint32_t i = 0; i < k_iterations; ++i) {
+    for (const auto& kv: g_counters_end) {
+      g_counters_start[kv.first] = kv.second;
+    }
+
+    cupti_event_data_enum_event_counters(e, enum_event_counters);
+
+    g_counters_diff = g_counters_end - g_counters_start;
+
+    // the stats that report() printed for each event
+    for (const auto& kv: g_counters_diff) {
+      uint64_t sum = 0;
+      uint64_t max = 0;
+      uint64_t min = UINT64_MAX;
+      
+      for (uint64_t value: kv.second) {
+        sum += value;
+        max = value > max ? value : max;
+        min = value < min ? value : min;
+      }
+
+      double mean = static_cast<double>(sum) / static_cast<double>(kv.second.size());
+      
+      cost.sum += sum;
+      cost.check += mean + static_cast<double>(max) + static_cast<double>(min);
+    }
+  }
+
+  cost.nsec = test_now_nsec() - start;
+  cost.allocs = test_allocs() - allocs;
+
+  return cost;
+}
+
+static fill_cost matrix_fill(cupti_event_data_t* e, cupti_counter_matrix_t* m) {
+  fill_cost cost = {};
+
+  uint64_t allocs = test_allocs();
+  uint64_t start = test_now_nsec();
+
+  for (uint32_t i = 0; i < k_iterations; ++i) {
+    cupti_event_data_counter_matrix(e, m);
+
+    for (uint32_t row = 0; row < m->num_rows; ++row) {
+      uint32_t num_instances = 0;
+      const uint64_t* values = cupti_counter_matrix_row(m, row, &num_instances);
+
+      cupti_counter_stats_t stats;
+      cupti_counter_stats(values, num_instances, &stats);
+
+      cost.sum += stats.sum;
+      cost.check += stats.mean + static_cast<double>(stats.max) + static_cast<double>(stats.min);
+    }
+  }
+
+  cost.nsec = test_now_nsec() - start;
+  cost.allocs = test_allocs() - allocs;
+
+  return cost;
+}
+
+int main() {
+  setenv(ENV_EVENTS,
+         "stub_d0_e0,stub_d0_e1,stub_d0_e2,stub_d0_e3,stub_d0_e4,stub_d0_e5,"
+         "stub_d1_e0,stub_d1_e1,stub_d1_e2,stub_d1_e3,stub_d1_e4,stub_d1_e5",
+         1);
+
+  nvcd_host_session_begin();
+
+  nvcd_host_begin("bench_counters", k_num_threads);
+  test_run(test_kernel_sleep, dim3(k_num_threads / k_block_size), dim3(k_block_size), nullptr, 0);
+  nvcd_host_end();
+
+  C_ASSERT(nvcd_lock_events());
+
+  cupti_event_data_t* e = nvcd_get_events();
+
+  // the first fill of each allocates its buffers
+  cupti_counter_matrix_t m = CUPTI_COUNTER_MATRIX_INIT;
+  matrix_fill(e, &m);
+  maps_fill(e);
+
+  fill_cost maps = maps_fill(e);
+  fill_cost matrix = matrix_fill(e, &m);
+
+  printf("|BENCH|counters of %" PRIu32 " events, as maps of start, end and diff: "
+         "%.0f ns, %.1f heap allocations per launch\n",
+         m.num_rows,
+         static_cast<double>(maps.nsec) / k_iterations,
+         static_cast<double>(maps.allocs) / k_iterations);
+
+  printf("|BENCH|counters of %" PRIu32 " events, as a counter matrix: "
+         "%.0f ns, %" PRIu64 " heap allocations in %" PRIu32 " launches (%.1fx faster)\n",
+         m.num_rows,
+         static_cast<double>(matrix.nsec) / k_iterations,
+         matrix.allocs,
+         k_iterations,
+         static_cast<double>(maps.nsec) / static_cast<double>(matrix.nsec));
+
+  nvcd_release_events();
+  nvcd_host_session_end();
+
+  cupti_counter_matrix_free(&m);
+
+  // each diff was the values of one launch, like each matrix
+  C_ASSERT(matrix.sum == maps.sum);
+  C_ASSERT(matrix.allocs == 0);
+  C_ASSERT(matrix.nsec < maps.nsec);
+
+  return 0;
+}
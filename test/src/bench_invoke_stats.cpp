@@ -0,0 +1,307 @@
+//
+// kernel_invoke_data::write() on synthetic thread times, from 1M to
+// 100M threads: lognormal times, spread over 80 SMs.
+//
+// Each size is written with several chunk counts, on the pool's
+// workers and with a thread per chunk as parallel_chunks() used to,
+// beside the reduction write() replaced, which sorted every thread.
+// The chunk counts are the program's arguments, or the comma
+// separated list in BENCH_CHUNKS, or else 1, 2, 4 and 8.
+//
+// Then the cost of a parallel_chunks() call itself, on the pool's
+// workers, against starting a thread per chunk. The pool has four
+// workers here, whatever the machine, so that every call hands
+// chunks off.
+//
+
+#include "test_nvcd.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <unistd.h>
+
+static const uint32_t k_num_sms = 80;
+
+static const size_t k_sizes[] = {
+  1000000,
+  10000000,
+  30000000,
+  100000000
+};
+
+// the sort's vector<block> alone needs 16 bytes a thread, and grows
+// by doubling, so it isn't run on the larger sizes
+static const size_t k_max_sorted = 30000000;
+
+static const size_t k_num_workers = 4;
+static const uint32_t k_calls = 2000;
+
+static const char* const k_env_chunks = "BENCH_CHUNKS";
+
+struct outliers {
+  size_t minor;
+  size_t major;
+};
+
+// parallel_chunks() as it was, with a thread per chunk
+template <class TFn>
+static void spawn_chunks(size_t n, size_t num_chunks, TFn fn) {
+  size_t chunk_size = (n + num_chunks - 1) / num_chunks;
+
+  std::vector<std::thread> pool;
+
+  for (size_t c = 1; c < num_chunks; ++c) {
+    size_t begin = std::min(c * chunk_size, n);
+    pool.emplace_back(fn, begin, std::min(begin + chunk_size, n), c);
+  }
+
+  fn(0, std::min(chunk_size, n), 0);
+
+  for (auto& thread: pool) {
+    thread.join();
+  }
+}
+
+// write() with a thread per chunk, as it was before the pool
+static outliers write_spawn(const kernel_invoke_data& d, size_t num_chunks) {
+  clock64_t minor_max = 0;
+  clock64_t major_max = 0;
+
+  d.outlier_bounds(minor_max, major_max);
+
+  std::vector<std::vector<block>> minor(num_chunks);
+  std::vector<std::vector<block>> major(num_chunks);
+  std::vector<std::vector<uint32_t>> sm_threads(num_chunks);
+
+  spawn_chunks(d.num_threads,
+               num_chunks,
+               [&](size_t begin, size_t end, size_t chunk) -> void {
+                 d.scan(begin, end, minor_max, major_max, minor[chunk], major[chunk], sm_threads[chunk]);
+               });
+
+  std::vector<block> load_minor;
+  std::vector<block> load_major;
+
+  for (size_t c = 0; c < num_chunks; ++c) {
+    load_minor.insert(load_minor.end(), minor[c].begin(), minor[c].end());
+    load_major.insert(load_major.end(), major[c].begin(), major[c].end());
+  }
+
+  return outliers{load_minor.size(), load_major.size()};
+}
+
+// write() before it was chunked: sorts every thread for the quartiles,
+// then goes over the sorted threads once per outlier class
+static outliers write_sorted(const kernel_invoke_data& d) {
+  std::unordered_set<int> smids_used;
+
+  for (size_t i = 0; i < d.num_threads; ++i) {
+    smids_used.insert(static_cast<int>(d.smids[i]));
+  }
+
+  std::vector<block> sorted;
+
+  for (size_t i = 0; i < d.num_threads; ++i) {
+    sorted.push_back(block{static_cast<int>(i), d.times[i]});
+  }
+
+  std::sort(sorted.begin(), sorted.end(), [](const block& a, const block& b) -> bool {
+      return a.time < b.time;
+    });
+
+  size_t qlen = d.num_threads >> 2;
+
+  double q1 = (static_cast<double>(sorted[qlen].time) + static_cast<double>(sorted[qlen - 1].time)) * 0.5;
+  double q3 = (static_cast<double>(sorted[qlen * 3].time) + static_cast<double>(sorted[qlen * 3 - 1].time)) * 0.5;
+  double iqr = q3 - q1;
+
+  std::vector<block> load_minor;
+  std::vector<block> load_major;
+
+  for (const block& b: sorted) {
+    if (b.time > static_cast<clock64_t>(q3) + static_cast<clock64_t>(iqr * 1.5)) {
+      load_minor.push_back(b);
+    }
+  }
+
+  for (const block& b: sorted) {
+    if (b.time > static_cast<clock64_t>(q3) + static_cast<clock64_t>(iqr * 3.0)) {
+      load_major.push_back(b);
+    }
+  }
+
+  ASSERT(smids_used.size() == k_num_sms);
+
+  return outliers{load_minor.size(), load_major.size()};
+}
+
+// compared with the sort, if it was run
+static void print_write(size_t num_threads, const char* how, uint64_t nsec, uint64_t sorted_nsec) {
+  char speedup[64] = "";
+
+  if (sorted_nsec > 0) {
+    snprintf(speedup, sizeof(speedup), " (%.2fx faster than the sort)",
+             static_cast<double>(sorted_nsec) / static_cast<double>(nsec));
+  }
+
+  printf("|BENCH|invoke stats of %" PRIu64 "M threads, %s: %.3f s, %.2f ns per thread%s\n",
+         static_cast<uint64_t>(num_threads / 1000000),
+         how,
+         static_cast<double>(nsec) * 1e-9,
+         static_cast<double>(nsec) / static_cast<double>(num_threads),
+         speedup);
+}
+
+static void bench_write(size_t num_threads, const std::vector<size_t>& chunk_counts) {
+  kernel_invoke_data d(num_threads);
+
+  std::mt19937_64 rng(num_threads);
+  std::lognormal_distribution<double> time(10.0, 0.5);
+
+  for (size_t i = 0; i < num_threads; ++i) {
+    d.times[i] = static_cast<clock64_t>(time(rng));
+    d.smids[i] = static_cast<uint32_t>(i % k_num_sms);
+  }
+
+  d.write();
+
+  // roughly 4% of lognormal(10, 0.5) times are past q3 + 1.5 IQR
+  ASSERT(!d.load_minor.empty() && d.load_minor.size() < num_threads / 10);
+  ASSERT(d.load_major.size() <= d.load_minor.size());
+
+  outliers expected{d.load_minor.size(), d.load_major.size()};
+
+  printf("|BENCH|invoke stats of %" PRIu64 "M threads: %" PRIu64 " minor and %" PRIu64 " major outliers, "
+         "%" PRIu64 " chunks by default\n",
+         static_cast<uint64_t>(num_threads / 1000000),
+         static_cast<uint64_t>(expected.minor),
+         static_cast<uint64_t>(expected.major),
+         static_cast<uint64_t>(parallel_num_chunks(num_threads, kernel_invoke_data::k_min_chunk)));
+
+  uint64_t sorted_nsec = 0;
+
+  if (num_threads <= k_max_sorted) {
+    uint64_t start = test_now_nsec();
+    outliers o = write_sorted(d);
+    sorted_nsec = test_now_nsec() - start;
+
+    ASSERT(o.minor == expected.minor && o.major == expected.major);
+
+    print_write(num_threads, "sorted", sorted_nsec, 0);
+  }
+
+  for (size_t num_chunks: chunk_counts) {
+    char how[64];
+
+    uint64_t start = test_now_nsec();
+    outliers o = write_spawn(d, num_chunks);
+    uint64_t spawn_nsec = test_now_nsec() - start;
+
+    ASSERT(o.minor == expected.minor && o.major == expected.major);
+
+    snprintf(how, sizeof(how), "%" PRIu64 " chunks, a thread per chunk", static_cast<uint64_t>(num_chunks));
+    print_write(num_threads, how, spawn_nsec, sorted_nsec);
+
+    d.load_minor.clear();
+    d.load_major.clear();
+
+    start = test_now_nsec();
+    d.write(num_chunks);
+    uint64_t pool_nsec = test_now_nsec() - start;
+
+    ASSERT(d.load_minor.size() == expected.minor && d.load_major.size() == expected.major);
+
+    snprintf(how, sizeof(how), "%" PRIu64 " chunks, on the pool", static_cast<uint64_t>(num_chunks));
+    print_write(num_threads, how, pool_nsec, sorted_nsec);
+  }
+}
+
+// from the arguments, or else BENCH_CHUNKS
+static std::vector<size_t> chunk_counts(int argc, char** argv) {
+  std::vector<size_t> counts;
+  std::string list;
+
+  if (argc > 1) {
+    for (int i = 1; i < argc; ++i) {
+      list += std::string(argv[i]) + ",";
+    }
+  } else if (getenv(k_env_chunks) != NULL) {
+    list = getenv(k_env_chunks);
+  } else {
+    list = "1,2,4,8";
+  }
+
+  size_t begin = 0;
+
+  while (begin < list.size()) {
+    size_t end = list.find(',', begin);
+
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+
+    if (end > begin) {
+      long n = strtol(list.substr(begin, end - begin).c_str(), nullptr, 10);
+      C_ASSERT(n > 0 /* chunk counts must be positive */);
+      counts.push_back(static_cast<size_t>(n));
+    }
+
+    begin = end + 1;
+  }
+
+  C_ASSERT(!counts.empty());
+
+  return counts;
+}
+
+int main(int argc, char** argv) {
+  alarm(600);
+
+  std::vector<size_t> counts = chunk_counts(argc, argv);
+
+  g_chunk_pool.start(k_num_workers);
+
+  for (size_t num_threads: k_sizes) {
+    bench_write(num_threads, counts);
+  }
+
+  std::atomic<uint64_t> sum(0);
+
+  auto chunk =
+    [&](size_t begin, size_t end, size_t) -> void {
+      sum += end - begin;
+    };
+
+  uint64_t start = test_now_nsec();
+
+  for (uint32_t i = 0; i < k_calls; ++i) {
+    spawn_chunks(k_num_workers, k_num_workers, chunk);
+  }
+
+  uint64_t spawn_nsec = test_now_nsec() - start;
+
+  start = test_now_nsec();
+
+  for (uint32_t i = 0; i < k_calls; ++i) {
+    parallel_chunks(k_num_workers, k_num_workers, chunk);
+  }
+
+  uint64_t pool_nsec = test_now_nsec() - start;
+
+  C_ASSERT(sum == 2 * k_calls * k_num_workers);
+
+  printf("|BENCH|%" PRIu64 " chunks per call, a thread per chunk: %.1f us per call\n",
+         static_cast<uint64_t>(k_num_workers),
+         static_cast<double>(spawn_nsec) * 1e-3 / k_calls);
+
+  printf("|BENCH|%" PRIu64 " chunks per call, on the pool: %.1f us per call (%.1fx faster)\n",
+         static_cast<uint64_t>(k_num_workers),
+         static_cast<double>(pool_nsec) * 1e-3 / k_calls,
+         static_cast<double>(spawn_nsec) / static_cast<double>(pool_nsec));
+
+  return 0;
+}
@@ -0,0 +1,108 @@
+//
+// The setup cost of a profiled launch: nvcd_host_begin(), with and
+// without a session. Within a session, every launch after the first
+// reuses its event groups and device buffers, so it shouldn't create a
+// group, allocate device memory or touch the heap.
+//
+
+#include "test_nvcd.h"
+
+// small, since the stub clears the device buffers on the host
+static const int k_num_threads = 1 << 10;
+static const int k_block_size = 256;
+
+static const uint32_t k_session_launches = 2000;
+static const uint32_t k_unsession_launches = 200;
+
+struct setup_cost {
+  uint64_t nsec;
+  uint64_t allocs;
+  stub_counters_t stub;
+};
+
+static setup_cost profiled_launch() {
+  setup_cost cost;
+
+  stub_counters_reset();
+  uint64_t allocs = test_allocs();
+  uint64_t start = test_now_nsec();
+
+  nvcd_host_begin("bench_launch",
+                  k_num_threads,
+                  0,
+                  reinterpret_cast<const void*>(test_kernel_sleep),
+                  k_block_size);
+
+  cost.nsec = test_now_nsec() - start;
+  cost.allocs = test_allocs() - allocs;
+  stub_counters_get(&cost.stub);
+
+  test_run(test_kernel_sleep, dim3(k_num_threads / k_block_size), dim3(k_block_size), nullptr, 0);
+  nvcd_host_end();
+
+  return cost;
+}
+
+int main() {
+  setenv(ENV_EVENTS, "stub_d0_e0,stub_d0_e1,stub_d1_e0,stub_d1_e1", 1);
+  setenv(ENV_METRICS, "stub_m_sum", 1);
+
+  // each launch rebuilds its event data
+  setup_cost unsession = {};
+
+  for (uint32_t i = 0; i < k_unsession_launches; ++i) {
+    setup_cost c = profiled_launch();
+    unsession.nsec += c.nsec;
+    unsession.allocs += c.allocs;
+    unsession.stub.group_creates += c.stub.group_creates;
+    unsession.stub.mallocs += c.stub.mallocs;
+  }
+
+  nvcd_host_session_begin();
+
+  setup_cost first = profiled_launch();
+  setup_cost session = {};
+
+  for (uint32_t i = 0; i < k_session_launches; ++i) {
+    setup_cost c = profiled_launch();
+    session.nsec += c.nsec;
+    session.allocs += c.allocs;
+    session.stub.group_creates += c.stub.group_creates;
+    session.stub.mallocs += c.stub.mallocs;
+    session.stub.symbol_copies += c.stub.symbol_copies;
+  }
+
+  nvcd_host_session_end();
+
+  printf("|BENCH|launch setup without a session: %.0f ns, %.1f heap allocations, "
+         "%.1f group creates, %.1f device allocations per launch\n",
+         static_cast<double>(unsession.nsec) / k_unsession_launches,
+         static_cast<double>(unsession.allocs) / k_unsession_launches,
+         static_cast<double>(unsession.stub.group_creates) / k_unsession_launches,
+         static_cast<double>(unsession.stub.mallocs) / k_unsession_launches);
+
+  printf("|BENCH|launch setup, first in a session: %" PRIu64 " ns, %" PRIu64 " heap allocations, "
+         "%" PRIu64 " group creates, %" PRIu64 " device allocations\n",
+         first.nsec,
+         first.allocs,
+         first.stub.group_creates,
+         first.stub.mallocs);
+
+  printf("|BENCH|launch setup, rest of the session: %.0f ns, %" PRIu64 " heap allocations, "
+         "%" PRIu64 " group creates, %" PRIu64 " device allocations, "
+         "%" PRIu64 " symbol copies in %" PRIu32 " launches\n",
+         static_cast<double>(session.nsec) / k_session_launches,
+         session.allocs,
+         session.stub.group_creates,
+         session.stub.mallocs,
+         session.stub.symbol_copies,
+         k_session_launches);
+
+  C_ASSERT(first.stub.group_creates > 0);
+  C_ASSERT(session.stub.group_creates == 0);
+  C_ASSERT(session.stub.mallocs == 0);
+  C_ASSERT(session.stub.symbol_copies == 0);
+  C_ASSERT(session.allocs == 0);
+
+  return 0;
+}
@@ -0,0 +1,170 @@
+//
+// Several host threads profile the same device, each in its own
+// session, and meet at a barrier after every launch. A thread only
+// holds the device's event data for the launch itself, so none of
+// them waits at the barrier while holding it.
+//
+// Each thread launches a different number of threads, so counters
+// that were read for another thread's launch don't match.
+//
+// Then, the launch rate of 1, 2, 4 and 8 threads that don't wait for
+// each other, each profiling a device of its own, against 8 threads
+// on one device, which take turns with its event data. Those kernels
+// take no time, so the rate is that of profiling itself.
+//
+
+#include "test_nvcd.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+static const int k_num_host_threads = 8;
+static const uint32_t k_launches = 200;
+static const uint32_t k_sweep_launches = 2000;
+static const int k_block_size = 128;
+
+static const int k_sweep_threads[] = { 1, 2, 4, 8 };
+
+// how long each kernel runs, in the barrier run
+static const uint64_t k_kernel_nsec = 20000;
+
+static pthread_barrier_t g_barrier;
+
+struct host_thread {
+  pthread_t thread;
+  int index;
+  int device;
+  bool barrier;
+  uint32_t num_launches;
+  uint64_t kernel_nsec;
+  uint64_t wait_nsec;
+};
+
+static void check_counters(int num_threads) {
+  const cupti_counter_matrix_t& m = g_run_info->counters;
+
+  ASSERT(m.num_rows > 0);
+
+  for (uint32_t row = 0; row < m.num_rows; ++row) {
+    uint32_t num_instances = 0;
+    const uint64_t* values = cupti_counter_matrix_row(&m, row, &num_instances);
+
+    for (uint32_t k = 0; k < num_instances; ++k) {
+      ASSERT(values[k] == stub_counter_value(m.event_ids[row], k, num_threads));
+    }
+  }
+}
+
+static void* host_thread_main(void* arg) {
+  host_thread* t = static_cast<host_thread*>(arg);
+
+  int num_threads = (t->index + 1) * k_block_size;
+  uint64_t kernel_nsec = t->kernel_nsec;
+  void* args[] = { &kernel_nsec };
+
+  C_ASSERT(cudaSetDevice(t->device) == cudaSuccess);
+
+  nvcd_host_session_begin();
+
+  for (uint32_t i = 0; i < t->num_launches; ++i) {
+    test_launch("bench_threads",
+                test_kernel_sleep,
+                dim3(num_threads / k_block_size),
+                dim3(k_block_size),
+                args);
+
+    check_counters(num_threads);
+
+    if (t->barrier) {
+      uint64_t start = test_now_nsec();
+      pthread_barrier_wait(&g_barrier);
+      t->wait_nsec += test_now_nsec() - start;
+    }
+  }
+
+  nvcd_host_session_end();
+
+  return nullptr;
+}
+
+// runs num_host_threads threads, which all use device 0 if
+// same_device is set, and returns how long they took
+static uint64_t run(int num_host_threads,
+                    bool same_device,
+                    bool barrier,
+                    uint32_t num_launches,
+                    uint64_t kernel_nsec,
+                    uint64_t* wait_nsec) {
+  if (barrier) {
+    C_ASSERT(pthread_barrier_init(&g_barrier, nullptr, num_host_threads) == 0);
+  }
+
+  host_thread threads[k_num_host_threads] = {};
+
+  uint64_t start = test_now_nsec();
+
+  for (int i = 0; i < num_host_threads; ++i) {
+    threads[i].index = i;
+    threads[i].device = same_device ? 0 : i;
+    threads[i].barrier = barrier;
+    threads[i].num_launches = num_launches;
+    threads[i].kernel_nsec = kernel_nsec;
+    C_ASSERT(pthread_create(&threads[i].thread, nullptr, host_thread_main, &threads[i]) == 0);
+  }
+
+  *wait_nsec = 0;
+
+  for (int i = 0; i < num_host_threads; ++i) {
+    C_ASSERT(pthread_join(threads[i].thread, nullptr) == 0);
+    *wait_nsec += threads[i].wait_nsec;
+  }
+
+  uint64_t total_nsec = test_now_nsec() - start;
+
+  if (barrier) {
+    pthread_barrier_destroy(&g_barrier);
+  }
+
+  return total_nsec;
+}
+
+static void bench_rate(int num_host_threads, bool same_device) {
+  uint64_t wait_nsec = 0;
+  uint64_t total_nsec = run(num_host_threads, same_device, false, k_sweep_launches, 0, &wait_nsec);
+  uint64_t num_launches = static_cast<uint64_t>(num_host_threads) * k_sweep_launches;
+
+  printf("|BENCH|%d thread%s on %s, no barrier: %.0f launches/s\n",
+         num_host_threads,
+         num_host_threads == 1 ? "" : "s",
+         same_device ? "one device" : "a device each",
+         static_cast<double>(num_launches) / (static_cast<double>(total_nsec) * 1e-9));
+}
+
+int main() {
+  setenv(ENV_EVENTS, "stub_d0_e0,stub_d0_e1,stub_d0_e2,stub_d0_e3,stub_d0_e4,stub_d1_e0", 1);
+
+  stub_set_num_devices(k_num_host_threads);
+
+  // a deadlock fails the benchmark, rather than hanging it
+  alarm(120);
+
+  uint64_t wait_nsec = 0;
+  uint64_t total_nsec = run(k_num_host_threads, true, true, k_launches, k_kernel_nsec, &wait_nsec);
+  uint64_t num_launches = static_cast<uint64_t>(k_num_host_threads) * k_launches;
+
+  printf("|BENCH|%d threads on one device, barrier after each launch: %" PRIu64 " launches in %.3f s, "
+         "%.1f us per launch, %.1f us mean wait at the barrier\n",
+         k_num_host_threads,
+         num_launches,
+         static_cast<double>(total_nsec) * 1e-9,
+         static_cast<double>(total_nsec) * 1e-3 / static_cast<double>(num_launches),
+         static_cast<double>(wait_nsec) * 1e-3 / static_cast<double>(num_launches));
+
+  for (int num_host_threads: k_sweep_threads) {
+    bench_rate(num_host_threads, false);
+  }
+
+  bench_rate(k_num_host_threads, true);
+
+  return 0;
+}
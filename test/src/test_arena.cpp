@@ -0,0 +1,131 @@
+//
+// Allocations of odd sizes from an arena are aligned, don't overlap,
+// and keep their contents while the arena chains on larger blocks.
+// After a reset, the same allocations fit in the one block that
+// replaced the chain, so repeating them doesn't reach the heap.
+//
+
+#include "test_util.h"
+
+#include <nvcd/arena.h>
+
+#include <vector>
+
+#include <string.h>
+
+static const uint32_t k_num_allocations = 2000;
+
+struct allocation {
+  uint8_t* p;
+  size_t size;
+  uint8_t fill;
+};
+
+static size_t allocation_size(uint32_t i) {
+  // mostly small, with some larger than a whole block
+  return i % 211 == 0 ? NVCD_ARENA_MIN_BLOCK_SIZE + i : 1 + (i * 37) % 500;
+}
+
+// the source of nvcd_arena_memdup(), which isn't allocated,
+// so that the heap allocations counted are the arena's
+static uint8_t g_src[NVCD_ARENA_MIN_BLOCK_SIZE + k_num_allocations];
+
+// allocations is reserved, so that it doesn't allocate either
+static void allocate(nvcd_arena_t* arena, std::vector<allocation>& allocations) {
+  allocations.clear();
+
+  for (uint32_t i = 0; i < k_num_allocations; ++i) {
+    allocation a;
+    a.size = allocation_size(i);
+    a.fill = static_cast<uint8_t>(i);
+
+    if (i % 3 == 0) {
+      a.p = static_cast<uint8_t*>(nvcd_arena_zalloc(arena, a.size));
+
+      for (size_t k = 0; k < a.size; ++k) {
+        ASSERT(a.p[k] == 0);
+      }
+
+      memset(a.p, a.fill, a.size);
+    } else if (i % 3 == 1) {
+      memset(g_src, a.fill, a.size);
+      a.p = static_cast<uint8_t*>(nvcd_arena_memdup(arena, g_src, a.size));
+    } else {
+      a.p = static_cast<uint8_t*>(nvcd_arena_malloc(arena, a.size));
+      memset(a.p, a.fill, a.size);
+    }
+
+    ASSERT(a.p != NULL);
+    ASSERT(reinterpret_cast<uintptr_t>(a.p) % NVCD_ARENA_ALIGN == 0);
+
+    allocations.push_back(a);
+  }
+}
+
+// nothing was overwritten by a later allocation
+static void check(const std::vector<allocation>& allocations) {
+  for (const allocation& a: allocations) {
+    for (size_t k = 0; k < a.size; ++k) {
+      ASSERT(a.p[k] == a.fill);
+    }
+  }
+}
+
+int main() {
+  nvcd_arena_t arena = NVCD_ARENA_INIT;
+
+  size_t total = 0;
+
+  for (uint32_t i = 0; i < k_num_allocations; ++i) {
+    total += allocation_size(i);
+  }
+
+  std::vector<allocation> first;
+  std::vector<allocation> second;
+  first.reserve(k_num_allocations);
+  second.reserve(k_num_allocations);
+
+  allocate(&arena, first);
+  check(first);
+
+  ASSERT(arena.used >= total);
+  ASSERT(arena.used < total + k_num_allocations * NVCD_ARENA_ALIGN);
+
+  printf("|TEST|arena allocations are aligned and keep their contents across blocks\n");
+
+  size_t used = arena.used;
+
+  nvcd_arena_reset(&arena);
+  ASSERT(arena.used == 0);
+
+  // the reset itself replaces the chain; after it, the
+  // same allocations don't touch the heap
+  uint64_t allocs = test_allocs();
+
+  allocate(&arena, second);
+  check(second);
+
+  ASSERT(arena.used == used);
+  ASSERT(test_allocs() - allocs == 0);
+
+  // a reset of a single block reuses its memory from the start
+  nvcd_arena_reset(&arena);
+
+  void* p = nvcd_arena_malloc(&arena, 1);
+  ASSERT(p == second[0].p);
+  ASSERT(test_allocs() - allocs == 0);
+
+  printf("|TEST|arena reset keeps one block that fits everything, so repeats don't allocate\n");
+
+  nvcd_arena_free(&arena);
+
+  ASSERT(arena.block == NULL && arena.used == 0);
+
+  // usable again after it's freed
+  p = nvcd_arena_zalloc(&arena, 0);
+  ASSERT(p != NULL);
+
+  nvcd_arena_free(&arena);
+
+  return 0;
+}
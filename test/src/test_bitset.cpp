@@ -0,0 +1,110 @@
+//
+// The bitset helpers of util.h, against a std::vector<bool> that's
+// given the same random sets and clears, for sizes on either side of
+// a word boundary. bitset_fill() leaves the bits past the size clear,
+// so whole words can be counted.
+//
+
+#include "test_util.h"
+
+#include <random>
+#include <vector>
+
+static const uint32_t k_sizes[] = { 1, 5, 63, 64, 65, 127, 128, 129, 300 };
+static const uint32_t k_steps = 2000;
+
+static void check(const uint64_t* set, const std::vector<bool>& expected) {
+  uint32_t num_bits = static_cast<uint32_t>(expected.size());
+  uint32_t num_words = BITSET_NUM_WORDS(num_bits);
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < num_bits; ++i) {
+    ASSERT(bitset_test(set, i) == expected[i]);
+    count += expected[i];
+  }
+
+  ASSERT(bitset_count(set, num_words) == count);
+
+  // every set bit is visited once, in order
+  uint32_t visited = 0;
+  uint32_t last = 0;
+
+  BITSET_FOR_EACH(set, num_words, i) {
+    ASSERT(i < num_bits && expected[i]);
+    ASSERT(visited == 0 || i > last);
+
+    last = i;
+    visited++;
+  }
+
+  ASSERT(visited == count);
+
+  for (uint32_t i = 0; i < num_bits; ++i) {
+    uint32_t next = i;
+
+    while (next < num_bits && !expected[next]) {
+      next++;
+    }
+
+    ASSERT(bitset_next(set, num_words, i) == (next < num_bits ? next : UINT32_MAX));
+  }
+
+  ASSERT(bitset_next(set, num_words, num_words * BITSET_WORD_BITS) == UINT32_MAX);
+}
+
+int main() {
+  std::mt19937 rng(15);
+
+  for (uint32_t num_bits: k_sizes) {
+    uint32_t num_words = BITSET_NUM_WORDS(num_bits);
+
+    ASSERT(num_words * BITSET_WORD_BITS >= num_bits);
+    ASSERT((num_words - 1) * BITSET_WORD_BITS < num_bits);
+
+    std::vector<uint64_t> set(num_words, 0);
+    std::vector<bool> expected(num_bits, false);
+
+    check(set.data(), expected);
+
+    std::uniform_int_distribution<uint32_t> bit(0, num_bits - 1);
+
+    for (uint32_t step = 0; step < k_steps; ++step) {
+      uint32_t i = bit(rng);
+
+      if (rng() % 3 != 0) {
+        bitset_set(set.data(), i);
+        expected[i] = true;
+      } else {
+        bitset_clear(set.data(), i);
+        expected[i] = false;
+      }
+
+      if (step % 97 == 0) {
+        check(set.data(), expected);
+      }
+    }
+
+    check(set.data(), expected);
+
+    // with a word of garbage past the end, which fill mustn't touch
+    set.push_back(0x5555555555555555ull);
+
+    bitset_fill(set.data(), num_bits);
+    expected.assign(num_bits, true);
+
+    check(set.data(), expected);
+    ASSERT(bitset_count(set.data(), num_words) == num_bits);
+    ASSERT(set[num_words] == 0x5555555555555555ull);
+
+    for (uint32_t i = 0; i < num_bits; i += 3) {
+      bitset_clear(set.data(), i);
+      expected[i] = false;
+    }
+
+    check(set.data(), expected);
+  }
+
+  printf("|TEST|bitset set, clear, fill, count and iteration match a reference, across word boundaries\n");
+
+  return 0;
+}
@@ -0,0 +1,296 @@
+//
+// A catalog of made-up domains, events and metrics is written with
+// nvcd_catalog_writer and opened again. Every name is found through
+// the perfect hash, with the entry it was written with, and names
+// that were never written aren't.
+//
+// Copies of the file that were truncated, or had one field of their
+// header or sections corrupted, fail validation. Through ENV_CATALOG,
+// a device only uses a file that was written for it.
+//
+
+#include "test_nvcd.h"
+
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+static const uint32_t k_num_domains = 5;
+static const uint32_t k_events_per_domain = 300;
+static const uint32_t k_num_metrics = 400;
+static const uint32_t k_events_per_metric = 3;
+static const uint32_t k_events_per_group = 4;
+
+static std::string g_dir;
+
+static std::string event_name(uint32_t domain, uint32_t index) {
+  return "dom" + std::to_string(domain) + "_event" + std::to_string(index);
+}
+
+static std::string metric_name(uint32_t index) {
+  return "metric_" + std::to_string(index);
+}
+
+static CUpti_EventID event_id(uint32_t domain, uint32_t index) {
+  return domain * 1000 + index + 1;
+}
+
+static void build(nvcd_catalog_writer& w) {
+  for (uint32_t d = 0; d < k_num_domains; ++d) {
+    nvcd_catalog_domain_t domain = {};
+    domain.id = d + 1;
+    domain.name = w.add_string(("dom" + std::to_string(d)).c_str());
+    domain.events_begin = static_cast<uint32_t>(w.events.size());
+    domain.num_events = k_events_per_domain;
+    w.domains.push_back(domain);
+
+    for (uint32_t i = 0; i < k_events_per_domain; ++i) {
+      if (i % k_events_per_group == 0) {
+        nvcd_catalog_group_t group = {};
+        group.domain = d;
+        group.events_begin = static_cast<uint32_t>(w.group_events.size());
+        w.groups.push_back(group);
+      }
+
+      nvcd_catalog_event_t event = {};
+      event.id = event_id(d, i);
+      event.name = w.add_string(event_name(d, i).c_str());
+      event.domain = d;
+      event.category = i % 5;
+      event.group = static_cast<uint32_t>(w.groups.size() - 1);
+      w.events.push_back(event);
+
+      w.group_events.push_back(event.id);
+      w.groups.back().num_events++;
+    }
+  }
+
+  for (uint32_t m = 0; m < k_num_metrics; ++m) {
+    nvcd_catalog_metric_t metric = {};
+    metric.id = 5000 + m;
+    metric.name = w.add_string(metric_name(m).c_str());
+    metric.events_begin = static_cast<uint32_t>(w.metric_events.size());
+    metric.num_events = k_events_per_metric;
+    metric.supported = m % 2;
+    w.metrics.push_back(metric);
+
+    for (uint32_t k = 0; k < k_events_per_metric; ++k) {
+      w.metric_events.push_back(event_id(k, m % k_events_per_domain));
+    }
+  }
+}
+
+static void check_lookups(const nvcd_catalog_t* c) {
+  ASSERT(nvcd_catalog_count(c, NVCD_CATALOG_DOMAINS) == k_num_domains);
+  ASSERT(nvcd_catalog_count(c, NVCD_CATALOG_EVENTS) == k_num_domains * k_events_per_domain);
+  ASSERT(nvcd_catalog_count(c, NVCD_CATALOG_METRICS) == k_num_metrics);
+
+  for (uint32_t d = 0; d < k_num_domains; ++d) {
+    for (uint32_t i = 0; i < k_events_per_domain; ++i) {
+      std::string name = event_name(d, i);
+      const nvcd_catalog_event_t* e = nvcd_catalog_find_event(c, name.c_str());
+
+      ASSERT(e != NULL);
+      ASSERT(e->id == event_id(d, i));
+      ASSERT(e->domain == d && e->category == i % 5);
+      ASSERT(strcmp(nvcd_catalog_string(c, e->name), name.c_str()) == 0);
+
+      const nvcd_catalog_group_t& g = c->groups[e->group];
+      ASSERT(g.domain == d);
+      ASSERT(c->group_events[g.events_begin + i % k_events_per_group] == e->id);
+
+      // names that are close to it, but weren't written
+      ASSERT(nvcd_catalog_find_event(c, (name + "x").c_str()) == NULL);
+      ASSERT(nvcd_catalog_find_event(c, name.substr(1).c_str()) == NULL);
+      ASSERT(nvcd_catalog_find_event(c, event_name(d + k_num_domains, i).c_str()) == NULL);
+    }
+  }
+
+  for (uint32_t m = 0; m < k_num_metrics; ++m) {
+    std::string name = metric_name(m);
+    const nvcd_catalog_metric_t* metric = nvcd_catalog_find_metric(c, name.c_str());
+
+    ASSERT(metric != NULL);
+    ASSERT(metric->id == 5000 + m && metric->supported == m % 2);
+    ASSERT(metric->num_events == k_events_per_metric);
+
+    for (uint32_t k = 0; k < k_events_per_metric; ++k) {
+      ASSERT(c->metric_events[metric->events_begin + k] == event_id(k, m % k_events_per_domain));
+    }
+
+    ASSERT(nvcd_catalog_find_metric(c, metric_name(m + k_num_metrics).c_str()) == NULL);
+
+    // events and metrics are indexed apart
+    ASSERT(nvcd_catalog_find_event(c, name.c_str()) == NULL);
+  }
+
+  ASSERT(nvcd_catalog_find_event(c, "") == NULL);
+  ASSERT(nvcd_catalog_find_metric(c, "") == NULL);
+  ASSERT(nvcd_catalog_find_metric(c, event_name(0, 0).c_str()) == NULL);
+}
+
+static std::vector<uint8_t> read_file(const std::string& path) {
+  std::vector<uint8_t> data;
+
+  FILE* f = fopen(path.c_str(), "rb");
+  C_ASSERT(f != NULL);
+
+  uint8_t buffer[4096];
+  size_t n = 0;
+
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data.insert(data.end(), buffer, buffer + n);
+  }
+
+  fclose(f);
+
+  return data;
+}
+
+static void write_file(const std::string& path, const std::vector<uint8_t>& data) {
+  FILE* f = fopen(path.c_str(), "wb");
+  C_ASSERT(f != NULL);
+  C_ASSERT(fwrite(data.data(), 1, data.size(), f) == data.size());
+  fclose(f);
+}
+
+static bool opens(const std::vector<uint8_t>& data) {
+  std::string path = g_dir + "/corrupt.bin";
+  write_file(path, data);
+
+  nvcd_catalog_t c;
+  bool ok = nvcd_catalog_open(&c, path.c_str());
+
+  if (ok) {
+    nvcd_catalog_close(&c);
+  }
+
+  unlink(path.c_str());
+
+  return ok;
+}
+
+// a copy of data with the uint32_t at offset set to value
+static std::vector<uint8_t> with_u32(const std::vector<uint8_t>& data, size_t offset, uint32_t value) {
+  std::vector<uint8_t> copy(data);
+  memcpy(&copy[offset], &value, sizeof(value));
+  return copy;
+}
+
+static size_t section_offset(const std::vector<uint8_t>& data, uint32_t section) {
+  const nvcd_catalog_header_t* h = reinterpret_cast<const nvcd_catalog_header_t*>(data.data());
+  return h->sections[section].offset;
+}
+
+static void check_rejected(const std::vector<uint8_t>& data) {
+  ASSERT(opens(data));
+
+  // truncated anywhere, including inside the header
+  for (size_t size: { size_t(0), size_t(16), sizeof(nvcd_catalog_header_t) - 1,
+                      sizeof(nvcd_catalog_header_t), data.size() / 2, data.size() - 1 }) {
+    ASSERT(!opens(std::vector<uint8_t>(data.begin(), data.begin() + size)));
+  }
+
+  // with a byte appended, the size in the header doesn't match
+  std::vector<uint8_t> longer(data);
+  longer.push_back(0);
+  ASSERT(!opens(longer));
+
+  std::vector<uint8_t> magic(data);
+  magic[0] ^= 1;
+  ASSERT(!opens(magic));
+
+  ASSERT(!opens(with_u32(data, offsetof(nvcd_catalog_header_t, version), NVCD_CATALOG_VERSION + 1)));
+  ASSERT(!opens(with_u32(data, offsetof(nvcd_catalog_header_t, header_size), 8)));
+
+  size_t events_section =
+    offsetof(nvcd_catalog_header_t, sections) + sizeof(nvcd_catalog_section_t) * NVCD_CATALOG_EVENTS;
+
+  // a section that's misaligned, or runs past the end
+  ASSERT(!opens(with_u32(data, events_section + offsetof(nvcd_catalog_section_t, offset),
+                         static_cast<uint32_t>(section_offset(data, NVCD_CATALOG_EVENTS) + 4))));
+  ASSERT(!opens(with_u32(data, events_section + offsetof(nvcd_catalog_section_t, count),
+                         static_cast<uint32_t>(data.size()))));
+
+  // entries that point outside their sections
+  size_t events = section_offset(data, NVCD_CATALOG_EVENTS);
+  size_t metrics = section_offset(data, NVCD_CATALOG_METRICS);
+  size_t domains = section_offset(data, NVCD_CATALOG_DOMAINS);
+  size_t groups = section_offset(data, NVCD_CATALOG_GROUPS);
+  size_t event_slots = section_offset(data, NVCD_CATALOG_EVENT_SLOTS);
+  size_t metric_slots = section_offset(data, NVCD_CATALOG_METRIC_SLOTS);
+
+  ASSERT(!opens(with_u32(data, events + offsetof(nvcd_catalog_event_t, name), UINT32_MAX - 1)));
+  ASSERT(!opens(with_u32(data, events + offsetof(nvcd_catalog_event_t, domain), k_num_domains)));
+  ASSERT(!opens(with_u32(data, events + offsetof(nvcd_catalog_event_t, group), UINT32_MAX - 1)));
+  ASSERT(!opens(with_u32(data, metrics + offsetof(nvcd_catalog_metric_t, num_events), UINT32_MAX)));
+  ASSERT(!opens(with_u32(data, domains + offsetof(nvcd_catalog_domain_t, events_begin), UINT32_MAX)));
+  ASSERT(!opens(with_u32(data, groups + offsetof(nvcd_catalog_group_t, domain), k_num_domains)));
+  ASSERT(!opens(with_u32(data, event_slots, k_num_domains * k_events_per_domain)));
+  ASSERT(!opens(with_u32(data, metric_slots, k_num_metrics)));
+
+  // the strings don't end in a null terminator
+  std::vector<uint8_t> strings(data);
+  strings.back() = 'x';
+  ASSERT(!opens(strings));
+}
+
+int main() {
+  stub_set_num_devices(2);
+
+  C_ASSERT(cuInit(0) == CUDA_SUCCESS);
+
+  char dir_template[] = "/tmp/test_catalog_XXXXXX";
+  C_ASSERT(mkdtemp(dir_template) != NULL);
+  g_dir = dir_template;
+
+  nvcd_catalog_device_t device_0;
+  nvcd_catalog_device_t device_1;
+  nvcd_catalog_device(0, &device_0);
+  nvcd_catalog_device(1, &device_1);
+
+  char path_0[512];
+  char path_1[512];
+  nvcd_catalog_path(&device_0, g_dir.c_str(), path_0, sizeof(path_0));
+  nvcd_catalog_path(&device_1, g_dir.c_str(), path_1, sizeof(path_1));
+
+  ASSERT(strcmp(path_0, path_1) != 0);
+
+  nvcd_catalog_writer w;
+  build(w);
+  ASSERT(w.write(device_0, path_0));
+
+  nvcd_catalog_t c;
+  ASSERT(nvcd_catalog_open(&c, path_0));
+  check_lookups(&c);
+  nvcd_catalog_close(&c);
+
+  printf("|TEST|catalog finds every event and metric it was written with, and nothing else\n");
+
+  check_rejected(read_file(path_0));
+
+  printf("|TEST|catalog rejects truncated and corrupted files\n");
+
+  // device 1's file is the one written for device 0
+  write_file(path_1, read_file(path_0));
+
+  setenv(ENV_CATALOG, g_dir.c_str(), 1);
+
+  const nvcd_catalog_t* found = nvcd_catalog_for_device(0);
+  ASSERT(found != NULL);
+  ASSERT(nvcd_catalog_find_event(found, event_name(1, 2).c_str())->id == event_id(1, 2));
+
+  ASSERT(nvcd_catalog_for_device(0) == found);
+  ASSERT(nvcd_catalog_for_device(1) == NULL);
+
+  printf("|TEST|catalog is only used by the device it was written for\n");
+
+  unlink(path_0);
+  unlink(path_1);
+  rmdir(g_dir.c_str());
+
+  return 0;
+}
@@ -0,0 +1,190 @@
+//
+// The counters and metrics of a profiled launch are the ones the stub
+// produced, for launches on their own and in a session, and with
+// enough events that they take more than one pass.
+//
+
+#include "test_nvcd.h"
+
+static const int k_block_size = 128;
+
+static uint64_t stub_event_id(const char* name) {
+  CUpti_EventID id = 0;
+  CUPTI_FN(cuptiEventGetIdFromName(0, name, &id));
+  return id;
+}
+
+static void check_counters(int num_threads) {
+  const cupti_counter_matrix_t& m = g_run_info->counters;
+
+  ASSERT(m.num_rows > 0);
+
+  for (uint32_t row = 0; row < m.num_rows; ++row) {
+    uint32_t num_instances = 0;
+    const uint64_t* values = cupti_counter_matrix_row(&m, row, &num_instances);
+
+    ASSERT(num_instances > 0);
+
+    for (uint32_t k = 0; k < num_instances; ++k) {
+      ASSERT(values[k] == stub_counter_value(m.event_ids[row], k, num_threads));
+    }
+  }
+}
+
+// stub_m_sum adds the per-instance means of two events
+static uint64_t expected_sum(int num_threads) {
+  uint64_t d0 = 0;
+  uint64_t d1 = 0;
+
+  for (uint32_t k = 0; k < 4; ++k) {
+    d0 += stub_counter_value(stub_event_id("stub_d0_e0"), k, num_threads);
+  }
+
+  for (uint32_t k = 0; k < 2; ++k) {
+    d1 += stub_counter_value(stub_event_id("stub_d1_e0"), k, num_threads);
+  }
+
+  return d0 / 4 + d1 / 2;
+}
+
+static void check_metric(int num_threads) {
+  C_ASSERT(nvcd_lock_events());
+  
+  cupti_metric_data_t* m = nvcd_get_events()->metric_data;
+
+  ASSERT(m != NULL);
+  ASSERT(m->num_metrics == 1);
+  ASSERT(m->computed[0] == true);
+  ASSERT(m->metric_values[0].metricValueUint64 == expected_sum(num_threads));
+
+  nvcd_release_events();
+}
+
+// every count around a multiple of the lanes, with
+// the extremes in each lane and in the tail
+static void check_stats() {
+  uint64_t values[19];
+
+  for (uint32_t count = 0; count <= 19; ++count) {
+    for (uint32_t pick = 0; pick < count; ++pick) {
+      uint64_t sum = 0;
+      
+      for (uint32_t i = 0; i < count; ++i) {
+        values[i] = 1000 + i;
+        values[i] = i == pick ? UINT64_MAX / 32 : values[i];
+        values[i] = i == (pick + 1) % count && count > 1 ? 1 : values[i];
+        sum += values[i];
+      }
+
+      cupti_counter_stats_t stats;
+      cupti_counter_stats(values, count, &stats);
+
+      ASSERT(stats.sum == sum);
+      ASSERT(stats.max == UINT64_MAX / 32);
+      ASSERT(stats.min == (count > 1 ? 1 : UINT64_MAX / 32));
+    }
+  }
+
+  cupti_counter_stats_t stats;
+  cupti_counter_stats(values, 0, &stats);
+  
+  ASSERT(stats.sum == 0 && stats.min == 0 && stats.max == 0 && stats.mean == 0.0);
+}
+
+// each pass fills its own events' rows, at the same
+// rows as the full matrix, and no other pass fills them
+static void check_pass_counters() {
+  const cupti_counter_matrix_t& full = g_run_info->counters;
+  cupti_counter_matrix_t pass_counters = CUPTI_COUNTER_MATRIX_INIT;
+  uint32_t num_fills[64] = {};
+
+  ASSERT(full.num_rows <= 64);
+  
+  C_ASSERT(nvcd_lock_events());
+
+  cupti_event_data_t* e = nvcd_get_events();
+
+  ASSERT(cupti_event_data_num_passes(e) > 1);
+  
+  for (uint32_t pass = 0; pass < cupti_event_data_num_passes(e); ++pass) {
+    cupti_event_data_pass_counter_matrix(e, pass, &pass_counters);
+
+    ASSERT(pass_counters.num_rows == full.num_rows);
+
+    for (uint32_t row = 0; row < full.num_rows; ++row) {
+      ASSERT(pass_counters.event_ids[row] == full.event_ids[row]);
+      
+      if (cupti_counter_matrix_filled(&pass_counters, row)) {
+        uint32_t num_instances = 0;
+        uint32_t full_num_instances = 0;
+        const uint64_t* values = cupti_counter_matrix_row(&pass_counters, row, &num_instances);
+        const uint64_t* full_values = cupti_counter_matrix_row(&full, row, &full_num_instances);
+
+        ASSERT(num_instances == full_num_instances);
+        ASSERT(memcmp(values, full_values, sizeof(values[0]) * num_instances) == 0);
+
+        num_fills[row]++;
+      }
+    }
+  }
+
+  nvcd_release_events();
+
+  for (uint32_t row = 0; row < full.num_rows; ++row) {
+    ASSERT(num_fills[row] == 1);
+  }
+
+  cupti_counter_matrix_free(&pass_counters);
+}
+
+static void launch(int num_threads) {
+  test_launch("test_counters",
+              test_kernel_sleep,
+              dim3(num_threads / k_block_size),
+              dim3(k_block_size));
+}
+
+int main() {
+  check_stats();
+
+  printf("|TEST|counter stats\n");
+  
+  // more events of domain 0 than fit in one group
+  setenv(ENV_EVENTS, "stub_d0_e0,stub_d0_e1,stub_d0_e2,stub_d0_e3,stub_d0_e4,stub_d1_e0", 1);
+  setenv(ENV_METRICS, "stub_m_sum", 1);
+
+  launch(1024);
+  check_counters(1024);
+
+  printf("|TEST|counters of a single launch\n");
+
+  stub_counters_t before;
+  stub_counters_get(&before);
+
+  nvcd_host_session_begin();
+
+  for (int i = 1; i <= 8; ++i) {
+    int num_threads = i * 512;
+
+    nvcd_host_begin("test_counters", num_threads);
+    test_run(test_kernel_sleep, dim3(num_threads / k_block_size), dim3(k_block_size), nullptr, 0);
+    nvcd_host_end();
+
+    // counters aren't carried over from the previous launch
+    check_counters(num_threads);
+    check_metric(num_threads);
+    check_pass_counters();
+  }
+
+  nvcd_host_session_end();
+
+  stub_counters_t after;
+  stub_counters_get(&after);
+
+  // every pass was read after its kernel finished
+  ASSERT(after.early_reads == before.early_reads);
+
+  printf("|TEST|counters and metrics of launches in a session, and of each pass\n");
+
+  return 0;
+}
@@ -0,0 +1,110 @@
+//
+// Threads that profile the same device share its buffers, which the
+// device symbols point to. Here, threads with launches of different
+// sizes take turns on one device, and each must read back the thread
+// times its own kernel wrote, whichever thread grew the buffers last.
+//
+
+#include "test_nvcd.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+static const int k_num_host_threads = 4;
+static const uint32_t k_launches = 20;
+static const int k_block_size = 64;
+
+static pthread_barrier_t g_barrier;
+
+// writes base + i as the time of thread i, through the device symbols
+static uint64_t kernel_write_times(const stub_launch_t* launch) {
+  uint64_t base = *static_cast<const uint64_t*>(launch->args[0]);
+  uint32_t num_threads = launch->grid.x * launch->block.x;
+
+  for (uint32_t i = 0; i < num_threads; ++i) {
+    detail::dev_ttime[i] = static_cast<clock64_t>(base + i);
+    detail::dev_smids[i] = 1 + i % STUB_NUM_SMS;
+  }
+
+  return 1000;
+}
+
+static void* host_thread_main(void* arg) {
+  int index = *static_cast<int*>(arg);
+
+  nvcd_host_session_begin();
+
+  for (uint32_t i = 0; i < k_launches; ++i) {
+    // each thread launches a different size in turn,
+    // so the buffers keep being outgrown
+    int num_blocks = 1 + (index + static_cast<int>(i)) % k_num_host_threads;
+    int num_threads = num_blocks * k_block_size;
+
+    uint64_t base = (static_cast<uint64_t>(index) << 32) + (static_cast<uint64_t>(i) << 16);
+    void* args[] = { &base };
+
+    // one thread launches at a time, in a different order each round
+    for (int turn = 0; turn < k_num_host_threads; ++turn) {
+      if (turn == (index + static_cast<int>(i)) % k_num_host_threads) {
+        test_launch("test_device_pool",
+                    kernel_write_times,
+                    dim3(num_blocks),
+                    dim3(k_block_size),
+                    args);
+
+        const kernel_invoke_data& d = g_run_info->kernel_stats.back();
+
+        ASSERT(d.num_threads == static_cast<size_t>(num_threads));
+
+        for (int t = 0; t < num_threads; ++t) {
+          ASSERT(d.times[t] == static_cast<clock64_t>(base + t));
+          ASSERT(d.smids[t] == static_cast<uint32_t>(t % STUB_NUM_SMS));
+        }
+      }
+
+      pthread_barrier_wait(&g_barrier);
+    }
+  }
+
+  nvcd_host_session_end();
+
+  return nullptr;
+}
+
+int main() {
+  setenv(ENV_EVENTS, "stub_d0_e0", 1);
+  setenv(ENV_IMBALANCE, "1", 1);
+
+  alarm(60);
+
+  C_ASSERT(pthread_barrier_init(&g_barrier, nullptr, k_num_host_threads) == 0);
+
+  pthread_t threads[k_num_host_threads];
+  int indices[k_num_host_threads];
+
+  for (int i = 0; i < k_num_host_threads; ++i) {
+    indices[i] = i;
+    C_ASSERT(pthread_create(&threads[i], nullptr, host_thread_main, &indices[i]) == 0);
+  }
+
+  for (int i = 0; i < k_num_host_threads; ++i) {
+    C_ASSERT(pthread_join(threads[i], nullptr) == 0);
+  }
+
+  pthread_barrier_destroy(&g_barrier);
+
+  stub_counters_t c;
+  stub_counters_get(&c);
+
+  // the one pool was only grown to the largest launch,
+  // rather than once per thread, and freed by the last thread
+  // to terminate. Each launch cleared it with one memset.
+  ASSERT(c.mallocs <= 3);
+  ASSERT(c.frees == c.mallocs);
+  ASSERT(c.memsets == k_num_host_threads * k_launches);
+
+  printf("|TEST|threads sharing a device read back their own thread times (%" PRIu64 " device allocations)\n",
+         c.mallocs);
+
+  return 0;
+}
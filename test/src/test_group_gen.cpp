@@ -0,0 +1,178 @@
+//
+// domain_group_gen solves sets of up to exact_max_events events
+// exactly. The stub is given a domain of that many events, with
+// random pairs of them that can't share a group, and every solution is
+// checked against the fewest groups found by an exhaustive search over
+// the same conflicts and group size.
+//
+// The group size is either that of the stub, or a smaller requested
+// maximum, or a larger one, which CUPTI turns down as full; the
+// generator then shrinks it and solves again.
+//
+
+#include "test_nvcd.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+static const uint32_t k_num_events = 14;
+static const uint32_t k_num_graphs = 40;
+
+static const CUpti_EventDomainID k_domain = 1;
+
+static CUpti_EventID event_id(uint32_t index) {
+  return index + 1;
+}
+
+struct graph {
+  // a mask of the events each conflicts with
+  std::vector<uint32_t> conflicts;
+
+  explicit graph(uint32_t n)
+    : conflicts(n, 0) {
+  }
+
+  bool independent(uint32_t set) const {
+    for (uint32_t v = 0; v < conflicts.size(); ++v) {
+      if (((set >> v) & 1) && (conflicts[v] & set) != 0) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+};
+
+static graph random_graph(std::mt19937& rng, double density) {
+  graph g(k_num_events);
+  std::bernoulli_distribution edge(density);
+
+  for (uint32_t a = 0; a < k_num_events; ++a) {
+    for (uint32_t b = a + 1; b < k_num_events; ++b) {
+      if (edge(rng)) {
+        g.conflicts[a] |= 1u << b;
+        g.conflicts[b] |= 1u << a;
+      }
+    }
+  }
+
+  return g;
+}
+
+// the fewest sets of at most capacity events, with no conflicts
+// within a set, that cover every event
+static uint32_t fewest_groups(const graph& g, uint32_t capacity) {
+  uint32_t n = static_cast<uint32_t>(g.conflicts.size());
+  uint32_t all = (1u << n) - 1;
+
+  std::vector<uint32_t> sets;
+
+  for (uint32_t set = 1; set <= all; ++set) {
+    if (static_cast<uint32_t>(__builtin_popcount(set)) <= capacity && g.independent(set)) {
+      sets.push_back(set);
+    }
+  }
+
+  // fewest[mask] covers the events in mask; each step covers
+  // the lowest event that's left, so every cover is tried once
+  std::vector<uint32_t> fewest(all + 1, UINT32_MAX);
+  fewest[0] = 0;
+
+  for (uint32_t mask = 1; mask <= all; ++mask) {
+    uint32_t lowest = mask & (~mask + 1);
+
+    for (uint32_t set: sets) {
+      if ((set & lowest) != 0 && (set & ~mask) == 0 && fewest[mask & ~set] != UINT32_MAX) {
+        fewest[mask] = std::min(fewest[mask], fewest[mask & ~set] + 1);
+      }
+    }
+  }
+
+  return fewest[all];
+}
+
+static void check_groups(const graph& g,
+                         const event_group_list_type& groups,
+                         uint32_t capacity,
+                         uint32_t expected) {
+  uint32_t covered = 0;
+
+  ASSERT(groups.size() == expected);
+
+  for (const event_group& group: groups) {
+    uint32_t set = 0;
+
+    ASSERT(!group.events.empty() && group.events.size() <= capacity);
+
+    for (CUpti_EventID e: group.events) {
+      uint32_t v = e - 1;
+
+      ASSERT(v < k_num_events && ((covered | set) >> v & 1) == 0);
+      set |= 1u << v;
+    }
+
+    ASSERT(g.independent(set));
+    covered |= set;
+  }
+
+  ASSERT(covered == (1u << k_num_events) - 1);
+}
+
+int main() {
+  stub_set_events_per_domain(k_num_events);
+
+  nvcd_init();
+
+  std::mt19937 rng(1234);
+
+  uint32_t num_solved = 0;
+
+  for (uint32_t i = 0; i < k_num_graphs; ++i) {
+    graph g = random_graph(rng, 0.1 + 0.6 * i / k_num_graphs);
+
+    stub_clear_conflicts();
+
+    for (uint32_t a = 0; a < k_num_events; ++a) {
+      for (uint32_t b = a + 1; b < k_num_events; ++b) {
+        if ((g.conflicts[a] >> b) & 1) {
+          stub_set_conflict(event_id(a), event_id(b));
+        }
+      }
+    }
+
+    for (size_t max_events: { size_t(2), size_t(3), size_t(STUB_MAX_GROUP_EVENTS), size_t(8) }) {
+      uint32_t capacity = static_cast<uint32_t>(std::min<size_t>(max_events, STUB_MAX_GROUP_EVENTS));
+
+      nvcd_device_info::domain_group_gen gen(g_nvcd.devices[0],
+                                             g_nvcd.contexts[0],
+                                             k_domain,
+                                             max_events,
+                                             nullptr);
+
+      ASSERT(gen.num_events() == k_num_events);
+      ASSERT(gen.unsupported_events().empty());
+
+      event_group_list_type groups = gen();
+
+      check_groups(g, groups, capacity, fewest_groups(g, capacity));
+
+      for (const event_group& group: groups) {
+        CUPTI_FN(cuptiEventGroupRemoveAllEvents(group.group));
+        CUPTI_FN(cuptiEventGroupDestroy(group.group));
+      }
+
+      num_solved++;
+    }
+  }
+
+  printf("|TEST|domain_group_gen finds the fewest groups for %" PRIu32 " sets of %" PRIu32 " events\n",
+         num_solved,
+         k_num_events);
+
+  stub_clear_conflicts();
+
+  nvcd_terminate();
+
+  return 0;
+}
@@ -0,0 +1,309 @@
+//
+// Nested regions, entered through the hook:
+//
+//   outer          1 launch of 1 block
+//     inner        2 launches of 2 blocks, on each of 2 entries
+//       leaf       1 launch of 3 blocks
+//     other        1 launch of 4 blocks
+//
+// libnvcd_region_report() gives every path its inclusive totals and
+// those of its own launches, which are checked against the stub's
+// counter values. The folded stacks written to ENV_FOLDED weigh each
+// path by its exclusive value of ENV_FOLDED_EVENT, or by its exclusive
+// wall time without it.
+//
+
+#include "test_util.h"
+
+#include <nvcd/writer.h>
+
+#include <map>
+#include <string>
+
+#include <string.h>
+#include <unistd.h>
+
+extern "C" {
+  void libnvcd_begin(const char* region_name);
+  void libnvcd_end();
+  void libnvcd_region_report();
+}
+
+static const uint32_t k_block_size = 64;
+static const uint64_t k_kernel_nsec = 10000;
+
+// stub_d0_e0 has 4 instances, stub_d1_e0 has 2
+static const CUpti_EventID k_d0_e0 = 1;
+static const CUpti_EventID k_d1_e0 = 257;
+
+struct region_line {
+  uint64_t entries;
+  uint64_t wall_nsec;
+  uint64_t excl_wall_nsec;
+  uint64_t kernels;
+  uint64_t excl_kernels;
+  uint64_t kernel_nsec;
+  uint64_t excl_kernel_nsec;
+};
+
+struct counter_line {
+  uint64_t sum;
+  uint64_t excl_sum;
+};
+
+static std::map<std::string, region_line> g_regions;
+static std::map<std::string, counter_line> g_counters; // by "path:event"
+
+static void launch(uint32_t num_blocks) {
+  uint64_t kernel_nsec = k_kernel_nsec;
+  void* args[] = { &kernel_nsec };
+
+  C_ASSERT(cudaLaunchKernel(reinterpret_cast<const void*>(test_kernel_sleep),
+                            dim3(num_blocks),
+                            dim3(k_block_size),
+                            args,
+                            0,
+                            0) == cudaSuccess);
+}
+
+// the sum over instances of one launch's counter
+static uint64_t launch_sum(CUpti_EventID event, uint32_t num_blocks) {
+  uint32_t num_instances = event == k_d0_e0 ? 4 : 2;
+  uint64_t sum = 0;
+
+  for (uint32_t k = 0; k < num_instances; ++k) {
+    sum += stub_counter_value(event, k, num_blocks * k_block_size);
+  }
+
+  return sum;
+}
+
+static void run_regions() {
+  libnvcd_begin("outer");
+  launch(1);
+
+  for (int i = 0; i < 2; ++i) {
+    libnvcd_begin("inner");
+    launch(2);
+    launch(2);
+
+    if (i == 1) {
+      libnvcd_begin("leaf");
+      launch(3);
+      libnvcd_end();
+    }
+
+    libnvcd_end();
+  }
+
+  libnvcd_begin("other");
+  launch(4);
+  libnvcd_end();
+
+  libnvcd_end();
+}
+
+// reports the region tree, and parses its lines
+static void report() {
+  FILE* output = tmpfile();
+  C_ASSERT(output != NULL);
+
+  nvcd_writer_flush();
+  fflush(stdout);
+
+  int saved_stdout = dup(STDOUT_FILENO);
+  C_ASSERT(saved_stdout >= 0);
+  C_ASSERT(dup2(fileno(output), STDOUT_FILENO) == STDOUT_FILENO);
+
+  libnvcd_region_report();
+
+  nvcd_writer_flush();
+  fflush(stdout);
+
+  C_ASSERT(dup2(saved_stdout, STDOUT_FILENO) == STDOUT_FILENO);
+  close(saved_stdout);
+
+  g_regions.clear();
+  g_counters.clear();
+
+  rewind(output);
+
+  char line[1024];
+
+  while (fgets(line, sizeof(line), output) != NULL) {
+    fputs(line, stdout);
+
+    char name[256] = {};
+
+    if (strncmp(line, "|REGION|", 8) == 0) {
+      region_line r = {};
+
+      C_ASSERT(sscanf(line,
+                      "|REGION|%255[^:]: ENTRIES: %" SCNu64 " WALL_NSEC: %" SCNu64
+                      " EXCL_WALL_NSEC: %" SCNu64 " KERNELS: %" SCNu64 " EXCL_KERNELS: %" SCNu64
+                      " KERNEL_NSEC: %" SCNu64 " EXCL_KERNEL_NSEC: %" SCNu64,
+                      name,
+                      &r.entries,
+                      &r.wall_nsec,
+                      &r.excl_wall_nsec,
+                      &r.kernels,
+                      &r.excl_kernels,
+                      &r.kernel_nsec,
+                      &r.excl_kernel_nsec) == 8);
+
+      g_regions[name] = r;
+    } else if (strncmp(line, "|REGION_COUNTER|", 16) == 0) {
+      counter_line c = {};
+
+      C_ASSERT(sscanf(line,
+                      "|REGION_COUNTER|%255[^ ] SUM: %" SCNu64 " EXCL_SUM: %" SCNu64,
+                      name,
+                      &c.sum,
+                      &c.excl_sum) == 3);
+
+      // "path:event:"
+      size_t length = strlen(name);
+      C_ASSERT(length > 0 && name[length - 1] == ':');
+      name[length - 1] = '\0';
+
+      g_counters[name] = c;
+    }
+  }
+
+  fclose(output);
+}
+
+static void check_region(const char* path,
+                         uint64_t entries,
+                         uint64_t excl_kernels,
+                         uint64_t kernels,
+                         const char* const* children) {
+  auto it = g_regions.find(path);
+  ASSERT(it != g_regions.end());
+
+  const region_line& r = it->second;
+
+  ASSERT(r.entries == entries);
+  ASSERT(r.excl_kernels == excl_kernels);
+  ASSERT(r.kernels == kernels);
+
+  // every launch ran for at least the kernel's time
+  ASSERT(r.excl_kernel_nsec >= excl_kernels * k_kernel_nsec);
+
+  uint64_t children_wall_nsec = 0;
+  uint64_t children_kernel_nsec = 0;
+
+  for (const char* const* child = children; *child != nullptr; ++child) {
+    const region_line& c = g_regions.at(*child);
+    children_wall_nsec += c.wall_nsec;
+    children_kernel_nsec += c.kernel_nsec;
+  }
+
+  ASSERT(r.kernel_nsec == r.excl_kernel_nsec + children_kernel_nsec);
+  ASSERT(r.wall_nsec >= children_wall_nsec);
+  ASSERT(r.excl_wall_nsec == r.wall_nsec - children_wall_nsec);
+  ASSERT(r.wall_nsec >= r.kernel_nsec);
+}
+
+static void check_counter(const char* path, CUpti_EventID event, uint64_t excl_sum, uint64_t sum) {
+  std::string key = std::string(path) + ":" + (event == k_d0_e0 ? "stub_d0_e0" : "stub_d1_e0");
+
+  auto it = g_counters.find(key);
+  ASSERT(it != g_counters.end());
+
+  ASSERT(it->second.excl_sum == excl_sum);
+  ASSERT(it->second.sum == sum);
+}
+
+static void check_report() {
+  static const char* const outer_children[] = { "outer/inner", "outer/other", nullptr };
+  static const char* const inner_children[] = { "outer/inner/leaf", nullptr };
+  static const char* const no_children[] = { nullptr };
+
+  ASSERT(g_regions.size() == 4);
+
+  check_region("outer", 1, 1, 7, outer_children);
+  check_region("outer/inner", 2, 4, 5, inner_children);
+  check_region("outer/inner/leaf", 1, 1, 1, no_children);
+  check_region("outer/other", 1, 1, 1, no_children);
+
+  ASSERT(g_counters.size() == 8);
+
+  for (CUpti_EventID event: { k_d0_e0, k_d1_e0 }) {
+    uint64_t outer = launch_sum(event, 1);
+    uint64_t inner = 4 * launch_sum(event, 2);
+    uint64_t leaf = launch_sum(event, 3);
+    uint64_t other = launch_sum(event, 4);
+
+    check_counter("outer", event, outer, outer + inner + leaf + other);
+    check_counter("outer/inner", event, inner, inner + leaf);
+    check_counter("outer/inner/leaf", event, leaf, leaf);
+    check_counter("outer/other", event, other, other);
+  }
+}
+
+// the folded stacks in filename, by stack
+static std::map<std::string, uint64_t> read_folded(const char* filename) {
+  std::map<std::string, uint64_t> stacks;
+
+  FILE* f = fopen(filename, "r");
+  C_ASSERT(f != NULL);
+
+  char stack[256] = {};
+  uint64_t weight = 0;
+
+  while (fscanf(f, "%255s %" SCNu64, stack, &weight) == 2) {
+    ASSERT(stacks.find(stack) == stacks.end());
+    stacks[stack] = weight;
+  }
+
+  fclose(f);
+
+  return stacks;
+}
+
+int main() {
+  setenv(ENV_EVENTS, "stub_d0_e0,stub_d1_e0", 1);
+
+  char folded[] = "/tmp/test_hook_regions_XXXXXX";
+  int fd = mkstemp(folded);
+  C_ASSERT(fd >= 0);
+  close(fd);
+
+  setenv(ENV_FOLDED, folded, 1);
+  setenv(ENV_FOLDED_EVENT, "stub_d0_e0", 1);
+
+  run_regions();
+  report();
+  check_report();
+
+  printf("|TEST|region tree inclusive and exclusive totals of nested regions\n");
+
+  std::map<std::string, uint64_t> stacks = read_folded(folded);
+
+  ASSERT(stacks.size() == 4);
+  ASSERT(stacks["outer"] == launch_sum(k_d0_e0, 1));
+  ASSERT(stacks["outer;inner"] == 4 * launch_sum(k_d0_e0, 2));
+  ASSERT(stacks["outer;inner;leaf"] == launch_sum(k_d0_e0, 3));
+  ASSERT(stacks["outer;other"] == launch_sum(k_d0_e0, 4));
+
+  // by exclusive wall time; every region takes some
+  C_ASSERT(truncate(folded, 0) == 0);
+  unsetenv(ENV_FOLDED_EVENT);
+
+  report();
+
+  stacks = read_folded(folded);
+
+  ASSERT(stacks.size() == 4);
+  ASSERT(stacks["outer"] == g_regions.at("outer").excl_wall_nsec);
+  ASSERT(stacks["outer;inner"] == g_regions.at("outer/inner").excl_wall_nsec);
+  ASSERT(stacks["outer;inner;leaf"] == g_regions.at("outer/inner/leaf").excl_wall_nsec);
+  ASSERT(stacks["outer;other"] == g_regions.at("outer/other").excl_wall_nsec);
+
+  unlink(folded);
+
+  printf("|TEST|region tree folded stacks, by counter and by wall time\n");
+
+  return 0;
+}
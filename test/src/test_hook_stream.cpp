@@ -0,0 +1,180 @@
+//
+// With ENV_STREAM set, the hook returns as soon as the profiled kernel
+// is launched, and its counters are read once they're needed. Work
+// that's submitted to another stream right after the launch runs
+// alongside the kernel, rather than after it.
+//
+// Then, threads on the same device take turns, so that each thread's
+// launch is still running when the next thread's launch reads it.
+//
+
+#include "test_util.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+
+extern "C" {
+  void libnvcd_begin(const char* region_name);
+  void libnvcd_end();
+}
+
+static const uint32_t k_launches = 10;
+static const uint64_t k_kernel_nsec = 20000000;
+
+static const int k_num_host_threads = 4;
+static const uint32_t k_thread_launches = 20;
+
+static sem_t g_submit;
+static sem_t g_submitted;
+static cudaStream_t g_other_stream = nullptr;
+
+static pthread_barrier_t g_barrier;
+
+static void launch(cudaStream_t stream, uint64_t* kernel_nsec) {
+  void* args[] = { kernel_nsec };
+
+  C_ASSERT(cudaLaunchKernel(reinterpret_cast<const void*>(test_kernel_sleep),
+                            dim3(4),
+                            dim3(64),
+                            args,
+                            0,
+                            stream) == cudaSuccess);
+}
+
+// outside of any region, so its launches aren't profiled
+static void* submit_thread_main(void*) {
+  uint64_t kernel_nsec = k_kernel_nsec;
+
+  for (uint32_t i = 0; i < k_launches; ++i) {
+    C_ASSERT(sem_wait(&g_submit) == 0);
+    launch(g_other_stream, &kernel_nsec);
+    C_ASSERT(sem_post(&g_submitted) == 0);
+  }
+
+  return nullptr;
+}
+
+static void test_overlap() {
+  cudaStream_t stream = nullptr;
+
+  C_ASSERT(cudaStreamCreate(&stream) == cudaSuccess);
+  C_ASSERT(cudaStreamCreate(&g_other_stream) == cudaSuccess);
+  C_ASSERT(sem_init(&g_submit, 0, 0) == 0);
+  C_ASSERT(sem_init(&g_submitted, 0, 0) == 0);
+
+  pthread_t thread;
+  C_ASSERT(pthread_create(&thread, nullptr, submit_thread_main, nullptr) == 0);
+
+  stub_counters_t before;
+  stub_counters_get(&before);
+
+  uint64_t kernel_nsec = k_kernel_nsec;
+  uint64_t total_nsec = 0;
+
+  libnvcd_begin("test_hook_stream");
+
+  for (uint32_t i = 0; i < k_launches; ++i) {
+    uint64_t start = test_now_nsec();
+
+    launch(stream, &kernel_nsec);
+
+    C_ASSERT(sem_post(&g_submit) == 0);
+    C_ASSERT(sem_wait(&g_submitted) == 0);
+
+    C_ASSERT(cudaStreamSynchronize(stream) == cudaSuccess);
+    C_ASSERT(cudaStreamSynchronize(g_other_stream) == cudaSuccess);
+
+    total_nsec += test_now_nsec() - start;
+  }
+
+  libnvcd_end();
+
+  C_ASSERT(pthread_join(thread, nullptr) == 0);
+
+  stub_counters_t after;
+  stub_counters_get(&after);
+
+  // both kernels run at once, rather than one after the other
+  uint64_t mean_nsec = total_nsec / k_launches;
+  ASSERT(mean_nsec < k_kernel_nsec + k_kernel_nsec / 2);
+
+  // every launch was read, once its kernel was done, and
+  // nvcd never had to wait for it, since the program already had
+  ASSERT(after.group_reads - before.group_reads == k_launches);
+  ASSERT(after.early_reads == before.early_reads);
+  ASSERT(after.event_syncs == before.event_syncs);
+
+  sem_destroy(&g_submit);
+  sem_destroy(&g_submitted);
+  C_ASSERT(cudaStreamDestroy(stream) == cudaSuccess);
+  C_ASSERT(cudaStreamDestroy(g_other_stream) == cudaSuccess);
+
+  printf("|TEST|another stream runs alongside the profiled kernel (%.1f ms per launch, kernels of %.1f ms)\n",
+         static_cast<double>(mean_nsec) * 1e-6,
+         static_cast<double>(k_kernel_nsec) * 1e-6);
+}
+
+static void* host_thread_main(void*) {
+  cudaStream_t stream = nullptr;
+  C_ASSERT(cudaStreamCreate(&stream) == cudaSuccess);
+
+  uint64_t kernel_nsec = 100000;
+
+  libnvcd_begin("test_hook_stream_threads");
+
+  for (uint32_t i = 0; i < k_thread_launches; ++i) {
+    launch(stream, &kernel_nsec);
+    pthread_barrier_wait(&g_barrier);
+  }
+
+  libnvcd_end();
+
+  C_ASSERT(cudaStreamDestroy(stream) == cudaSuccess);
+
+  return nullptr;
+}
+
+static void test_threads() {
+  C_ASSERT(pthread_barrier_init(&g_barrier, nullptr, k_num_host_threads) == 0);
+
+  stub_counters_t before;
+  stub_counters_get(&before);
+
+  pthread_t threads[k_num_host_threads];
+
+  for (int i = 0; i < k_num_host_threads; ++i) {
+    C_ASSERT(pthread_create(&threads[i], nullptr, host_thread_main, nullptr) == 0);
+  }
+
+  for (int i = 0; i < k_num_host_threads; ++i) {
+    C_ASSERT(pthread_join(threads[i], nullptr) == 0);
+  }
+
+  pthread_barrier_destroy(&g_barrier);
+
+  stub_counters_t after;
+  stub_counters_get(&after);
+
+  // whichever thread read a launch, it was read
+  // exactly once, and after its kernel was done
+  ASSERT(after.group_reads - before.group_reads == k_num_host_threads * k_thread_launches);
+  ASSERT(after.early_reads == before.early_reads);
+
+  printf("|TEST|launches left running are read by whichever thread launches next, from %d threads\n",
+         k_num_host_threads);
+}
+
+int main() {
+  // one group, so each launch takes a single pass
+  setenv(ENV_EVENTS, "stub_d0_e0", 1);
+  setenv(ENV_STREAM, "1", 1);
+
+  // a deadlock fails the test, rather than hanging it
+  alarm(60);
+
+  test_overlap();
+  test_threads();
+
+  return 0;
+}
@@ -0,0 +1,202 @@
+//
+// Kernels launched through the hook by several threads, each in its
+// own region, which wait for each other after every launch. Run
+// once as is, and once more with ENV_ROTATE set, since the hook
+// reads it once per process.
+//
+// The rotated run's output goes to a file, whose |ROTATE| lines are
+// checked against the stub's counter values: each thread's region
+// covers every event on half of its launches.
+//
+
+#include "test_util.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern "C" {
+  void libnvcd_begin(const char* region_name);
+  void libnvcd_end();
+}
+
+static const int k_num_host_threads = 4;
+static const uint32_t k_launches = 50;
+
+// the events of domain 0 need two groups, which can't
+// be enabled together, so every launch takes two passes
+static const uint64_t k_num_passes = 2;
+
+static const uint32_t k_grid_size = 4;
+static const uint32_t k_block_size = 64;
+static const uint64_t k_kernel_nsec = 10000;
+
+static const char* const k_events[] = {
+  "stub_d0_e0", "stub_d0_e1", "stub_d0_e2", "stub_d0_e3", "stub_d0_e4", "stub_d1_e0"
+};
+
+static pthread_barrier_t g_barrier;
+
+static void* host_thread_main(void*) {
+  uint64_t kernel_nsec = k_kernel_nsec;
+  void* args[] = { &kernel_nsec };
+
+  libnvcd_begin("test_hook_threads");
+
+  for (uint32_t i = 0; i < k_launches; ++i) {
+    C_ASSERT(cudaLaunchKernel(reinterpret_cast<const void*>(test_kernel_sleep),
+                              dim3(k_grid_size),
+                              dim3(k_block_size),
+                              args,
+                              0,
+                              0) == cudaSuccess);
+
+    pthread_barrier_wait(&g_barrier);
+  }
+
+  libnvcd_end();
+
+  return nullptr;
+}
+
+static void run(bool rotate) {
+  C_ASSERT(pthread_barrier_init(&g_barrier, nullptr, k_num_host_threads) == 0);
+
+  pthread_t threads[k_num_host_threads];
+
+  for (int i = 0; i < k_num_host_threads; ++i) {
+    C_ASSERT(pthread_create(&threads[i], nullptr, host_thread_main, nullptr) == 0);
+  }
+
+  for (int i = 0; i < k_num_host_threads; ++i) {
+    C_ASSERT(pthread_join(threads[i], nullptr) == 0);
+  }
+
+  pthread_barrier_destroy(&g_barrier);
+
+  stub_counters_t c;
+  stub_counters_get(&c);
+
+  // every pass is replayed, unless they're rotated
+  uint64_t expected = k_num_host_threads * k_launches * (rotate ? 1 : k_num_passes);
+  ASSERT(c.launches == expected);
+}
+
+// the sum over instances of a launch's counter
+static uint64_t expected_per_call(const char* event_name) {
+  uint32_t domain = 0;
+  uint32_t index = 0;
+  C_ASSERT(sscanf(event_name, "stub_d%" SCNu32 "_e%" SCNu32, &domain, &index) == 2);
+
+  CUpti_EventID event = domain * 256 + index + 1;
+  uint32_t num_instances = domain == 0 ? 4 : 2;
+
+  uint64_t sum = 0;
+
+  for (uint32_t k = 0; k < num_instances; ++k) {
+    sum += stub_counter_value(event, k, k_grid_size * k_block_size);
+  }
+
+  return sum;
+}
+
+// checks the |ROTATE| lines in the output of the rotated run,
+// and passes the rest of it through
+static void check_rotate_output(FILE* f) {
+  uint32_t counts[ARRAY_LENGTH(k_events)] = {};
+  
+  char line[1024];
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    fputs(line, stdout);
+
+    const char* rotate = strstr(line, "|ROTATE|test_hook_threads:");
+
+    if (rotate == NULL) {
+      continue;
+    }
+
+    char event_name[64] = {};
+    double rate = 0.0;
+    double per_call = 0.0;
+    uint64_t covered = 0;
+    uint64_t calls = 0;
+
+    C_ASSERT(sscanf(rotate,
+                    "|ROTATE|test_hook_threads:%63[^:]: RATE: %lf/s PER_CALL: %lf COVERAGE: %" SCNu64 "/%" SCNu64,
+                    event_name,
+                    &rate,
+                    &per_call,
+                    &covered,
+                    &calls) == 5);
+
+    size_t i = 0;
+    while (i < ARRAY_LENGTH(k_events) && strcmp(k_events[i], event_name) != 0) {
+      i++;
+    }
+
+    ASSERT(i < ARRAY_LENGTH(k_events));
+    counts[i]++;
+    
+    // every launch of a thread is a call of its region's kernel,
+    // and each pass comes around every other call
+    ASSERT(calls == k_launches);
+    ASSERT(covered == k_launches / k_num_passes);
+    ASSERT(per_call == static_cast<double>(expected_per_call(event_name)));
+
+    // each covering call takes at least the kernel's time; other
+    // threads' kernels on the stream can only make it longer
+    double max_rate = per_call / (static_cast<double>(k_kernel_nsec) * 1e-9);
+    ASSERT(rate > 0.0 && rate <= max_rate * 1.001);
+  }
+
+  // a report for each thread's region
+  for (size_t i = 0; i < ARRAY_LENGTH(k_events); ++i) {
+    ASSERT(counts[i] == k_num_host_threads);
+  }
+}
+
+int main(int argc, char** argv) {
+  setenv(ENV_EVENTS, "stub_d0_e0,stub_d0_e1,stub_d0_e2,stub_d0_e3,stub_d0_e4,stub_d1_e0", 1);
+  setenv(ENV_STATS, "1", 1);
+
+  // a deadlock fails the test, rather than hanging it
+  alarm(60);
+
+  bool rotate = getenv(ENV_ROTATE) != NULL;
+
+  run(rotate);
+
+  if (!rotate) {
+    printf("|TEST|hook launches from %d threads with a barrier between them\n", k_num_host_threads);
+    fflush(stdout);
+
+    FILE* output = tmpfile();
+    C_ASSERT(output != NULL);
+
+    pid_t pid = fork();
+    C_ASSERT(pid >= 0);
+
+    if (pid == 0) {
+      C_ASSERT(dup2(fileno(output), STDOUT_FILENO) == STDOUT_FILENO);
+      setenv(ENV_ROTATE, "1", 1);
+      execv(argv[0], argv);
+      _exit(1);
+    }
+
+    int status = 0;
+    C_ASSERT(waitpid(pid, &status, 0) == pid);
+    C_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    rewind(output);
+    check_rotate_output(output);
+    fclose(output);
+
+    printf("|TEST|rotated RATE, PER_CALL and COVERAGE match the stub's counters\n");
+  } else {
+    printf("|TEST|hook launches from %d threads with a barrier between them, rotated\n", k_num_host_threads);
+  }
+
+  return 0;
+}
@@ -0,0 +1,314 @@
+//
+// The libnvcd_time() timer, with every combination of flags, over
+// outermost regions that each launch a few kernels, some of them
+// from a nested region. libnvcd_time_report() prints each entry as a
+// tree of spans, whose levels follow the flags, and in which each
+// outer span is the sum of the spans it contains. The stats that
+// follow count a span of each kind for every region, launch and pass.
+//
+// Then two threads time their own regions, whose records are merged
+// into the same report.
+//
+
+#include "test_util.h"
+
+#include <nvcd/writer.h>
+
+#include <libnvcd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+static const uint32_t k_num_regions = 3;
+static const uint32_t k_launches = 4; // per region, one of them nested
+
+// the events of domain 0 need two groups, which can't
+// be enabled together, so every launch takes two passes
+static const uint32_t k_num_passes = 2;
+
+static const uint32_t k_block_size = 64;
+static const uint64_t k_kernel_nsec = 20000;
+
+static const int k_num_host_threads = 2;
+
+static const char* const k_kinds[] = { "region", "kernel", "run" };
+
+static const uint32_t k_flags[] = {
+  NVCD_TIMESPEC_00R,
+  NVCD_TIMESPEC_0K0,
+  NVCD_TIMESPEC_0KR,
+  NVCD_TIMESPEC_R00,
+  NVCD_TIMESPEC_R0R,
+  NVCD_TIMESPEC_RK0,
+  NVCD_TIMESPEC_RKR
+};
+
+struct span_line {
+  uint32_t level;
+  std::string kind;
+  std::string region; // region spans only
+  double seconds;
+};
+
+struct time_report {
+  std::vector<span_line> spans;
+  std::map<std::string, uint64_t> counts; // by "region kind", over its records
+};
+
+static void launch() {
+  uint64_t kernel_nsec = k_kernel_nsec;
+  void* args[] = { &kernel_nsec };
+
+  C_ASSERT(cudaLaunchKernel(reinterpret_cast<const void*>(test_kernel_sleep),
+                            dim3(1),
+                            dim3(k_block_size),
+                            args,
+                            0,
+                            0) == cudaSuccess);
+}
+
+static void run_regions(const char* name) {
+  for (uint32_t r = 0; r < k_num_regions; ++r) {
+    libnvcd_begin(name);
+
+    for (uint32_t i = 0; i + 1 < k_launches; ++i) {
+      launch();
+    }
+
+    libnvcd_begin("nested");
+    launch();
+    libnvcd_end();
+
+    libnvcd_end();
+  }
+}
+
+// reports the merged records, and parses their lines
+static time_report report() {
+  FILE* output = tmpfile();
+  C_ASSERT(output != NULL);
+
+  nvcd_writer_flush();
+  fflush(stdout);
+
+  int saved_stdout = dup(STDOUT_FILENO);
+  C_ASSERT(saved_stdout >= 0);
+  C_ASSERT(dup2(fileno(output), STDOUT_FILENO) == STDOUT_FILENO);
+
+  libnvcd_time_report();
+
+  nvcd_writer_flush();
+  fflush(stdout);
+
+  C_ASSERT(dup2(saved_stdout, STDOUT_FILENO) == STDOUT_FILENO);
+  close(saved_stdout);
+
+  rewind(output);
+
+  time_report result;
+  char line[1024];
+
+  while (fgets(line, sizeof(line), output) != NULL) {
+    fputs(line, stdout);
+
+    const char* p = line;
+    uint32_t level = 0;
+
+    while (*p == '\t') {
+      level++;
+      p++;
+    }
+
+    char name[256] = {};
+    char kind[64] = {};
+    uint64_t count = 0;
+    double seconds = 0.0;
+
+    if (sscanf(p, "[HOOK TIME STATS region %255[^]]] %63s count: %" SCNu64, name, kind, &count) == 3) {
+      // one line of each kind per record, which is one per outermost entry
+      result.counts[std::string(name) + " " + kind] += count;
+    } else if (sscanf(p, "[HOOK TIME region %255[^]]] %lf seconds", name, &seconds) == 2) {
+      result.spans.push_back(span_line{level, "region", name, seconds});
+    } else if (sscanf(p, "[HOOK TIME %63[^]]] %lf seconds", kind, &seconds) == 2) {
+      result.spans.push_back(span_line{level, kind, "", seconds});
+    }
+  }
+
+  fclose(output);
+
+  return result;
+}
+
+static std::vector<std::string> selected_kinds(uint32_t flags) {
+  std::vector<std::string> kinds;
+
+  if (flags & NVCD_TIMEFLAGS_REGION) kinds.push_back("region");
+  if (flags & NVCD_TIMEFLAGS_KERNEL) kinds.push_back("kernel");
+  if (flags & NVCD_TIMEFLAGS_RUN) kinds.push_back("run");
+
+  return kinds;
+}
+
+// the times are printed to 6 significant digits
+static bool close_enough(double a, double b) {
+  return std::fabs(a - b) <= 2e-5 * std::max(a, b);
+}
+
+// each span is the sum of the spans one level below it that follow
+// it, up to the next one of its level or above
+static void check_sums(const std::vector<span_line>& spans, uint32_t num_levels) {
+  for (size_t i = 0; i < spans.size(); ++i) {
+    if (spans[i].level + 1 == num_levels) {
+      continue;
+    }
+
+    double sum = 0.0;
+
+    for (size_t k = i + 1; k < spans.size() && spans[k].level > spans[i].level; ++k) {
+      if (spans[k].level == spans[i].level + 1) {
+        sum += spans[k].seconds;
+      }
+    }
+
+    ASSERT(close_enough(spans[i].seconds, sum));
+  }
+}
+
+static void check_flags(uint32_t flags) {
+  std::vector<std::string> kinds = selected_kinds(flags);
+  uint32_t num_levels = static_cast<uint32_t>(kinds.size());
+
+  libnvcd_time(flags);
+
+  stub_counters_t before;
+  stub_counters_get(&before);
+
+  run_regions("timed");
+
+  stub_counters_t after;
+  stub_counters_get(&after);
+
+  libnvcd_time(NVCD_TIMEFLAGS_NONE);
+
+  time_report r = report();
+
+  uint64_t expected[] = {
+    k_num_regions,
+    k_num_regions * k_launches,
+    k_num_regions * k_launches * k_num_passes
+  };
+
+  // every pass is its own launch of the stub
+  ASSERT(after.launches - before.launches == expected[2]);
+
+  std::map<std::string, uint64_t> counts;
+
+  for (const span_line& span: r.spans) {
+    ASSERT(span.level < num_levels);
+    ASSERT(span.kind == kinds[span.level]);
+    ASSERT(span.kind != "region" || span.region == "timed");
+
+    // every span covers at least one kernel
+    ASSERT(span.seconds >= static_cast<double>(k_kernel_nsec) * 1e-9);
+
+    counts[span.kind]++;
+  }
+
+  // the first span of each entry is of the outermost level
+  ASSERT(!r.spans.empty() && r.spans[0].level == 0);
+
+  check_sums(r.spans, num_levels);
+
+  for (uint32_t kind = 0; kind < 3; ++kind) {
+    bool selected = std::find(kinds.begin(), kinds.end(), k_kinds[kind]) != kinds.end();
+    uint64_t n = selected ? expected[kind] : 0;
+
+    ASSERT(counts[k_kinds[kind]] == n);
+
+    auto it = r.counts.find(std::string("timed ") + k_kinds[kind]);
+    ASSERT(selected ? (it != r.counts.end() && it->second == n) : it == r.counts.end());
+  }
+
+  // the report consumes the records
+  ASSERT(report().spans.empty());
+}
+
+static pthread_barrier_t g_barrier;
+
+static void* host_thread_main(void* arg) {
+  int index = *static_cast<int*>(arg);
+  std::string name = "thread_" + std::to_string(index);
+
+  // the timer is per thread
+  libnvcd_time(NVCD_TIMESPEC_RK0);
+
+  pthread_barrier_wait(&g_barrier);
+
+  run_regions(name.c_str());
+
+  libnvcd_time(NVCD_TIMEFLAGS_NONE);
+
+  return nullptr;
+}
+
+static void check_threads() {
+  C_ASSERT(pthread_barrier_init(&g_barrier, nullptr, k_num_host_threads) == 0);
+
+  pthread_t threads[k_num_host_threads];
+  int indices[k_num_host_threads];
+
+  for (int i = 0; i < k_num_host_threads; ++i) {
+    indices[i] = i;
+    C_ASSERT(pthread_create(&threads[i], nullptr, host_thread_main, &indices[i]) == 0);
+  }
+
+  for (int i = 0; i < k_num_host_threads; ++i) {
+    C_ASSERT(pthread_join(threads[i], nullptr) == 0);
+  }
+
+  pthread_barrier_destroy(&g_barrier);
+
+  time_report r = report();
+
+  for (int i = 0; i < k_num_host_threads; ++i) {
+    std::string name = "thread_" + std::to_string(i);
+    uint64_t regions = 0;
+
+    for (const span_line& span: r.spans) {
+      regions += span.region == name;
+    }
+
+    ASSERT(regions == k_num_regions);
+    ASSERT(r.counts.at(name + " region") == k_num_regions);
+    ASSERT(r.counts.at(name + " kernel") == k_num_regions * k_launches);
+  }
+
+  check_sums(r.spans, 2);
+}
+
+int main() {
+  setenv(ENV_EVENTS, "stub_d0_e0,stub_d0_e1,stub_d0_e2,stub_d0_e3,stub_d0_e4,stub_d1_e0", 1);
+
+  alarm(60);
+
+  libnvcd_load();
+
+  for (uint32_t flags: k_flags) {
+    check_flags(flags);
+  }
+
+  printf("|TEST|hook timer spans nest and sum for every combination of flags\n");
+
+  check_threads();
+
+  printf("|TEST|hook timer spans of %d threads are merged into one report\n", k_num_host_threads);
+
+  return 0;
+}
@@ -0,0 +1,143 @@
+//
+// nvcd_imbalance_analyze() on synthetic arrays, where the busy time of
+// every SM is known, and then on a launch whose kernel only records
+// some of its threads. Threads that aren't recorded have no SM, rather
+// than being counted on SM 0.
+//
+
+#include "test_nvcd.h"
+
+static const uint32_t k_none = NVCD_IMBALANCE_SMID_NONE;
+
+static const nvcd_imbalance_sm_t* find_sm(const nvcd_imbalance_t& imbalance, uint32_t smid) {
+  for (uint32_t i = 0; i < imbalance.num_sms; ++i) {
+    if (imbalance.sms[i].smid == smid) {
+      return &imbalance.sms[i];
+    }
+  }
+
+  return nullptr;
+}
+
+// four blocks of four threads, on SMs 0, 2, 5 and 2
+static void check_synthetic() {
+  const clock64_t times[] = {
+    10, 20, 30, 40,
+    0,  5,  -7, 5,
+    100, 200, 300, 400,
+    1,  1,  1,  1
+  };
+
+  const uint32_t smids[] = {
+    0, 0, 0, 0,
+    k_none, 2, 2, 2,
+    5, 5, 5, 5,
+    2, 2, k_none, 2
+  };
+
+  nvcd_imbalance_t imbalance = NVCD_IMBALANCE_INIT;
+
+  nvcd_imbalance_analyze(&imbalance, times, smids, ARRAY_LENGTH(times), 4);
+
+  ASSERT(imbalance.num_sms == 3);
+
+  const nvcd_imbalance_sm_t* sm0 = find_sm(imbalance, 0);
+  const nvcd_imbalance_sm_t* sm2 = find_sm(imbalance, 2);
+  const nvcd_imbalance_sm_t* sm5 = find_sm(imbalance, 5);
+
+  ASSERT(sm0 != nullptr && sm2 != nullptr && sm5 != nullptr);
+
+  // the unrecorded threads aren't on SM 0, or anywhere else,
+  // and the negative time counts as none
+  ASSERT(sm0->num_threads == 4 && sm0->busy == 100 && sm0->max_time == 40 && sm0->num_blocks == 1);
+  ASSERT(sm2->num_threads == 6 && sm2->busy == 13 && sm2->max_time == 5 && sm2->num_blocks == 2);
+  ASSERT(sm5->num_threads == 4 && sm5->busy == 1000 && sm5->max_time == 400 && sm5->num_blocks == 1);
+
+  ASSERT(imbalance.sms[imbalance.critical_sm].smid == 5);
+  ASSERT(imbalance.min_busy == 13);
+  ASSERT(imbalance.median_busy == 100);
+  ASSERT(imbalance.max_busy == 1000);
+  ASSERT(imbalance.mean_busy == 1113.0 / 3.0);
+  ASSERT(imbalance.tail_ratio == 10.0);
+  ASSERT(imbalance.speedup_if_balanced == 1000.0 / (1113.0 / 3.0));
+
+  // 100 is in the first tenth of [13, 1000]
+  ASSERT(imbalance.histogram[0] == 2);
+  ASSERT(imbalance.histogram[NVCD_IMBALANCE_NUM_BINS - 1] == 1);
+
+  // nothing recorded
+  const uint32_t none[] = { k_none, k_none, k_none, k_none };
+
+  nvcd_imbalance_analyze(&imbalance, times, none, ARRAY_LENGTH(none), 2);
+
+  ASSERT(imbalance.num_sms == 0);
+  ASSERT(imbalance.speedup_if_balanced == 1.0);
+
+  nvcd_imbalance_free(&imbalance);
+}
+
+// records the even threads only, on SMs 1 to STUB_NUM_SMS - 1, which
+// are stored as smid + 1. The odd threads are given a time, as an
+// earlier launch would have left, but no smid.
+static uint64_t kernel_record_even(const stub_launch_t* launch) {
+  uint32_t num_threads = launch->grid.x * launch->block.x;
+
+  for (uint32_t i = 0; i < num_threads; ++i) {
+    detail::dev_ttime[i] = 1000 + i;
+
+    if (i % 2 == 0) {
+      detail::dev_smids[i] = 2 + i % (STUB_NUM_SMS - 1);
+    }
+  }
+
+  return 1000;
+}
+
+static void check_launch() {
+  const int num_blocks = 8;
+  const int block_size = 64;
+
+  test_launch("test_imbalance",
+              kernel_record_even,
+              dim3(num_blocks),
+              dim3(block_size));
+
+  const nvcd_imbalance_t& imbalance = g_run_info->imbalance;
+
+  ASSERT(find_sm(imbalance, 0) == nullptr);
+
+  uint32_t num_threads = 0;
+
+  for (uint32_t i = 0; i < imbalance.num_sms; ++i) {
+    num_threads += imbalance.sms[i].num_threads;
+  }
+
+  ASSERT(num_threads == num_blocks * block_size / 2);
+
+  const kernel_invoke_data& d = g_run_info->kernel_stats.back();
+
+  for (size_t i = 0; i < d.num_threads; ++i) {
+    if (i % 2 == 0) {
+      ASSERT(d.smids[i] == 1 + i % (STUB_NUM_SMS - 1));
+      ASSERT(d.times[i] == static_cast<clock64_t>(1000 + i));
+    } else {
+      ASSERT(d.smids[i] == NVCD_IMBALANCE_SMID_NONE);
+      ASSERT(d.times[i] == 0);
+    }
+  }
+}
+
+int main() {
+  check_synthetic();
+
+  printf("|TEST|imbalance of synthetic thread times\n");
+
+  setenv(ENV_EVENTS, "stub_d0_e0", 1);
+  setenv(ENV_IMBALANCE, "1", 1);
+
+  check_launch();
+
+  printf("|TEST|imbalance of a launch that only records some threads\n");
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+//
+// Messages longer than the MSG_BUFFER_MIN_SIZE bytes msg_impl() starts
+// with are written whole, prefix and all, after its buffer grows. Each
+// thread's buffer is freed when the thread exits, so threads that come
+// and go, each writing a long message, don't add to what's in use.
+//
+
+#include "test_util.h"
+
+#include <nvcd/writer.h>
+
+#include <string>
+
+#include <malloc.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+static const size_t k_lengths[] = { 1, 4090, 4095, 4096, 4097, 9000, 100000 };
+
+static const uint32_t k_num_threads = 64;
+static const size_t k_thread_length = 32768;
+
+static std::string message_text(size_t length, char c) {
+  return std::string(length, c);
+}
+
+// writes each message, and returns what reached stdout
+static std::string capture(void (*write_messages)()) {
+  FILE* output = tmpfile();
+  C_ASSERT(output != NULL);
+
+  nvcd_writer_flush();
+  fflush(stdout);
+
+  int saved_stdout = dup(STDOUT_FILENO);
+  C_ASSERT(saved_stdout >= 0);
+  C_ASSERT(dup2(fileno(output), STDOUT_FILENO) == STDOUT_FILENO);
+
+  write_messages();
+
+  nvcd_writer_flush();
+  fflush(stdout);
+
+  C_ASSERT(dup2(saved_stdout, STDOUT_FILENO) == STDOUT_FILENO);
+  close(saved_stdout);
+
+  std::string text;
+  char buffer[4096];
+  size_t n = 0;
+
+  rewind(output);
+
+  while ((n = fread(buffer, 1, sizeof(buffer), output)) > 0) {
+    text.append(buffer, n);
+  }
+
+  fclose(output);
+
+  return text;
+}
+
+static void write_long_messages() {
+  char c = 'a';
+
+  for (size_t length: k_lengths) {
+    std::string text = message_text(length, c++);
+
+    msg_impl(MSG_LEVEL_USER, __LINE__, __FILE__, __FUNC__, "%s\n", text.c_str());
+    msg_impl(MSG_LEVEL_WARNING, __LINE__, __FILE__, __FUNC__, "%s\n", text.c_str());
+  }
+}
+
+static void* thread_main(void*) {
+  std::string text = message_text(k_thread_length, 'x');
+
+  msg_impl(MSG_LEVEL_USER, __LINE__, __FILE__, __FUNC__, "%s\n", text.c_str());
+
+  return nullptr;
+}
+
+// one at a time, so that each thread's buffer
+// is either freed or left behind before the next
+static void write_thread_messages() {
+  for (uint32_t i = 0; i < k_num_threads; ++i) {
+    pthread_t thread;
+
+    C_ASSERT(pthread_create(&thread, nullptr, thread_main, nullptr) == 0);
+    C_ASSERT(pthread_join(thread, nullptr) == 0);
+  }
+}
+
+int main() {
+  std::string output = capture(write_long_messages);
+  std::string expected;
+  char c = 'a';
+
+  for (size_t length: k_lengths) {
+    std::string text = message_text(length, c++);
+
+    expected += text + "\n";
+    expected += "[WARNING]:" + text + "\n";
+  }
+
+  ASSERT(output == expected);
+
+  printf("|TEST|msg_impl writes messages longer than its initial buffer whole\n");
+
+  // the threads' arenas, and the writer's allocations, are
+  // in use from the first run on; what's captured is freed
+  // by the end of each ASSERT, before it's measured
+  size_t output_size = k_num_threads * (k_thread_length + 1);
+
+  ASSERT(capture(write_thread_messages).size() == output_size);
+
+  size_t in_use = mallinfo2().uordblks;
+
+  ASSERT(capture(write_thread_messages).size() == output_size);
+
+  // each buffer that was left behind would be twice k_thread_length
+  ASSERT(mallinfo2().uordblks < in_use + k_num_threads * k_thread_length);
+
+  printf("|TEST|msg_impl frees each thread's buffer when the thread exits\n");
+
+  return 0;
+}
@@ -0,0 +1,155 @@
+//
+// Launches on several devices are each profiled on their own device,
+// in its context, with the event data and buffers of that device.
+// The stub only counts a kernel in groups of the device it ran on, so
+// a launch that's attributed to another device reads zeros.
+//
+// First, one thread switches devices between launches; then, one
+// thread per device profiles the whole node at once.
+//
+
+#include "test_nvcd.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+static const int k_num_devices = 4;
+static const uint32_t k_rounds = 3;
+static const uint32_t k_thread_launches = 50;
+static const int k_block_size = 128;
+
+static void check_counters(int num_threads) {
+  const cupti_counter_matrix_t& m = g_run_info->counters;
+
+  ASSERT(m.num_rows > 0);
+
+  for (uint32_t row = 0; row < m.num_rows; ++row) {
+    uint32_t num_instances = 0;
+    const uint64_t* values = cupti_counter_matrix_row(&m, row, &num_instances);
+
+    for (uint32_t k = 0; k < num_instances; ++k) {
+      ASSERT(values[k] == stub_counter_value(m.event_ids[row], k, num_threads));
+    }
+  }
+}
+
+static void launch_on(int device) {
+  // a different size on each device, so counters
+  // read from another device's launch don't match
+  int num_threads = (device + 1) * k_block_size;
+
+  C_ASSERT(cudaSetDevice(device) == cudaSuccess);
+
+  test_launch("test_multi_device",
+              test_kernel_sleep,
+              dim3(device + 1),
+              dim3(k_block_size));
+
+  ASSERT(g_run_info->device_index == device);
+  check_counters(num_threads);
+
+  C_ASSERT(nvcd_lock_events());
+  ASSERT(nvcd_get_events()->cuda_device == g_nvcd.devices[device]);
+  ASSERT(nvcd_get_events()->cuda_context == g_nvcd.contexts[device]);
+  nvcd_release_events();
+}
+
+static void test_switch_devices() {
+  nvcd_host_session_begin();
+
+  ASSERT(g_nvcd.num_devices == k_num_devices);
+
+  stub_counters_t first_round;
+
+  for (uint32_t round = 0; round < k_rounds; ++round) {
+    for (int device = 0; device < k_num_devices; ++device) {
+      launch_on(device);
+    }
+
+    if (round == 0) {
+      stub_counters_get(&first_round);
+    }
+  }
+
+  stub_counters_t after;
+  stub_counters_get(&after);
+
+  // each device's event data was built once, and kept
+  ASSERT(after.group_creates == first_round.group_creates);
+
+  // each device has its own buffers, which its symbols point to
+  void* buffers[k_num_devices] = {};
+
+  for (int device = 0; device < k_num_devices; ++device) {
+    C_ASSERT(stub_symbol_value(&detail::dev_ttime, device, &buffers[device], sizeof(buffers[device])));
+    ASSERT(buffers[device] != nullptr);
+
+    for (int other = 0; other < device; ++other) {
+      ASSERT(buffers[device] != buffers[other]);
+    }
+  }
+
+  nvcd_host_session_end();
+
+  printf("|TEST|one thread switching between %d devices\n", k_num_devices);
+}
+
+static void* device_thread_main(void* arg) {
+  int device = *static_cast<int*>(arg);
+
+  nvcd_host_session_begin();
+
+  for (uint32_t i = 0; i < k_thread_launches; ++i) {
+    launch_on(device);
+  }
+
+  nvcd_host_session_end();
+
+  return nullptr;
+}
+
+static void test_whole_node() {
+  pthread_t threads[k_num_devices];
+  int devices[k_num_devices];
+
+  for (int i = 0; i < k_num_devices; ++i) {
+    devices[i] = i;
+    C_ASSERT(pthread_create(&threads[i], nullptr, device_thread_main, &devices[i]) == 0);
+  }
+
+  for (int i = 0; i < k_num_devices; ++i) {
+    C_ASSERT(pthread_join(threads[i], nullptr) == 0);
+  }
+
+  printf("|TEST|one thread per device, %d devices at once\n", k_num_devices);
+}
+
+int main() {
+  stub_set_num_devices(k_num_devices);
+
+  setenv(ENV_EVENTS, "stub_d0_e0,stub_d0_e1,stub_d0_e2,stub_d0_e3,stub_d0_e4,stub_d1_e0", 1);
+
+  alarm(60);
+
+  test_switch_devices();
+  test_whole_node();
+
+  // reports can tell the devices apart
+  nvcd_init();
+
+  char uuids[k_num_devices][NVCD_UUID_STR_LENGTH];
+
+  for (int device = 0; device < k_num_devices; ++device) {
+    nvcd_device_uuid_str(device, uuids[device], sizeof(uuids[device]));
+
+    for (int other = 0; other < device; ++other) {
+      ASSERT(strcmp(uuids[device], uuids[other]) != 0);
+    }
+  }
+
+  nvcd_terminate();
+
+  printf("|TEST|each device has its own UUID\n");
+
+  return 0;
+}
@@ -0,0 +1,118 @@
+//
+// A name table is built from unsorted IDs with duplicates, whose names
+// are long enough that its string buffer has to grow several times.
+// Each ID maps to its name and back, each name is queried once, and
+// IDs and names that weren't added aren't found.
+//
+
+#include "test_util.h"
+
+#include <nvcd/name_table.h>
+
+#include <algorithm>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <string.h>
+
+static const uint32_t k_num_ids = 500;
+
+static uint32_t g_num_queries = 0;
+
+// some names are far longer than the 32 characters per name the
+// buffer starts with, and some longer than any CUPTI name
+static std::string expected_name(uint32_t id) {
+  std::string name = "name_" + std::to_string(id);
+
+  if (id % 5 == 0) {
+    name += std::string(100 + id % 60, 'a' + id % 26);
+  }
+
+  if (id % 97 == 0) {
+    name += std::string(400, 'z');
+  }
+
+  return name.substr(0, 255);
+}
+
+static void query(uint32_t id, char* name, size_t length) {
+  g_num_queries++;
+  snprintf(name, length, "%s", expected_name(id).c_str());
+}
+
+int main() {
+  nvcd_name_table_t empty = NVCD_NAME_TABLE_INIT;
+  uint32_t id = 0;
+
+  nvcd_name_table_build(&empty, NULL, 0, query);
+
+  ASSERT(nvcd_name_table_name(&empty, 1) == NULL);
+  ASSERT(!nvcd_name_table_find(&empty, "name_1", &id));
+
+  nvcd_name_table_free(&empty);
+
+  std::mt19937 rng(18);
+  std::vector<uint32_t> ids;
+
+  // every ID is odd, so the even ones are missing
+  for (uint32_t i = 0; i < k_num_ids; ++i) {
+    ids.push_back(2 * (i * 7919 % k_num_ids) + 1);
+  }
+
+  // duplicates
+  for (uint32_t i = 0; i < k_num_ids / 4; ++i) {
+    ids.push_back(ids[rng() % ids.size()]);
+  }
+
+  std::shuffle(ids.begin(), ids.end(), rng);
+
+  nvcd_name_table_t table = NVCD_NAME_TABLE_INIT;
+  nvcd_name_table_build(&table, ids.data(), static_cast<uint32_t>(ids.size()), query);
+
+  std::set<uint32_t> unique(ids.begin(), ids.end());
+
+  ASSERT(table.count == unique.size());
+  ASSERT(g_num_queries == unique.size());
+
+  for (uint32_t i: unique) {
+    std::string name = expected_name(i);
+    const char* found = nvcd_name_table_name(&table, i);
+
+    ASSERT(found != NULL && name == found);
+
+    ASSERT(nvcd_name_table_find(&table, name.c_str(), &id));
+    ASSERT(id == i);
+
+    // the same lookups don't query again
+    ASSERT(nvcd_name_table_name(&table, i) == found);
+  }
+
+  ASSERT(g_num_queries == unique.size());
+
+  printf("|TEST|name table maps every ID to its name and back, with names that grow its buffer\n");
+
+  uint32_t max_id = *unique.rbegin();
+
+  for (uint32_t i = 0; i <= max_id + 2; i += 2) {
+    ASSERT(nvcd_name_table_name(&table, i) == NULL);
+    ASSERT(!nvcd_name_table_find(&table, expected_name(i).c_str(), &id));
+  }
+
+  // names on either side of, and inside, stored ones
+  ASSERT(!nvcd_name_table_find(&table, "", &id));
+  ASSERT(!nvcd_name_table_find(&table, "name_", &id));
+  ASSERT(!nvcd_name_table_find(&table, "name_1x", &id));
+  ASSERT(!nvcd_name_table_find(&table, "A", &id));
+  ASSERT(!nvcd_name_table_find(&table, "zzz", &id));
+  ASSERT(!nvcd_name_table_find(&table, expected_name(5).substr(0, 20).c_str(), &id));
+
+  printf("|TEST|name table misses IDs and names that weren't added\n");
+
+  nvcd_name_table_free(&table);
+
+  ASSERT(table.count == 0 && table.ids == NULL && table.strings == NULL);
+
+  return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef __TEST_NVCD_H__
+#define __TEST_NVCD_H__
+
+//
+// For programs that call libnvcd directly, rather than through the
+// hook. Kernels are launched with cudaLaunchKernel(), since there's
+// no <<<>>> syntax without nvcc.
+//
+
+#define NVCD_HEADER_IMPL
+#include <nvcd/nvcd.cuh>
+#undef NVCD_HEADER_IMPL
+
+#include "test_util.h"
+
+// Replays the kernel until every pass has been collected,
+// as nvcd_run() does.
+static inline void test_run(stub_kernel_fn_t kernel,
+                            dim3 grid,
+                            dim3 block,
+                            void** args,
+                            cudaStream_t stream) {
+  cupti_event_data_begin(nvcd_get_events());
+
+  while (!nvcd_host_finished()) {
+    CUDA_RUNTIME_FN(cudaLaunchKernel(reinterpret_cast<const void*>(kernel),
+                                     grid,
+                                     block,
+                                     args,
+                                     0,
+                                     stream));
+    nvcd_host_sync();
+    g_run_info->run_kernel_count_inc();
+  }
+
+  cupti_event_data_end(nvcd_get_events());
+}
+
+// one profiled launch, from nvcd_host_begin() to nvcd_host_end()
+static inline void test_launch(const char* region_name,
+                               stub_kernel_fn_t kernel,
+                               dim3 grid,
+                               dim3 block,
+                               void** args = nullptr,
+                               cudaStream_t stream = 0) {
+  int block_size = static_cast<int>(block.x * block.y * block.z);
+  int num_threads = static_cast<int>(grid.x * grid.y * grid.z) * block_size;
+
+  nvcd_host_begin(region_name,
+                  num_threads,
+                  stream,
+                  reinterpret_cast<const void*>(kernel),
+                  block_size);
+  test_run(kernel, grid, block, args, stream);
+  nvcd_host_end();
+}
+
+#endif // __TEST_NVCD_H__
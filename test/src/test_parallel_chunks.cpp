@@ -0,0 +1,154 @@
+//
+// parallel_chunks() covers every element once, whatever the number of
+// chunks, and runs on the same workers from one call to the next,
+// including calls from several threads at once.
+//
+// The pool is started with more workers than this machine may have
+// hardware threads, so that chunks are handed off either way.
+//
+
+#include "test_nvcd.h"
+
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const size_t k_num_workers = 4;
+static const int k_num_host_threads = 4;
+static const uint32_t k_thread_calls = 500;
+
+// the Threads: line of /proc/self/status
+static int num_process_threads() {
+  FILE* f = fopen("/proc/self/status", "r");
+  C_ASSERT(f != NULL);
+
+  char line[256];
+  int n = -1;
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "Threads: %d", &n) == 1) {
+      break;
+    }
+  }
+
+  fclose(f);
+
+  return n;
+}
+
+// each element is counted by the chunk that covers it
+static void check_cover(size_t n, size_t num_chunks) {
+  std::vector<std::atomic<uint32_t>> counts(n);
+  std::vector<std::atomic<uint32_t>> chunk_calls(num_chunks);
+
+  for (auto& c: counts) {
+    c = 0;
+  }
+
+  for (auto& c: chunk_calls) {
+    c = 0;
+  }
+
+  parallel_chunks(n,
+                  num_chunks,
+                  [&](size_t begin, size_t end, size_t chunk) -> void {
+                    ASSERT(begin <= end && end <= n);
+                    ASSERT(chunk < num_chunks);
+
+                    chunk_calls[chunk]++;
+
+                    for (size_t i = begin; i < end; ++i) {
+                      counts[i]++;
+                    }
+                  });
+
+  for (size_t i = 0; i < n; ++i) {
+    ASSERT(counts[i] == 1);
+  }
+
+  for (size_t c = 0; c < num_chunks; ++c) {
+    ASSERT(chunk_calls[c] == 1);
+  }
+}
+
+static void* host_thread_main(void* arg) {
+  size_t index = *static_cast<size_t*>(arg);
+
+  for (uint32_t i = 0; i < k_thread_calls; ++i) {
+    check_cover(1000 + index * 7 + i, 1 + (index + i) % 8);
+  }
+
+  return nullptr;
+}
+
+int main() {
+  alarm(60);
+
+  g_chunk_pool.start(k_num_workers);
+
+  int num_threads = num_process_threads();
+
+  ASSERT(num_threads == static_cast<int>(k_num_workers));
+
+  for (size_t n = 0; n < 40; ++n) {
+    for (size_t num_chunks = 1; num_chunks <= 9; ++num_chunks) {
+      check_cover(n, num_chunks);
+    }
+  }
+
+  check_cover(1 << 20, k_num_workers * 3);
+
+  // no thread is started for a call, even while it runs
+  std::atomic<int> max_threads(0);
+  
+  parallel_chunks(k_num_workers * 3,
+                  k_num_workers * 3,
+                  [&](size_t, size_t, size_t) -> void {
+                    int n = num_process_threads();
+                    int max = max_threads;
+
+                    while (n > max && !max_threads.compare_exchange_weak(max, n)) {
+                    }
+                  });
+
+  ASSERT(max_threads == num_threads);
+  ASSERT(num_process_threads() == num_threads);
+
+  printf("|TEST|parallel chunks cover every element once, on %" PRIu64 " threads\n",
+         static_cast<uint64_t>(k_num_workers));
+
+  pthread_t threads[k_num_host_threads];
+  size_t indices[k_num_host_threads];
+
+  for (int i = 0; i < k_num_host_threads; ++i) {
+    indices[i] = static_cast<size_t>(i);
+    C_ASSERT(pthread_create(&threads[i], nullptr, host_thread_main, &indices[i]) == 0);
+  }
+
+  for (int i = 0; i < k_num_host_threads; ++i) {
+    C_ASSERT(pthread_join(threads[i], nullptr) == 0);
+  }
+
+  ASSERT(num_process_threads() == num_threads);
+
+  printf("|TEST|parallel chunks from %d threads at once\n", k_num_host_threads);
+
+  // a forked child doesn't have the workers, so it runs every chunk itself
+  fflush(stdout);
+
+  pid_t pid = fork();
+  C_ASSERT(pid >= 0);
+
+  if (pid == 0) {
+    check_cover(1000, k_num_workers);
+    _exit(num_process_threads() == 1 ? 0 : 1);
+  }
+
+  int status = 0;
+  C_ASSERT(waitpid(pid, &status, 0) == pid);
+  C_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  printf("|TEST|parallel chunks in a forked child\n");
+
+  return 0;
+}
@@ -0,0 +1,221 @@
+//
+// Passes are planned by coloring the conflict graph of the event groups
+// with DSatur. Before, a launch enabled every unread group in order and
+// put off the ones CUPTI rejected, which is a greedy coloring in group
+// order. The planner keeps that coloring when DSatur does worse, so it
+// never needs more passes, and it needs far fewer on a crown graph in
+// the order that greedy does worst on.
+//
+// Then, the plan for an event set of the stub takes as many passes as
+// its largest domain needs groups.
+//
+
+#include "test_nvcd.h"
+
+#include <vector>
+
+struct conflict_graph {
+  uint32_t n;
+  std::vector<uint8_t> usable;
+  std::vector<uint8_t> conflicts;
+
+  explicit conflict_graph(uint32_t n_)
+    : n(n_),
+      usable(n_, 1),
+      conflicts(n_ * n_, 0)
+  {}
+
+  void add(uint32_t i, uint32_t j) {
+    conflicts[i * n + j] = conflicts[j * n + i] = 1;
+  }
+};
+
+// the colors the old launch loop ended up with: each pass
+// takes every remaining group that fits, in group order
+static uint32_t greedy_colors(const conflict_graph& g) {
+  std::vector<uint32_t> colors(g.n, UINT32_MAX);
+  uint32_t num_colors = 0;
+
+  for (uint32_t i = 0; i < g.n; ++i) {
+    if (!g.usable[i]) {
+      continue;
+    }
+
+    std::vector<uint8_t> seen(g.n + 1, 0);
+
+    for (uint32_t j = 0; j < i; ++j) {
+      if (g.conflicts[i * g.n + j] && colors[j] != UINT32_MAX) {
+        seen[colors[j]] = 1;
+      }
+    }
+
+    uint32_t c = 0;
+
+    while (seen[c]) {
+      c++;
+    }
+
+    colors[i] = c;
+    num_colors = c + 1 > num_colors ? c + 1 : num_colors;
+  }
+
+  return num_colors;
+}
+
+static uint32_t dsatur_colors(const conflict_graph& g) {
+  nvcd_arena_t arena = NVCD_ARENA_INIT;
+  std::vector<uint32_t> colors(g.n);
+
+  uint32_t num_colors = cupti_color_conflict_graph(&arena,
+                                                   g.n,
+                                                   g.usable.data(),
+                                                   g.conflicts.data(),
+                                                   colors.data());
+
+  // a proper coloring, which leaves out the unusable groups
+  for (uint32_t i = 0; i < g.n; ++i) {
+    if (!g.usable[i]) {
+      ASSERT(colors[i] == UINT32_MAX);
+      continue;
+    }
+
+    ASSERT(colors[i] < num_colors);
+
+    for (uint32_t j = 0; j < g.n; ++j) {
+      ASSERT(!g.conflicts[i * g.n + j] || colors[i] != colors[j]);
+    }
+  }
+
+  nvcd_arena_free(&arena);
+
+  return num_colors;
+}
+
+// k pairs, ordered a0 b0 a1 b1 ..., where ai and bj
+// conflict unless i == j: bipartite, but greedy
+// gives each pair a color of its own
+static conflict_graph crown_graph(uint32_t k) {
+  conflict_graph g(2 * k);
+
+  for (uint32_t i = 0; i < k; ++i) {
+    for (uint32_t j = 0; j < k; ++j) {
+      if (i != j) {
+        g.add(2 * i, 2 * j + 1);
+      }
+    }
+  }
+
+  return g;
+}
+
+static conflict_graph cycle_graph(uint32_t n) {
+  conflict_graph g(n);
+
+  for (uint32_t i = 0; i < n; ++i) {
+    g.add(i, (i + 1) % n);
+  }
+
+  return g;
+}
+
+static conflict_graph complete_graph(uint32_t n) {
+  conflict_graph g(n);
+
+  for (uint32_t i = 0; i < n; ++i) {
+    for (uint32_t j = i + 1; j < n; ++j) {
+      g.add(i, j);
+    }
+  }
+
+  return g;
+}
+
+static conflict_graph random_graph(uint32_t n, uint32_t percent, uint64_t seed) {
+  conflict_graph g(n);
+
+  for (uint32_t i = 0; i < n; ++i) {
+    for (uint32_t j = i + 1; j < n; ++j) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+
+      if ((seed >> 33) % 100 < percent) {
+        g.add(i, j);
+      }
+    }
+  }
+
+  return g;
+}
+
+static void check_graphs() {
+  for (uint32_t k = 2; k <= 8; ++k) {
+    conflict_graph g = crown_graph(k);
+
+    ASSERT(greedy_colors(g) == k);
+    ASSERT(dsatur_colors(g) == 2);
+  }
+
+  ASSERT(dsatur_colors(complete_graph(5)) == 5);
+  ASSERT(dsatur_colors(cycle_graph(7)) == 3);
+  ASSERT(dsatur_colors(cycle_graph(8)) == 2);
+
+  // unusable groups aren't colored, nor counted
+  conflict_graph partial = complete_graph(4);
+  partial.usable[1] = 0;
+
+  ASSERT(dsatur_colors(partial) == 3);
+
+  ASSERT(dsatur_colors(conflict_graph(0)) == 0);
+
+  uint32_t num_graphs = 0;
+  uint32_t num_fewer = 0;
+
+  for (uint32_t percent = 10; percent <= 60; percent += 10) {
+    for (uint64_t seed = 1; seed <= 20; ++seed) {
+      conflict_graph g = random_graph(24, percent, seed);
+
+      uint32_t greedy = greedy_colors(g);
+      uint32_t dsatur = dsatur_colors(g);
+
+      ASSERT(dsatur <= greedy);
+
+      num_graphs++;
+      num_fewer += dsatur < greedy;
+    }
+  }
+
+  printf("|TEST|DSatur needs no more passes than greedy, and fewer on crown graphs "
+         "(fewer on %" PRIu32 " of %" PRIu32 " random graphs)\n",
+         num_fewer,
+         num_graphs);
+}
+
+static uint32_t stub_num_passes(const char* events) {
+  setenv(ENV_EVENTS, events, 1);
+
+  nvcd_host_session_begin();
+
+  test_launch("test_pass_planner", test_kernel_sleep, dim3(1), dim3(64));
+
+  C_ASSERT(nvcd_lock_events());
+  uint32_t num_passes = cupti_event_data_num_passes(nvcd_get_events());
+  nvcd_release_events();
+
+  nvcd_host_session_end();
+
+  return num_passes;
+}
+
+int main() {
+  check_graphs();
+
+  // one group per domain can be enabled at a time,
+  // and a group holds up to STUB_MAX_GROUP_EVENTS events
+  ASSERT(stub_num_passes("stub_d0_e0,stub_d1_e0") == 1);
+  ASSERT(stub_num_passes("stub_d0_e0,stub_d0_e1,stub_d0_e2,stub_d0_e3,stub_d0_e4,stub_d1_e0") == 2);
+  ASSERT(stub_num_passes("stub_d0_e0,stub_d0_e1,stub_d0_e2,stub_d0_e3,stub_d0_e4,stub_d0_e5,"
+                         "stub_d1_e0,stub_d1_e1,stub_d1_e2,stub_d1_e3,stub_d1_e4,stub_d1_e5") == 2);
+
+  printf("|TEST|stub event sets take as many passes as their largest domain\n");
+
+  return 0;
+}
@@ -0,0 +1,223 @@
+//
+// Every run is a process of its own, which profiles one launch with
+// ENV_PLAN_CACHE set, checks its counters, and reports how many CUPTI
+// lookups (the stub's queries) it made. The second run of an event set
+// on a device loads the plan that the first saved, with far fewer.
+//
+// A cache file is named after its key, so a file that's keyed for
+// another event set or device is copied over the one a run would load;
+// it's rejected, and the run plans its events again and saves them.
+//
+
+#include "test_nvcd.h"
+
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const char* const k_all = ENV_ALL_EVENTS;
+static const char* const k_two = "stub_d0_e0,stub_d1_e0";
+
+static const uint64_t k_num_all_events = STUB_NUM_DOMAINS * STUB_EVENTS_PER_DOMAIN;
+
+static const int k_block_size = 64;
+
+static std::string g_dir;
+
+static void check_counters(int num_threads) {
+  const cupti_counter_matrix_t& m = g_run_info->counters;
+
+  ASSERT(m.num_rows > 0);
+
+  for (uint32_t row = 0; row < m.num_rows; ++row) {
+    uint32_t num_instances = 0;
+    const uint64_t* values = cupti_counter_matrix_row(&m, row, &num_instances);
+
+    for (uint32_t k = 0; k < num_instances; ++k) {
+      ASSERT(values[k] == stub_counter_value(m.event_ids[row], k, num_threads));
+    }
+  }
+}
+
+// runs one launch of the given events on the given device in a child
+// process, and returns the number of CUPTI lookups it made
+static uint64_t run(const char* events, int device) {
+  fflush(stdout);
+
+  int fds[2];
+  C_ASSERT(pipe(fds) == 0);
+
+  pid_t pid = fork();
+  C_ASSERT(pid >= 0);
+
+  if (pid == 0) {
+    close(fds[0]);
+
+    setenv(ENV_EVENTS, events, 1);
+
+    C_ASSERT(cudaSetDevice(device) == cudaSuccess);
+
+    test_launch("test_plan_cache", test_kernel_sleep, dim3(2), dim3(k_block_size));
+    check_counters(2 * k_block_size);
+
+    stub_counters_t c;
+    stub_counters_get(&c);
+
+    C_ASSERT(write(fds[1], &c.queries, sizeof(c.queries)) == sizeof(c.queries));
+    close(fds[1]);
+
+    exit(0);
+  }
+
+  close(fds[1]);
+
+  uint64_t queries = 0;
+  C_ASSERT(read(fds[0], &queries, sizeof(queries)) == sizeof(queries));
+  close(fds[0]);
+
+  int status = 0;
+  C_ASSERT(waitpid(pid, &status, 0) == pid);
+  C_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  return queries;
+}
+
+// the cache files, by name
+static std::vector<std::string> cache_files() {
+  std::vector<std::string> files;
+
+  DIR* dir = opendir(g_dir.c_str());
+  C_ASSERT(dir != NULL);
+
+  struct dirent* entry = NULL;
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      files.push_back(entry->d_name);
+    }
+  }
+
+  closedir(dir);
+
+  return files;
+}
+
+// the file that isn't in files
+static std::string new_cache_file(const std::vector<std::string>& files) {
+  std::vector<std::string> now = cache_files();
+
+  ASSERT(now.size() == files.size() + 1);
+
+  for (const std::string& name: now) {
+    bool found = false;
+
+    for (const std::string& old_name: files) {
+      found = found || old_name == name;
+    }
+
+    if (!found) {
+      return g_dir + "/" + name;
+    }
+  }
+
+  return std::string();
+}
+
+static std::string read_file(const std::string& path) {
+  std::string data;
+
+  FILE* f = fopen(path.c_str(), "rb");
+  C_ASSERT(f != NULL);
+
+  char buffer[4096];
+  size_t n = 0;
+
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data.append(buffer, n);
+  }
+
+  fclose(f);
+
+  return data;
+}
+
+static void write_file(const std::string& path, const std::string& data) {
+  FILE* f = fopen(path.c_str(), "wb");
+  C_ASSERT(f != NULL);
+  C_ASSERT(fwrite(data.data(), 1, data.size(), f) == data.size());
+  fclose(f);
+}
+
+// copies the file keyed for one run over that of another, and
+// checks that the other rejects it, plans again, and saves its own
+static void check_rejected(const std::string& from,
+                           const std::string& to,
+                           const char* events,
+                           int device,
+                           uint64_t planned_queries) {
+  std::string saved = read_file(to);
+
+  write_file(to, read_file(from));
+
+  ASSERT(run(events, device) == planned_queries);
+  ASSERT(read_file(to) == saved);
+}
+
+int main() {
+  stub_set_num_devices(2);
+
+  char dir_template[] = "/tmp/test_plan_cache_XXXXXX";
+  C_ASSERT(mkdtemp(dir_template) != NULL);
+  g_dir = dir_template;
+
+  setenv(ENV_PLAN_CACHE, g_dir.c_str(), 1);
+
+  // a deadlock fails the test, rather than hanging it
+  alarm(120);
+
+  uint64_t planned = run(k_all, 0);
+  std::string all_0 = new_cache_file({});
+
+  uint64_t loaded = run(k_all, 0);
+
+  ASSERT(cache_files().size() == 1);
+  // only the names of the events, which are reported, are looked up
+  ASSERT(loaded == k_num_all_events);
+  ASSERT(loaded * 3 < planned);
+
+  printf("|TEST|plan cache: a second run loads the plan with %" PRIu64 " CUPTI lookups, not %" PRIu64 "\n",
+         loaded,
+         planned);
+
+  uint64_t planned_two = run(k_two, 0);
+  std::string two_0 = new_cache_file({ all_0.substr(g_dir.size() + 1) });
+
+  ASSERT(run(k_two, 0) < planned_two);
+
+  check_rejected(all_0, two_0, k_two, 0, planned_two);
+
+  printf("|TEST|plan cache: a file keyed for another event set is rejected and rebuilt\n");
+
+  std::vector<std::string> files = cache_files();
+
+  ASSERT(run(k_all, 1) == planned);
+  std::string all_1 = new_cache_file(files);
+
+  check_rejected(all_0, all_1, k_all, 1, planned);
+
+  ASSERT(run(k_all, 1) == loaded);
+
+  printf("|TEST|plan cache: a file keyed for another device is rejected and rebuilt\n");
+
+  for (const std::string& name: cache_files()) {
+    unlink((g_dir + "/" + name).c_str());
+  }
+
+  rmdir(g_dir.c_str());
+
+  return 0;
+}
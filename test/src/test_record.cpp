@@ -0,0 +1,360 @@
+//
+// Launches are recorded to ENV_RECORD, and the file is decoded with
+// nvcddump as text, CSV and JSON, whose values are checked against
+// the stub's counters. Once the first launch has looked up the events
+// and metrics, recording more launches queries CUPTI no further.
+//
+// Then, nvcddump rejects the file once it's been cut short, or given
+// a bad header size or a misaligned record, and a process whose
+// ENV_RECORD has no %p or %r writes to a file of its own.
+//
+
+#include "test_nvcd.h"
+
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const uint32_t k_launches = 3;
+static const uint32_t k_block_size = 64;
+
+static std::string g_dump;
+
+// the stub's launches are 1, 2, ... k_launches blocks
+static uint64_t launch_threads(uint64_t launch) {
+  return (launch + 1) * k_block_size;
+}
+
+static CUpti_EventID event_id(const char* name) {
+  uint32_t domain = 0;
+  uint32_t index = 0;
+  C_ASSERT(sscanf(name, "stub_d%" SCNu32 "_e%" SCNu32, &domain, &index) == 2);
+  return domain * 256 + index + 1;
+}
+
+static uint32_t num_instances(CUpti_EventID event) {
+  return event < 256 ? 4 : 2;
+}
+
+static uint64_t expected_sum(CUpti_EventID event, uint64_t launch) {
+  uint64_t sum = 0;
+
+  for (uint32_t k = 0; k < num_instances(event); ++k) {
+    sum += stub_counter_value(event, k, launch_threads(launch));
+  }
+
+  return sum;
+}
+
+// Metrics are computed from each event's mean over its
+// instances, as there's a single instance in each domain
+static uint64_t expected_metric(uint64_t launch) {
+  CUpti_EventID d0_e0 = event_id("stub_d0_e0");
+  CUpti_EventID d1_e0 = event_id("stub_d1_e0");
+
+  return
+    expected_sum(d0_e0, launch) / num_instances(d0_e0) +
+    expected_sum(d1_e0, launch) / num_instances(d1_e0);
+}
+
+// runs nvcddump, and returns its exit status
+static int dump(const char* format, const std::string& path, std::vector<std::string>* lines) {
+  std::string command = g_dump + " -f " + format + " " + path + " 2>/dev/null";
+
+  FILE* p = popen(command.c_str(), "r");
+  C_ASSERT(p != NULL);
+
+  char line[1024];
+
+  while (fgets(line, sizeof(line), p) != NULL) {
+    if (lines != nullptr) {
+      lines->push_back(line);
+    }
+  }
+
+  int status = pclose(p);
+  C_ASSERT(WIFEXITED(status));
+
+  return WEXITSTATUS(status);
+}
+
+static void check_text(const std::string& path) {
+  std::vector<std::string> lines;
+  ASSERT(dump("text", path, &lines) == 0);
+
+  uint32_t num_counters = 0;
+  uint32_t num_metrics = 0;
+
+  for (const std::string& line: lines) {
+    char name[64] = {};
+    uint64_t value = 0;
+    uint64_t launch = 0;
+
+    if (sscanf(line.c_str(), "|COUNTER|test_record:%63[^:]: SUM: %" SCNu64, name, &value) == 2) {
+      const char* l = strstr(line.c_str(), "LAUNCH: ");
+      C_ASSERT(l != NULL && sscanf(l, "LAUNCH: %" SCNu64, &launch) == 1);
+
+      ASSERT(launch < k_launches);
+      ASSERT(value == expected_sum(event_id(name), launch));
+      num_counters++;
+    } else if (sscanf(line.c_str(),
+                      "|METRIC|test_record:stub_m_sum: (uint64) %" SCNu64,
+                      &value) == 1) {
+      const char* l = strstr(line.c_str(), "LAUNCH: ");
+      C_ASSERT(l != NULL && sscanf(l, "LAUNCH: %" SCNu64, &launch) == 1);
+
+      ASSERT(launch < k_launches);
+      ASSERT(value == expected_metric(launch));
+      num_metrics++;
+    }
+  }
+
+  ASSERT(num_counters == 2 * k_launches);
+  ASSERT(num_metrics == k_launches);
+}
+
+static void check_csv(const std::string& path) {
+  std::vector<std::string> lines;
+  ASSERT(dump("csv", path, &lines) == 0);
+
+  ASSERT(!lines.empty() && lines[0].compare(0, 7, "\"type\",") == 0);
+
+  uint32_t num_values = 0;
+  uint32_t num_metrics = 0;
+
+  for (const std::string& line: lines) {
+    uint64_t launch = 0;
+    char name[64] = {};
+    uint32_t instance = 0;
+    uint64_t value = 0;
+
+    if (sscanf(line.c_str(),
+               "\"counter\",%" SCNu64 ",\"test_record\",\"0x%*[0-9a-f]\",0,\"%*[^\"]\",%*d,%*u,"
+               "\"%63[^\"]\",%" SCNu32 ",%" SCNu64 ",",
+               &launch,
+               name,
+               &instance,
+               &value) == 4) {
+      CUpti_EventID event = event_id(name);
+
+      ASSERT(launch < k_launches && instance < num_instances(event));
+      ASSERT(value == stub_counter_value(event, instance, launch_threads(launch)));
+      num_values++;
+    } else if (sscanf(line.c_str(),
+                      "\"metric\",%" SCNu64 ",\"test_record\",\"0x%*[0-9a-f]\",0,\"%*[^\"]\",,,"
+                      "\"stub_m_sum\",,%" SCNu64 ",\"uint64\"",
+                      &launch,
+                      &value) == 2) {
+      ASSERT(value == expected_metric(launch));
+      num_metrics++;
+    }
+  }
+
+  ASSERT(num_values == (4 + 2) * k_launches);
+  ASSERT(num_metrics == k_launches);
+}
+
+static void check_json(const std::string& path) {
+  std::vector<std::string> lines;
+  ASSERT(dump("json", path, &lines) == 0);
+
+  ASSERT(lines.front() == "[\n" && lines.back() == "]\n");
+
+  uint32_t num_counters = 0;
+  uint32_t num_metrics = 0;
+
+  for (const std::string& line: lines) {
+    uint64_t launch = 0;
+    uint64_t value = 0;
+
+    if (sscanf(line.c_str(), "  {\"type\": \"counter\", \"launch\": %" SCNu64, &launch) == 1) {
+      char name[64] = {};
+      const char* event = strstr(line.c_str(), "\"event\": ");
+      C_ASSERT(event != NULL && sscanf(event, "\"event\": \"%63[^\"]\"", name) == 1);
+
+      const char* values = strstr(line.c_str(), "\"values\": [");
+      C_ASSERT(values != NULL);
+      values += strlen("\"values\": [");
+
+      uint32_t instance = 0;
+      int consumed = 0;
+
+      while (sscanf(values, "%" SCNu64 "%n", &value, &consumed) == 1) {
+        ASSERT(value == stub_counter_value(event_id(name), instance, launch_threads(launch)));
+        instance++;
+        values += consumed;
+        values += strspn(values, ", ");
+      }
+
+      ASSERT(instance == num_instances(event_id(name)));
+      num_counters++;
+    } else if (sscanf(line.c_str(), "  {\"type\": \"metric\", \"launch\": %" SCNu64, &launch) == 1) {
+      const char* v = strstr(line.c_str(), "\"kind\": \"uint64\", \"value\": ");
+      C_ASSERT(v != NULL && sscanf(v, "\"kind\": \"uint64\", \"value\": %" SCNu64, &value) == 1);
+
+      ASSERT(value == expected_metric(launch));
+      num_metrics++;
+    }
+  }
+
+  ASSERT(num_counters == 2 * k_launches);
+  ASSERT(num_metrics == k_launches);
+}
+
+static std::vector<uint8_t> read_file(const std::string& path) {
+  FILE* f = fopen(path.c_str(), "rb");
+  C_ASSERT(f != NULL);
+
+  std::vector<uint8_t> data;
+  uint8_t buffer[4096];
+  size_t n = 0;
+
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data.insert(data.end(), buffer, buffer + n);
+  }
+
+  fclose(f);
+
+  return data;
+}
+
+static void write_file(const std::string& path, const std::vector<uint8_t>& data) {
+  FILE* f = fopen(path.c_str(), "wb");
+  C_ASSERT(f != NULL);
+  C_ASSERT(fwrite(data.data(), 1, data.size(), f) == data.size());
+  fclose(f);
+}
+
+static void check_rejected(const std::string& dir, const std::string& path) {
+  std::vector<uint8_t> good = read_file(path);
+  std::string bad = dir + "/bad.nvcd";
+
+  nvcd_record_file_header_t header;
+  memcpy(&header, good.data(), sizeof(header));
+
+  ASSERT(header.length > 0 && good.size() == header.header_size + header.length);
+
+  // cut short in the middle of a record, and between two
+  for (size_t cut: { good.size() - 4, good.size() - sizeof(nvcd_record_metric_t) }) {
+    std::vector<uint8_t> truncated(good.begin(), good.begin() + cut);
+    write_file(bad, truncated);
+    ASSERT(dump("text", bad, nullptr) != 0);
+  }
+
+  // before it was closed, the file was zeroed past its records
+  std::vector<uint8_t> unclosed = good;
+  reinterpret_cast<nvcd_record_file_header_t*>(unclosed.data())->length = 0;
+  unclosed.resize(good.size() + 4096, 0);
+  write_file(bad, unclosed);
+  ASSERT(dump("text", bad, nullptr) == 0);
+
+  // cut short before it was closed
+  unclosed.resize(good.size() - 4);
+  write_file(bad, unclosed);
+  ASSERT(dump("text", bad, nullptr) != 0);
+
+  for (uint32_t header_size: { 4u, static_cast<uint32_t>(sizeof(header) + 4), 1u << 30 }) {
+    std::vector<uint8_t> data = good;
+    reinterpret_cast<nvcd_record_file_header_t*>(data.data())->header_size = header_size;
+    write_file(bad, data);
+    ASSERT(dump("text", bad, nullptr) != 0);
+  }
+
+  // the first record's size, off by 4
+  std::vector<uint8_t> misaligned = good;
+  nvcd_record_header_t* first = reinterpret_cast<nvcd_record_header_t*>(&misaligned[header.header_size]);
+  first->size -= 4;
+  write_file(bad, misaligned);
+  ASSERT(dump("text", bad, nullptr) != 0);
+
+  unlink(bad.c_str());
+}
+
+static bool file_exists(const std::string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+int main() {
+  char self[PATH_MAX] = {};
+  C_ASSERT(readlink("/proc/self/exe", self, sizeof(self) - 1) > 0);
+  g_dump = std::string(dirname(self)) + "/nvcddump";
+
+  char dir_template[] = "/tmp/test_record_XXXXXX";
+  C_ASSERT(mkdtemp(dir_template) != NULL);
+  std::string dir = dir_template;
+
+  setenv(ENV_EVENTS, "stub_d0_e0,stub_d1_e0", 1);
+  setenv(ENV_METRICS, "stub_m_sum", 1);
+  setenv(ENV_RECORD, (dir + "/run.%p.nvcd").c_str(), 1);
+
+  // a process of its own, with no token in ENV_RECORD
+  fflush(stdout);
+
+  pid_t pid = fork();
+  C_ASSERT(pid >= 0);
+
+  if (pid == 0) {
+    setenv(ENV_RECORD, (dir + "/plain.nvcd").c_str(), 1);
+    test_launch("test_record", test_kernel_sleep, dim3(1), dim3(k_block_size));
+    exit(0);
+  }
+
+  int status = 0;
+  C_ASSERT(waitpid(pid, &status, 0) == pid);
+  C_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  std::string child_path = dir + "/plain.nvcd." + std::to_string(pid);
+  ASSERT(file_exists(child_path));
+  ASSERT(dump("text", child_path, nullptr) == 0);
+  unlink(child_path.c_str());
+
+  printf("|TEST|record file names are expanded per process\n");
+
+  uint64_t first_queries = 0;
+
+  nvcd_host_session_begin();
+
+  for (uint32_t launch = 0; launch < k_launches; ++launch) {
+    test_launch("test_record", test_kernel_sleep, dim3(launch + 1), dim3(k_block_size));
+
+    stub_counters_t c;
+    stub_counters_get(&c);
+
+    if (launch == 0) {
+      first_queries = c.queries;
+    } else {
+      ASSERT(c.queries == first_queries);
+    }
+  }
+
+  nvcd_host_session_end();
+  nvcd_record_close();
+
+  std::string path = dir + "/run." + std::to_string(getpid()) + ".nvcd";
+  ASSERT(file_exists(path));
+
+  printf("|TEST|recorded launches make no CUPTI queries after the first\n");
+
+  check_text(path);
+  check_csv(path);
+  check_json(path);
+
+  printf("|TEST|nvcddump decodes recorded counters and metrics as text, CSV and JSON\n");
+
+  check_rejected(dir, path);
+
+  printf("|TEST|nvcddump rejects truncated files, bad header sizes and misaligned records\n");
+
+  unlink(path.c_str());
+  rmdir(dir.c_str());
+
+  return 0;
+}
@@ -0,0 +1,204 @@
+//
+// Streaming statistics against the exact ones of the same values.
+// Quantiles are within half a bucket of the value of that rank, and
+// exact below NVCD_STATS_SUB_BUCKETS. Summaries built by several
+// threads, each over its own part of a stream, merge into the summary
+// of the whole stream. Values at either end of uint64_t land in the
+// first and last buckets, and bucket counts saturate rather than wrap.
+//
+
+#include "test_util.h"
+
+#include <nvcd/stats.h>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <pthread.h>
+#include <string.h>
+
+static const uint32_t k_num_values = 200000;
+static const int k_num_threads = 8;
+
+static const double k_quantiles[] = { 0.0, 0.001, 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99, 0.999, 1.0 };
+
+// spread over every power of two up to 2^62, with many small values
+static std::vector<uint64_t> random_values(std::mt19937_64& rng) {
+  std::vector<uint64_t> values;
+  values.reserve(k_num_values);
+
+  for (uint32_t i = 0; i < k_num_values; ++i) {
+    uint32_t bits = static_cast<uint32_t>(rng() % 63);
+    values.push_back(rng() >> (63 - bits));
+  }
+
+  return values;
+}
+
+static bool close(double a, double b) {
+  return std::fabs(a - b) <= 1e-9 * std::max(1.0, std::max(std::fabs(a), std::fabs(b)));
+}
+
+static void check_quantiles(const std::vector<uint64_t>& values) {
+  nvcd_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+
+  for (uint64_t v: values) {
+    nvcd_stats_add(&stats, v);
+  }
+
+  std::vector<uint64_t> sorted(values);
+  std::sort(sorted.begin(), sorted.end());
+
+  ASSERT(stats.count == values.size());
+  ASSERT(stats.min == sorted.front() && stats.max == sorted.back());
+
+  for (double q: k_quantiles) {
+    uint64_t exact = sorted[static_cast<size_t>(q * static_cast<double>(sorted.size() - 1))];
+    uint64_t estimate = nvcd_stats_quantile(&stats, q);
+    uint64_t error = estimate > exact ? estimate - exact : exact - estimate;
+
+    if (exact < NVCD_STATS_SUB_BUCKETS) {
+      ASSERT(error == 0);
+    } else {
+      // a bucket is at most 1/NVCD_STATS_SUB_BUCKETS of its
+      // smallest value wide, and the estimate is its middle
+      ASSERT(error <= exact / (2 * NVCD_STATS_SUB_BUCKETS));
+    }
+  }
+}
+
+struct part {
+  const uint64_t* values;
+  size_t count;
+  nvcd_stats_t stats;
+};
+
+static void* add_part(void* arg) {
+  part* p = static_cast<part*>(arg);
+
+  for (size_t i = 0; i < p->count; ++i) {
+    nvcd_stats_add(&p->stats, p->values[i]);
+  }
+
+  return nullptr;
+}
+
+static void check_merge(const std::vector<uint64_t>& values) {
+  nvcd_stats_t whole;
+  memset(&whole, 0, sizeof(whole));
+
+  for (uint64_t v: values) {
+    nvcd_stats_add(&whole, v);
+  }
+
+  // uneven parts, one of them empty
+  std::vector<part> parts(k_num_threads);
+  pthread_t threads[k_num_threads];
+  size_t begin = 0;
+
+  for (int i = 0; i < k_num_threads; ++i) {
+    size_t count = i == 1 ? 0 : (values.size() - begin) / 2;
+
+    if (i == k_num_threads - 1) {
+      count = values.size() - begin;
+    }
+
+    parts[i].values = values.data() + begin;
+    parts[i].count = count;
+    memset(&parts[i].stats, 0, sizeof(parts[i].stats));
+
+    begin += count;
+
+    C_ASSERT(pthread_create(&threads[i], nullptr, add_part, &parts[i]) == 0);
+  }
+
+  for (int i = 0; i < k_num_threads; ++i) {
+    C_ASSERT(pthread_join(threads[i], nullptr) == 0);
+  }
+
+  nvcd_stats_t merged;
+  memset(&merged, 0, sizeof(merged));
+
+  for (const part& p: parts) {
+    nvcd_stats_merge(&merged, &p.stats);
+  }
+
+  ASSERT(merged.count == whole.count);
+  ASSERT(merged.min == whole.min && merged.max == whole.max);
+  ASSERT(close(merged.mean, whole.mean));
+  ASSERT(close(nvcd_stats_variance(&merged), nvcd_stats_variance(&whole)));
+  ASSERT(memcmp(merged.buckets, whole.buckets, sizeof(whole.buckets)) == 0);
+
+  for (double q: k_quantiles) {
+    ASSERT(nvcd_stats_quantile(&merged, q) == nvcd_stats_quantile(&whole, q));
+  }
+}
+
+static void check_saturation() {
+  nvcd_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+
+  nvcd_stats_add(&stats, 0);
+  nvcd_stats_add(&stats, UINT64_MAX);
+  nvcd_stats_add(&stats, UINT64_MAX - 1);
+
+  ASSERT(stats.buckets[0] == 1);
+  ASSERT(stats.buckets[NVCD_STATS_NUM_BUCKETS - 1] == 2);
+
+  ASSERT(nvcd_stats_quantile(&stats, 0.0) == 0);
+  ASSERT(nvcd_stats_quantile(&stats, 0.25) == 0);
+  ASSERT(nvcd_stats_quantile(&stats, 1.0) == UINT64_MAX);
+
+  // the middle of the last bucket, which is within the bound
+  uint64_t top = nvcd_stats_quantile(&stats, 0.5);
+  ASSERT(UINT64_MAX - top <= UINT64_MAX / (2 * NVCD_STATS_SUB_BUCKETS));
+
+  // counts stop at UINT32_MAX, whether added to or merged
+  stats.buckets[0] = UINT32_MAX - 1;
+
+  nvcd_stats_add(&stats, 0);
+  ASSERT(stats.buckets[0] == UINT32_MAX);
+
+  nvcd_stats_add(&stats, 0);
+  ASSERT(stats.buckets[0] == UINT32_MAX);
+
+  nvcd_stats_t other = stats;
+
+  nvcd_stats_merge(&stats, &other);
+  ASSERT(stats.buckets[0] == UINT32_MAX);
+  ASSERT(stats.buckets[NVCD_STATS_NUM_BUCKETS - 1] == 4);
+  ASSERT(stats.count == 2 * other.count);
+}
+
+int main() {
+  std::mt19937_64 rng(21);
+
+  std::vector<uint64_t> values = random_values(rng);
+
+  check_quantiles(values);
+
+  // every value exact, with many repeats
+  std::vector<uint64_t> small;
+
+  for (uint32_t i = 0; i < 1000; ++i) {
+    small.push_back(rng() % NVCD_STATS_SUB_BUCKETS);
+  }
+
+  check_quantiles(small);
+
+  printf("|TEST|stats quantiles are within half a bucket of the exact ones\n");
+
+  check_merge(values);
+
+  printf("|TEST|stats of %d threads' parts of a stream merge into the stats of the whole\n",
+         k_num_threads);
+
+  check_saturation();
+
+  printf("|TEST|stats saturate at the edges of the bucket range\n");
+
+  return 0;
+}
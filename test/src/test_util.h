@@ -0,0 +1,73 @@
+#ifndef __TEST_UTIL_H__
+#define __TEST_UTIL_H__
+
+//
+// Shared by the programs in test/src, each of which is a single
+// source file. Results are printed as |TEST| and |BENCH| lines, which
+// `make test` and `make bench` list; failures exit through ASSERT.
+//
+// Heap allocations are counted by replacing malloc() and friends for
+// the whole process, so those made by libnvcd are included.
+//
+
+#include <nvcd/commondef.h>
+#include <nvcd/util.h>
+#include <nvcd/env_var.h>
+
+#include "stub.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static volatile uint64_t g_test_allocs = 0;
+
+void* malloc(size_t size) __THROW {
+  __atomic_add_fetch(&g_test_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) __THROW {
+  __atomic_add_fetch(&g_test_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) __THROW {
+  __atomic_add_fetch(&g_test_allocs, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) __THROW {
+  __libc_free(ptr);
+}
+
+static inline uint64_t test_allocs() {
+  return __atomic_load_n(&g_test_allocs, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t test_now_nsec() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000ull + (uint64_t) t.tv_nsec;
+}
+
+// a kernel that takes the number of nanoseconds in its first argument
+static inline uint64_t test_kernel_sleep(const stub_launch_t* launch) {
+  return launch->args != NULL ? *(const uint64_t*) launch->args[0] : 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __TEST_UTIL_H__
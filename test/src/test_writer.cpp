@@ -0,0 +1,189 @@
+//
+// Several threads write numbered messages through the writer, under
+// each ENV_WRITER_POLICY. The queue is kept small, so that it fills.
+// A policy is read once per process, so each one runs in a child
+// process of its own, whose output goes to a file that's checked
+// here: every thread's messages are in order, none is repeated, and
+// they're all there, unless the policy drops some, in which case the
+// number dropped is reported.
+//
+// Every run returns from main() without nvcd_writer_flush(), so what's
+// still queued is written at exit; the last run queues all of its
+// messages first, in a queue that holds them all.
+//
+
+#include "test_util.h"
+
+#include <nvcd/writer.h>
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const uint32_t k_num_threads = 4;
+static const uint32_t k_messages = 5000;
+
+static void* thread_main(void* arg) {
+  uint32_t index = *static_cast<uint32_t*>(arg);
+
+  for (uint32_t i = 0; i < k_messages; ++i) {
+    char line[64];
+    int length = snprintf(line, sizeof(line), "|MSG| %" PRIu32 " %" PRIu32 "\n", index, i);
+    nvcd_writer_write(line, static_cast<size_t>(length));
+  }
+
+  return nullptr;
+}
+
+static int child_main() {
+  pthread_t threads[k_num_threads];
+  uint32_t indices[k_num_threads];
+
+  for (uint32_t t = 0; t < k_num_threads; ++t) {
+    indices[t] = t;
+    C_ASSERT(pthread_create(&threads[t], nullptr, thread_main, &indices[t]) == 0);
+  }
+
+  for (uint32_t t = 0; t < k_num_threads; ++t) {
+    C_ASSERT(pthread_join(threads[t], nullptr) == 0);
+  }
+
+  return 0;
+}
+
+struct messages {
+  std::vector<std::vector<bool>> seen;
+  uint64_t count;
+  uint64_t dropped;
+
+  messages()
+    : seen(k_num_threads, std::vector<bool>(k_messages, false)),
+      count(0),
+      dropped(0) {
+  }
+
+  // each thread's messages are in order within a file
+  void read(FILE* f) {
+    std::vector<int64_t> last(k_num_threads, -1);
+    char line[256];
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+      uint32_t t = 0;
+      uint32_t i = 0;
+      uint64_t n = 0;
+
+      if (sscanf(line, "|MSG| %" SCNu32 " %" SCNu32, &t, &i) == 2) {
+        ASSERT(t < k_num_threads && i < k_messages);
+        ASSERT(static_cast<int64_t>(i) > last[t]);
+        ASSERT(!seen[t][i]);
+
+        last[t] = i;
+        seen[t][i] = true;
+        count++;
+      } else if (sscanf(line, "[WARNING]:%" SCNu64 " messages were dropped", &n) == 1) {
+        dropped = n;
+      }
+    }
+  }
+};
+
+// runs this program with the given policy,
+// and reads what it wrote to stdout
+static messages run(const char* argv0, const char* policy, const char* queue, const char* spill) {
+  fflush(stdout);
+
+  FILE* output = tmpfile();
+  C_ASSERT(output != NULL);
+
+  pid_t pid = fork();
+  C_ASSERT(pid >= 0);
+
+  if (pid == 0) {
+    C_ASSERT(dup2(fileno(output), STDOUT_FILENO) == STDOUT_FILENO);
+
+    setenv(ENV_WRITER_POLICY, policy, 1);
+
+    if (queue != nullptr) {
+      setenv(ENV_WRITER_QUEUE, queue, 1);
+    }
+
+    if (spill != nullptr) {
+      setenv(ENV_WRITER_SPILL, spill, 1);
+    }
+
+    execl(argv0, argv0, "child", static_cast<char*>(nullptr));
+    _exit(1);
+  }
+
+  int status = 0;
+  C_ASSERT(waitpid(pid, &status, 0) == pid);
+  C_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  messages m;
+
+  rewind(output);
+  m.read(output);
+  fclose(output);
+
+  return m;
+}
+
+static const uint64_t k_total = static_cast<uint64_t>(k_num_threads) * k_messages;
+
+int main(int argc, char** argv) {
+  if (argc == 2 && strcmp(argv[1], "child") == 0) {
+    return child_main();
+  }
+
+  // a deadlock fails the test, rather than hanging it
+  alarm(120);
+
+  for (const char* policy: { "block", "sync" }) {
+    messages m = run(argv[0], policy, "4", nullptr);
+
+    ASSERT(m.count == k_total && m.dropped == 0);
+
+    printf("|TEST|writer policy %s keeps every message, in order\n", policy);
+  }
+
+  messages dropped = run(argv[0], "drop", "4", nullptr);
+
+  ASSERT(dropped.count + dropped.dropped == k_total);
+
+  printf("|TEST|writer policy drop keeps messages in order, and counts the rest (%" PRIu64 " dropped)\n",
+         dropped.dropped);
+
+  char spill[] = "/tmp/test_writer_spill_XXXXXX";
+  int fd = mkstemp(spill);
+  C_ASSERT(fd >= 0);
+  close(fd);
+
+  messages spilled = run(argv[0], "spill", "4", spill);
+
+  uint64_t queued = spilled.count;
+
+  FILE* f = fopen(spill, "r");
+  C_ASSERT(f != NULL);
+  spilled.read(f);
+  fclose(f);
+  unlink(spill);
+
+  ASSERT(spilled.count == k_total && spilled.dropped == 0);
+
+  printf("|TEST|writer policy spill keeps every message, in order in each file (%" PRIu64 " spilled)\n",
+         k_total - queued);
+
+  // every message fits in the queue, so they're all
+  // still there when the program returns from main()
+  messages at_exit = run(argv[0], "block", "1048576", nullptr);
+
+  ASSERT(at_exit.count == k_total);
+
+  printf("|TEST|writer flushes queued messages at exit\n");
+
+  return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef __STUB_CUDA_RUNTIME_H__
+#define __STUB_CUDA_RUNTIME_H__
+
+//
+// Lets the device code of nvcd.cuh compile as host code. It's
+// never called by the tests, which write the device buffers
+// from the host instead (see stub.h).
+//
+
+#include "cuda_runtime_api.h"
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+#include <array>
+#endif
+
+#define __global__
+#define __device__
+#define __host__
+
+#ifdef __cplusplus
+typedef unsigned int uint;
+
+struct uint3 {
+  unsigned int x, y, z;
+};
+
+extern uint3 threadIdx;
+extern uint3 blockIdx;
+extern uint3 blockDim;
+extern uint3 gridDim;
+
+long long clock64();
+#endif
+
+#endif // __STUB_CUDA_RUNTIME_H__
@@ -0,0 +1,111 @@
+#ifndef __STUB_CUDA_RUNTIME_API_H__
+#define __STUB_CUDA_RUNTIME_API_H__
+
+//
+// The parts of the CUDA runtime API that libnvcd uses; see cuda.h.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cuda.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum cudaError {
+  cudaSuccess = 0,
+  cudaErrorInvalidValue = 1,
+  cudaErrorMemoryAllocation = 2,
+  cudaErrorInvalidDevice = 101,
+  cudaErrorInvalidResourceHandle = 400,
+  cudaErrorNotReady = 600
+} cudaError_t;
+
+typedef struct CUstream_st* cudaStream_t;
+typedef struct CUevent_st* cudaEvent_t;
+
+enum cudaMemcpyKind {
+  cudaMemcpyHostToHost = 0,
+  cudaMemcpyHostToDevice = 1,
+  cudaMemcpyDeviceToHost = 2,
+  cudaMemcpyDeviceToDevice = 3
+};
+
+#define cudaEventDefault 0x00
+#define cudaEventDisableTiming 0x02
+
+#ifdef __cplusplus
+struct dim3 {
+  unsigned int x, y, z;
+  dim3(unsigned int x_ = 1, unsigned int y_ = 1, unsigned int z_ = 1)
+    : x(x_), y(y_), z(z_) {}
+};
+#else
+typedef struct dim3 {
+  unsigned int x, y, z;
+} dim3;
+#endif
+
+const char* cudaGetErrorName(cudaError_t error);
+const char* cudaGetErrorString(cudaError_t error);
+
+cudaError_t cudaGetDeviceCount(int* count);
+cudaError_t cudaGetDevice(int* device);
+cudaError_t cudaSetDevice(int device);
+cudaError_t cudaDeviceSynchronize(void);
+
+cudaError_t cudaMalloc(void** ptr, size_t size);
+cudaError_t cudaFree(void* ptr);
+cudaError_t cudaMemcpy(void* dst, const void* src, size_t count, enum cudaMemcpyKind kind);
+cudaError_t cudaMemset(void* ptr, int value, size_t count);
+cudaError_t cudaMemsetAsync(void* ptr, int value, size_t count, cudaStream_t stream);
+
+cudaError_t cudaStreamCreate(cudaStream_t* stream);
+cudaError_t cudaStreamDestroy(cudaStream_t stream);
+cudaError_t cudaStreamSynchronize(cudaStream_t stream);
+cudaError_t cudaStreamQuery(cudaStream_t stream);
+
+cudaError_t cudaEventCreate(cudaEvent_t* event);
+cudaError_t cudaEventCreateWithFlags(cudaEvent_t* event, unsigned int flags);
+cudaError_t cudaEventDestroy(cudaEvent_t event);
+cudaError_t cudaEventRecord(cudaEvent_t event, cudaStream_t stream);
+cudaError_t cudaEventQuery(cudaEvent_t event);
+cudaError_t cudaEventSynchronize(cudaEvent_t event);
+cudaError_t cudaEventElapsedTime(float* msec, cudaEvent_t start, cudaEvent_t end);
+
+cudaError_t cudaLaunchKernel(const void* func,
+                             dim3 grid,
+                             dim3 block,
+                             void** args,
+                             size_t shared_mem,
+                             cudaStream_t stream);
+
+// device symbols are host variables; the stub keeps
+// their value on each device apart (see stub.h)
+cudaError_t stub_memcpy_to_symbol(const void* symbol,
+                                  const void* src,
+                                  size_t count,
+                                  size_t offset);
+
+#ifdef __cplusplus
+}
+
+template <class T>
+static inline cudaError_t cudaMemcpyToSymbol(const T& symbol,
+                                             const void* src,
+                                             size_t count,
+                                             size_t offset = 0,
+                                             enum cudaMemcpyKind kind = cudaMemcpyHostToDevice) {
+  return stub_memcpy_to_symbol(&symbol, src, count, offset);
+}
+
+template <class T>
+static inline cudaError_t cudaGetSymbolAddress(void** ptr, const T& symbol) {
+  *ptr = const_cast<T*>(&symbol);
+  return cudaSuccess;
+}
+#endif
+
+#endif // __STUB_CUDA_RUNTIME_API_H__
@@ -0,0 +1,250 @@
+#ifndef __STUB_CUPTI_H__
+#define __STUB_CUPTI_H__
+
+//
+// The parts of the CUPTI callback, event and metric APIs that
+// libnvcd uses; see cuda.h.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cuda.h"
+#include "cuda_runtime_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CUPTIAPI
+
+typedef enum {
+  CUPTI_SUCCESS = 0,
+  CUPTI_ERROR_INVALID_PARAMETER = 1,
+  CUPTI_ERROR_INVALID_DEVICE = 2,
+  CUPTI_ERROR_INVALID_EVENT_NAME = 3,
+  CUPTI_ERROR_INVALID_EVENT_DOMAIN_ID = 5,
+  CUPTI_ERROR_INVALID_EVENT_ID = 6,
+  CUPTI_ERROR_INVALID_OPERATION = 10,
+  CUPTI_ERROR_MAX_LIMIT_REACHED = 12,
+  CUPTI_ERROR_NOT_READY = 13,
+  CUPTI_ERROR_NOT_COMPATIBLE = 14,
+  CUPTI_ERROR_INVALID_METRIC_ID = 16,
+  CUPTI_ERROR_INVALID_METRIC_VALUE = 17,
+  CUPTI_ERROR_INVALID_METRIC_NAME = 18,
+  CUPTI_ERROR_MULTIPLE_SUBSCRIBERS_NOT_SUPPORTED = 39,
+  CUPTI_ERROR_UNKNOWN = 999
+} CUptiResult;
+
+typedef uint32_t CUpti_EventID;
+typedef uint32_t CUpti_EventDomainID;
+typedef uint32_t CUpti_MetricID;
+typedef void* CUpti_EventGroup;
+
+typedef struct CUpti_Subscriber_st* CUpti_SubscriberHandle;
+typedef uint32_t CUpti_CallbackId;
+
+typedef enum {
+  CUPTI_CB_DOMAIN_RUNTIME_API = 2
+} CUpti_CallbackDomain;
+
+typedef enum {
+  CUPTI_API_ENTER = 0,
+  CUPTI_API_EXIT = 1
+} CUpti_ApiCallbackSite;
+
+typedef enum {
+  CUPTI_RUNTIME_TRACE_CBID_cudaLaunch_v3020 = 13,
+  CUPTI_RUNTIME_TRACE_CBID_cudaLaunchKernel_v7000 = 211
+} CUpti_runtime_api_trace_cbid;
+
+typedef struct {
+  CUpti_ApiCallbackSite callbackSite;
+  const char* functionName;
+  const void* functionParams;
+  void* functionReturnValue;
+  const char* symbolName;
+  CUcontext context;
+  uint32_t contextUid;
+  uint64_t* correlationData;
+  uint32_t correlationId;
+} CUpti_CallbackData;
+
+typedef void (CUPTIAPI *CUpti_CallbackFunc)(void* userdata,
+                                            CUpti_CallbackDomain domain,
+                                            CUpti_CallbackId cbid,
+                                            const void* cbdata);
+
+typedef enum {
+  CUPTI_EVENT_COLLECTION_MODE_CONTINUOUS = 0,
+  CUPTI_EVENT_COLLECTION_MODE_KERNEL = 1
+} CUpti_EventCollectionMode;
+
+typedef enum {
+  CUPTI_EVENT_ATTR_NAME = 0,
+  CUPTI_EVENT_ATTR_CATEGORY = 3
+} CUpti_EventAttribute;
+
+typedef enum {
+  CUPTI_EVENT_CATEGORY_INSTRUCTION = 0
+} CUpti_EventCategory;
+
+typedef enum {
+  CUPTI_EVENT_DOMAIN_ATTR_NAME = 0,
+  CUPTI_EVENT_DOMAIN_ATTR_INSTANCE_COUNT = 1,
+  CUPTI_EVENT_DOMAIN_ATTR_TOTAL_INSTANCE_COUNT = 3
+} CUpti_EventDomainAttribute;
+
+typedef enum {
+  CUPTI_EVENT_GROUP_ATTR_EVENT_DOMAIN_ID = 0,
+  CUPTI_EVENT_GROUP_ATTR_PROFILE_ALL_DOMAIN_INSTANCES = 1,
+  CUPTI_EVENT_GROUP_ATTR_USER_DATA = 2,
+  CUPTI_EVENT_GROUP_ATTR_NUM_EVENTS = 3,
+  CUPTI_EVENT_GROUP_ATTR_EVENTS = 4,
+  CUPTI_EVENT_GROUP_ATTR_INSTANCE_COUNT = 5
+} CUpti_EventGroupAttribute;
+
+typedef enum {
+  CUPTI_EVENT_READ_FLAG_NONE = 0
+} CUpti_ReadEventFlags;
+
+typedef enum {
+  CUPTI_METRIC_ATTR_NAME = 0,
+  CUPTI_METRIC_ATTR_VALUE_KIND = 5
+} CUpti_MetricAttribute;
+
+typedef enum {
+  CUPTI_METRIC_VALUE_KIND_DOUBLE = 0,
+  CUPTI_METRIC_VALUE_KIND_UINT64 = 1,
+  CUPTI_METRIC_VALUE_KIND_PERCENT = 2,
+  CUPTI_METRIC_VALUE_KIND_THROUGHPUT = 3,
+  CUPTI_METRIC_VALUE_KIND_INT64 = 4,
+  CUPTI_METRIC_VALUE_KIND_UTILIZATION_LEVEL = 5
+} CUpti_MetricValueKind;
+
+typedef enum {
+  CUPTI_METRIC_VALUE_UTILIZATION_IDLE = 0,
+  CUPTI_METRIC_VALUE_UTILIZATION_LOW = 2,
+  CUPTI_METRIC_VALUE_UTILIZATION_MID = 5,
+  CUPTI_METRIC_VALUE_UTILIZATION_HIGH = 8,
+  CUPTI_METRIC_VALUE_UTILIZATION_MAX = 10
+} CUpti_MetricValueUtilizationLevel;
+
+typedef union {
+  double metricValueDouble;
+  uint64_t metricValueUint64;
+  int64_t metricValueInt64;
+  double metricValuePercent;
+  uint64_t metricValueThroughput;
+  CUpti_MetricValueUtilizationLevel metricValueUtilizationLevel;
+} CUpti_MetricValue;
+
+typedef struct {
+  uint32_t numEventGroups;
+  CUpti_EventGroup* eventGroups;
+} CUpti_EventGroupSet;
+
+typedef struct {
+  uint32_t numSets;
+  CUpti_EventGroupSet* sets;
+} CUpti_EventGroupSets;
+
+CUptiResult cuptiGetResultString(CUptiResult result, const char** str);
+CUptiResult cuptiGetVersion(uint32_t* version);
+
+CUptiResult cuptiSubscribe(CUpti_SubscriberHandle* subscriber,
+                           CUpti_CallbackFunc callback,
+                           void* userdata);
+CUptiResult cuptiUnsubscribe(CUpti_SubscriberHandle subscriber);
+CUptiResult cuptiEnableCallback(uint32_t enable,
+                                CUpti_SubscriberHandle subscriber,
+                                CUpti_CallbackDomain domain,
+                                CUpti_CallbackId cbid);
+
+CUptiResult cuptiSetEventCollectionMode(CUcontext context, CUpti_EventCollectionMode mode);
+CUptiResult cuptiDeviceGetTimestamp(CUcontext context, uint64_t* timestamp);
+
+CUptiResult cuptiDeviceGetNumEventDomains(CUdevice device, uint32_t* num_domains);
+CUptiResult cuptiDeviceEnumEventDomains(CUdevice device,
+                                        size_t* array_size,
+                                        CUpti_EventDomainID* domains);
+CUptiResult cuptiEventDomainGetNumEvents(CUpti_EventDomainID domain, uint32_t* num_events);
+CUptiResult cuptiEventDomainEnumEvents(CUpti_EventDomainID domain,
+                                       size_t* array_size,
+                                       CUpti_EventID* events);
+CUptiResult cuptiEventDomainGetAttribute(CUpti_EventDomainID domain,
+                                         CUpti_EventDomainAttribute attrib,
+                                         size_t* size,
+                                         void* value);
+
+CUptiResult cuptiEventGetAttribute(CUpti_EventID event,
+                                   CUpti_EventAttribute attrib,
+                                   size_t* size,
+                                   void* value);
+CUptiResult cuptiEventGetIdFromName(CUdevice device, const char* name, CUpti_EventID* event);
+
+CUptiResult cuptiEventGroupCreate(CUcontext context, CUpti_EventGroup* group, uint32_t flags);
+CUptiResult cuptiEventGroupDestroy(CUpti_EventGroup group);
+CUptiResult cuptiEventGroupAddEvent(CUpti_EventGroup group, CUpti_EventID event);
+CUptiResult cuptiEventGroupRemoveEvent(CUpti_EventGroup group, CUpti_EventID event);
+CUptiResult cuptiEventGroupRemoveAllEvents(CUpti_EventGroup group);
+CUptiResult cuptiEventGroupEnable(CUpti_EventGroup group);
+CUptiResult cuptiEventGroupDisable(CUpti_EventGroup group);
+CUptiResult cuptiEventGroupGetAttribute(CUpti_EventGroup group,
+                                        CUpti_EventGroupAttribute attrib,
+                                        size_t* size,
+                                        void* value);
+CUptiResult cuptiEventGroupSetAttribute(CUpti_EventGroup group,
+                                        CUpti_EventGroupAttribute attrib,
+                                        size_t size,
+                                        void* value);
+CUptiResult cuptiEventGroupReadAllEvents(CUpti_EventGroup group,
+                                         CUpti_ReadEventFlags flags,
+                                         size_t* counter_buffer_size,
+                                         uint64_t* counter_buffer,
+                                         size_t* event_id_array_size,
+                                         CUpti_EventID* event_id_array,
+                                         size_t* num_event_ids_read);
+CUptiResult cuptiEventGroupReadEvent(CUpti_EventGroup group,
+                                     CUpti_ReadEventFlags flags,
+                                     CUpti_EventID event,
+                                     size_t* counter_buffer_size,
+                                     uint64_t* counter_buffer);
+
+CUptiResult cuptiEventGroupSetsCreate(CUcontext context,
+                                      size_t event_id_array_size,
+                                      CUpti_EventID* events,
+                                      CUpti_EventGroupSets** sets);
+CUptiResult cuptiEventGroupSetsDestroy(CUpti_EventGroupSets* sets);
+
+CUptiResult cuptiDeviceGetNumMetrics(CUdevice device, uint32_t* num_metrics);
+CUptiResult cuptiDeviceEnumMetrics(CUdevice device,
+                                   size_t* array_size,
+                                   CUpti_MetricID* metrics);
+CUptiResult cuptiMetricGetIdFromName(CUdevice device, const char* name, CUpti_MetricID* metric);
+CUptiResult cuptiMetricGetNumEvents(CUpti_MetricID metric, uint32_t* num_events);
+CUptiResult cuptiMetricEnumEvents(CUpti_MetricID metric,
+                                  size_t* array_size,
+                                  CUpti_EventID* events);
+CUptiResult cuptiMetricGetAttribute(CUpti_MetricID metric,
+                                    CUpti_MetricAttribute attrib,
+                                    size_t* size,
+                                    void* value);
+CUptiResult cuptiMetricCreateEventGroupSets(CUcontext context,
+                                            size_t metric_id_array_size,
+                                            CUpti_MetricID* metrics,
+                                            CUpti_EventGroupSets** sets);
+CUptiResult cuptiMetricGetValue(CUdevice device,
+                                CUpti_MetricID metric,
+                                size_t event_id_array_size,
+                                CUpti_EventID* events,
+                                size_t event_value_array_size,
+                                uint64_t* event_values,
+                                uint64_t time_duration,
+                                CUpti_MetricValue* value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __STUB_CUPTI_H__
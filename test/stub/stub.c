@@ -0,0 +1,1571 @@
+#include "stub.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+//
+// Every entry point takes g_lock, apart from the callbacks, which are
+// invoked without it since they call back into the stub. Kernels are run
+// under g_exec_lock, with the device symbols of their device loaded.
+//
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_exec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static stub_counters_t g_counters;
+
+static int g_num_devices = 0;
+static uint32_t g_events_per_domain = STUB_EVENTS_PER_DOMAIN;
+static bool g_initialized = false;
+
+struct CUctx_st {
+  int device;
+};
+
+struct CUstream_st {
+  int device;
+  uint64_t busy_until;
+  struct CUstream_st* next;
+};
+
+struct CUevent_st {
+  uint64_t time;
+  bool recorded;
+  bool timing;
+};
+
+static struct CUctx_st g_contexts[STUB_MAX_DEVICES];
+
+// the NULL stream of each device
+static struct CUstream_st g_default_streams[STUB_MAX_DEVICES];
+
+// every stream created with cudaStreamCreate()
+static struct CUstream_st* g_streams = NULL;
+
+static __thread int t_device = 0;
+static __thread CUcontext t_context = NULL;
+
+static const uint32_t g_domain_instances[STUB_NUM_DOMAINS] = { 4, 2 };
+
+uint64_t stub_now_nsec(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000ull + (uint64_t) t.tv_nsec;
+}
+
+static void wait_until(uint64_t time) {
+  uint64_t now = stub_now_nsec();
+
+  while (now < time) {
+    uint64_t wait = time - now;
+    struct timespec t = { (time_t) (wait / 1000000000ull), (long) (wait % 1000000000ull) };
+    nanosleep(&t, NULL);
+    now = stub_now_nsec();
+  }
+}
+
+static inline void lock(void) {
+  pthread_mutex_lock(&g_lock);
+}
+
+static inline void unlock(void) {
+  pthread_mutex_unlock(&g_lock);
+}
+
+// counts a lookup of names, attributes or the events of a domain or metric
+static inline void count_query(void) {
+  lock();
+  g_counters.queries++;
+  unlock();
+}
+
+//
+// Control
+//
+
+void stub_set_num_devices(int num_devices) {
+  lock();
+  g_num_devices = num_devices;
+  unlock();
+}
+
+void stub_set_events_per_domain(uint32_t num_events) {
+  lock();
+  g_events_per_domain = num_events <= STUB_MAX_EVENTS_PER_DOMAIN ? num_events : STUB_MAX_EVENTS_PER_DOMAIN;
+  unlock();
+}
+
+void stub_counters_get(stub_counters_t* out) {
+  lock();
+  *out = g_counters;
+  unlock();
+}
+
+void stub_counters_reset(void) {
+  lock();
+  memset(&g_counters, 0, sizeof(g_counters));
+  unlock();
+}
+
+//
+// Device symbols
+//
+
+#define STUB_MAX_SYMBOLS 64
+#define STUB_MAX_SYMBOL_SIZE 16
+
+typedef struct stub_symbol {
+  void* symbol;
+  int device;
+  size_t size;
+  uint8_t value[STUB_MAX_SYMBOL_SIZE];
+} stub_symbol_t;
+
+static stub_symbol_t g_symbols[STUB_MAX_SYMBOLS];
+static uint32_t g_num_symbols = 0;
+
+static stub_symbol_t* symbol_find(const void* symbol, int device) {
+  for (uint32_t i = 0; i < g_num_symbols; ++i) {
+    if (g_symbols[i].symbol == symbol && g_symbols[i].device == device) {
+      return &g_symbols[i];
+    }
+  }
+
+  return NULL;
+}
+
+cudaError_t stub_memcpy_to_symbol(const void* symbol,
+                                  const void* src,
+                                  size_t count,
+                                  size_t offset) {
+  if (offset + count > STUB_MAX_SYMBOL_SIZE) {
+    return cudaErrorInvalidValue;
+  }
+
+  lock();
+
+  stub_symbol_t* s = symbol_find(symbol, t_device);
+
+  if (s == NULL) {
+    if (g_num_symbols == STUB_MAX_SYMBOLS) {
+      unlock();
+      return cudaErrorMemoryAllocation;
+    }
+
+    s = &g_symbols[g_num_symbols++];
+    memset(s, 0, sizeof(*s));
+    s->symbol = (void*) symbol;
+    s->device = t_device;
+  }
+
+  memcpy(&s->value[offset], src, count);
+  s->size = s->size > offset + count ? s->size : offset + count;
+
+  g_counters.symbol_copies++;
+
+  unlock();
+
+  return cudaSuccess;
+}
+
+bool stub_symbol_value(const void* symbol, int device, void* out, size_t size) {
+  lock();
+
+  stub_symbol_t* s = symbol_find(symbol, device);
+  bool found = s != NULL && size <= s->size;
+
+  if (found) {
+    memcpy(out, s->value, size);
+  }
+
+  unlock();
+
+  return found;
+}
+
+// the host variables behind the symbols take the device's values
+static void symbols_load(int device) {
+  lock();
+
+  for (uint32_t i = 0; i < g_num_symbols; ++i) {
+    if (g_symbols[i].device == device) {
+      memcpy(g_symbols[i].symbol, g_symbols[i].value, g_symbols[i].size);
+    }
+  }
+
+  unlock();
+}
+
+//
+// Driver API
+//
+
+CUresult cuInit(unsigned int flags) {
+  lock();
+
+  if (!g_initialized) {
+    if (g_num_devices == 0) {
+      const char* value = getenv(STUB_ENV_DEVICES);
+      g_num_devices = value != NULL ? atoi(value) : 1;
+    }
+
+    if (g_num_devices < 1) {
+      g_num_devices = 1;
+    } else if (g_num_devices > STUB_MAX_DEVICES) {
+      g_num_devices = STUB_MAX_DEVICES;
+    }
+
+    for (int i = 0; i < STUB_MAX_DEVICES; ++i) {
+      g_contexts[i].device = i;
+      g_default_streams[i].device = i;
+    }
+
+    g_initialized = true;
+  }
+
+  unlock();
+
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDriverGetVersion(int* version) {
+  *version = 10010;
+  return CUDA_SUCCESS;
+}
+
+static inline bool device_valid(int device) {
+  return g_initialized && 0 <= device && device < g_num_devices;
+}
+
+CUresult cuDeviceGet(CUdevice* device, int ordinal) {
+  if (!device_valid(ordinal)) {
+    return CUDA_ERROR_INVALID_DEVICE;
+  }
+
+  *device = ordinal;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetName(char* name, int length, CUdevice device) {
+  if (!device_valid(device)) {
+    return CUDA_ERROR_INVALID_DEVICE;
+  }
+
+  snprintf(name, (size_t) length, "Stub GPU %d", device);
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetUuid(CUuuid* uuid, CUdevice device) {
+  if (!device_valid(device)) {
+    return CUDA_ERROR_INVALID_DEVICE;
+  }
+
+  for (int i = 0; i < 16; ++i) {
+    uuid->bytes[i] = (char) (0x50 + i + device * 16);
+  }
+
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDeviceGetAttribute(int* value, CUdevice_attribute attribute, CUdevice device) {
+  if (!device_valid(device)) {
+    return CUDA_ERROR_INVALID_DEVICE;
+  }
+
+  switch (attribute) {
+  case CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT:
+    *value = STUB_NUM_SMS;
+    break;
+  case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR:
+    *value = 7;
+    break;
+  case CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR:
+    *value = 0;
+    break;
+  default:
+    return CUDA_ERROR_INVALID_VALUE;
+  }
+
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDevicePrimaryCtxRetain(CUcontext* context, CUdevice device) {
+  if (!device_valid(device)) {
+    return CUDA_ERROR_INVALID_DEVICE;
+  }
+
+  *context = &g_contexts[device];
+  return CUDA_SUCCESS;
+}
+
+CUresult cuDevicePrimaryCtxRelease(CUdevice device) {
+  return device_valid(device) ? CUDA_SUCCESS : CUDA_ERROR_INVALID_DEVICE;
+}
+
+CUresult cuCtxGetCurrent(CUcontext* context) {
+  *context = t_context;
+  return CUDA_SUCCESS;
+}
+
+CUresult cuCtxSetCurrent(CUcontext context) {
+  t_context = context;
+
+  if (context != NULL) {
+    t_device = context->device;
+  }
+
+  return CUDA_SUCCESS;
+}
+
+CUresult cuCtxGetDevice(CUdevice* device) {
+  if (t_context == NULL) {
+    return CUDA_ERROR_INVALID_CONTEXT;
+  }
+
+  *device = t_context->device;
+  return CUDA_SUCCESS;
+}
+
+//
+// Runtime API
+//
+
+const char* cudaGetErrorName(cudaError_t error) {
+  switch (error) {
+  case cudaSuccess: return "cudaSuccess";
+  case cudaErrorInvalidValue: return "cudaErrorInvalidValue";
+  case cudaErrorMemoryAllocation: return "cudaErrorMemoryAllocation";
+  case cudaErrorInvalidDevice: return "cudaErrorInvalidDevice";
+  case cudaErrorInvalidResourceHandle: return "cudaErrorInvalidResourceHandle";
+  case cudaErrorNotReady: return "cudaErrorNotReady";
+  }
+
+  return "cudaErrorUnknown";
+}
+
+const char* cudaGetErrorString(cudaError_t error) {
+  return cudaGetErrorName(error);
+}
+
+cudaError_t cudaGetDeviceCount(int* count) {
+  cuInit(0);
+  *count = g_num_devices;
+  return cudaSuccess;
+}
+
+cudaError_t cudaGetDevice(int* device) {
+  *device = t_device;
+  return cudaSuccess;
+}
+
+cudaError_t cudaSetDevice(int device) {
+  cuInit(0);
+
+  if (!device_valid(device)) {
+    return cudaErrorInvalidDevice;
+  }
+
+  t_device = device;
+  t_context = &g_contexts[device];
+
+  return cudaSuccess;
+}
+
+static inline struct CUstream_st* stream_get(cudaStream_t stream) {
+  return stream != NULL ? (struct CUstream_st*) stream : &g_default_streams[t_device];
+}
+
+static uint64_t device_busy_until(int device) {
+  uint64_t time = g_default_streams[device].busy_until;
+
+  for (struct CUstream_st* s = g_streams; s != NULL; s = s->next) {
+    if (s->device == device && s->busy_until > time) {
+      time = s->busy_until;
+    }
+  }
+
+  return time;
+}
+
+cudaError_t cudaDeviceSynchronize(void) {
+  lock();
+  uint64_t time = device_busy_until(t_device);
+  g_counters.device_syncs++;
+  unlock();
+
+  wait_until(time);
+
+  return cudaSuccess;
+}
+
+cudaError_t cudaMalloc(void** ptr, size_t size) {
+  *ptr = malloc(size > 0 ? size : 1);
+
+  if (*ptr == NULL) {
+    return cudaErrorMemoryAllocation;
+  }
+
+  lock();
+  g_counters.mallocs++;
+  unlock();
+
+  return cudaSuccess;
+}
+
+cudaError_t cudaFree(void* ptr) {
+  if (ptr != NULL) {
+    free(ptr);
+
+    lock();
+    g_counters.frees++;
+    unlock();
+  }
+
+  return cudaSuccess;
+}
+
+cudaError_t cudaMemcpy(void* dst, const void* src, size_t count, enum cudaMemcpyKind kind) {
+  memmove(dst, src, count);
+  return cudaSuccess;
+}
+
+cudaError_t cudaMemset(void* ptr, int value, size_t count) {
+  memset(ptr, value, count);
+
+  lock();
+  g_counters.memsets++;
+  unlock();
+
+  return cudaSuccess;
+}
+
+cudaError_t cudaMemsetAsync(void* ptr, int value, size_t count, cudaStream_t stream) {
+  memset(ptr, value, count);
+
+  lock();
+  g_counters.memsets++;
+  unlock();
+
+  return cudaSuccess;
+}
+
+cudaError_t cudaStreamCreate(cudaStream_t* stream) {
+  struct CUstream_st* s = calloc(1, sizeof(*s));
+
+  if (s == NULL) {
+    return cudaErrorMemoryAllocation;
+  }
+
+  lock();
+  s->device = t_device;
+  s->next = g_streams;
+  g_streams = s;
+  unlock();
+
+  *stream = (cudaStream_t) s;
+
+  return cudaSuccess;
+}
+
+cudaError_t cudaStreamDestroy(cudaStream_t stream) {
+  lock();
+
+  struct CUstream_st** p = &g_streams;
+
+  while (*p != NULL && *p != (struct CUstream_st*) stream) {
+    p = &(*p)->next;
+  }
+
+  bool found = *p != NULL;
+
+  if (found) {
+    *p = (*p)->next;
+  }
+
+  unlock();
+
+  if (!found) {
+    return cudaErrorInvalidResourceHandle;
+  }
+
+  free(stream);
+
+  return cudaSuccess;
+}
+
+cudaError_t cudaStreamSynchronize(cudaStream_t stream) {
+  lock();
+  uint64_t time = stream_get(stream)->busy_until;
+  g_counters.stream_syncs++;
+  unlock();
+
+  wait_until(time);
+
+  return cudaSuccess;
+}
+
+cudaError_t cudaStreamQuery(cudaStream_t stream) {
+  lock();
+  uint64_t time = stream_get(stream)->busy_until;
+  unlock();
+
+  return stub_now_nsec() >= time ? cudaSuccess : cudaErrorNotReady;
+}
+
+cudaError_t cudaEventCreateWithFlags(cudaEvent_t* event, unsigned int flags) {
+  struct CUevent_st* e = calloc(1, sizeof(*e));
+
+  if (e == NULL) {
+    return cudaErrorMemoryAllocation;
+  }
+
+  e->timing = (flags & cudaEventDisableTiming) == 0;
+  *event = (cudaEvent_t) e;
+
+  return cudaSuccess;
+}
+
+cudaError_t cudaEventCreate(cudaEvent_t* event) {
+  return cudaEventCreateWithFlags(event, cudaEventDefault);
+}
+
+cudaError_t cudaEventDestroy(cudaEvent_t event) {
+  free(event);
+  return cudaSuccess;
+}
+
+cudaError_t cudaEventRecord(cudaEvent_t event, cudaStream_t stream) {
+  struct CUevent_st* e = (struct CUevent_st*) event;
+
+  lock();
+
+  uint64_t now = stub_now_nsec();
+  uint64_t busy = stream_get(stream)->busy_until;
+
+  e->time = busy > now ? busy : now;
+  e->recorded = true;
+
+  unlock();
+
+  return cudaSuccess;
+}
+
+cudaError_t cudaEventQuery(cudaEvent_t event) {
+  struct CUevent_st* e = (struct CUevent_st*) event;
+
+  lock();
+  uint64_t time = e->time;
+  unlock();
+
+  return stub_now_nsec() >= time ? cudaSuccess : cudaErrorNotReady;
+}
+
+cudaError_t cudaEventSynchronize(cudaEvent_t event) {
+  struct CUevent_st* e = (struct CUevent_st*) event;
+
+  lock();
+  uint64_t time = e->time;
+  g_counters.event_syncs++;
+  unlock();
+
+  wait_until(time);
+
+  return cudaSuccess;
+}
+
+cudaError_t cudaEventElapsedTime(float* msec, cudaEvent_t start, cudaEvent_t end) {
+  struct CUevent_st* s = (struct CUevent_st*) start;
+  struct CUevent_st* e = (struct CUevent_st*) end;
+
+  if (!s->recorded || !e->recorded || !s->timing || !e->timing) {
+    return cudaErrorInvalidResourceHandle;
+  }
+
+  // as with CUDA, the end event has to have completed
+  if (stub_now_nsec() < e->time) {
+    return cudaErrorNotReady;
+  }
+
+  *msec = (float) ((double) (e->time - s->time) * 1e-6);
+
+  return cudaSuccess;
+}
+
+//
+// Events
+//
+
+#define STUB_EVENT_ID(domain, index) ((CUpti_EventID) ((domain) * 256 + (index) + 1))
+#define STUB_DOMAIN_ID(domain) ((CUpti_EventDomainID) ((domain) + 1))
+
+static inline bool event_valid(CUpti_EventID event) {
+  uint32_t domain = (event - 1) / 256;
+  uint32_t index = (event - 1) % 256;
+
+  return event > 0 && domain < STUB_NUM_DOMAINS && index < g_events_per_domain;
+}
+
+static inline uint32_t event_domain(CUpti_EventID event) {
+  return (event - 1) / 256;
+}
+
+static inline bool domain_valid(CUpti_EventDomainID domain) {
+  return domain > 0 && domain <= STUB_NUM_DOMAINS;
+}
+
+static inline uint32_t event_index(CUpti_EventID event) {
+  return (event - 1) % 256;
+}
+
+// by domain and event index, a mask of the events it conflicts with
+static uint64_t g_conflicts[STUB_NUM_DOMAINS][STUB_MAX_EVENTS_PER_DOMAIN];
+
+void stub_set_conflict(CUpti_EventID a, CUpti_EventID b) {
+  if (event_valid(a) && event_valid(b) && event_domain(a) == event_domain(b)) {
+    lock();
+    g_conflicts[event_domain(a)][event_index(a)] |= 1ull << event_index(b);
+    g_conflicts[event_domain(b)][event_index(b)] |= 1ull << event_index(a);
+    unlock();
+  }
+}
+
+void stub_clear_conflicts(void) {
+  lock();
+  memset(g_conflicts, 0, sizeof(g_conflicts));
+  unlock();
+}
+
+uint64_t stub_counter_value(CUpti_EventID event, uint32_t instance, uint64_t num_threads) {
+  return num_threads * (uint64_t) (event % 7 + 1) + instance;
+}
+
+typedef struct stub_group {
+  int device;
+  uint32_t domain; // index, or UINT32_MAX while empty
+  uint32_t num_events;
+  CUpti_EventID events[STUB_MAX_GROUP_EVENTS];
+
+  // instance by instance, as CUPTI lays them out
+  uint64_t counters[STUB_MAX_GROUP_EVENTS * 4];
+
+  uint64_t ready_at;
+  bool enabled;
+
+  struct stub_group* next;
+} stub_group_t;
+
+static stub_group_t* g_groups = NULL;
+
+static inline uint32_t group_num_instances(const stub_group_t* g) {
+  return g->domain != UINT32_MAX ? g_domain_instances[g->domain] : 1;
+}
+
+static void event_name(CUpti_EventID event, char* name, size_t length) {
+  snprintf(name, length, "stub_d%u_e%u", event_domain(event), (event - 1) % 256);
+}
+
+static CUptiResult attr_string(const char* value, size_t* size, void* out) {
+  size_t length = strlen(value) + 1;
+
+  if (*size < length) {
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  }
+
+  memcpy(out, value, length);
+  *size = length;
+
+  return CUPTI_SUCCESS;
+}
+
+static CUptiResult attr_u32(uint32_t value, size_t* size, void* out) {
+  if (*size < sizeof(value)) {
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  }
+
+  memcpy(out, &value, sizeof(value));
+  *size = sizeof(value);
+
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiGetResultString(CUptiResult result, const char** str) {
+  switch (result) {
+  case CUPTI_SUCCESS: *str = "CUPTI_SUCCESS"; break;
+  case CUPTI_ERROR_INVALID_PARAMETER: *str = "CUPTI_ERROR_INVALID_PARAMETER"; break;
+  case CUPTI_ERROR_INVALID_EVENT_NAME: *str = "CUPTI_ERROR_INVALID_EVENT_NAME"; break;
+  case CUPTI_ERROR_MAX_LIMIT_REACHED: *str = "CUPTI_ERROR_MAX_LIMIT_REACHED"; break;
+  case CUPTI_ERROR_NOT_COMPATIBLE: *str = "CUPTI_ERROR_NOT_COMPATIBLE"; break;
+  case CUPTI_ERROR_INVALID_METRIC_VALUE: *str = "CUPTI_ERROR_INVALID_METRIC_VALUE"; break;
+  case CUPTI_ERROR_INVALID_METRIC_NAME: *str = "CUPTI_ERROR_INVALID_METRIC_NAME"; break;
+  case CUPTI_ERROR_MULTIPLE_SUBSCRIBERS_NOT_SUPPORTED:
+    *str = "CUPTI_ERROR_MULTIPLE_SUBSCRIBERS_NOT_SUPPORTED";
+    break;
+  default: *str = "CUPTI_ERROR_UNKNOWN"; break;
+  }
+
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiGetVersion(uint32_t* version) {
+  *version = 12;
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiSetEventCollectionMode(CUcontext context, CUpti_EventCollectionMode mode) {
+  return context != NULL ? CUPTI_SUCCESS : CUPTI_ERROR_INVALID_PARAMETER;
+}
+
+CUptiResult cuptiDeviceGetTimestamp(CUcontext context, uint64_t* timestamp) {
+  *timestamp = stub_now_nsec();
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiDeviceGetNumEventDomains(CUdevice device, uint32_t* num_domains) {
+  count_query();
+
+  *num_domains = STUB_NUM_DOMAINS;
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiDeviceEnumEventDomains(CUdevice device,
+                                        size_t* array_size,
+                                        CUpti_EventDomainID* domains) {
+  count_query();
+
+  uint32_t n = (uint32_t) (*array_size / sizeof(domains[0]));
+  n = n < STUB_NUM_DOMAINS ? n : STUB_NUM_DOMAINS;
+
+  for (uint32_t i = 0; i < n; ++i) {
+    domains[i] = STUB_DOMAIN_ID(i);
+  }
+
+  *array_size = n * sizeof(domains[0]);
+
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiEventDomainGetNumEvents(CUpti_EventDomainID domain, uint32_t* num_events) {
+  count_query();
+
+  if (!domain_valid(domain)) {
+    return CUPTI_ERROR_INVALID_EVENT_DOMAIN_ID;
+  }
+
+  *num_events = g_events_per_domain;
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiEventDomainEnumEvents(CUpti_EventDomainID domain,
+                                       size_t* array_size,
+                                       CUpti_EventID* events) {
+  count_query();
+
+  if (!domain_valid(domain)) {
+    return CUPTI_ERROR_INVALID_EVENT_DOMAIN_ID;
+  }
+
+  uint32_t n = (uint32_t) (*array_size / sizeof(events[0]));
+  n = n < g_events_per_domain ? n : g_events_per_domain;
+
+  for (uint32_t i = 0; i < n; ++i) {
+    events[i] = STUB_EVENT_ID(domain - 1, i);
+  }
+
+  *array_size = n * sizeof(events[0]);
+
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiEventDomainGetAttribute(CUpti_EventDomainID domain,
+                                         CUpti_EventDomainAttribute attrib,
+                                         size_t* size,
+                                         void* value) {
+  count_query();
+
+  if (!domain_valid(domain)) {
+    return CUPTI_ERROR_INVALID_EVENT_DOMAIN_ID;
+  }
+
+  switch (attrib) {
+  case CUPTI_EVENT_DOMAIN_ATTR_NAME: {
+    char name[32];
+    snprintf(name, sizeof(name), "stub_d%u", domain - 1);
+    return attr_string(name, size, value);
+  }
+  case CUPTI_EVENT_DOMAIN_ATTR_INSTANCE_COUNT:
+  case CUPTI_EVENT_DOMAIN_ATTR_TOTAL_INSTANCE_COUNT:
+    return attr_u32(g_domain_instances[domain - 1], size, value);
+  }
+
+  return CUPTI_ERROR_INVALID_PARAMETER;
+}
+
+CUptiResult cuptiEventGetAttribute(CUpti_EventID event,
+                                   CUpti_EventAttribute attrib,
+                                   size_t* size,
+                                   void* value) {
+  count_query();
+
+  if (!event_valid(event)) {
+    return CUPTI_ERROR_INVALID_EVENT_ID;
+  }
+
+  switch (attrib) {
+  case CUPTI_EVENT_ATTR_NAME: {
+    char name[32];
+    event_name(event, name, sizeof(name));
+    return attr_string(name, size, value);
+  }
+  case CUPTI_EVENT_ATTR_CATEGORY:
+    return attr_u32(CUPTI_EVENT_CATEGORY_INSTRUCTION, size, value);
+  }
+
+  return CUPTI_ERROR_INVALID_PARAMETER;
+}
+
+CUptiResult cuptiEventGetIdFromName(CUdevice device, const char* name, CUpti_EventID* event) {
+  count_query();
+
+  unsigned domain = 0;
+  unsigned index = 0;
+  char tail = 0;
+
+  if (sscanf(name, "stub_d%u_e%u%c", &domain, &index, &tail) == 2 &&
+      domain < STUB_NUM_DOMAINS &&
+      index < g_events_per_domain) {
+    *event = STUB_EVENT_ID(domain, index);
+    return CUPTI_SUCCESS;
+  }
+
+  return CUPTI_ERROR_INVALID_EVENT_NAME;
+}
+
+//
+// Event groups
+//
+
+CUptiResult cuptiEventGroupCreate(CUcontext context, CUpti_EventGroup* group, uint32_t flags) {
+  if (context == NULL) {
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  }
+
+  stub_group_t* g = calloc(1, sizeof(*g));
+
+  if (g == NULL) {
+    return CUPTI_ERROR_UNKNOWN;
+  }
+
+  g->device = context->device;
+  g->domain = UINT32_MAX;
+
+  lock();
+  g->next = g_groups;
+  g_groups = g;
+  g_counters.group_creates++;
+  unlock();
+
+  *group = g;
+
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiEventGroupDestroy(CUpti_EventGroup group) {
+  lock();
+
+  stub_group_t** p = &g_groups;
+
+  while (*p != NULL && *p != group) {
+    p = &(*p)->next;
+  }
+
+  bool found = *p != NULL && !(*p)->enabled;
+
+  if (found) {
+    *p = (*p)->next;
+  }
+
+  unlock();
+
+  if (!found) {
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  }
+
+  free(group);
+
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiEventGroupAddEvent(CUpti_EventGroup group, CUpti_EventID event) {
+  stub_group_t* g = group;
+
+  if (!event_valid(event)) {
+    return CUPTI_ERROR_INVALID_EVENT_ID;
+  }
+
+  CUptiResult result = CUPTI_SUCCESS;
+
+  lock();
+
+  if (g->enabled) {
+    result = CUPTI_ERROR_INVALID_OPERATION;
+  } else if (g->domain != UINT32_MAX && g->domain != event_domain(event)) {
+    result = CUPTI_ERROR_NOT_COMPATIBLE;
+  } else if (g->num_events == STUB_MAX_GROUP_EVENTS) {
+    result = CUPTI_ERROR_MAX_LIMIT_REACHED;
+  } else {
+    for (uint32_t i = 0; i < g->num_events && result == CUPTI_SUCCESS; ++i) {
+      if ((g_conflicts[event_domain(event)][event_index(event)] >> event_index(g->events[i])) & 1) {
+        result = CUPTI_ERROR_NOT_COMPATIBLE;
+      }
+    }
+  }
+
+  if (result == CUPTI_SUCCESS) {
+    g->domain = event_domain(event);
+    g->events[g->num_events++] = event;
+  }
+
+  unlock();
+
+  return result;
+}
+
+CUptiResult cuptiEventGroupRemoveEvent(CUpti_EventGroup group, CUpti_EventID event) {
+  stub_group_t* g = group;
+  CUptiResult result = CUPTI_ERROR_INVALID_EVENT_ID;
+
+  lock();
+
+  for (uint32_t i = 0; i < g->num_events; ++i) {
+    if (g->events[i] == event) {
+      memmove(&g->events[i], &g->events[i + 1], sizeof(g->events[0]) * (g->num_events - i - 1));
+      g->num_events--;
+      result = CUPTI_SUCCESS;
+      break;
+    }
+  }
+
+  if (g->num_events == 0) {
+    g->domain = UINT32_MAX;
+  }
+
+  unlock();
+
+  return result;
+}
+
+CUptiResult cuptiEventGroupRemoveAllEvents(CUpti_EventGroup group) {
+  stub_group_t* g = group;
+
+  lock();
+  g->num_events = 0;
+  g->domain = UINT32_MAX;
+  unlock();
+
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiEventGroupEnable(CUpti_EventGroup group) {
+  stub_group_t* g = group;
+  CUptiResult result = CUPTI_SUCCESS;
+
+  lock();
+
+  if (g->num_events == 0) {
+    result = CUPTI_ERROR_INVALID_PARAMETER;
+  } else if (!g->enabled) {
+    for (stub_group_t* h = g_groups; h != NULL; h = h->next) {
+      if (h->enabled && h->device == g->device && h->domain == g->domain) {
+        result = CUPTI_ERROR_NOT_COMPATIBLE;
+      }
+    }
+
+    if (result == CUPTI_SUCCESS) {
+      g->enabled = true;
+      memset(g->counters, 0, sizeof(g->counters));
+      g->ready_at = 0;
+      g_counters.group_enables++;
+    }
+  }
+
+  unlock();
+
+  return result;
+}
+
+CUptiResult cuptiEventGroupDisable(CUpti_EventGroup group) {
+  stub_group_t* g = group;
+
+  lock();
+  g->enabled = false;
+  unlock();
+
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiEventGroupGetAttribute(CUpti_EventGroup group,
+                                        CUpti_EventGroupAttribute attrib,
+                                        size_t* size,
+                                        void* value) {
+  stub_group_t* g = group;
+  CUptiResult result = CUPTI_ERROR_INVALID_PARAMETER;
+
+  lock();
+
+  switch (attrib) {
+  case CUPTI_EVENT_GROUP_ATTR_EVENT_DOMAIN_ID:
+    result = attr_u32(g->domain != UINT32_MAX ? STUB_DOMAIN_ID(g->domain) : 0, size, value);
+    break;
+  case CUPTI_EVENT_GROUP_ATTR_PROFILE_ALL_DOMAIN_INSTANCES:
+    result = attr_u32(0, size, value);
+    break;
+  case CUPTI_EVENT_GROUP_ATTR_NUM_EVENTS:
+    result = attr_u32(g->num_events, size, value);
+    break;
+  case CUPTI_EVENT_GROUP_ATTR_INSTANCE_COUNT:
+    result = attr_u32(group_num_instances(g), size, value);
+    break;
+  case CUPTI_EVENT_GROUP_ATTR_EVENTS: {
+    size_t length = sizeof(g->events[0]) * g->num_events;
+
+    if (*size >= length) {
+      memcpy(value, g->events, length);
+      *size = length;
+      result = CUPTI_SUCCESS;
+    }
+  } break;
+  default:
+    break;
+  }
+
+  unlock();
+
+  return result;
+}
+
+CUptiResult cuptiEventGroupSetAttribute(CUpti_EventGroup group,
+                                        CUpti_EventGroupAttribute attrib,
+                                        size_t size,
+                                        void* value) {
+  return CUPTI_SUCCESS;
+}
+
+// g_lock is held
+static bool group_read_ready(stub_group_t* g) {
+  g_counters.group_reads++;
+
+  if (stub_now_nsec() < g->ready_at) {
+    g_counters.early_reads++;
+    return false;
+  }
+
+  return true;
+}
+
+CUptiResult cuptiEventGroupReadAllEvents(CUpti_EventGroup group,
+                                         CUpti_ReadEventFlags flags,
+                                         size_t* counter_buffer_size,
+                                         uint64_t* counter_buffer,
+                                         size_t* event_id_array_size,
+                                         CUpti_EventID* event_id_array,
+                                         size_t* num_event_ids_read) {
+  stub_group_t* g = group;
+  CUptiResult result = CUPTI_SUCCESS;
+
+  lock();
+
+  size_t num_counters = (size_t) g->num_events * group_num_instances(g);
+  size_t cb_size = sizeof(counter_buffer[0]) * num_counters;
+  size_t ib_size = sizeof(event_id_array[0]) * g->num_events;
+
+  if (!g->enabled) {
+    result = CUPTI_ERROR_INVALID_OPERATION;
+  } else if (*counter_buffer_size < cb_size || *event_id_array_size < ib_size) {
+    result = CUPTI_ERROR_INVALID_PARAMETER;
+  } else {
+    if (group_read_ready(g)) {
+      memcpy(counter_buffer, g->counters, cb_size);
+    } else {
+      memset(counter_buffer, 0, cb_size);
+    }
+
+    memcpy(event_id_array, g->events, ib_size);
+
+    *counter_buffer_size = cb_size;
+    *event_id_array_size = ib_size;
+    *num_event_ids_read = g->num_events;
+  }
+
+  unlock();
+
+  return result;
+}
+
+CUptiResult cuptiEventGroupReadEvent(CUpti_EventGroup group,
+                                     CUpti_ReadEventFlags flags,
+                                     CUpti_EventID event,
+                                     size_t* counter_buffer_size,
+                                     uint64_t* counter_buffer) {
+  stub_group_t* g = group;
+  CUptiResult result = CUPTI_ERROR_INVALID_EVENT_ID;
+
+  lock();
+
+  uint32_t num_instances = group_num_instances(g);
+
+  for (uint32_t i = 0; i < g->num_events; ++i) {
+    if (g->events[i] == event) {
+      if (*counter_buffer_size < sizeof(counter_buffer[0]) * num_instances) {
+        result = CUPTI_ERROR_INVALID_PARAMETER;
+      } else {
+        bool ready = group_read_ready(g);
+
+        for (uint32_t k = 0; k < num_instances; ++k) {
+          counter_buffer[k] = ready ? g->counters[k * g->num_events + i] : 0;
+        }
+
+        *counter_buffer_size = sizeof(counter_buffer[0]) * num_instances;
+        result = CUPTI_SUCCESS;
+      }
+    }
+  }
+
+  unlock();
+
+  return result;
+}
+
+// Groups as they would be formed for the given events: each domain's
+// events are split into groups of at most STUB_MAX_GROUP_EVENTS, and
+// set k holds the k-th group of every domain.
+CUptiResult cuptiEventGroupSetsCreate(CUcontext context,
+                                      size_t event_id_array_size,
+                                      CUpti_EventID* events,
+                                      CUpti_EventGroupSets** sets) {
+  count_query();
+
+  size_t num_events = event_id_array_size / sizeof(events[0]);
+
+  uint32_t num_sets = 0;
+  uint32_t per_domain[STUB_NUM_DOMAINS] = { 0 };
+
+  for (size_t i = 0; i < num_events; ++i) {
+    if (!event_valid(events[i])) {
+      return CUPTI_ERROR_INVALID_EVENT_ID;
+    }
+
+    per_domain[event_domain(events[i])]++;
+  }
+
+  for (uint32_t d = 0; d < STUB_NUM_DOMAINS; ++d) {
+    uint32_t n = (per_domain[d] + STUB_MAX_GROUP_EVENTS - 1) / STUB_MAX_GROUP_EVENTS;
+    num_sets = n > num_sets ? n : num_sets;
+  }
+
+  CUpti_EventGroupSets* out = calloc(1, sizeof(*out));
+  out->numSets = num_sets;
+  out->sets = calloc(num_sets > 0 ? num_sets : 1, sizeof(out->sets[0]));
+
+  for (uint32_t s = 0; s < num_sets; ++s) {
+    out->sets[s].eventGroups = calloc(STUB_NUM_DOMAINS, sizeof(CUpti_EventGroup));
+  }
+
+  uint32_t seen[STUB_NUM_DOMAINS] = { 0 };
+
+  for (size_t i = 0; i < num_events; ++i) {
+    uint32_t d = event_domain(events[i]);
+    uint32_t s = seen[d] / STUB_MAX_GROUP_EVENTS;
+    CUpti_EventGroupSet* set = &out->sets[s];
+
+    CUpti_EventGroup group = NULL;
+
+    for (uint32_t k = 0; k < set->numEventGroups; ++k) {
+      if (((stub_group_t*) set->eventGroups[k])->domain == d) {
+        group = set->eventGroups[k];
+      }
+    }
+
+    if (group == NULL) {
+      cuptiEventGroupCreate(context, &group, 0);
+      set->eventGroups[set->numEventGroups++] = group;
+    }
+
+    cuptiEventGroupAddEvent(group, events[i]);
+    seen[d]++;
+  }
+
+  *sets = out;
+
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiEventGroupSetsDestroy(CUpti_EventGroupSets* sets) {
+  for (uint32_t s = 0; s < sets->numSets; ++s) {
+    for (uint32_t k = 0; k < sets->sets[s].numEventGroups; ++k) {
+      cuptiEventGroupDestroy(sets->sets[s].eventGroups[k]);
+    }
+
+    free(sets->sets[s].eventGroups);
+  }
+
+  free(sets->sets);
+  free(sets);
+
+  return CUPTI_SUCCESS;
+}
+
+//
+// Metrics
+//
+
+#define STUB_NUM_METRICS 2
+
+typedef struct stub_metric {
+  const char* name;
+  CUpti_MetricValueKind kind;
+  uint32_t num_events;
+  CUpti_EventID events[2];
+} stub_metric_t;
+
+static const stub_metric_t g_metrics[STUB_NUM_METRICS] =
+  {
+   { "stub_m_sum", CUPTI_METRIC_VALUE_KIND_UINT64, 2, { STUB_EVENT_ID(0, 0), STUB_EVENT_ID(1, 0) } },
+   { "stub_m_rate", CUPTI_METRIC_VALUE_KIND_DOUBLE, 1, { STUB_EVENT_ID(0, 1), 0 } }
+  };
+
+#define STUB_METRIC_ID(index) ((CUpti_MetricID) (1000 + (index)))
+
+static const stub_metric_t* metric_get(CUpti_MetricID metric) {
+  return
+    metric >= STUB_METRIC_ID(0) && metric < STUB_METRIC_ID(STUB_NUM_METRICS) ?
+    &g_metrics[metric - STUB_METRIC_ID(0)] :
+    NULL;
+}
+
+CUptiResult cuptiDeviceGetNumMetrics(CUdevice device, uint32_t* num_metrics) {
+  count_query();
+
+  *num_metrics = STUB_NUM_METRICS;
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiDeviceEnumMetrics(CUdevice device,
+                                   size_t* array_size,
+                                   CUpti_MetricID* metrics) {
+  count_query();
+
+  uint32_t n = (uint32_t) (*array_size / sizeof(metrics[0]));
+  n = n < STUB_NUM_METRICS ? n : STUB_NUM_METRICS;
+
+  for (uint32_t i = 0; i < n; ++i) {
+    metrics[i] = STUB_METRIC_ID(i);
+  }
+
+  *array_size = n * sizeof(metrics[0]);
+
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiMetricGetIdFromName(CUdevice device, const char* name, CUpti_MetricID* metric) {
+  count_query();
+
+  for (uint32_t i = 0; i < STUB_NUM_METRICS; ++i) {
+    if (strcmp(name, g_metrics[i].name) == 0) {
+      *metric = STUB_METRIC_ID(i);
+      return CUPTI_SUCCESS;
+    }
+  }
+
+  return CUPTI_ERROR_INVALID_METRIC_NAME;
+}
+
+CUptiResult cuptiMetricGetNumEvents(CUpti_MetricID metric, uint32_t* num_events) {
+  count_query();
+
+  const stub_metric_t* m = metric_get(metric);
+
+  if (m == NULL) {
+    return CUPTI_ERROR_INVALID_METRIC_ID;
+  }
+
+  *num_events = m->num_events;
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiMetricEnumEvents(CUpti_MetricID metric,
+                                  size_t* array_size,
+                                  CUpti_EventID* events) {
+  count_query();
+
+  const stub_metric_t* m = metric_get(metric);
+
+  if (m == NULL) {
+    return CUPTI_ERROR_INVALID_METRIC_ID;
+  }
+
+  size_t length = sizeof(events[0]) * m->num_events;
+
+  if (*array_size < length) {
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  }
+
+  memcpy(events, m->events, length);
+  *array_size = length;
+
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiMetricGetAttribute(CUpti_MetricID metric,
+                                    CUpti_MetricAttribute attrib,
+                                    size_t* size,
+                                    void* value) {
+  count_query();
+
+  const stub_metric_t* m = metric_get(metric);
+
+  if (m == NULL) {
+    return CUPTI_ERROR_INVALID_METRIC_ID;
+  }
+
+  switch (attrib) {
+  case CUPTI_METRIC_ATTR_NAME:
+    return attr_string(m->name, size, value);
+  case CUPTI_METRIC_ATTR_VALUE_KIND:
+    return attr_u32(m->kind, size, value);
+  }
+
+  return CUPTI_ERROR_INVALID_PARAMETER;
+}
+
+CUptiResult cuptiMetricCreateEventGroupSets(CUcontext context,
+                                            size_t metric_id_array_size,
+                                            CUpti_MetricID* metrics,
+                                            CUpti_EventGroupSets** sets) {
+  CUpti_EventID events[STUB_NUM_METRICS * 2];
+  size_t num_events = 0;
+
+  for (size_t i = 0; i < metric_id_array_size / sizeof(metrics[0]); ++i) {
+    const stub_metric_t* m = metric_get(metrics[i]);
+
+    if (m == NULL) {
+      return CUPTI_ERROR_INVALID_METRIC_ID;
+    }
+
+    for (uint32_t j = 0; j < m->num_events; ++j) {
+      bool found = false;
+
+      for (size_t k = 0; k < num_events; ++k) {
+        found = found || events[k] == m->events[j];
+      }
+
+      if (!found) {
+        events[num_events++] = m->events[j];
+      }
+    }
+  }
+
+  return cuptiEventGroupSetsCreate(context, sizeof(events[0]) * num_events, events, sets);
+}
+
+CUptiResult cuptiMetricGetValue(CUdevice device,
+                                CUpti_MetricID metric,
+                                size_t event_id_array_size,
+                                CUpti_EventID* events,
+                                size_t event_value_array_size,
+                                uint64_t* event_values,
+                                uint64_t time_duration,
+                                CUpti_MetricValue* value) {
+  const stub_metric_t* m = metric_get(metric);
+
+  if (m == NULL) {
+    return CUPTI_ERROR_INVALID_METRIC_ID;
+  }
+
+  size_t num_events = event_id_array_size / sizeof(events[0]);
+
+  if (event_value_array_size / sizeof(event_values[0]) < num_events) {
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  }
+
+  uint64_t inputs[2] = { 0, 0 };
+
+  for (uint32_t j = 0; j < m->num_events; ++j) {
+    bool found = false;
+
+    for (size_t k = 0; k < num_events && !found; ++k) {
+      if (events[k] == m->events[j]) {
+        inputs[j] = event_values[k];
+        found = true;
+      }
+    }
+
+    if (!found) {
+      return CUPTI_ERROR_INVALID_METRIC_VALUE;
+    }
+  }
+
+  if (m->kind == CUPTI_METRIC_VALUE_KIND_UINT64) {
+    value->metricValueUint64 = inputs[0] + inputs[1];
+  } else {
+    if (time_duration == 0) {
+      return CUPTI_ERROR_INVALID_METRIC_VALUE;
+    }
+
+    value->metricValueDouble = (double) inputs[0] / (double) time_duration;
+  }
+
+  return CUPTI_SUCCESS;
+}
+
+//
+// Callbacks and launches
+//
+
+struct CUpti_Subscriber_st {
+  CUpti_CallbackFunc callback;
+  void* userdata;
+  bool launch_enabled;
+};
+
+static struct CUpti_Subscriber_st g_subscriber;
+static bool g_subscribed = false;
+
+CUptiResult cuptiSubscribe(CUpti_SubscriberHandle* subscriber,
+                           CUpti_CallbackFunc callback,
+                           void* userdata) {
+  CUptiResult result = CUPTI_SUCCESS;
+
+  lock();
+
+  if (g_subscribed) {
+    result = CUPTI_ERROR_MULTIPLE_SUBSCRIBERS_NOT_SUPPORTED;
+  } else {
+    g_subscriber.callback = callback;
+    g_subscriber.userdata = userdata;
+    g_subscriber.launch_enabled = false;
+    g_subscribed = true;
+    *subscriber = &g_subscriber;
+  }
+
+  unlock();
+
+  return result;
+}
+
+CUptiResult cuptiUnsubscribe(CUpti_SubscriberHandle subscriber) {
+  lock();
+  bool ok = g_subscribed && subscriber == &g_subscriber;
+  g_subscribed = g_subscribed && !ok;
+  unlock();
+
+  return ok ? CUPTI_SUCCESS : CUPTI_ERROR_INVALID_PARAMETER;
+}
+
+CUptiResult cuptiEnableCallback(uint32_t enable,
+                                CUpti_SubscriberHandle subscriber,
+                                CUpti_CallbackDomain domain,
+                                CUpti_CallbackId cbid) {
+  if (subscriber != &g_subscriber || domain != CUPTI_CB_DOMAIN_RUNTIME_API) {
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  }
+
+  if (cbid == CUPTI_RUNTIME_TRACE_CBID_cudaLaunchKernel_v7000) {
+    lock();
+    g_subscriber.launch_enabled = enable != 0;
+    unlock();
+  }
+
+  return CUPTI_SUCCESS;
+}
+
+static void launch_callback(CUpti_ApiCallbackSite site, const void* func) {
+  lock();
+  bool enabled = g_subscribed && g_subscriber.launch_enabled;
+  CUpti_CallbackFunc callback = g_subscriber.callback;
+  void* userdata = g_subscriber.userdata;
+  unlock();
+
+  if (enabled) {
+    CUpti_CallbackData data;
+    memset(&data, 0, sizeof(data));
+
+    data.callbackSite = site;
+    data.functionName = "cudaLaunchKernel";
+    data.symbolName = "stub_kernel";
+    data.context = t_context;
+
+    callback(userdata,
+             CUPTI_CB_DOMAIN_RUNTIME_API,
+             CUPTI_RUNTIME_TRACE_CBID_cudaLaunchKernel_v7000,
+             &data);
+  }
+}
+
+cudaError_t cudaLaunchKernel(const void* func,
+                             dim3 grid,
+                             dim3 block,
+                             void** args,
+                             size_t shared_mem,
+                             cudaStream_t stream) {
+  cuInit(0);
+
+  // the runtime makes the primary context current
+  // on the first launch
+  if (t_context == NULL) {
+    t_context = &g_contexts[t_device];
+  }
+
+  launch_callback(CUPTI_API_ENTER, func);
+
+  stub_launch_t launch =
+    {
+     .func = func,
+     .grid = grid,
+     .block = block,
+     .args = args,
+     .stream = stream,
+     .device = t_device
+    };
+
+  pthread_mutex_lock(&g_exec_lock);
+  symbols_load(t_device);
+  uint64_t duration = ((stub_kernel_fn_t) func)(&launch);
+  pthread_mutex_unlock(&g_exec_lock);
+
+  uint64_t num_threads =
+    (uint64_t) grid.x * grid.y * grid.z *
+    (uint64_t) block.x * block.y * block.z;
+
+  lock();
+
+  struct CUstream_st* s = stream_get(stream);
+  uint64_t now = stub_now_nsec();
+  uint64_t start = s->busy_until > now ? s->busy_until : now;
+
+  s->busy_until = start + duration;
+
+  // only the enabled groups count the kernel
+  for (stub_group_t* g = g_groups; g != NULL; g = g->next) {
+    if (g->enabled && g->device == t_device) {
+      uint32_t num_instances = group_num_instances(g);
+
+      for (uint32_t k = 0; k < num_instances; ++k) {
+        for (uint32_t i = 0; i < g->num_events; ++i) {
+          g->counters[k * g->num_events + i] += stub_counter_value(g->events[i], k, num_threads);
+        }
+      }
+
+      g->ready_at = s->busy_until;
+    }
+  }
+
+  g_counters.launches++;
+
+  unlock();
+
+  launch_callback(CUPTI_API_EXIT, func);
+
+  return cudaSuccess;
+}
@@ -0,0 +1,110 @@
+#ifndef __STUB_H__
+#define __STUB_H__
+
+//
+// Control and inspection of the stub CUDA/CUPTI backend, which lets
+// libnvcd and the hook run on hosts without a GPU.
+//
+// The stub has 1 to STUB_MAX_DEVICES devices, set with
+// stub_set_num_devices() or NVCD_STUB_DEVICES before cuInit().
+// Each device has STUB_NUM_DOMAINS event domains of
+// STUB_EVENTS_PER_DOMAIN events, and two metrics:
+//
+//   stub_m_sum  (uint64) = stub_d0_e0 + stub_d1_e0
+//   stub_m_rate (double) = stub_d0_e1 per nanosecond
+//
+// A group holds at most STUB_MAX_GROUP_EVENTS events of one domain,
+// and only one group per domain can be enabled in a context at a time,
+// so larger event sets take several passes, as they would on hardware.
+// Pairs of events set with stub_set_conflict() can't share a group
+// either; that's only checked by cuptiEventGroupAddEvent().
+//
+// Kernels are host functions that return how long they "run" for.
+// Each stream is a timeline on the monotonic clock: a launch starts
+// once the stream's previous work is done, and events and
+// synchronization follow that timeline, so a host thread that waits
+// on a kernel really waits. Counters read before the kernel that
+// produced them has finished are zero, and counted as early reads.
+//
+
+#include <stdbool.h>
+
+#include <cuda.h>
+#include <cuda_runtime_api.h>
+#include <cupti.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STUB_MAX_DEVICES 8
+#define STUB_NUM_SMS 8
+
+#define STUB_NUM_DOMAINS 2
+#define STUB_EVENTS_PER_DOMAIN 6 // unless set with stub_set_events_per_domain()
+#define STUB_MAX_EVENTS_PER_DOMAIN 64
+#define STUB_MAX_GROUP_EVENTS 4
+
+#define STUB_ENV_DEVICES "NVCD_STUB_DEVICES"
+
+typedef struct stub_launch {
+  const void* func;
+  dim3 grid;
+  dim3 block;
+  void** args;
+  cudaStream_t stream;
+  int device;
+} stub_launch_t;
+
+// returns the simulated run time, in nanoseconds
+typedef uint64_t (*stub_kernel_fn_t)(const stub_launch_t* launch);
+
+typedef struct stub_counters {
+  uint64_t launches;
+  uint64_t group_creates;
+  uint64_t group_enables;
+  uint64_t group_reads;
+  uint64_t mallocs;
+  uint64_t frees;
+  uint64_t memsets;
+  uint64_t symbol_copies;
+  uint64_t event_syncs;
+  uint64_t stream_syncs;
+  uint64_t device_syncs;
+  uint64_t early_reads;
+  // calls that look up names or attributes, or enumerate the events of
+  // a domain or metric, including cuptiEventGroupSetsCreate()
+  uint64_t queries;
+} stub_counters_t;
+
+// must be called before cuInit()
+void stub_set_num_devices(int num_devices);
+
+// up to STUB_MAX_EVENTS_PER_DOMAIN; must be called before cuInit()
+void stub_set_events_per_domain(uint32_t num_events);
+
+// the two events, of the same domain, can't be added to the same group
+void stub_set_conflict(CUpti_EventID a, CUpti_EventID b);
+
+void stub_clear_conflicts(void);
+
+void stub_counters_get(stub_counters_t* out);
+
+void stub_counters_reset(void);
+
+// the value of the given event's counter on the given domain instance,
+// for a kernel of num_threads threads
+uint64_t stub_counter_value(CUpti_EventID event, uint32_t instance, uint64_t num_threads);
+
+// the stub's clock
+uint64_t stub_now_nsec(void);
+
+// Copies the value last written to a device symbol on the given
+// device with cudaMemcpyToSymbol(). Returns false if there's none.
+bool stub_symbol_value(const void* symbol, int device, void* out, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __STUB_H__